@@ -7,11 +7,14 @@
  */
 #include "tests.h"
 
+#include <arch/atomic.h>
 #include <inttypes.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <lib/bench.h>
 #include <lk/err.h>
 #include <platform.h>
 #include <rand.h>
@@ -222,6 +225,102 @@ __NO_INLINE static void arm_bench_multi_issue(void) {
 #endif // __CORTEX_M
 #endif // ARCH_ARM
 
+// arm, cancel and fire a large number of kernel timers
+#define TIMER_BENCH_COUNT 100000
+
+static volatile int timer_bench_fired;
+
+static enum handler_return timer_bench_callback(timer_t *t, lk_time_t now, void *arg) {
+    atomic_add(&timer_bench_fired, 1);
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timers(void) {
+    timer_t *timers = malloc(sizeof(timer_t) * TIMER_BENCH_COUNT);
+    if (!timers) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_initialize(&timers[i]);
+    }
+    timer_bench_fired = 0;
+
+    // random deadlines between 1 and 2 seconds out
+    ulong count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_set_oneshot(&timers[i], 1000 + rand() % 1000, timer_bench_callback, NULL);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %lu cycles to arm %u timers (%lu cycles per)\n",
+           count, TIMER_BENCH_COUNT, count / TIMER_BENCH_COUNT);
+
+    // cancel every other one
+    count = arch_cycle_count();
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i += 2) {
+        timer_cancel(&timers[i]);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %lu cycles to cancel %u timers (%lu cycles per)\n",
+           count, TIMER_BENCH_COUNT / 2, count / (TIMER_BENCH_COUNT / 2));
+
+    // let the rest fire
+    lk_time_t start = current_time();
+    while (timer_bench_fired < TIMER_BENCH_COUNT / 2 && current_time() - start < 5000) {
+        thread_sleep(10);
+    }
+    printf("%d of %u remaining timers fired after %u ms\n",
+           timer_bench_fired, TIMER_BENCH_COUNT / 2, (uint)(current_time() - start));
+
+    for (uint i = 0; i < TIMER_BENCH_COUNT; i++) {
+        timer_cancel_sync(&timers[i]);
+    }
+    free(timers);
+}
+
+// cost of a mutex acquire/release pair, uncontended and with a thread per cpu
+// hammering the same mutex
+#define MUTEX_BENCH_ITER 100000
+
+static mutex_t mutex_bench_lock = MUTEX_INITIAL_VALUE(mutex_bench_lock);
+static volatile ulong mutex_bench_counter;
+
+static uint64_t mutex_bench_thread(void *arg, uint index, const volatile bool *stop) {
+    for (uint i = 0; i < MUTEX_BENCH_ITER; i++) {
+        mutex_acquire(&mutex_bench_lock);
+        mutex_bench_counter++;
+        mutex_release(&mutex_bench_lock);
+    }
+    return MUTEX_BENCH_ITER;
+}
+
+__NO_INLINE static void bench_mutex(void) {
+    ulong count = arch_cycle_count();
+    for (uint i = 0; i < MUTEX_BENCH_ITER; i++) {
+        mutex_acquire(&mutex_bench_lock);
+        mutex_release(&mutex_bench_lock);
+    }
+    count = arch_cycle_count() - count;
+    printf("took %lu cycles to acquire and release an uncontended mutex %u times (%lu cycles per)\n",
+           count, MUTEX_BENCH_ITER, count / MUTEX_BENCH_ITER);
+
+    mutex_bench_counter = 0;
+    struct bench_run run = {
+        .name = "mutex bench",
+        .fn = mutex_bench_thread,
+        .thread_count = MIN(MAX(2u, bench_cpu_count()), BENCH_MAX_THREADS),
+    };
+    if (bench_run_threads(&run) != NO_ERROR || run.ops == 0) {
+        printf("failed to start the mutex bench threads\n");
+        return;
+    }
+
+    printf("%u threads took %llu usecs to acquire and release a shared mutex %llu times (%llu nsecs per)%s\n",
+           run.thread_count, run.elapsed, run.ops, run.elapsed * 1000 / run.ops,
+           mutex_bench_counter == run.ops ? "" : ", COUNTER MISMATCH");
+}
+
 #if WITH_LIB_LIBM
 #include <math.h>
 
@@ -264,6 +363,54 @@ __NO_INLINE static void bench_sincos(void) {
 
 #endif // WITH_LIB_LIBM
 
+#if WITH_LIB_MINIP
+#include <lib/minip/chksum.h>
+
+__NO_INLINE static void bench_chksum(void) {
+    uint8_t *buf = memalign(CACHE_LINE, BUFSIZE);
+    if (!buf) {
+        printf("failed to allocate buffer\n");
+        return;
+    }
+    memset(buf, 0x5a, BUFSIZE);
+
+    const struct ones_sum_impl *impl;
+    for (size_t n = 0; (impl = ones_sum_get_impl(n)); n++) {
+        __UNUSED volatile uint64_t sum = 0;
+
+        ulong count = arch_cycle_count();
+        for (uint i = 0; i < ITER; i++) {
+            sum = impl->sum(sum, buf, BUFSIZE);
+        }
+        count = arch_cycle_count() - count;
+        if (count == 0) {
+            count = 1;
+        }
+
+        uint64_t bytes_cycle = (TOTAL_SIZE * 1000) / count;
+        printf("took %lu cycles to checksum a buffer of size %zu %u times using %s "
+               "(%" PRIu64 " bytes), %" PRIu64 ".%03" PRIu64 " bytes/cycle\n",
+               count, BUFSIZE, ITER, impl->name, TOTAL_SIZE, bytes_cycle / 1000, bytes_cycle % 1000);
+
+        count = arch_cycle_count();
+        for (uint i = 0; i < ITER; i++) {
+            sum = impl->copy_sum(sum, buf, buf + BUFSIZE / 2, BUFSIZE / 2);
+        }
+        count = arch_cycle_count() - count;
+        if (count == 0) {
+            count = 1;
+        }
+
+        bytes_cycle = (TOTAL_SIZE / 2 * 1000) / count;
+        printf("took %lu cycles to copy and checksum a buffer of size %zu %u times using %s "
+               "(%" PRIu64 " bytes), %" PRIu64 ".%03" PRIu64 " bytes/cycle\n",
+               count, BUFSIZE / 2, ITER, impl->name, TOTAL_SIZE / 2, bytes_cycle / 1000, bytes_cycle % 1000);
+    }
+
+    free(buf);
+}
+#endif // WITH_LIB_MINIP
+
 int benchmarks(int argc, const console_cmd_args *argv) {
     bench_set_overhead();
     bench_memset();
@@ -275,6 +422,9 @@ int benchmarks(int argc, const console_cmd_args *argv) {
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_timers();
+    bench_mutex();
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
@@ -285,6 +435,9 @@ int benchmarks(int argc, const console_cmd_args *argv) {
 #if WITH_LIB_LIBM
     bench_sincos();
 #endif
+#if WITH_LIB_MINIP
+    bench_chksum();
+#endif
 
     return NO_ERROR;
 }
@@ -17,6 +17,7 @@ MODULE_FLOAT_SRCS := \
     $(LOCAL_DIR)/float_instructions.S \
 
 MODULE_DEPS += \
+    lib/bench \
     lib/cbuf \
     lib/libm
 
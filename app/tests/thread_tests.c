@@ -10,12 +10,15 @@
 #include <lk/debug.h>
 #include <lk/trace.h>
 #include <rand.h>
+#include <stdlib.h>
 #include <lk/err.h>
 #include <assert.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <lib/bench.h>
 #include <platform.h>
 #include <platform/time.h>
 #include <arch/atomic.h>
@@ -469,6 +472,83 @@ static void preempt_test(void) {
     printf("done with real-time preempt test, above time stamps should be 1 second apart\n");
 }
 
+#if WITH_KERNEL_SCHED_DEADLINE
+static volatile bool deadline_stop;
+
+struct deadline_args {
+    lk_time_t runtime;
+    lk_time_t period;
+    lk_bigtime_t work; // usecs of spinning per job
+    uint jobs;
+};
+
+static int deadline_tester(void *arg) {
+    struct deadline_args *args = (struct deadline_args *)arg;
+
+    while (!deadline_stop) {
+        spin(args->work);
+        args->jobs++;
+        thread_deadline_yield();
+    }
+
+    return 0;
+}
+
+/* keeps its cpu busy for a second, even from the thread running the test */
+static int deadline_hog(void *arg) {
+    lk_time_t start = current_time();
+
+    while (!deadline_stop && current_time() - start < 1000)
+        ;
+
+    return 0;
+}
+
+static void deadline_test(void) {
+    struct deadline_args args[2] = {
+        { .runtime = 2, .period = 10, .work = 1000 },
+        { .runtime = 5, .period = 20, .work = 2500 },
+    };
+    thread_t *threads[2];
+    status_t err;
+
+    printf("testing deadline scheduling\n");
+
+    deadline_stop = false;
+
+    /* a busy higher priority thread on the same cpu should not hold them up */
+    thread_t *hog = thread_create("deadline hog", &deadline_hog, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_set_pinned_cpu(hog, 0);
+
+    err = thread_set_deadline(hog, 11, 10, 10);
+    printf("\truntime longer than the period returns %d (should be %d)\n", err, ERR_INVALID_ARGS);
+
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create("deadline tester", &deadline_tester, &args[i], LOW_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[i], 0);
+        err = thread_set_deadline(threads[i], args[i].runtime, args[i].period, args[i].period);
+        printf("\t%u/%u ms thread admitted with %d\n", args[i].runtime, args[i].period, err);
+    }
+
+    err = thread_set_deadline(hog, 6, 10, 10);
+    printf("\t6/10 ms thread on the same cpu returns %d (should be %d)\n", err, ERR_NO_RESOURCES);
+
+    thread_resume(hog);
+    for (uint i = 0; i < countof(threads); i++)
+        thread_resume(threads[i]);
+
+    thread_sleep(1000);
+    deadline_stop = true;
+
+    thread_join(hog, NULL, INFINITE_TIME);
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        printf("\t%u/%u ms thread ran %u jobs in 1 second (should be about %u)\n",
+               args[i].runtime, args[i].period, args[i].jobs, 1000 / args[i].period);
+    }
+}
+#endif
+
 static int join_tester(void *arg) {
     long val = (long)arg;
 
@@ -581,6 +661,70 @@ static void spinlock_test(void) {
 #undef COUNT
 }
 
+/* measure lock/unlock throughput as threads are added, each thread either
+ * hammering its own mutex or all of them sharing one */
+#define CONTENTION_TEST_TIME 500 /* ms */
+
+struct contention_args {
+    mutex_t locks[BENCH_MAX_THREADS];
+    bool shared;
+};
+
+static uint64_t contention_tester(void *arg, uint index, const volatile bool *stop) {
+    struct contention_args *args = (struct contention_args *)arg;
+    mutex_t *lock = &args->locks[args->shared ? 0 : index];
+    uint64_t count = 0;
+
+    while (!*stop) {
+        mutex_acquire(lock);
+        mutex_release(lock);
+        count++;
+    }
+
+    return count;
+}
+
+static uint64_t contention_run(uint thread_count, bool shared) {
+    struct contention_args args = { .shared = shared };
+
+    for (uint i = 0; i < thread_count; i++) {
+        mutex_init(&args.locks[i]);
+    }
+
+    struct bench_run run = {
+        .name = "contention tester",
+        .fn = contention_tester,
+        .arg = &args,
+        .thread_count = thread_count,
+        .duration = CONTENTION_TEST_TIME,
+    };
+    bench_run_threads(&run);
+
+    for (uint i = 0; i < thread_count; i++) {
+        mutex_destroy(&args.locks[i]);
+    }
+
+    return run.ops;
+}
+
+static void lock_contention_test(void) {
+    uint cpu_count = bench_cpu_count();
+
+    printf("testing lock contention scaling on %u cpus, %u ms per run\n", cpu_count, CONTENTION_TEST_TIME);
+
+    for (uint shared = 0; shared < 2; shared++) {
+        uint64_t base = 0;
+        for (uint thread_count = 1; thread_count <= MIN(cpu_count * 2, BENCH_MAX_THREADS); thread_count *= 2) {
+            uint64_t ops = contention_run(thread_count, shared);
+            if (thread_count == 1)
+                base = ops ? ops : 1;
+            printf("%s mutex: %2u threads, %llu ops/sec, %llu.%02llux single thread\n",
+                   shared ? "shared " : "private", thread_count,
+                   ops * 1000 / CONTENTION_TEST_TIME, ops / base, (ops * 100 / base) % 100);
+        }
+    }
+}
+
 int thread_tests(int argc, const console_cmd_args *argv) {
     mutex_test();
     semaphore_test();
@@ -588,12 +732,17 @@ int thread_tests(int argc, const console_cmd_args *argv) {
 
     spinlock_test();
     atomic_test();
+    lock_contention_test();
 
     thread_sleep(200);
     context_switch_test();
 
     preempt_test();
 
+#if WITH_KERNEL_SCHED_DEADLINE
+    deadline_test();
+#endif
+
     join_test();
 
     return 0;
@@ -105,8 +105,8 @@ static vaddr_t pendsv_swap_sp(vaddr_t old_frame) {
     /* make sure the stack is 8 byte aligned */
     DEBUG_ASSERT(((uintptr_t)__GET_FRAME() & 0x7) == 0);
 
-    DEBUG_ASSERT_MSG(!spin_lock_held(&thread_lock),
-                     "PENDSV: thread lock was held when preempted! pc %#x\n", ((struct arm_cm_exception_frame *)old_frame)->pc);
+    DEBUG_ASSERT_MSG(!thread_sched_lock_held(),
+                     "PENDSV: scheduler lock was held when preempted! pc %#x\n", ((struct arm_cm_exception_frame *)old_frame)->pc);
 
     DEBUG_ASSERT(_prev_running_thread != NULL);
     DEBUG_ASSERT(_current_thread != NULL);
@@ -152,7 +152,7 @@ void arch_context_switch(struct thread *oldthread, struct thread *newthread) {
 #endif
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(thread_sched_lock_held());
 
     const bool in_interrupt_context = arch_in_int_handler();
 
@@ -191,7 +191,7 @@ void arch_context_switch(struct thread *oldthread, struct thread *newthread) {
         /* we're in thread context, so jump to PendSV immediately */
 
         /* drop the lock and enable interrupts so PendSV can run */
-        spin_unlock(&thread_lock);
+        thread_sched_unlock();
         arch_enable_ints();
 
         /*
@@ -204,7 +204,7 @@ void arch_context_switch(struct thread *oldthread, struct thread *newthread) {
         /* should jump to PendSV here */
 
         arch_disable_ints();
-        spin_lock(&thread_lock);
+        thread_sched_lock();
     } else {
         /*
          * If we're in interrupt context, then we've come through
@@ -30,9 +30,12 @@ static inline int atomic_and(volatile int *ptr, int val) {
 static inline int atomic_swap(volatile int *ptr, int val) {
     return __atomic_exchange_n(ptr, val, __ATOMIC_RELAXED);
 }
+
+/* returns the previous value, the swap happened if it matches oldval */
 static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval) {
-    // TODO: implement
-    return 0;
+    __atomic_compare_exchange_n(ptr, &oldval, newval, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return oldval;
 }
 
 #else
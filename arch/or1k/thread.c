@@ -28,7 +28,7 @@ static void initial_thread_func(void) {
 #endif
 
     /* exit the implicit critical section we're within */
-    spin_unlock(&thread_lock);
+    thread_sched_unlock();
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
@@ -29,8 +29,8 @@ static void initial_thread_func(void) {
     dump_thread(ct);
 #endif
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* release the scheduler lock that was implicitly held across the reschedule */
+    thread_sched_unlock();
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
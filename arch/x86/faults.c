@@ -8,6 +8,7 @@
  */
 #include <arch/fpu.h>
 #include <arch/x86.h>
+#include <kernel/debug.h>
 #include <kernel/thread.h>
 #include <lk/debug.h>
 #include <lk/trace.h>
@@ -199,7 +200,9 @@ void x86_exception_handler(x86_iframe_t *frame) {
 
         /* pass the rest of the irq vectors to the platform */
         case 0x20 ... 255:
+            KEVLOG_IRQ_ENTER(vector);
             ret = platform_irq(frame);
+            KEVLOG_IRQ_EXIT(vector);
     }
 
     if (ret != INT_NO_RESCHEDULE) {
@@ -24,8 +24,8 @@ struct thread *_current_thread;
 
 static void initial_thread_func(void) __NO_RETURN;
 static void initial_thread_func(void) {
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* release the scheduler lock that was implicitly held across the reschedule */
+    thread_sched_unlock();
     arch_enable_ints();
 
     thread_t *ct = arch_get_current_thread();
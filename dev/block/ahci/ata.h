@@ -96,7 +96,15 @@ inline FIS_REG_H2D ata_cmd_flush_cache() {
 #define ATA_CMD_READ_FPDMA_QUEUED 0x60
 #define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
 
-inline FIS_REG_H2D ata_cmd_read_fpdma_queued(uint64_t lba, uint16_t sector_count, uint8_t tag) {
+// The tag goes in the Count register (lower 8 bits), shifted left by 3.
+// Upper 5 bits of Count register (14:10) hold the tag bits (4:0).
+inline void ata_fis_set_ncq_tag(FIS_REG_H2D *fis, uint8_t tag) {
+    fis->countl = (tag & 0x1f) << 3;
+    fis->counth = 0;
+}
+
+// The tag is left at 0, the port sets it to the command slot once it has one.
+inline FIS_REG_H2D ata_cmd_read_fpdma_queued(uint64_t lba, uint16_t sector_count) {
     FIS_REG_H2D fis = {};
     fis.fis_type = FIS_TYPE_REG_H2D;
     fis.command = ATA_CMD_READ_FPDMA_QUEUED;
@@ -116,15 +124,10 @@ inline FIS_REG_H2D ata_cmd_read_fpdma_queued(uint64_t lba, uint16_t sector_count
     fis.featurel = sector_count & 0xff;
     fis.featureh = (sector_count >> 8) & 0xff;
 
-    // Tag goes in the Count register (lower 8 bits), shifted left by 3.
-    // Upper 5 bits of Count register (14:10) hold the tag bits (4:0).
-    fis.countl = (tag & 0x1f) << 3;
-    fis.counth = 0;
-
     return fis;
 }
 
-inline FIS_REG_H2D ata_cmd_write_fpdma_queued(uint64_t lba, uint16_t sector_count, uint8_t tag) {
+inline FIS_REG_H2D ata_cmd_write_fpdma_queued(uint64_t lba, uint16_t sector_count) {
     FIS_REG_H2D fis = {};
     fis.fis_type = FIS_TYPE_REG_H2D;
     fis.command = ATA_CMD_WRITE_FPDMA_QUEUED;
@@ -143,9 +146,5 @@ inline FIS_REG_H2D ata_cmd_write_fpdma_queued(uint64_t lba, uint16_t sector_coun
     fis.featurel = sector_count & 0xff;
     fis.featureh = (sector_count >> 8) & 0xff;
 
-    // Tag goes in the Count register (lower 8 bits), shifted left by 3
-    fis.countl = (tag & 0x1f) << 3;
-    fis.counth = 0;
-
     return fis;
 }
@@ -56,7 +56,7 @@ status_t ahci_disk::identify() {
 
     // issue the identify command (not using NCQ, so tag is irrelevant)
     int slot;
-    auto err = port_.queue_command(&fis, sizeof(fis), identify_data, sizeof(identify_data), false, false, 0, &slot);
+    auto err = port_.queue_command(&fis, sizeof(fis), identify_data, sizeof(identify_data), false, false, &slot);
     if (err != NO_ERROR) {
         printf("ahci_disk::identify: queue_command failed: %d\n", err);
         return err;
@@ -131,6 +131,7 @@ status_t ahci_disk::identify() {
         LTRACEF("drive supports NCQ with queue depth %u\n", ncq_queue_depth);
         supports_ncq_ = true;
         ncq_queue_depth_ = ncq_queue_depth;
+        port_.set_ncq_depth(ncq_queue_depth);
     }
 
     dprintf(INFO,
@@ -159,76 +160,67 @@ status_t ahci_disk::identify() {
     return NO_ERROR;
 }
 
-status_t ahci_disk::do_rw_sectors_sync(uint64_t lba, void *buf, size_t buf_len, bool write) {
-    LTRACEF("lba %#llx buf %p len %zu write %d\n", lba, buf, buf_len, write);
+status_t ahci_disk::issue(bio_request_t *req) {
+    const uint64_t lba = req->dev_block;
+    const size_t sector_count = req->merge_count;
+    const bool write = req->op == BIO_OP_WRITE;
 
-    if (buf_len % logical_sector_size_ != 0) {
-        return ERR_INVALID_ARGS;
-    }
+    LTRACEF("lba %#llx count %zu write %d\n", lba, sector_count, write);
 
-    size_t sector_count = buf_len / logical_sector_size_;
     if (sector_count == 0 || sector_count > 0xffff) {
         return ERR_INVALID_ARGS;
     }
 
-    // Allocate an NCQ tag if using NCQ, otherwise use tag 0 (unused for non-NCQ)
-    uint8_t tag = 0;
-    bool use_ncq = false;
-    if (supports_ncq_) {
-        int tag_result = port_.allocate_ncq_tag();
-        if (tag_result < 0) {
-            LTRACEF("failed to allocate NCQ tag, falling back to DMA: %d\n", tag_result);
-            // Fall back to DMA if we can't allocate a tag
-        } else {
-            tag = tag_result;
-            use_ncq = true;
+    // gather the physical runs of the request and everything merged behind it
+    ahci_mem_run runs[ahci_port::PRD_PER_CMD];
+    size_t run_count = 0;
+    bio_sg_iter_t iter;
+    bio_sg_iter_init(&iter, req);
+    void *buf;
+    size_t len;
+    while (bio_sg_iter_next(&iter, SIZE_MAX, &buf, &len)) {
+        status_t err = ahci_virtual_to_pa_runs(buf, len, runs, countof(runs), &run_count);
+        if (err != NO_ERROR) {
+            return err;
         }
     }
 
-    // Select appropriate command based on NCQ support
+    // Select appropriate command based on NCQ support. The port tags a queued
+    // command with the slot it gets.
+    const bool use_ncq = supports_ncq_;
     FIS_REG_H2D fis = use_ncq
-                          ? (write ? ata_cmd_write_fpdma_queued(lba, sector_count, tag)
-                                   : ata_cmd_read_fpdma_queued(lba, sector_count, tag))
+                          ? (write ? ata_cmd_write_fpdma_queued(lba, sector_count)
+                                   : ata_cmd_read_fpdma_queued(lba, sector_count))
                           : (write ? ata_cmd_write_dma_ext(lba, sector_count)
                                    : ata_cmd_read_dma_ext(lba, sector_count));
 
-    int slot;
-    auto err = port_.queue_command(&fis, sizeof(fis), buf, buf_len, write, use_ncq, tag, &slot);
-    if (err != NO_ERROR) {
-        if (use_ncq) {
-            port_.release_ncq_tag(tag);
-        }
-        return err;
-    }
+    // remembered for the completion
+    req->driver_data[0] = reinterpret_cast<uintptr_t>(this);
 
-    // wait for it to complete
-    uint32_t error_status;
-    err = port_.wait_for_completion(slot, &error_status);
-    if (use_ncq) {
-        port_.release_ncq_tag(tag);
-    }
+    const ahci_cmd_completion completion = { &command_done, req };
+    int slot;
+    auto err = port_.queue_command(&fis, sizeof(fis), runs, run_count, write, use_ncq, &completion, &slot);
     if (err != NO_ERROR) {
-        return err;
-    }
-
-    // check the status bits
-    if (error_status & (1U << 0)) { // check ERR bit
-        printf("ahci_disk::%s_sectors: device reported error, status %#x\n",
-               write ? "write" : "read", error_status);
-        return ERR_IO;
+        // out of command slots, try again once one comes back
+        return (err == ERR_NOT_FOUND) ? ERR_BUSY : err;
     }
 
-    LTRACEF("error_status %#x\n", error_status);
-
     return NO_ERROR;
 }
 
-status_t ahci_disk::read_sectors_sync(uint64_t lba, void *buf, size_t buf_len) {
-    return do_rw_sectors_sync(lba, buf, buf_len, false);
-}
+// called from the port's irq handler
+void ahci_disk::command_done(void *arg, status_t status) {
+    auto *req = static_cast<bio_request_t *>(arg);
+    auto *disk = reinterpret_cast<ahci_disk *>(req->driver_data[0]);
 
-status_t ahci_disk::write_sectors_sync(uint64_t lba, const void *buf, size_t buf_len) {
-    return do_rw_sectors_sync(lba, const_cast<void *>(buf), buf_len, true);
+    if (status != NO_ERROR) {
+        printf("ahci_disk: device reported error on %s of lba %#x\n",
+               req->op == BIO_OP_WRITE ? "write" : "read", req->dev_block);
+        bio_request_complete(req, status);
+        return;
+    }
+
+    bio_request_complete(req, static_cast<ssize_t>(req->merge_count) * disk->logical_sector_size());
 }
 
 // block io interface
@@ -237,22 +229,13 @@ ahci_disk::bio_handler::~bio_handler() {
         bio_unregister_device(&bdev_);
         registered_ = false;
     }
+    bio_queue_detach(&bdev_);
 }
 
-ssize_t ahci_disk::bio_handler::bdev_read_block_hook(struct bdev *dev, void *buf, bnum_t block, uint count) {
-    ahci_disk *disk = bdev_to_disk(dev);
-    uint64_t lba = static_cast<uint64_t>(block);
-    size_t len = static_cast<size_t>(count) * disk->logical_sector_size();
-    return disk->read_sectors_sync(lba, buf, len) == NO_ERROR ? static_cast<ssize_t>(len) : ERR_IO;
+status_t ahci_disk::bio_handler::bdev_issue_hook(struct bdev *dev, bio_request_t *req) {
+    return bdev_to_disk(dev)->issue(req);
 }
 
-ssize_t ahci_disk::bio_handler::bdev_write_block_hook(struct bdev *dev, const void *buf, bnum_t block, uint count) {
-    ahci_disk *disk = bdev_to_disk(dev);
-    uint64_t lba = static_cast<uint64_t>(block);
-    size_t len = static_cast<size_t>(count) * disk->logical_sector_size();
-    return disk->write_sectors_sync(lba, buf, len) == NO_ERROR ? static_cast<ssize_t>(len) : ERR_IO;
-};
-
 void ahci_disk::bio_handler::bdev_close_hook(struct bdev *dev) {
     bio_handler *handler = bdev_to_handler(dev);
     handler->registered_ = false;
@@ -277,11 +260,19 @@ status_t ahci_disk::bio_handler::initialize_bdev() {
                         nullptr,
                         BIO_FLAGS_NONE);
 
-    // register some block device hooks
-    bdev_.read_block = &bdev_read_block_hook;
-    bdev_.write_block = &bdev_write_block_hook;
-    bdev_.read_async = &bdev_read_async_hook;
-    bdev_.write_async = &bdev_write_async_hook;
+    // Block and async I/O go through a request queue, as many at once as the
+    // drive queues with NCQ. Merges are limited by the sector count of a command
+    // and its PRDT entries.
+    bio_queue_config qconfig = {};
+    qconfig.issue = &bdev_issue_hook;
+    qconfig.depth = disk_->supports_ncq_ ? disk_->ncq_queue_depth_ : 1;
+    qconfig.max_blocks = 0xffff;
+    qconfig.max_segments = ahci_port::PRD_PER_CMD;
+    status_t err = bio_queue_attach(&bdev_, &qconfig);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
     bdev_.close = &bdev_close_hook;
 
     dprintf(INFO, "ahci%d: registering block device '%s'\n",
@@ -293,69 +284,3 @@ status_t ahci_disk::bio_handler::initialize_bdev() {
 
     return NO_ERROR;
 }
-
-status_t ahci_disk::bio_handler::bdev_read_async_hook(struct bdev *dev, void *buf, off_t offset, size_t len,
-                                                       bio_async_callback_t callback, void *callback_context) {
-    ahci_disk *disk = bdev_to_disk(dev);
-    return disk->do_rw_sectors_async(dev, offset / disk->logical_sector_size_, buf,
-                                     len, false, callback, callback_context);
-}
-
-status_t ahci_disk::bio_handler::bdev_write_async_hook(struct bdev *dev, const void *buf, off_t offset, size_t len,
-                                                        bio_async_callback_t callback, void *callback_context) {
-    ahci_disk *disk = bdev_to_disk(dev);
-    return disk->do_rw_sectors_async(dev, offset / disk->logical_sector_size_, (void *)buf,
-                                     len, true, callback, callback_context);
-}
-
-status_t ahci_disk::do_rw_sectors_async(bdev_t *bdev, uint64_t lba, void *buf, size_t buf_len, bool write,
-                                        bio_async_callback_t callback, void *callback_context) {
-    LTRACEF("lba %#llx buf %p len %zu write %d\n", lba, buf, buf_len, write);
-
-    if (buf_len % logical_sector_size_ != 0) {
-        return ERR_INVALID_ARGS;
-    }
-
-    size_t sector_count = buf_len / logical_sector_size_;
-    if (sector_count == 0 || sector_count > 0xffff) {
-        return ERR_INVALID_ARGS;
-    }
-
-    // Allocate an NCQ tag if using NCQ, otherwise use tag 0 (unused for non-NCQ)
-    uint8_t tag = 0;
-    bool use_ncq = false;
-    if (supports_ncq_) {
-        int tag_result = port_.allocate_ncq_tag();
-        if (tag_result < 0) {
-            LTRACEF("failed to allocate NCQ tag, falling back to DMA: %d\n", tag_result);
-            // Fall back to DMA if we can't allocate a tag
-        } else {
-            tag = tag_result;
-            use_ncq = true;
-        }
-    }
-
-    // Select appropriate command based on NCQ support
-    FIS_REG_H2D fis = use_ncq
-                          ? (write ? ata_cmd_write_fpdma_queued(lba, sector_count, tag)
-                                   : ata_cmd_read_fpdma_queued(lba, sector_count, tag))
-                          : (write ? ata_cmd_write_dma_ext(lba, sector_count)
-                                   : ata_cmd_read_dma_ext(lba, sector_count));
-
-    int slot;
-    auto err = port_.queue_command(&fis, sizeof(fis), buf, buf_len, write, use_ncq, tag, &slot);
-    if (err != NO_ERROR) {
-        if (use_ncq) {
-            port_.release_ncq_tag(tag);
-        }
-        // Invoke callback with error immediately
-        callback(callback_context, bdev, (ssize_t)err);
-        return NO_ERROR;  // Return NO_ERROR since we handled the error via callback
-    }
-
-    // Register async callback with port - will be invoked when command completes
-    port_.register_async_callback(slot, callback, bdev, callback_context, (ssize_t)buf_len);
-
-    // Return NO_ERROR immediately (async operation is queued)
-    return NO_ERROR;
-}
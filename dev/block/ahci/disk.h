@@ -7,6 +7,7 @@
 #pragma once
 
 #include <lib/bio.h>
+#include <lib/bio/queue.h>
 #include <lk/cpp.h>
 #include <lk/list.h>
 #include <sys/types.h>
@@ -16,13 +17,6 @@
 
 struct ahci_disk_bio_handler;
 
-// Tracks a pending async I/O operation
-struct async_io_op {
-    bio_async_callback_t callback;
-    void *callback_context;
-    ssize_t result; // set by completion handler
-};
-
 class ahci_disk final {
   public:
     explicit ahci_disk(ahci_port &p) : port_(p) {}
@@ -43,14 +37,9 @@ class ahci_disk final {
     }
 
   private:
-    status_t read_sectors_sync(uint64_t lba, void *buf, size_t buf_len);
-    status_t write_sectors_sync(uint64_t lba, const void *buf, size_t buf_len);
-
-    status_t do_rw_sectors_sync(uint64_t lba, void *buf, size_t buf_len, bool write);
-
-    // Async I/O helper
-    status_t do_rw_sectors_async(bdev_t *bdev, uint64_t lba, void *buf, size_t buf_len, bool write,
-                                 bio_async_callback_t callback, void *callback_context);
+    // start the transfer for a request from the bio queue
+    status_t issue(bio_request_t *req);
+    static void command_done(void *arg, status_t status);
 
     ahci_port &port_;
 
@@ -75,16 +64,8 @@ class ahci_disk final {
         ahci_disk *disk_;
         bool registered_ = false;
 
-        // Track pending async operations: indexed by command slot
-        async_io_op pending_async_[ahci_port::MAX_CMD_COUNT] = {};
-
       private:
-        static ssize_t bdev_read_block_hook(struct bdev *dev, void *buf, bnum_t block, uint count);
-        static ssize_t bdev_write_block_hook(struct bdev *dev, const void *buf, bnum_t block, uint count);
-        static status_t bdev_read_async_hook(struct bdev *dev, void *buf, off_t offset, size_t len,
-                                             bio_async_callback_t callback, void *callback_context);
-        static status_t bdev_write_async_hook(struct bdev *dev, const void *buf, off_t offset, size_t len,
-                                              bio_async_callback_t callback, void *callback_context);
+        static status_t bdev_issue_hook(struct bdev *dev, bio_request_t *req);
         static void bdev_close_hook(struct bdev *dev);
     } bio_handler_{this};
 
@@ -13,6 +13,7 @@
 #include <lk/trace.h>
 #include <string.h>
 
+#include "ata.h"
 #include "disk.h"
 
 #define LOCAL_TRACE 0
@@ -163,12 +164,22 @@ status_t ahci_port::probe(ahci_disk **found_disk) {
     return NO_ERROR;
 }
 
-status_t ahci_port::find_free_cmdslot(uint *slot_out) {
+status_t ahci_port::find_free_cmdslot(bool ncq, uint *slot_out) {
     DEBUG_ASSERT(spin_lock_held(&lock_));
 
     uint32_t all_slots = read_port_reg(ahci_port_reg::PxSACT) |
                          read_port_reg(ahci_port_reg::PxCI);
 
+    // mask out all the bits for commands that are still pending, and slots the
+    // controller doesn't have
+    all_slots |= cmd_pending_;
+    if (command_slots_ < 32) {
+        all_slots |= ~((1U << command_slots_) - 1);
+    }
+    if (ncq && ncq_depth_ < 32) {
+        all_slots |= ~((1U << ncq_depth_) - 1);
+    }
+
     LTRACEF_LEVEL(2, "all_slots %#x\n", all_slots);
 
     if (unlikely(all_slots == 0xffffffff)) {
@@ -176,40 +187,24 @@ status_t ahci_port::find_free_cmdslot(uint *slot_out) {
         return ERR_NOT_FOUND;
     }
 
-    // mask out all the bits for commands that are still pending
-    all_slots |= cmd_pending_;
-
-    uint avail = __builtin_clz(~all_slots);
+    uint avail = __builtin_ctz(~all_slots);
     LTRACEF_LEVEL(2, "avail %u\n", avail);
 
     *slot_out = avail;
     return NO_ERROR;
-
-    // static int next_slot = 0;
-    // return next_slot++ % command_slots_;
 }
 
-struct ahci_mem_run {
-    paddr_t address;
-    size_t length;
-};
-
-namespace {
-
-// convert a virtual buffer into a list of physical runs suitable for programming into AHCI PRDT entries.
+// convert a virtual buffer into a list of physical runs suitable for programming into AHCI PRDT entries,
+// appending to the runs already there.
 // TODO: consider moving into some sort of shared library if needed elsewhere.
-status_t virtual_to_pa_runs(const void *buf, const size_t len,
-                            struct ahci_mem_run *runs,
-                            size_t *run_count) {
-    const size_t max_runs = *run_count;
-    *run_count = 0;
-
+status_t ahci_virtual_to_pa_runs(const void *buf, const size_t len, ahci_mem_run *runs,
+                                 const size_t max_runs, size_t *run_count) {
     const uint8_t *ptr = static_cast<const uint8_t *>(buf);
 
     LTRACEF("buf %p len %zu\n", buf, len);
 
     size_t remaining = len;
-    size_t index = 0;
+    size_t index = *run_count;
     while (remaining > 0) {
         const paddr_t pa = vaddr_to_paddr((void *)ptr);
         if (pa == 0) {
@@ -243,43 +238,49 @@ status_t virtual_to_pa_runs(const void *buf, const size_t len,
     return NO_ERROR;
 }
 
-} // namespace
-
-// Queue a command to the AHCI port, finding a slot, setting up the PRDT entries, and kicking the command engine.
-// Returns the slot number used in slot_out.
-status_t ahci_port::queue_command(const void *fis, size_t fis_len, void *buf, size_t buf_len, bool write, bool ncq, uint8_t tag, int *slot_out) {
-    LTRACEF("fis %p len %zu buf %p len %zu write %d ncq %d tag %u\n", fis, fis_len, buf, buf_len, write, ncq, tag);
-
-    DEBUG_ASSERT(fis);
-    DEBUG_ASSERT(fis_len > 0 && fis_len <= 64 && IS_ALIGNED(fis_len, 4));
+// Queue a command to the AHCI port for a single virtual buffer.
+status_t ahci_port::queue_command(const void *fis, size_t fis_len, void *buf, size_t buf_len, bool write, bool ncq, int *slot_out) {
     DEBUG_ASSERT(buf || buf_len == 0);
 
     // build a list of physical memory runs
     ahci_mem_run runs[PRD_PER_CMD];
-    size_t run_count = countof(runs);
-    status_t err = virtual_to_pa_runs(buf, buf_len, runs, &run_count);
+    size_t run_count = 0;
+    status_t err = ahci_virtual_to_pa_runs(buf, buf_len, runs, countof(runs), &run_count);
     if (err != NO_ERROR) {
         return err;
     }
     DEBUG_ASSERT(buf_len == 0 || run_count != 0);
+
+    return queue_command(fis, fis_len, runs, run_count, write, ncq, nullptr, slot_out);
+}
+
+// Queue a command to the AHCI port, finding a slot, setting up the PRDT entries, and kicking the command engine.
+// Returns the slot number used in slot_out.
+status_t ahci_port::queue_command(const void *fis, size_t fis_len, const ahci_mem_run *runs, size_t run_count,
+                                  bool write, bool ncq, const ahci_cmd_completion *completion,
+                                  int *slot_out) {
+    LTRACEF("fis %p len %zu runs %zu write %d ncq %d\n", fis, fis_len, run_count, write, ncq);
+
+    DEBUG_ASSERT(fis);
+    DEBUG_ASSERT(fis_len > 0 && fis_len <= 64 && IS_ALIGNED(fis_len, 4));
     DEBUG_ASSERT(run_count <= PRD_PER_CMD);
+    DEBUG_ASSERT(!ncq || fis_len == sizeof(FIS_REG_H2D));
 
     AutoSpinLock guard(&lock_);
 
     // Allocate a slot
     uint slot;
-    status_t status = find_free_cmdslot(&slot);
+    status_t status = find_free_cmdslot(ncq, &slot);
     if (status != NO_ERROR) {
         return status;
     }
 
-    DEBUG_ASSERT((command_slots_ & (1U << slot)) == 0);
-    // TODO: handle the case where we couldn't find a free slot
+    DEBUG_ASSERT(slot < command_slots_);
 
     LTRACEF("slot %u\n", slot);
 
-    // clear interrupt status for this port
-    write_port_reg(ahci_port_reg::PxIS, 0xf);
+    // Interrupt status is left alone here, other commands may still be finishing
+    // and the irq handler acks what it has seen.
 
     auto *cmd_table = cmd_table_ptr(slot);
 
@@ -299,6 +300,14 @@ status_t ahci_port::queue_command(const void *fis, size_t fis_len, void *buf, si
         }
     }
 
+    // an NCQ command is tagged with its slot, the controller matches them up
+    FIS_REG_H2D tagged_fis;
+    if (ncq) {
+        memcpy(&tagged_fis, fis, sizeof(tagged_fis));
+        ata_fis_set_ncq_tag(&tagged_fis, slot);
+        fis = &tagged_fis;
+    }
+
     // copy command into the command table
     for (size_t i = 0; i < fis_len / 4; i++) {
         cmd_table->cfis[i] = static_cast<const uint32_t *>(fis)[i];
@@ -316,8 +325,10 @@ status_t ahci_port::queue_command(const void *fis, size_t fis_len, void *buf, si
     // barrier here
     wmb();
 
-    // unsignal the command complete event for this slot
+    // unsignal the command complete event for this slot, and note who to tell if
+    // nobody will be waiting on it
     event_unsignal(&cmd_complete_event_[slot]);
+    async_cmds_[slot] = completion ? *completion : ahci_cmd_completion{};
 
     LTRACEF("IS %#x (before kick)\n", read_port_reg(ahci_port_reg::PxIS));
 
@@ -364,10 +375,8 @@ handler_return ahci_port::irq_handler() {
     // List of completed commands to invoke callbacks for (outside spinlock)
     struct {
         size_t slot;
-        bio_async_callback_t callback;
-        bdev_t *bdev;
-        void *callback_context;
-        ssize_t result;
+        ahci_cmd_completion completion;
+        status_t status;
     } completed_async[MAX_CMD_COUNT];
     size_t completed_async_count = 0;
     int sync_waiters_woken = 0;
@@ -410,29 +419,22 @@ handler_return ahci_port::irq_handler() {
             const auto error_status = read_port_reg(ahci_port_reg::PxTFD);
             LTRACEF("error_status %#x\n", error_status);
 
-            // Compute result for async callbacks
-            ssize_t result;
-            if (error_status & (1U << 0)) {  // check ERR bit
-                result = ERR_IO;  // Return error code
-            } else {
-                result = async_cmds_[cmd_slot].bytes_to_read_write;  // Return bytes on success
-            }
-            cmd_results_[cmd_slot] = result;
-
-            // Collect async callbacks to invoke later (outside spinlock)
-            if (async_cmds_[cmd_slot].callback) {
+            // Collect async callbacks to invoke later (outside spinlock). Nobody
+            // waits on these, so the slot is freed here.
+            if (async_cmds_[cmd_slot].func) {
                 completed_async[completed_async_count].slot = cmd_slot;
-                completed_async[completed_async_count].callback = async_cmds_[cmd_slot].callback;
-                completed_async[completed_async_count].bdev = async_cmds_[cmd_slot].bdev;
-                completed_async[completed_async_count].callback_context = async_cmds_[cmd_slot].callback_context;
-                completed_async[completed_async_count].result = result;
+                completed_async[completed_async_count].completion = async_cmds_[cmd_slot];
+                completed_async[completed_async_count].status =
+                    (error_status & (1U << 0)) ? ERR_IO : NO_ERROR; // check ERR bit
                 completed_async_count++;
-                async_cmds_[cmd_slot].callback = nullptr;
+                async_cmds_[cmd_slot] = {};
+                cmd_pending_ &= ~(1U << cmd_slot);
+                ncq_active_ &= ~(1U << cmd_slot);
+            } else {
+                // Signal the sync completion event
+                sync_waiters_woken += event_signal(&cmd_complete_event_[cmd_slot], false);
             }
 
-            // Signal the sync completion event
-            sync_waiters_woken += event_signal(&cmd_complete_event_[cmd_slot], false);
-
             // move to the next pending slot (if any)
             cmd_complete_bitmap &= ~(1U << cmd_slot);
         }
@@ -444,60 +446,15 @@ handler_return ahci_port::irq_handler() {
     // Invoke async callbacks outside the spinlock to avoid deadlocks
     for (size_t i = 0; i < completed_async_count; i++) {
         LTRACEF("invoking async callback for slot %zu\n", completed_async[i].slot);
-        completed_async[i].callback(completed_async[i].callback_context, completed_async[i].bdev,
-                                    completed_async[i].result);
+        completed_async[i].completion.func(completed_async[i].completion.arg, completed_async[i].status);
     }
 
     return (sync_waiters_woken > 0 || completed_async_count > 0) ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 
-// Allocate an NCQ tag for use by a new queued command.
-// Returns tag number (0-31) on success, or negative error code if no tags available.
-int ahci_port::allocate_ncq_tag() {
-    AutoSpinLock guard(&lock_);
-
-    if (free_ncq_tags_ == 0) {
-        // no free tags available
-        return ERR_BUSY;
-    }
-
-    // find the first set bit (first free tag)
-    int tag = __builtin_ctz(free_ncq_tags_);
-    DEBUG_ASSERT(tag >= 0 && tag < 32);
-
-    // mark this tag as in use
-    free_ncq_tags_ &= ~(1U << tag);
-
-    LTRACEF("allocated tag %d (free_ncq_tags_ now %#x)\n", tag, free_ncq_tags_);
-
-    return tag;
-}
-
-// Release a previously allocated NCQ tag back to the pool.
-void ahci_port::release_ncq_tag(uint8_t tag) {
-    DEBUG_ASSERT(tag < 32);
+void ahci_port::set_ncq_depth(uint depth) {
+    DEBUG_ASSERT(depth > 0 && depth <= MAX_CMD_COUNT);
 
     AutoSpinLock guard(&lock_);
-
-    DEBUG_ASSERT((free_ncq_tags_ & (1U << tag)) == 0); // tag should be in use
-
-    // mark this tag as free
-    free_ncq_tags_ |= (1U << tag);
-
-    LTRACEF("released tag %u (free_ncq_tags_ now %#x)\n", tag, free_ncq_tags_);
-}
-
-// Register an async completion callback for a command slot.
-void ahci_port::register_async_callback(uint slot, bio_async_callback_t callback, bdev_t *bdev,
-                                        void *callback_context, ssize_t bytes_to_transfer) {
-    DEBUG_ASSERT(slot < command_slots_);
-
-    AutoSpinLock guard(&lock_);
-
-    async_cmds_[slot].callback = callback;
-    async_cmds_[slot].bdev = bdev;
-    async_cmds_[slot].callback_context = callback_context;
-    async_cmds_[slot].bytes_to_read_write = bytes_to_transfer;
-
-    LTRACEF("registered async callback for slot %u, %ld bytes\n", slot, bytes_to_transfer);
+    ncq_depth_ = depth;
 }
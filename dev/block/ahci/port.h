@@ -17,6 +17,24 @@
 
 class ahci_disk;
 
+// a physically contiguous piece of a transfer, one PRDT entry
+struct ahci_mem_run {
+    paddr_t address;
+    size_t length;
+};
+
+// Append the physical runs of a virtual buffer to runs, merging with the last one
+// where they touch. Fails with ERR_NOT_ENOUGH_BUFFER past max_runs.
+status_t ahci_virtual_to_pa_runs(const void *buf, size_t len, ahci_mem_run *runs,
+                                 size_t max_runs, size_t *run_count);
+
+// Called from the irq handler when a command nobody waits on finishes, with
+// NO_ERROR or ERR_IO. Its slot is free again by then.
+struct ahci_cmd_completion {
+    void (*func)(void *arg, status_t status);
+    void *arg;
+};
+
 // per port AHCI object
 class ahci_port final {
   public:
@@ -29,18 +47,19 @@ class ahci_port final {
 
     status_t probe(ahci_disk **found_disk);
 
-    status_t queue_command(const void *fis, size_t fis_len, void *buf, size_t buf_len, bool write, bool ncq, uint8_t tag, int *slot_out);
+    // Queue a command transferring to or from runs. Without a completion it is
+    // waited for with wait_for_completion(). Returns ERR_NOT_FOUND if every slot
+    // is in use. An NCQ command's slot is its tag, which is written into the FIS
+    // here.
+    status_t queue_command(const void *fis, size_t fis_len, const ahci_mem_run *runs, size_t run_count,
+                           bool write, bool ncq, const ahci_cmd_completion *completion,
+                           int *slot_out);
+    status_t queue_command(const void *fis, size_t fis_len, void *buf, size_t buf_len, bool write, bool ncq, int *slot_out);
     status_t wait_for_completion(uint slot, uint32_t *error_status);
 
-    // Register async callback for a pending command. Called after queue_command
-    // returns a slot. bytes_to_transfer is the number of bytes to transfer
-    // (returned as result on success).
-    void register_async_callback(uint slot, bio_async_callback_t callback, bdev_t *bdev,
-                                 void *callback_context, ssize_t bytes_to_transfer);
-
-    // Tag allocation for NCQ
-    int allocate_ncq_tag();
-    void release_ncq_tag(uint8_t tag);
+    // NCQ commands only go in the slots below the device's queue depth, so the
+    // tags are ones it takes
+    void set_ncq_depth(uint depth);
 
     auto index() const { return index_; }
     auto controller_unit() const { return ahci_.unit_num(); }
@@ -52,19 +71,11 @@ class ahci_port final {
     static const size_t CMD_TABLE_ENTRY_SIZE = sizeof(ahci_cmd_table) + sizeof(ahci_prd) * PRD_PER_CMD;
     static const size_t MAX_PRDT_RUN_LENGTH = 0x400000;  // 4MB AHCI PRDT limit
 
-  private:
-    struct async_cmd_info {
-        bio_async_callback_t callback = nullptr;
-        bdev_t *bdev = nullptr;
-        void *callback_context = nullptr;
-        ssize_t bytes_to_read_write = 0;  // bytes to transfer (for result on success)
-    };
-
   private:
     uint32_t read_port_reg(ahci_port_reg reg);
     void write_port_reg(ahci_port_reg reg, uint32_t val);
 
-    status_t find_free_cmdslot(uint *slot_out);
+    status_t find_free_cmdslot(bool ncq, uint *slot_out);
     volatile ahci_cmd_table *cmd_table_ptr(uint cmd_slot);
 
     bool is_command_queued(uint slot) {
@@ -85,12 +96,10 @@ class ahci_port final {
     // pending command bitmap
     uint32_t cmd_pending_ = 0;
     uint32_t ncq_active_ = 0;
-    // bitmap of free NCQ tags (32 tags total)
-    uint32_t free_ncq_tags_ = 0xffffffff;
+    uint32_t ncq_depth_ = MAX_CMD_COUNT;
 
-    // async command tracking: indexed by command slot
-    async_cmd_info async_cmds_[MAX_CMD_COUNT] = {};
-    ssize_t cmd_results_[MAX_CMD_COUNT] = {};  // result (bytes read/written) for each slot
+    // completions of commands nobody waits on, indexed by command slot
+    ahci_cmd_completion async_cmds_[MAX_CMD_COUNT] = {};
 
     event cmd_complete_event_[MAX_CMD_COUNT];
 
@@ -12,6 +12,7 @@
 #include <kernel/mutex.h>
 #include <kernel/event.h>
 #include <lib/bio.h>
+#include <lib/bio/queue.h>
 #include <limits.h>
 #include <lk/debug.h>
 #include <lk/err.h>
@@ -179,8 +180,7 @@ static ssize_t ide_get_block_size(struct ide_device *dev, int drive);
 static ssize_t ide_get_block_count(struct ide_device *dev, int drive);
 static ssize_t ide_write(struct ide_device *dev, int drive, off_t offset, const void *buf, size_t count);
 static ssize_t ide_read(struct ide_device *dev, int drive, off_t offset, void *buf, size_t count);
-static ssize_t ide_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
-static ssize_t ide_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t ide_bdev_issue(struct bdev *bdev, bio_request_t *req);
 
 static uint8_t ide_read_reg8(struct ide_device *dev, int index);
 static uint16_t ide_read_reg16(struct ide_device *dev, int index);
@@ -369,8 +369,16 @@ static status_t ide_register_bdev(struct ide_channel_state *chan, int drive) {
                         NULL,
                         BIO_FLAGS_NONE);
 
-    ide_bdev->bdev.read_block = ide_bdev_read_block;
-    ide_bdev->bdev.write_block = ide_bdev_write_block;
+    /* PIO transfers block, so the queue feeds them one at a time from a thread */
+    const struct bio_queue_config qconfig = {
+        .issue = ide_bdev_issue,
+        .depth = 1,
+        .blocking = true,
+    };
+    status_t err = bio_queue_attach(&ide_bdev->bdev, &qconfig);
+    if (err < 0) {
+        return err;
+    }
 
     bio_register_device(&ide_bdev->bdev);
     ide_bdev->registered = true;
@@ -380,34 +388,38 @@ static status_t ide_register_bdev(struct ide_channel_state *chan, int drive) {
     return NO_ERROR;
 }
 
-static ssize_t ide_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count) {
-    struct ide_bdev *ide_bdev = (struct ide_bdev *)bdev;
-    uint trim_count = bio_trim_block_range(bdev, block, count);
-    if (trim_count == 0) {
-        return 0;
-    }
-
-    ssize_t sectors = ide_read(ide_bdev->dev, ide_bdev->drive, (off_t)block, buf, trim_count);
-    if (sectors < 0) {
-        return sectors;
-    }
-
-    return sectors * (ssize_t)bdev->block_size;
-}
-
-static ssize_t ide_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count) {
+/* carry out a request and anything merged behind it, a command per buffer */
+static status_t ide_bdev_issue(struct bdev *bdev, bio_request_t *req) {
     struct ide_bdev *ide_bdev = (struct ide_bdev *)bdev;
-    uint trim_count = bio_trim_block_range(bdev, block, count);
-    if (trim_count == 0) {
-        return 0;
-    }
+    off_t block = req->dev_block;
+    ssize_t total = 0;
+
+    bio_sg_iter_t iter;
+    bio_sg_iter_init(&iter, req);
+    void *buf;
+    size_t len;
+    while (bio_sg_iter_next(&iter, SIZE_MAX, &buf, &len)) {
+        size_t count = len >> bdev->block_shift;
+        ssize_t sectors;
+        if (req->op == BIO_OP_WRITE) {
+            sectors = ide_write(ide_bdev->dev, ide_bdev->drive, block, buf, count);
+        } else {
+            sectors = ide_read(ide_bdev->dev, ide_bdev->drive, block, buf, count);
+        }
+        if (sectors < 0) {
+            total = sectors;
+            break;
+        }
 
-    ssize_t sectors = ide_write(ide_bdev->dev, ide_bdev->drive, (off_t)block, buf, trim_count);
-    if (sectors < 0) {
-        return sectors;
+        total += sectors * (ssize_t)bdev->block_size;
+        if ((size_t)sectors != count) {
+            break;
+        }
+        block += count;
     }
 
-    return sectors * (ssize_t)bdev->block_size;
+    bio_request_complete(req, total);
+    return NO_ERROR;
 }
 
 static enum handler_return ide_irq_handler(void *arg) {
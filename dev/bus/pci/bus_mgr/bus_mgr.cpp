@@ -369,6 +369,27 @@ status_t pci_bus_mgr_allocate_msix(const pci_location_t loc, size_t num_requeste
     return d->allocate_msix(num_requested, irqbase);
 }
 
+size_t pci_bus_mgr_msix_table_count(const pci_location_t loc) {
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return 0;
+    }
+
+    return d->msix_table_count();
+}
+
+status_t pci_bus_mgr_set_msix_cpu(const pci_location_t loc, size_t index, uint cpu) {
+    char str[14];
+    LTRACEF("%s index %zu cpu %u\n", pci_loc_string(loc, str), index, cpu);
+
+    device *d = lookup_device_by_loc(loc);
+    if (!d) {
+        return ERR_NOT_FOUND;
+    }
+
+    return d->set_msix_cpu(index, cpu);
+}
+
 status_t pci_bus_mgr_allocate_irq(const pci_location_t loc, uint *irqbase) {
     char str[14];
     LTRACEF("%s\n", pci_loc_string(loc, str));
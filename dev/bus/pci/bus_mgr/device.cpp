@@ -10,6 +10,7 @@
 #include "arch/mmu.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <dev/bus/pci.h>
 #include <lk/cpp.h>
 #include <lk/debug.h>
@@ -379,11 +380,23 @@ status_t device::allocate_msi(size_t num_requested, uint *msi_base) {
     return NO_ERROR;
 }
 
+uint32_t device::msix_table_count() {
+    if (!has_msix()) {
+        return 0;
+    }
+
+    uint16_t control;
+    if (pci_read_config_half(loc(), msix_cap_->config_offset + 2, &control) != NO_ERROR) {
+        return 0;
+    }
+
+    return (control & 0x7ff) + 1;
+}
+
 status_t device::allocate_msix(size_t num_requested, uint *msi_base) {
     LTRACE_ENTRY;
 
-    // for the moment, only deal with 1
-    DEBUG_ASSERT(num_requested == 1);
+    DEBUG_ASSERT(num_requested > 0);
 
     if (!has_msix()) {
         return ERR_NOT_SUPPORTED;
@@ -400,7 +413,7 @@ status_t device::allocate_msix(size_t num_requested, uint *msi_base) {
     if (err != NO_ERROR) {
         return err;
     }
-    const uint32_t table_count = (control & 0x3f) + 1;
+    const uint32_t table_count = (control & 0x7ff) + 1;
     LTRACEF("control word %#x table count %u\n", control, table_count);
     uint32_t table_offset, pba_offset;
     err = pci_read_config_word(loc(), cap_offset + 4, &table_offset);
@@ -488,15 +501,6 @@ status_t device::allocate_msix(size_t num_requested, uint *msi_base) {
 
     LTRACEF("msix table %p, pba table %p\n", msix_table_ptr, msix_pba_ptr);
 
-    // compute the MSI message to construct
-    uint64_t msi_address = 0;
-    uint16_t msi_data = 0;
-    err = platform_compute_msi_values(vector_base, 0, true, &msi_address, &msi_data);
-    if (err != NO_ERROR) {
-        // TODO: return the allocated msi
-        return err;
-    }
-
     // Mask all of the vectors
     for (size_t i = 0; i < table_count; i++) {
         msix_table_ptr[i * 4] = 0;
@@ -505,12 +509,17 @@ status_t device::allocate_msix(size_t num_requested, uint *msi_base) {
         msix_table_ptr[i * 4 + 3] = 1; // masked
     }
 
-    // write the requested vectors
+    msix_table_size = table_count;
+    msix_vector_base = vector_base;
+    msix_vector_count = num_requested;
+
+    // write the requested vectors, each one its own vector delivered to cpu 0 to start with
     for (size_t i = 0; i < num_requested; i++) {
-        msix_table_ptr[i * 4] = msi_address;
-        msix_table_ptr[i * 4 + 1] = msi_address >> 32;
-        msix_table_ptr[i * 4 + 2] = msi_data;
-        msix_table_ptr[i * 4 + 3] = 0; // not masked
+        err = set_msix_cpu(i, 0);
+        if (err != NO_ERROR) {
+            // TODO: return the allocated msi
+            return err;
+        }
     }
 
     // set up the control register and enable it
@@ -526,6 +535,33 @@ status_t device::allocate_msix(size_t num_requested, uint *msi_base) {
     return NO_ERROR;
 }
 
+status_t device::set_msix_cpu(size_t index, uint cpu) {
+    if (!msix_table_ptr || index >= msix_vector_count) {
+        return ERR_INVALID_ARGS;
+    }
+
+    // compute the MSI message to construct
+    uint64_t msi_address = 0;
+    uint16_t msi_data = 0;
+    status_t err = platform_compute_msi_values(msix_vector_base + index, cpu, true, &msi_address, &msi_data);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    LTRACEF("index %zu vector %zu cpu %u address %#" PRIx64 " data %#x\n", index, msix_vector_base + index,
+            cpu, msi_address, msi_data);
+
+    // mask the entry while it is being rewritten so a half updated message is never sent
+    volatile uint32_t *entry = &msix_table_ptr[index * 4];
+    entry[3] = 1;
+    entry[0] = msi_address;
+    entry[1] = msi_address >> 32;
+    entry[2] = msi_data;
+    entry[3] = 0; // not masked
+
+    return NO_ERROR;
+}
+
 status_t device::load_bars() {
     size_t num_bars;
 
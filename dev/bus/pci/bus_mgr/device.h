@@ -35,6 +35,8 @@ public:
     status_t allocate_irq(uint *irq);
     status_t allocate_msi(size_t num_requested, uint *msi_base);
     status_t allocate_msix(size_t num_requested, uint *msi_base);
+    status_t set_msix_cpu(size_t index, uint cpu);
+    uint32_t msix_table_count();
     status_t load_config();
     status_t load_bars();
 
@@ -125,6 +127,8 @@ private:
 
     // MSI-X saved details
     uint32_t msix_table_size = {};
+    uint msix_vector_base = {};
+    size_t msix_vector_count = {};
     void *msix_table_map = nullptr;
     void *msix_pba_map = nullptr;
     volatile uint32_t *msix_table_ptr = nullptr;
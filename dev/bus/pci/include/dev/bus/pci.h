@@ -102,8 +102,15 @@ bool pci_bus_mgr_has_msix(pci_location_t loc);
 status_t pci_bus_mgr_allocate_msi(pci_location_t loc, size_t num_requested, uint *irqbase);
 
 // try to allocate one or more msi-x vectors for this device
+// table entry i is delivered as irqbase + i, all to cpu 0 until moved
 status_t pci_bus_mgr_allocate_msix(const pci_location_t loc, size_t num_requested, uint *irqbase);
 
+// number of msi-x table entries the device has, 0 if none
+size_t pci_bus_mgr_msix_table_count(pci_location_t loc);
+
+// deliver an allocated msi-x vector to another cpu
+status_t pci_bus_mgr_set_msix_cpu(pci_location_t loc, size_t index, uint cpu);
+
 // allocate a regular irq for this device and return it in irqbase
 status_t pci_bus_mgr_allocate_irq(pci_location_t loc, uint *irqbase);
 
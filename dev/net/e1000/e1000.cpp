@@ -12,7 +12,6 @@
 #include <lk/trace.h>
 #include <lk/list.h>
 #include <dev/bus/pci.h>
-#include <kernel/event.h>
 #include <kernel/thread.h>
 #include <kernel/vm.h>
 #include <lib/minip.h>
@@ -55,6 +54,13 @@ private:
 
     handler_return irq_handler();
 
+    // polling, kicked off by the irq
+    int poll(int budget);
+    void poll_irq_disable();
+    bool poll_irq_enable();
+    void reclaim_tx();
+    static const netif_poll_ops poll_ops_;
+
     void add_pktbuf_to_rxring(pktbuf_t *pkt);
     void add_pktbuf_to_rxring_locked(pktbuf_t *pkt);
 
@@ -82,11 +88,9 @@ private:
     uint8_t *rx_buf_ = nullptr; // rxbuffer_len * rxring_len byte buffer that rx_pktbuf[] points to
     pktbuf_t *rx_pending_pkt_ = nullptr;
 
-    // rx worker thread
-    list_node rx_queue_ = LIST_INITIAL_VALUE(rx_queue_);
-    event_t rx_event_ = EVENT_INITIAL_VALUE(rx_event_, 0, EVENT_FLAG_AUTOUNSIGNAL);
-    thread_t *rx_worker_thread_ = nullptr;
-    int rx_worker_routine();
+    // the rx ring and tx completions are handled by a poll on the cpu that took the irq
+    netif_poll poll_ = {};
+    volatile int rx_overrun_ = 0;
 
     // tx ring
     tdesc *txring_ = nullptr;
@@ -141,6 +145,9 @@ e1000::~e1000() {
     // TODO: free resources
 }
 
+// the causes that are handled by polling, masked off while it's going on
+static const uint32_t poll_irq_causes = E1000_ICR_TXDW | E1000_ICR_TXQE | E1000_ICR_RXTO | E1000_ICR_RXO;
+
 handler_return e1000::irq_handler() {
     // read the interrupt cause register, which also auto clears all bits
     auto icr = read_reg(e1000_reg::ICR);
@@ -150,164 +157,179 @@ handler_return e1000::irq_handler() {
 
     LTRACEF("icr %#x\n", icr);
 
-    AutoSpinLockNoIrqSave guard(&lock_);
-
     handler_return ret = INT_NO_RESCHEDULE;
 
-    if (icr & E1000_ICR_TXDW) { // TXDW - transmit descriptor written back
-        // Walk from last known head to current TDH, freeing completed TX pktbufs.
-        auto tdh = read_reg(e1000_reg::TDH);
-        while (tx_last_head_ != tdh) {
-            if (tx_pktbuf_[tx_last_head_]) {
-                pktbuf_free(tx_pktbuf_[tx_last_head_], false);
-                tx_pktbuf_[tx_last_head_] = nullptr;
-                ret = INT_RESCHEDULE;
-            }
-            tx_last_head_ = (tx_last_head_ + 1) % txring_len;
-        }
-    }
     if (icr & E1000_ICR_LSC) { // LSC - link status change
         LTRACEF("link status change, STATUS=%#x\n", read_reg(e1000_reg::STATUS));
     }
-    if (icr & E1000_ICR_TXQE) { // TXQE - transmit queue empty
-        // nothing to really do here
-    }
     if (icr & E1000_ICR_RXO) {
         LTRACEF("RX overrun\n");
 
-        // Any in-flight multi-descriptor frame is no longer trustworthy after overrun.
-        // Drop it so subsequent fragments do not get appended to stale packet state.
-        if (rx_pending_pkt_) {
-            pktbuf_reset(rx_pending_pkt_, 0);
-            add_pktbuf_to_rxring_locked(rx_pending_pkt_);
-            rx_pending_pkt_ = nullptr;
+        // the poll owns the rx ring, let it clean up
+        atomic_or(&rx_overrun_, 1);
+    }
+    if (icr & poll_irq_causes) {
+        // TXDW - transmit descriptor written back, RXTO/RXO - rx work pending
+        netif_poll_schedule(&poll_);
+        ret = INT_RESCHEDULE;
+    }
+
+    return ret;
+}
+
+void e1000::poll_irq_disable() {
+    write_reg(e1000_reg::IMC, poll_irq_causes);
+}
+
+bool e1000::poll_irq_enable() {
+    write_reg(e1000_reg::IMS, poll_irq_causes);
+
+    // look for anything that finished before the causes were unmasked
+    rdesc rxd;
+    copy(&rxd, rxring_ + rx_last_head_);
+    return (rxd.status & E1000_RXD_STAT_DD) || rx_overrun_ || read_reg(e1000_reg::TDH) != tx_last_head_;
+}
+
+// Walk from last known head to current TDH, freeing completed TX pktbufs.
+void e1000::reclaim_tx() {
+    AutoSpinLock guard(&lock_);
+
+    auto tdh = read_reg(e1000_reg::TDH);
+    while (tx_last_head_ != tdh) {
+        if (tx_pktbuf_[tx_last_head_]) {
+            pktbuf_free(tx_pktbuf_[tx_last_head_], false);
+            tx_pktbuf_[tx_last_head_] = nullptr;
+            poll_.tx_packets++;
         }
+        tx_last_head_ = (tx_last_head_ + 1) % txring_len;
     }
-    if (icr & (E1000_ICR_RXTO | E1000_ICR_RXO)) { // RXTO/RXO - rx work pending
-        // Packets may be ready, or descriptors may need draining after overrun.
-        auto rdh = read_reg(e1000_reg::RDH);
-        auto rdt = read_reg(e1000_reg::RDT);
+}
+
+int e1000::poll(int budget) {
+    reclaim_tx();
+
+    // packets completed this time around, handed up the stack once the lock is dropped
+    list_node rx_queue = LIST_INITIAL_VALUE(rx_queue);
+    int count = 0;
+
+    {
+        AutoSpinLock guard(&lock_);
 
-        while (rx_last_head_ != rdh) {
+        if (atomic_swap(&rx_overrun_, 0)) {
+            // Any in-flight multi-descriptor frame is no longer trustworthy after overrun.
+            // Drop it so subsequent fragments do not get appended to stale packet state.
+            if (rx_pending_pkt_) {
+                pktbuf_reset(rx_pending_pkt_, 0);
+                add_pktbuf_to_rxring_locked(rx_pending_pkt_);
+                rx_pending_pkt_ = nullptr;
+            }
+        }
+
+        // take descriptors the nic is done with, up to the budget
+        while (count < budget) {
             // copy the current rx descriptor locally for better cache performance
             rdesc rxd;
             copy(&rxd, rxring_ + rx_last_head_);
 
-            LTRACEF("last_head %#x RDH %#x RDT %#x\n", rx_last_head_, rdh, rdt);
+            if ((rxd.status & E1000_RXD_STAT_DD) == 0) { // the nic still owns this one
+                break;
+            }
+
+            LTRACEF("last_head %#x\n", rx_last_head_);
             if (LOCAL_TRACE) rxd.dump();
 
             // recover the pktbuf we queued in this spot
             DEBUG_ASSERT(rx_pktbuf_[rx_last_head_]);
             DEBUG_ASSERT(pktbuf_data_phys(rx_pktbuf_[rx_last_head_]) == rxd.addr);
             pktbuf_t *pkt = rx_pktbuf_[rx_last_head_];
+            rx_pktbuf_[rx_last_head_] = nullptr;
+            rx_last_head_ = (rx_last_head_ + 1) % rxring_len;
+            count++;
 
-            bool consumed_pkt = false;
-            if (rxd.status & E1000_RXD_STAT_DD) { // descriptor done, we own it now
-                bool eop = (rxd.status & E1000_RXD_STAT_EOP);
-
-                if (rxd.errors == 0) {
-                    if (rx_pending_pkt_) {
-                        // We are in the middle of a multi-descriptor packet. Append this fragment.
-                        if (pktbuf_avail_tail(rx_pending_pkt_) >= rxd.length) {
-                            // minip consumes a single contiguous pktbuf per frame. Copying this fragment
-                            // lets us present one complete packet while returning this descriptor buffer
-                            // immediately to the RX ring.
-                            pktbuf_append_data(rx_pending_pkt_, pkt->data, rxd.length);
-
-                            // This fragment buffer was consumed by copy. Recycle it to the rx ring.
-                            pktbuf_reset(pkt, 0);
-                            add_pktbuf_to_rxring_locked(pkt);
-                            consumed_pkt = true;
-
-                            if (eop) {
-                                // Packet is now complete.
-                                rx_pending_pkt_->flags |= PKTBUF_FLAG_EOF;
-                                list_add_tail(&rx_queue_, &rx_pending_pkt_->list);
-                                rx_pending_pkt_ = nullptr;
-                                event_signal(&rx_event_, false);
-                                ret = INT_RESCHEDULE;
-                            }
-                        } else {
-                            // Coalesced packet exceeded our fixed receive buffer. Drop and recover.
-                            pktbuf_reset(rx_pending_pkt_, 0);
-                            add_pktbuf_to_rxring_locked(rx_pending_pkt_);
-                            rx_pending_pkt_ = nullptr;
-                        }
-                    } else {
-                        // Start or finish a packet from this descriptor.
-                        pkt->dlen = rxd.length;
-                        if (eop) {
-                            pkt->flags |= PKTBUF_FLAG_EOF;
-                            list_add_tail(&rx_queue_, &pkt->list);
-                            event_signal(&rx_event_, false);
-                            ret = INT_RESCHEDULE;
-                            consumed_pkt = true;
-                        } else {
-                            // Save first fragment until we see EOP.
-                            pkt->flags &= ~PKTBUF_FLAG_EOF;
-                            rx_pending_pkt_ = pkt;
-                            consumed_pkt = true;
-                        }
-                    }
-                } else {
-                    // Descriptor has errors. Drop this packet and any in-progress coalesced frame.
-                    if (rx_pending_pkt_) {
-                        pktbuf_reset(rx_pending_pkt_, 0);
-                        add_pktbuf_to_rxring_locked(rx_pending_pkt_);
+            bool eop = (rxd.status & E1000_RXD_STAT_EOP);
+
+            if (rxd.errors != 0) {
+                // Descriptor has errors. Drop this packet and any in-progress coalesced frame.
+                if (rx_pending_pkt_) {
+                    pktbuf_reset(rx_pending_pkt_, 0);
+                    add_pktbuf_to_rxring_locked(rx_pending_pkt_);
+                    rx_pending_pkt_ = nullptr;
+                }
+                pktbuf_reset(pkt, 0);
+                add_pktbuf_to_rxring_locked(pkt);
+            } else if (rx_pending_pkt_) {
+                // We are in the middle of a multi-descriptor packet. Append this fragment.
+                if (pktbuf_avail_tail(rx_pending_pkt_) >= rxd.length) {
+                    // minip consumes a single contiguous pktbuf per frame. Copying this fragment
+                    // lets us present one complete packet while returning this descriptor buffer
+                    // immediately to the RX ring.
+                    pktbuf_append_data(rx_pending_pkt_, pkt->data, rxd.length);
+
+                    if (eop) {
+                        // Packet is now complete.
+                        rx_pending_pkt_->flags |= PKTBUF_FLAG_EOF;
+                        list_add_tail(&rx_queue, &rx_pending_pkt_->list);
                         rx_pending_pkt_ = nullptr;
                     }
+                } else {
+                    // Coalesced packet exceeded our fixed receive buffer. Drop and recover.
+                    pktbuf_reset(rx_pending_pkt_, 0);
+                    add_pktbuf_to_rxring_locked(rx_pending_pkt_);
+                    rx_pending_pkt_ = nullptr;
                 }
-            }
-            if (!consumed_pkt) {
-                // TODO: return the pkt to the ring
+
+                // This fragment buffer was consumed by copy. Recycle it to the rx ring.
+                pktbuf_reset(pkt, 0);
                 add_pktbuf_to_rxring_locked(pkt);
+            } else {
+                // Start or finish a packet from this descriptor.
+                pkt->dlen = rxd.length;
+                if (eop) {
+                    pkt->flags |= PKTBUF_FLAG_EOF;
+                    list_add_tail(&rx_queue, &pkt->list);
+                } else {
+                    // Save first fragment until we see EOP.
+                    pkt->flags &= ~PKTBUF_FLAG_EOF;
+                    rx_pending_pkt_ = pkt;
+                }
             }
-
-            rx_last_head_ = (rx_last_head_ + 1) % rxring_len;
         }
     }
-    return ret;
-}
-
-int e1000::rx_worker_routine() {
-    for (;;) {
-        event_wait(&rx_event_);
-
-        // pull some packets from the received queue
-        for (;;) {
-            pktbuf_t *p;
-
-            {
-                AutoSpinLock guard(&lock_);
 
-                p = list_remove_head_type(&rx_queue_, pktbuf_t, list);
-            }
-
-            if (!p) {
-                break; // nothing left in the queue, go back to waiting
-            }
-
-            if (LOCAL_TRACE) {
-                LTRACEF("got packet: ");
-                pktbuf_dump(p);
-            }
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&rx_queue, pktbuf_t, list))) {
+        if (LOCAL_TRACE) {
+            LTRACEF("got packet: ");
+            pktbuf_dump(p);
+        }
 
-            // push it up the stack
-            minip_rx_driver_callback(&netif_, p);
+        // push it up the stack
+        netif_poll_receive(&poll_, p);
 
-            // we own the pktbuf again
+        // we own the pktbuf again
 
-            // set the data pointer to the start of the buffer and set dlen to 0
-            pktbuf_reset(p, 0);
+        // set the data pointer to the start of the buffer and set dlen to 0
+        pktbuf_reset(p, 0);
 
-            // add it back to the rx ring at the current tail
-            add_pktbuf_to_rxring(p);
-        }
+        // add it back to the rx ring at the current tail
+        add_pktbuf_to_rxring(p);
     }
 
-    return 0;
+    return count;
 }
 
+const netif_poll_ops e1000::poll_ops_ = {
+    .poll = [](netif_poll *np, int budget) {
+        return static_cast<e1000 *>(np->arg)->poll(budget);
+    },
+    .irq_disable = [](netif_poll *np) {
+        static_cast<e1000 *>(np->arg)->poll_irq_disable();
+    },
+    .irq_enable = [](netif_poll *np) {
+        return static_cast<e1000 *>(np->arg)->poll_irq_enable();
+    },
+};
+
 int e1000::tx(pktbuf_t *p) {
     LTRACE;
     if (LOCAL_TRACE) {
@@ -535,6 +557,10 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
         // construct a 2K pktbuf, pointing outo our rx_buf_ block of memory
         auto *pkt = pktbuf_alloc_empty();
         if (!pkt) {
+            // run with a shorter ring, as long as there's something in it
+            if (i == 0) {
+                return ERR_NO_MEMORY;
+            }
             break;
         }
         pktbuf_add_buffer(pkt, rx_buf_ + i * rxbuffer_len, rxbuffer_len, 0, 0, nullptr, nullptr);
@@ -543,14 +569,10 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
     }
     //hexdump(rxring_, rxring_len * sizeof(rdesc));
 
-    // start rx worker thread
-    auto wrapper_lambda = [](void *arg) -> int {
-        e1000 *e = (e1000 *)arg;
-        return e->rx_worker_routine();
-    };
-    snprintf(str, sizeof(str), "e1000 %d rx worker", unit_);
-    rx_worker_thread_ = thread_create(str, wrapper_lambda, this, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
-    thread_resume(rx_worker_thread_);
+    // the rx and tx rings are polled from the netif poll thread, kicked off by the irq
+    snprintf(str, sizeof(str), "e1000-%d", unit_);
+    netif_create(&netif_, str);
+    netif_poll_init(&poll_, &netif_, &poll_ops_, this, NETIF_POLL_BUDGET, NETIF_POLL_CPU_CURRENT);
 
     // start receiver
     // enable RX, unicast permiscuous, multicast permiscuous, broadcast accept, BSIZE 2048
@@ -585,8 +607,6 @@ status_t e1000::init_device(pci_location_t loc, const e1000_id_features *id) {
     write_reg(e1000_reg::IMS, ims | E1000_ICR_TXQE | E1000_ICR_TXDW);
 
     // register this NIC instance with minip's netif layer
-    snprintf(str, sizeof(str), "e1000-%d", unit_);
-    netif_create(&netif_, str);
     auto tx = [](void *arg, pktbuf_t *p) -> int {
         auto *e = static_cast<e1000 *>(arg);
         DEBUG_ASSERT(e);
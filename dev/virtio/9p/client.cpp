@@ -72,54 +72,138 @@ static void pdu_reset(struct p9_fcall *pdu)
     pdu->size = 0;
 }
 
-static status_t p9_req_prepare(struct p9_req *req,
-                               const virtio_9p_msg_t *tmsg)
+// free pdu's buffer, taking it off the pinned count if it was a big one
+static void pdu_release(struct virtio_9p_dev *p9dev, struct p9_fcall *pdu)
 {
-    struct virtio_9p_dev *p9dev = containerof(req, struct virtio_9p_dev, req);
-    status_t ret = NO_ERROR;
-
-    if ((ret = pdu_init(&req->tc, p9dev->msize)) != NO_ERROR) {
-        goto err;
+    if (pdu->capacity > VIRTIO_9P_SMALL_MSIZE) {
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
+        p9dev->pinned -= pdu->capacity;
+        spin_unlock_irqrestore(&p9dev->lock, state);
     }
+    pdu_fini(pdu);
+}
 
-    if ((ret = pdu_init(&req->rc, p9dev->msize)) != NO_ERROR) {
-        goto err;
+// make sure pdu can hold size bytes, keeping the buffer it has if it's big enough
+static status_t pdu_reserve(struct virtio_9p_dev *p9dev, struct p9_fcall *pdu, size_t size)
+{
+    if (pdu->sdata && pdu->capacity >= size)
+        return NO_ERROR;
+
+    pdu_release(p9dev, pdu);
+    status_t ret = pdu_init(pdu, ROUNDUP(size, PAGE_SIZE));
+    if (ret == NO_ERROR && pdu->capacity > VIRTIO_9P_SMALL_MSIZE) {
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
+        p9dev->pinned += pdu->capacity;
+        spin_unlock_irqrestore(&p9dev->lock, state);
     }
+    return ret;
+}
 
-    pdu_reset(&req->tc);
-    pdu_reset(&req->rc);
+// once a request is done, drop a big buffer if the slots are holding on to
+// more than VIRTIO_9P_MAX_PINNED, the next request on the slot allocates a
+// small one again
+static void pdu_trim(struct virtio_9p_dev *p9dev, struct p9_fcall *pdu)
+{
+    if (pdu->capacity <= VIRTIO_9P_SMALL_MSIZE)
+        return;
 
-    event_init(&req->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    req->status = P9_REQ_S_INITIALIZED;
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
+    bool over = p9dev->pinned > VIRTIO_9P_MAX_PINNED;
+    spin_unlock_irqrestore(&p9dev->lock, state);
 
-    // fill 9p header
-    if (pdu_writed(&req->tc, 0) != NO_ERROR) {
-        ret = ERR_IO;
-        goto err;
-    }
-    if (pdu_writeb(&req->tc, tmsg->msg_type) != NO_ERROR) {
-        ret = ERR_IO;
-        goto err;
+    if (over)
+        pdu_release(p9dev, pdu);
+}
+
+static void p9_req_trim(struct virtio_9p_dev *p9dev, struct p9_req *req)
+{
+    pdu_trim(p9dev, &req->tc);
+    pdu_trim(p9dev, &req->rc);
+}
+
+// buffer sizes needed for tmsg and its reply
+static void p9_msg_sizes(struct virtio_9p_dev *p9dev, const virtio_9p_msg_t *tmsg,
+                         size_t *tsize, size_t *rsize)
+{
+    const size_t small = MIN(p9dev->msize, (uint32_t)VIRTIO_9P_SMALL_MSIZE);
+
+    *tsize = small;
+    *rsize = small;
+    switch (tmsg->msg_type) {
+        case P9_TREAD:
+            *rsize = MAX(small, (size_t)tmsg->msg.tread.count + P9_IOHDRSZ);
+            break;
+        case P9_TREADDIR:
+            *rsize = MAX(small, (size_t)tmsg->msg.treaddir.count + P9_IOHDRSZ);
+            break;
+        case P9_TWRITE:
+            *tsize = MAX(small, (size_t)tmsg->msg.twrite.count + P9_IOHDRSZ);
+            break;
+        default:
+            break;
     }
-    if (pdu_writew(&req->tc, tmsg->tag) != NO_ERROR) {
-        ret = ERR_IO;
-        goto err;
+}
+
+// take a free request slot, waiting for one if they're all in use and wait is set
+static struct p9_req *p9_req_alloc(struct virtio_9p_dev *p9dev, bool wait)
+{
+    if (wait) {
+        sem_wait(&p9dev->free_reqs);
+    } else if (sem_trywait(&p9dev->free_reqs) != NO_ERROR) {
+        return NULL;
     }
 
-    return NO_ERROR;
-err:
-    pdu_fini(&req->tc);
-    pdu_fini(&req->rc);
-    return ret;
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
+    DEBUG_ASSERT(p9dev->free_reqs_mask != 0);
+    uint tag = __builtin_ctz(p9dev->free_reqs_mask);
+    p9dev->free_reqs_mask &= ~(1u << tag);
+    spin_unlock_irqrestore(&p9dev->lock, state);
+
+    return &p9dev->reqs[tag];
 }
 
-static void p9_req_release(struct p9_req *req)
+void p9_req_free_locked(struct virtio_9p_dev *p9dev, struct p9_req *req)
 {
     req->status = P9_REQ_S_UNKNOWN;
-    event_destroy(&req->io_event);
+    p9dev->free_reqs_mask |= 1u << req->tag;
+    sem_post(&p9dev->free_reqs, false);
+}
 
-    pdu_fini(&req->tc);
-    pdu_fini(&req->rc);
+static void p9_req_free(struct virtio_9p_dev *p9dev, struct p9_req *req)
+{
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
+    p9_req_free_locked(p9dev, req);
+    spin_unlock_irqrestore(&p9dev->lock, state);
+}
+
+static status_t p9_req_prepare(struct virtio_9p_dev *p9dev, struct p9_req *req,
+                               const virtio_9p_msg_t *tmsg)
+{
+    status_t ret;
+    size_t tsize, rsize;
+
+    p9_msg_sizes(p9dev, tmsg, &tsize, &rsize);
+    if ((ret = pdu_reserve(p9dev, &req->tc, tsize)) != NO_ERROR)
+        return ret;
+    if ((ret = pdu_reserve(p9dev, &req->rc, rsize)) != NO_ERROR)
+        return ret;
+
+    pdu_reset(&req->tc);
+    pdu_reset(&req->rc);
+
+    event_unsignal(&req->io_event);
+    req->status = P9_REQ_S_INITIALIZED;
+
+    // fill 9p header, the tag is the slot's own except for Tversion
+    uint16_t tag = (tmsg->msg_type == P9_TVERSION) ? P9_TAG_NOTAG : req->tag;
+    if (pdu_writed(&req->tc, 0) != NO_ERROR)
+        return ERR_IO;
+    if (pdu_writeb(&req->tc, tmsg->msg_type) != NO_ERROR)
+        return ERR_IO;
+    if (pdu_writew(&req->tc, tag) != NO_ERROR)
+        return ERR_IO;
+
+    return NO_ERROR;
 }
 
 static status_t p9_req_finalize(struct p9_req *req)
@@ -170,7 +254,9 @@ static void virtio_9p_req_send(struct virtio_9p_dev *p9dev,
 
     arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
 
+    // two per slot, there are always enough
     desc = dev->virtio_alloc_desc_chain(VIRTIO_9P_RING_IDX, 2, &idx);
+    DEBUG_ASSERT(desc);
 
     const bool modern = dev->config_is_modern();
     vring_desc_write_len(desc, req->tc.size, modern);
@@ -191,39 +277,38 @@ static void virtio_9p_req_send(struct virtio_9p_dev *p9dev,
 #endif
 
     req->status = P9_REQ_S_SENT;
+    p9dev->sent[idx] = req;
 
     /* submit the transfer */
     dev->virtio_submit_chain(VIRTIO_9P_RING_IDX, idx);
 
     /* kick it off */
-    dev->bus()->virtio_kick(VIRTIO_9P_RING_IDX);
+    dev->virtio_kick(VIRTIO_9P_RING_IDX);
 
     spin_unlock_irqrestore(&p9dev->lock, state);
 }
 
-status_t virtio_9p_rpc(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
-                       virtio_9p_msg_t *rmsg)
+static status_t virtio_9p_send(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
+                               uint16_t *tag, bool wait)
 {
-    LTRACEF("dev (%p) tmsg (%p) rmsg (%p)\n", dev, tmsg, rmsg);
+    LTRACEF("dev (%p) tmsg (%p) wait %d\n", dev, tmsg, wait);
 
     auto *p9dev = (virtio_9p_dev *)dev->priv();
-    struct p9_req *req = &p9dev->req;
     status_t ret;
 
-    if (!tmsg || !rmsg) {
+    if (!tmsg || !tag) {
         return ERR_INVALID_ARGS;
     }
 
-    // Since we allow only one outstanding request for now, we have a 9p device
-    // level lock for restricting only one rpc can be executed at a time. One
-    // day if we can support multiple outstanding requests, we should move the
-    // lock into the request allocation phase.
-    mutex_acquire(&p9dev->req_lock);
+    struct p9_req *req = p9_req_alloc(p9dev, wait);
+    if (!req) {
+        return ERR_BUSY;
+    }
 
     // prepare the message header
-    ret = p9_req_prepare(req, tmsg);
+    ret = p9_req_prepare(p9dev, req, tmsg);
     if (ret != NO_ERROR) {
-        goto req_unlock;
+        goto err;
     }
 
     // setup the T-message by its msg-type
@@ -284,10 +369,49 @@ status_t virtio_9p_rpc(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
 
     virtio_9p_req_send(p9dev, req);
 
+    *tag = req->tag;
+    return NO_ERROR;
+
+err:
+    p9_req_trim(p9dev, req);
+    p9_req_free(p9dev, req);
+    return ret;
+}
+
+status_t virtio_9p_rpc_start(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
+                             uint16_t *tag, bool wait)
+{
+    return virtio_9p_send(dev, tmsg, tag, wait);
+}
+
+status_t virtio_9p_rpc_wait(struct virtio_device *dev, uint16_t tag,
+                            virtio_9p_msg_t *rmsg)
+{
+    LTRACEF("dev (%p) tag (%u) rmsg (%p)\n", dev, tag, rmsg);
+
+    auto *p9dev = (virtio_9p_dev *)dev->priv();
+    status_t ret;
+
+    if (tag >= VIRTIO_9P_MAX_REQS || !rmsg) {
+        return ERR_INVALID_ARGS;
+    }
+
+    struct p9_req *req = &p9dev->reqs[tag];
+    DEBUG_ASSERT(req->status == P9_REQ_S_SENT || req->status == P9_REQ_S_RECEIVED);
+
     // wait for server's response
     if (event_wait_timeout(&req->io_event, VIRTIO_9P_RPC_TIMEOUT) != NO_ERROR) {
-        ret = ERR_TIMED_OUT;
-        goto err;
+        // the device still has the buffers, leave the slot to the irq handler,
+        // unless the reply has just come in
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&p9dev->lock);
+        bool abandoned = (req->status == P9_REQ_S_SENT);
+        if (abandoned) {
+            req->status = P9_REQ_S_ABANDONED;
+        }
+        spin_unlock_irqrestore(&p9dev->lock, state);
+        if (abandoned) {
+            return ERR_TIMED_OUT;
+        }
     }
 
     // read the message header from the returned request
@@ -338,20 +462,47 @@ status_t virtio_9p_rpc(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
             ret = p9_proto_rmkdir(req, rmsg);
             break;
         default:
-            LTRACEF("9p R-message type not supported: %u\n", tmsg->msg_type);
+            LTRACEF("9p R-message type not supported: %u\n", rmsg->msg_type);
             ret = ERR_NOT_SUPPORTED;
-            goto err;
+            break;
     }
 
-err:
-    p9_req_release(req);
+    if (ret == NO_ERROR && rmsg->tag != tag && rmsg->tag != P9_TAG_NOTAG) {
+        LTRACEF("9p R-message tag %u, expected %u\n", rmsg->tag, tag);
+        virtio_9p_msg_destroy(rmsg);
+        ret = ERR_IO;
+    }
 
-req_unlock:
-    mutex_release(&p9dev->req_lock);
+    p9_req_trim(p9dev, req);
+    p9_req_free(p9dev, req);
 
     return ret;
 }
 
+status_t virtio_9p_rpc(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
+                       virtio_9p_msg_t *rmsg)
+{
+    uint16_t tag;
+    status_t ret;
+
+    if (!rmsg) {
+        return ERR_INVALID_ARGS;
+    }
+
+    if ((ret = virtio_9p_send(dev, tmsg, &tag, true)) != NO_ERROR) {
+        return ret;
+    }
+
+    return virtio_9p_rpc_wait(dev, tag, rmsg);
+}
+
+uint32_t virtio_9p_max_io(struct virtio_device *dev)
+{
+    auto *p9dev = (virtio_9p_dev *)dev->priv();
+
+    return p9dev->msize - P9_IOHDRSZ;
+}
+
 void virtio_9p_msg_destroy(virtio_9p_msg_t *msg)
 {
     switch (msg->msg_type) {
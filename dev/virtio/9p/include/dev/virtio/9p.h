@@ -32,8 +32,8 @@
 #define VIRTIO_9P_RING_IDX 0
 #define VIRTIO_9P_RING_SIZE 128
 
-// Assuming there can be only one outstanding request. Pick a 16-bit unsigned
-// value arbtrarily as the default tag for no good reason.
+// The client picks the tag each request goes out with, callers can fill in
+// this one.
 #define P9_TAG_DEFAULT ((uint16_t)0x15)
 #define P9_TAG_NOTAG ((uint16_t)~0)
 
@@ -460,6 +460,19 @@ struct virtio_device *virtio_get_9p_device(uint index);
 
 status_t virtio_9p_rpc(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
                        virtio_9p_msg_t *rmsg);
+// Send tmsg without waiting for the reply, returning the tag it went out with.
+// rpcs from any number of threads can be outstanding at once. tmsg and its
+// data are copied, so can be reused right away. Each tag must be waited for
+// exactly once, and soon: its request slot isn't reused until then.
+// If all the slots are in use, waits for one if wait is set, otherwise returns
+// ERR_BUSY without sending anything. Only wait with no rpcs of your own
+// outstanding, the slots they hold won't come back while you do.
+status_t virtio_9p_rpc_start(struct virtio_device *dev, const virtio_9p_msg_t *tmsg,
+                             uint16_t *tag, bool wait);
+status_t virtio_9p_rpc_wait(struct virtio_device *dev, uint16_t tag,
+                            virtio_9p_msg_t *rmsg);
+// Most data a single Tread or Twrite can carry with the negotiated msize.
+uint32_t virtio_9p_max_io(struct virtio_device *dev);
 void virtio_9p_msg_destroy(virtio_9p_msg_t *msg);
 ssize_t p9_dirent_read(uint8_t *data, uint32_t size, p9_dirent_t *ent);
 void p9_dirent_destroy(p9_dirent_t *ent);
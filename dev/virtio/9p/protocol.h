@@ -25,13 +25,26 @@
 
 #include <dev/virtio/9p.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/semaphore.h>
 #include <lk/list.h>
 #include <sys/types.h>
 #include <string.h>
 
 #define VIRTIO_9P_RPC_TIMEOUT 3000 /* ms */
-#define VIRTIO_9P_DEFAULT_MSIZE (PAGE_SIZE << 5)
+#define VIRTIO_9P_DEFAULT_MSIZE (PAGE_SIZE << 7)
+
+// Requests that can be outstanding at once, each takes two descriptors
+#define VIRTIO_9P_MAX_REQS 16
+
+// Buffer size for messages without a data payload
+#define VIRTIO_9P_SMALL_MSIZE (PAGE_SIZE << 1)
+
+// Bytes of buffers bigger than that the request slots may hang on to between
+// requests, past this they go back to the small size once the request is done
+#define VIRTIO_9P_MAX_PINNED (VIRTIO_9P_DEFAULT_MSIZE << 2)
+
+// Header of Rread and Twrite, ahead of the data
+#define P9_IOHDRSZ 24
 
 struct p9_fcall {
     uint32_t size;
@@ -42,8 +55,11 @@ struct p9_fcall {
     uint8_t *sdata;
 };
 
+// A request slot. Its tag is its index, and its buffers stay allocated from
+// one rpc to the next, growing when a bigger message comes along.
 struct p9_req {
     int status;
+    uint16_t tag;
     event_t io_event;
     struct p9_fcall tc;
     struct p9_fcall rc;
@@ -54,6 +70,8 @@ enum {
     P9_REQ_S_INITIALIZED,
     P9_REQ_S_SENT,
     P9_REQ_S_RECEIVED,
+    // the waiter gave up, the slot is freed when the reply comes in
+    P9_REQ_S_ABANDONED,
 };
 
 struct virtio_9p_dev {
@@ -62,13 +80,23 @@ struct virtio_9p_dev {
     bdev_t bdev;
 
     uint32_t msize;
-    struct p9_req req;
-    mutex_t req_lock;
+
+    // request slots, free ones have their bit set in free_reqs_mask
+    struct p9_req reqs[VIRTIO_9P_MAX_REQS];
+    uint32_t free_reqs_mask;
+    semaphore_t free_reqs;
+    // request sent with each head descriptor
+    struct p9_req *sent[VIRTIO_9P_RING_SIZE];
+    // bytes held by the slots in buffers over the small size
+    size_t pinned;
 
     struct list_node list;
     spin_lock_t lock;
 };
 
+// return a request slot to the free ones, with the device lock held
+void p9_req_free_locked(struct virtio_9p_dev *p9dev, struct p9_req *req);
+
 // read/write APIs of basic types
 size_t pdu_read(struct p9_fcall *pdu, void *data, size_t size);
 size_t pdu_write(struct p9_fcall *pdu, void *data, size_t size);
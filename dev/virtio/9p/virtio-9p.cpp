@@ -67,9 +67,13 @@ status_t virtio_9p_init(virtio_device *dev, uint32_t host_features)
     p9dev->dev = dev;
     dev->set_priv(p9dev);
     p9dev->lock = SPIN_LOCK_INITIAL_VALUE;
-    // Assuming there can be only one outstanding request.
-    p9dev->req.status = P9_REQ_S_UNKNOWN;
-    mutex_init(&p9dev->req_lock);
+    for (uint16_t i = 0; i < VIRTIO_9P_MAX_REQS; i++) {
+        p9dev->reqs[i].tag = i;
+        p9dev->reqs[i].status = P9_REQ_S_UNKNOWN;
+        event_init(&p9dev->reqs[i].io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    }
+    p9dev->free_reqs_mask = (1u << VIRTIO_9P_MAX_REQS) - 1;
+    sem_init(&p9dev->free_reqs, VIRTIO_9P_MAX_REQS);
     p9dev->msize = VIRTIO_9P_DEFAULT_MSIZE;
 
     // Add the 9p device to the device list
@@ -95,6 +99,10 @@ status_t virtio_9p_init(virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     dev->bus()->virtio_status_acknowledge_driver();
 
+    /* requests are two descriptors, only event idx is worth having */
+    dev->bus()->virtio_set_guest_features(0, dev->negotiate_ring_features(host_features, 1u << VIRTIO_RING_F_EVENT_IDX));
+    dev->bus()->virtio_set_guest_features(1, dev->negotiate_ring_features_word1(dev->bus()->virtio_read_host_feature_word(1)));
+
     dev->virtio_alloc_ring(VIRTIO_9P_RING_IDX, VIRTIO_9P_RING_SIZE);
 
     /* set our irq handler */
@@ -125,7 +133,8 @@ status_t virtio_9p_start(virtio_device *dev)
     auto *p9dev = (virtio_9p_dev *)dev->priv();
     status_t ret;
 
-    // connect to the 9p server with 9P2000.L
+    // connect to the 9p server with 9P2000.L, asking for a large msize so reads
+    // and writes take few round trips. The server answers with what it allows.
     virtio_9p_msg_t tver = {
         .msg_type = P9_TVERSION,
         .tag = P9_TAG_NOTAG,
@@ -154,33 +163,43 @@ static enum handler_return virtio_9p_irq_driver_callback(
     uint16_t id = e->id;
     uint16_t id_next;
     vring_desc *desc = dev->virtio_desc_index_to_desc(ring, id);
-    struct p9_req *req = &p9dev->req;
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 #if LOCAL_TRACE
     virtio_dump_desc(desc);
 #endif
 
-    ASSERT(req->status == P9_REQ_S_SENT);
     ASSERT(desc);
     const bool modern = dev->config_is_modern();
     ASSERT(vring_desc_read_flags(desc, modern) & VRING_DESC_F_NEXT);
 
     spin_lock(&p9dev->lock);
 
+    struct p9_req *req = p9dev->sent[id];
+    ASSERT(req && (req->status == P9_REQ_S_SENT || req->status == P9_REQ_S_ABANDONED));
+    p9dev->sent[id] = NULL;
+
     // drop the T-message desc
     id_next = vring_desc_read_next(desc, modern);
     desc = dev->virtio_desc_index_to_desc(VIRTIO_9P_RING_IDX, id_next);
 #if LOCAL_TRACE
     virtio_dump_desc(desc);
 #endif
-    req->rc.size = e->len;
-    req->status = P9_REQ_S_RECEIVED;
 
     // free the desc
     dev->virtio_free_desc(ring, id);
     dev->virtio_free_desc(ring, id_next);
 
+    if (req->status == P9_REQ_S_ABANDONED) {
+        // nobody is waiting for it any more
+        p9_req_free_locked(p9dev, req);
+        spin_unlock(&p9dev->lock);
+        return INT_RESCHEDULE;
+    }
+
+    req->rc.size = e->len;
+    req->status = P9_REQ_S_RECEIVED;
+
     spin_unlock(&p9dev->lock);
 
     /* wake up the rpc */
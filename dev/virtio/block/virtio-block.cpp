@@ -13,6 +13,7 @@
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
 #include <lib/bio.h>
+#include <lib/bio/queue.h>
 #include <lib/partition.h>
 #include <lk/compiler.h>
 #include <lk/debug.h>
@@ -87,12 +88,10 @@ struct virtio_blk_discard_write_zeroes {
 static_assert(sizeof(virtio_blk_discard_write_zeroes) == 16, "virtio_blk_discard_write_zeroes size mismatch");
 
 struct virtio_block_txn {
-    /* bio callback, for async */
-    void *cookie;
+    /* the bio request being carried out */
+    bio_request_t *request;
     size_t len;
 
-    /* for async calls */
-    void (*callback)(void *, struct bdev *, ssize_t);
     /* virtio request structure, must be DMA-able */
     struct virtio_blk_req req;
 
@@ -139,15 +138,12 @@ constexpr uint32_t VIRTIO_BLK_S_UNSUPP = 2;
 
 constexpr uint16_t VIRTIO_BLK_RING_LEN = 256;
 
+// Indirect table entries per request, the header and status plus enough
+// discontiguous pages for most transfers. Larger ones fall back to a chain.
+constexpr uint16_t VIRTIO_BLK_INDIRECT_LEN = 16;
+
 enum handler_return virtio_block_irq_driver_callback(virtio_device *dev, uint ring, const vring_used_elem *e);
-ssize_t virtio_bdev_read_block(bdev *bdev, void *buf, bnum_t block, uint count);
-ssize_t virtio_bdev_write_block(bdev *bdev, const void *buf, bnum_t block, uint count);
-status_t virtio_bdev_read_async(
-    bdev *bdev, void *buf, off_t offset, size_t len,
-    void (*callback)(void *, struct bdev *, ssize_t), void *cookie);
-status_t virtio_bdev_write_async(
-    bdev *bdev, const void *buf, off_t offset, size_t len,
-    void (*callback)(void *, struct bdev *, ssize_t), void *cookie);
+status_t virtio_bdev_issue(bdev *bdev, bio_request_t *request);
 
 struct virtio_block_dev {
     virtio_device *dev;
@@ -158,7 +154,12 @@ struct virtio_block_dev {
     /* our negotiated guest features */
     uint32_t guest_features;
     bool readonly;
+    /* large transfers go in indirect tables */
+    bool indirect;
     virtio_block_txn *txns;
+
+    /* guards the ring against issues from several threads and the irq */
+    spin_lock_t lock;
 };
 
 
@@ -228,6 +229,7 @@ status_t virtio_block_init(virtio_device *dev) {
     }
 
     bdev->dev = dev;
+    spin_lock_init(&bdev->lock);
     dev->set_priv(bdev);
 
     /* make sure the device is reset */
@@ -254,7 +256,9 @@ status_t virtio_block_init(virtio_device *dev) {
                              VIRTIO_BLK_F_GEOMETRY |
                              VIRTIO_BLK_F_TOPOLOGY |
                              VIRTIO_BLK_F_CONFIG_WCE);
+    bdev->guest_features |= dev->negotiate_ring_features(host_features);
     dev->bus()->virtio_set_guest_features(0, bdev->guest_features);
+    dev->bus()->virtio_set_guest_features(1, dev->negotiate_ring_features_word1(dev->bus()->virtio_read_host_feature_word(1)));
 
     // If supported, prefer writeback mode for better throughput.
     if (bdev->guest_features & VIRTIO_BLK_F_CONFIG_WCE) {
@@ -263,6 +267,8 @@ status_t virtio_block_init(virtio_device *dev) {
 
     /* allocate a virtio ring */
     dev->virtio_alloc_ring(0, VIRTIO_BLK_RING_LEN);
+    bdev->indirect = dev->ring_indirect() &&
+                     dev->virtio_alloc_indirect(0, VIRTIO_BLK_INDIRECT_LEN) == NO_ERROR;
 
     // descriptor index would be used to index into the txns array
     // This is a simple way to keep track of which transaction entry is
@@ -297,11 +303,23 @@ status_t virtio_block_init(virtio_device *dev) {
                         blk_size, capacity,
                         0, NULL, BIO_FLAGS_NONE);
 
-    /* override our block device hooks */
-    bdev->bdev.read_block = &virtio_bdev_read_block;
-    bdev->bdev.write_block = &virtio_bdev_write_block;
-    bdev->bdev.read_async = &virtio_bdev_read_async;
-    bdev->bdev.write_async = &virtio_bdev_write_async;
+    /*
+     * Requests come through a queue. With indirect tables every request takes a
+     * single slot in the ring, otherwise one per physical run plus two.
+     */
+    bio_queue_config qconfig = {};
+    qconfig.issue = &virtio_bdev_issue;
+    if (bdev->indirect) {
+        qconfig.depth = VIRTIO_BLK_RING_LEN / 2;
+        qconfig.max_segments = VIRTIO_BLK_INDIRECT_LEN - 2;
+    } else {
+        qconfig.depth = VIRTIO_BLK_RING_LEN / 8;
+        qconfig.max_segments = 6;
+    }
+    status_t err = bio_queue_attach(&bdev->bdev, &qconfig);
+    if (err < 0) {
+        return err;
+    }
 
     bio_register_device(&bdev->bdev);
 
@@ -352,21 +370,16 @@ status_t virtio_block_init(virtio_device *dev) {
 
 namespace {
 
-enum handler_return virtio_block_irq_driver_callback(virtio_device *dev, uint ring, const struct vring_used_elem *e) {
-    auto *bdev = (virtio_block_dev *)dev->priv();
-
-    struct virtio_block_txn *txn = &bdev->txns[e->id];
-    LTRACEF("dev %p, ring %u, e %p, id %u, len %u, status %d\n", dev, ring, e, e->id, e->len, txn->status);
+/* put a chain of descriptors back on the free list */
+void virtio_block_free_chain(virtio_device *dev, uint16_t i) {
+    const bool modern = dev->config_is_modern();
 
-    /* parse our descriptor chain, add back to the free queue */
-    uint16_t i = e->id;
     for (;;) {
         int next;
-        vring_desc *desc = dev->virtio_desc_index_to_desc(ring, i);
+        vring_desc *desc = dev->virtio_desc_index_to_desc(0, i);
 
         // virtio_dump_desc(desc);
 
-        const bool modern = dev->config_is_modern();
         if (vring_desc_read_flags(desc, modern) & VRING_DESC_F_NEXT) {
             next = vring_desc_read_next(desc, modern);
         } else {
@@ -374,233 +387,236 @@ enum handler_return virtio_block_irq_driver_callback(virtio_device *dev, uint ri
             next = -1;
         }
 
-        dev->virtio_free_desc(ring, i);
+        dev->virtio_free_desc(0, i);
 
         if (next < 0) {
             break;
         }
         i = next;
     }
-
-    if (txn->callback) {
-        // async
-        ssize_t result =
-            (txn->status == VIRTIO_BLK_S_OK) ? (ssize_t)txn->len : ERR_IO;
-        LTRACEF("calling callback %p with cookie %p, len %ld\n", txn->callback,
-                txn->cookie, result);
-        txn->callback(txn->cookie, &bdev->bdev, result);
-    }
-
-    return INT_RESCHEDULE;
 }
 
-status_t virtio_block_do_txn(virtio_device *dev, void *buf,
-                             off_t offset, size_t len, bool write,
-                             bio_async_callback_t callback, void *cookie,
-                             virtio_block_txn **txn_out) {
+enum handler_return virtio_block_irq_driver_callback(virtio_device *dev, uint ring, const struct vring_used_elem *e) {
     auto *bdev = (virtio_block_dev *)dev->priv();
 
-    uint16_t i;
-    vring_desc *desc;
+    struct virtio_block_txn *txn = &bdev->txns[e->id];
+    LTRACEF("dev %p, ring %u, e %p, id %u, len %u, status %d\n", dev, ring, e, e->id, e->len, txn->status);
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    /* the txn goes with the descriptors, take what's needed before freeing them */
+    bio_request_t *request = txn->request;
+    ssize_t result = (txn->status == VIRTIO_BLK_S_OK) ? (ssize_t)txn->len : ERR_IO;
 
-    /* put together a transfer */
-    desc = dev->virtio_alloc_desc_chain(0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
-    if (!desc) {
-        return ERR_NO_RESOURCES;
-    }
-    struct virtio_block_txn *txn = &bdev->txns[i];
+    /* parse our descriptor chain, add back to the free queue */
+    spin_lock(&bdev->lock);
+    virtio_block_free_chain(dev, e->id);
+    spin_unlock(&bdev->lock);
+
+    LTRACEF("completing request %p, result %ld\n", request, result);
+    bio_request_complete(request, result);
+
+    return INT_RESCHEDULE;
+}
+
+void virtio_block_setup_txn(virtio_device *dev, virtio_block_txn *txn, bio_request_t *request,
+                            uint64_t sector, size_t len, bool write) {
     /* set up the request */
     txn->req.type = dev->ring_swap32(write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN);
     txn->req.ioprio = dev->ring_swap32(0);
-    txn->req.sector = dev->ring_swap64((uint64_t)offset / 512);
+    txn->req.sector = dev->ring_swap64(sector);
 
-    txn->callback = callback;
-    txn->cookie = cookie;
+    txn->request = request;
     txn->len = len;
     LTRACEF("blk_req type %u ioprio %u sector %llu\n", dev->ring_swap32(txn->req.type),
             dev->ring_swap32(txn->req.ioprio), dev->ring_swap64(txn->req.sector));
+}
 
-    const bool modern = dev->config_is_modern();
-
-    if (txn_out) {
-        *txn_out = txn;
-    }
-
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
-
-    /* set up the descriptor pointing to the head */
+paddr_t virtio_block_paddr(void *ptr) {
 #if WITH_KERNEL_VM
-    paddr_t req_phys = vaddr_to_paddr(&txn->req);
+    return vaddr_to_paddr(ptr);
 #else
-    paddr_t req_phys = (uint64_t)(uintptr_t)&txn->req;
+    return (paddr_t)(uintptr_t)ptr;
 #endif
-    vring_desc_write_addr(desc, req_phys, modern);
-    vring_desc_write_len(desc, sizeof(virtio_blk_req), modern);
-    vring_desc_write_flags(desc, VRING_DESC_F_NEXT, modern);
+}
 
-    /* set up the descriptor pointing to the buffer */
-    desc = dev->virtio_desc_index_to_desc(0, vring_desc_read_next(desc, modern));
+/*
+ * Call fn(pa, len) for each physically contiguous run of the buffers of a request
+ * and those merged behind it. Stops early and returns false if fn does.
+ */
+template <typename F>
+bool virtio_block_for_each_run(const bio_request_t *request, F fn) {
+    bio_sg_iter_t iter;
+    bio_sg_iter_init(&iter, request);
+
+    paddr_t run_pa = 0;
+    size_t run_len = 0;
+    void *buf;
+    size_t len;
+    while (bio_sg_iter_next(&iter, SIZE_MAX, &buf, &len)) {
+        vaddr_t va = (vaddr_t)buf;
+        while (len > 0) {
 #if WITH_KERNEL_VM
-    /* translate the first buffer */
-    vaddr_t va = (vaddr_t)buf;
-    paddr_t pa = vaddr_to_paddr((void *)va);
-    vring_desc_write_addr(desc, (uint64_t)pa, modern);
-    /* desc->len is filled in below */
+            size_t chunk = MIN(PAGE_ALIGN(va + 1) - va, len);
 #else
-    /* non VM world simply queues a single buffer that transfers the whole thing */
-    vring_desc_write_addr(desc, (uint64_t)(uintptr_t)buf, modern);
-    vring_desc_write_len(desc, len, modern);
+            size_t chunk = len;
 #endif
-    vring_desc_write_flags(desc, (write ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT, modern);
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    vring_desc_write_len(desc, MIN(next_pa - pa, len), modern);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va,
-            vring_desc_read_addr(desc, modern), vring_desc_read_len(desc, modern));
-
-    size_t remaining_len = len;
-    remaining_len -= vring_desc_read_len(desc, modern);
-    while (remaining_len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(remaining_len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, remaining_len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            /* we can simply extend the previous descriptor by another page */
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            vring_desc_write_len(desc, vring_desc_read_len(desc, modern) + len_tohandle, modern);
-        } else {
-            /* new physical page needed, allocate a new descriptor and start again */
-            uint16_t next_i = dev->virtio_alloc_desc(0);
-            vring_desc *next_desc = dev->virtio_desc_index_to_desc(0, next_i);
-            DEBUG_ASSERT(next_desc);
-
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
-
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            vring_desc_write_addr(next_desc, (uint64_t)pa, modern);
-            vring_desc_write_len(next_desc, len_tohandle, modern);
-            vring_desc_write_flags(next_desc,
-                                   (write ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT, modern);
-            vring_desc_write_next(next_desc, vring_desc_read_next(desc, modern), modern);
-            vring_desc_write_next(desc, next_i, modern);
-
-            desc = next_desc;
+            paddr_t pa = virtio_block_paddr((void *)va);
+
+            if (run_len > 0 && pa == run_pa + run_len) {
+                run_len += chunk;
+            } else {
+                if (run_len > 0 && !fn(run_pa, run_len)) {
+                    return false;
+                }
+                run_pa = pa;
+                run_len = chunk;
+            }
+
+            va += chunk;
+            len -= chunk;
         }
-        remaining_len -= len_tohandle;
-        next_pa += PAGE_SIZE;
     }
-#endif
 
-    /* set up the descriptor pointing to the response */
+    return run_len == 0 || fn(run_pa, run_len);
+}
+
 #if WITH_KERNEL_VM
-    paddr_t status_phys = vaddr_to_paddr(&txn->status);
-#else
-    paddr_t status_phys = (uint64_t)(uintptr_t)&txn->status;
-#endif
-    desc = dev->virtio_desc_index_to_desc(0, vring_desc_read_next(desc, modern));
-    vring_desc_write_addr(desc, status_phys, modern);
-    vring_desc_write_len(desc, 1, modern);
-    vring_desc_write_flags(desc, VRING_DESC_F_WRITE, modern);
+/*
+ * Lay out a transfer in the indirect table of descriptor i: the request, a descriptor
+ * per physically contiguous run of the buffers and the status. Returns the number of
+ * entries used, or 0 if the buffers need more than the table has.
+ */
+uint16_t virtio_block_fill_indirect(virtio_device *dev, uint16_t i, virtio_block_txn *txn,
+                                    const bio_request_t *request, bool write) {
+    const bool modern = dev->config_is_modern();
+    const uint16_t data_flags = (write ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT;
+
+    uint16_t max;
+    vring_desc *table = dev->virtio_indirect_table(0, i, &max);
+    DEBUG_ASSERT(table);
+
+    uint16_t n = 0;
+    vring_desc_write_addr(&table[n], vaddr_to_paddr(&txn->req), modern);
+    vring_desc_write_len(&table[n], sizeof(virtio_blk_req), modern);
+    vring_desc_write_flags(&table[n], VRING_DESC_F_NEXT, modern);
+    vring_desc_write_next(&table[n], n + 1, modern);
+    n++;
+
+    bool fits = virtio_block_for_each_run(request, [&](paddr_t pa, size_t len) {
+        /* leave room for the status */
+        if (n + 1 >= max) {
+            return false;
+        }
+        vring_desc_write_addr(&table[n], pa, modern);
+        vring_desc_write_len(&table[n], len, modern);
+        vring_desc_write_flags(&table[n], data_flags, modern);
+        vring_desc_write_next(&table[n], n + 1, modern);
+        n++;
+        return true;
+    });
+    if (!fits) {
+        return 0;
+    }
 
-    /* submit the transfer */
-    dev->virtio_submit_chain(0, i);
+    vring_desc_write_addr(&table[n], vaddr_to_paddr(&txn->status), modern);
+    vring_desc_write_len(&table[n], 1, modern);
+    vring_desc_write_flags(&table[n], VRING_DESC_F_WRITE, modern);
+    n++;
 
-    /* kick it off */
-    dev->bus()->virtio_kick(0);
+    LTRACEF("desc %u: %u indirect entries for len %zu\n", i, n, txn->len);
 
-    return NO_ERROR;
+    return n;
 }
+#endif
 
-// TODO: handle partial block transfers
-void sync_completion_cb(void *cookie, struct bdev *dev, ssize_t bytes) {
-    DEBUG_ASSERT(cookie);
-    event_t *event = (event_t *)cookie;
-    event_signal(event, false);
-}
+/*
+ * Lay out a transfer as a chain of ring descriptors starting at i, which holds the
+ * request. The chain is kept well formed as it grows, so it can be freed if the
+ * ring runs out partway.
+ */
+bool virtio_block_fill_chain(virtio_device *dev, uint16_t i, virtio_block_txn *txn,
+                             const bio_request_t *request, bool write) {
+    const bool modern = dev->config_is_modern();
 
-ssize_t virtio_block_read_write(virtio_device *dev, void *buf,
-                                const off_t offset, const size_t len,
-                                const bool write) {
-    struct virtio_block_txn *txn;
-    event_t event;
-    event_init(&event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    // XXX not cache safe.
+    // At the moment only tested on arm qemu, which doesn't emulate cache.
 
-    status_t err = virtio_block_do_txn(dev, buf, offset, len, write,
-                                       &sync_completion_cb, &event, &txn);
-    if (err < 0) {
-        return err;
-    }
+    vring_desc *desc = dev->virtio_desc_index_to_desc(0, i);
+    vring_desc_write_addr(desc, virtio_block_paddr(&txn->req), modern);
+    vring_desc_write_len(desc, sizeof(virtio_blk_req), modern);
+    vring_desc_write_flags(desc, 0, modern);
 
-    /* wait for the transfer to complete */
-    event_wait(&event);
+    auto append = [&](paddr_t pa, size_t len, uint16_t flags) {
+        uint16_t next_i = dev->virtio_alloc_desc(0);
+        if (next_i == 0xffff) {
+            return false;
+        }
+        vring_desc *next = dev->virtio_desc_index_to_desc(0, next_i);
+        vring_desc_write_addr(next, pa, modern);
+        vring_desc_write_len(next, len, modern);
+        vring_desc_write_flags(next, flags, modern);
 
-    LTRACEF("status 0x%hhx\n", txn->status);
+        vring_desc_write_next(desc, next_i, modern);
+        vring_desc_write_flags(desc, vring_desc_read_flags(desc, modern) | VRING_DESC_F_NEXT, modern);
+        desc = next;
+        return true;
+    };
 
-    ssize_t result = (txn->status == VIRTIO_BLK_S_OK) ? (ssize_t)len : ERR_IO;
+    const uint16_t data_flags = write ? 0 : VRING_DESC_F_WRITE;
+    if (!virtio_block_for_each_run(request, [&](paddr_t pa, size_t len) {
+            return append(pa, len, data_flags);
+        })) {
+        return false;
+    }
 
-    return result;
+    return append(virtio_block_paddr(&txn->status), 1, VRING_DESC_F_WRITE);
 }
 
-ssize_t virtio_bdev_read_block(bdev *bdev, void *buf, bnum_t block, uint count) {
-    virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+status_t virtio_bdev_issue(bdev *bdev, bio_request_t *request) {
+    auto *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    virtio_device *vdev = dev->dev;
 
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+    const bool write = request->op == BIO_OP_WRITE;
+    if (write && dev->readonly) {
+        return ERR_NOT_SUPPORTED;
+    }
 
-    ssize_t result = virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                             count * dev->bdev.block_size, false);
-    return result;
-}
+    const size_t len = (size_t)request->merge_count << bdev->block_shift;
+    const uint64_t sector = (uint64_t)request->dev_block << (bdev->block_shift - 9);
 
-status_t virtio_bdev_read_async(bdev *bdev, void *buf,
-                                off_t offset, size_t len,
-                                bio_async_callback_t callback,
-                                void *cookie) {
-    struct virtio_block_dev *dev =
-        containerof(bdev, struct virtio_block_dev, bdev);
+    LTRACEF("dev %p, request %p, sector %llu, len %zu, write %d\n", dev, request, sector, len, write);
 
-    return virtio_block_do_txn(dev->dev, buf, offset, len, false, callback,
-                               cookie, NULL);
-}
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&dev->lock);
 
-status_t virtio_bdev_write_async(bdev *bdev, const void *buf,
-                                 off_t offset, size_t len,
-                                 bio_async_callback_t callback,
-                                 void *cookie) {
-    struct virtio_block_dev *dev =
-        containerof(bdev, struct virtio_block_dev, bdev);
-
-    if (dev->readonly) {
-        return ERR_NOT_SUPPORTED;
+    uint16_t i = vdev->virtio_alloc_desc(0);
+    if (i == 0xffff) {
+        spin_unlock_irqrestore(&dev->lock, state);
+        return ERR_BUSY;
     }
 
-    return virtio_block_do_txn(dev->dev, (void *)buf, offset, len, true,
-                               callback, cookie, NULL);
-}
+    struct virtio_block_txn *txn = &dev->txns[i];
+    virtio_block_setup_txn(vdev, txn, request, sector, len, write);
 
-ssize_t virtio_bdev_write_block(bdev *bdev, const void *buf, bnum_t block, uint count) {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+#if WITH_KERNEL_VM
+    /* the whole transfer in one slot of the ring, if it fits in a table */
+    uint16_t count = dev->indirect ? virtio_block_fill_indirect(vdev, i, txn, request, write) : 0;
+    if (count > 0) {
+        vdev->virtio_set_indirect(0, i, count);
+    } else
+#endif
+    if (!virtio_block_fill_chain(vdev, i, txn, request, write)) {
+        /* out of descriptors, try again when some come back */
+        virtio_block_free_chain(vdev, i);
+        spin_unlock_irqrestore(&dev->lock, state);
+        return ERR_BUSY;
+    }
 
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+    /* submit the transfer and kick it off */
+    vdev->virtio_submit_chain(0, i);
+    vdev->virtio_kick(0);
 
-    if (dev->readonly) {
-        return ERR_NOT_SUPPORTED;
-    }
+    spin_unlock_irqrestore(&dev->lock, state);
 
-    ssize_t result = virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                             count * dev->bdev.block_size, true);
-    return result;
+    return NO_ERROR;
 }
 
 } // namespace
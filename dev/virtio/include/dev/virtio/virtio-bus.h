@@ -8,6 +8,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <lk/err.h>
+#include <sys/types.h>
 #include <platform/interrupts.h>
 
 class virtio_bus {
@@ -23,6 +25,13 @@ public:
     virtual void virtio_kick(uint16_t ring_index) = 0;
     virtual void register_ring(uint32_t page_size, uint32_t queue_sel, uint32_t queue_num, uint32_t queue_align, uint32_t queue_pfn) = 0;
 
+    // Register a ring by the addresses of its descriptor, driver and device areas,
+    // which is how packed rings go in. Only modern devices take them.
+    virtual status_t register_ring_areas(uint32_t queue_sel, uint32_t queue_num, uint64_t desc_pa, uint64_t driver_pa, uint64_t device_pa) = 0;
+
+    // mmio or pci, for debug output
+    virtual const char *name() const = 0;
+
     // Return if the device is legacy or modern.
     // For virtio-mmio this corresponds to V1 and V2, respectively.
     // For virtio-pci this corresponds to transitional and modern, respectively.
@@ -32,18 +41,22 @@ public:
         return virtio_read_host_feature_word(word) | static_cast<uint64_t>(virtio_read_host_feature_word(word + 1)) << 32;
     }
 
-    // A simple set of routines to handle a single IRQ.
-    // TODO: rethink where this goes in a more complicated MSI based solution.
+    // A simple set of routines to handle a single IRQ. Busses that give rings
+    // interrupts of their own mask and unmask those along with it.
     void set_irq(uint32_t irq) { irq_ = irq; }
 
-    void mask_interrupt() {
+    virtual void mask_interrupt() {
         ::mask_interrupt(irq_);
     }
 
-    void unmask_interrupt() {
+    virtual void unmask_interrupt() {
         ::unmask_interrupt(irq_);
     }
 
+    // Deliver the interrupt for a ring to a particular cpu, if the bus has one
+    // per ring. Otherwise all rings share the single IRQ above.
+    virtual status_t set_ring_irq_cpu(uint16_t ring_index, uint cpu) { return ERR_NOT_SUPPORTED; }
+
 private:
     uint32_t irq_ {};
 };
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <endian.h>
 #include <sys/types.h>
+#include <lk/list.h>
 #include <lk/reg.h>
 #include <dev/virtio.h>
 #include <dev/virtio/virtio_ring.h>
@@ -19,10 +20,8 @@
 
 class virtio_device {
 public:
-    explicit virtio_device(virtio_bus *bus) : bus_(bus) {}
-    virtual ~virtio_device() {
-        delete bus_;
-    }
+    explicit virtio_device(virtio_bus *bus);
+    virtual ~virtio_device();
 
     /* api used by devices to interact with the virtio bus */
     status_t virtio_alloc_ring(uint index, uint16_t len);
@@ -45,6 +44,41 @@ public:
     /* submit a chain to the avail list */
     void virtio_submit_chain(uint ring_index, uint16_t desc_index);
 
+    /* notify the device of submitted chains, unless it has asked not to be */
+    void virtio_kick(uint ring_index);
+
+    // Device independent ring features. Pick the ones of wanted that this layer supports
+    // out of feature word 0 of the host, to be or'd into the guest features by the driver
+    // before its rings are allocated.
+    uint32_t negotiate_ring_features(uint32_t host_features,
+                                     uint32_t wanted = (1u << VIRTIO_RING_F_EVENT_IDX) | (1u << VIRTIO_RING_F_INDIRECT_DESC));
+
+    // Packed rings, offered up in feature word 1 by modern devices. Returns the bits of
+    // word 1 to set, VERSION_1 included, for the driver to write in place of what the bus
+    // accepted before its rings are allocated.
+    //
+    // Drivers don't see the difference: they go on building chains of split descriptors,
+    // which for a packed ring live in memory of our own and are copied into the ring when
+    // submitted. The used entries come back the same way, by the index of the chain's
+    // first descriptor. Indirect tables are only used with split rings.
+    uint32_t negotiate_ring_features_word1(uint32_t host_features_word1,
+                                           uint32_t wanted = 1u << (VIRTIO_RING_F_PACKED - 32));
+
+    bool ring_event_idx() const { return event_idx_; }
+    bool ring_indirect() const { return indirect_ && !packed_; }
+    bool ring_packed() const { return packed_; }
+
+    // Indirect descriptors, if negotiated. Every descriptor of a ring gets a table
+    // of up to count entries, so a request with many buffers can take a single slot
+    // in the ring. Entries of a table chain through their next fields like the ring's.
+    status_t virtio_alloc_indirect(uint ring_index, uint16_t count);
+
+    /* the table of a descriptor and its size, nullptr if the ring has none */
+    vring_desc *virtio_indirect_table(uint ring_index, uint16_t desc_index, uint16_t *count);
+
+    /* point a descriptor at the first count entries of its table */
+    void virtio_set_indirect(uint ring_index, uint16_t desc_index, uint16_t count);
+
     // accessors
     void *priv() { return priv_; }
     const void *priv() const { return priv_; }
@@ -141,10 +175,64 @@ public:
     handler_return handle_queue_interrupt();
     handler_return handle_config_interrupt();
 
-    // TODO: allow an aribitrary number of rings
-    static const size_t MAX_VIRTIO_RINGS = 4;
+    // Process the used entries of a single ring, for busses that can tell which
+    // ring an interrupt is for. A ring must not be processed on two cpus at once.
+    handler_return handle_ring_interrupt(uint ring_index);
+
+    // Polled rings, for drivers that batch their work. An interrupt for a polled ring
+    // only calls the notify callback, and the driver hands the used entries to its irq
+    // callback itself with poll_ring(), outside of interrupt context. A ring must not
+    // be polled on two cpus at once.
+    using ring_notify_callback = enum handler_return (*)(virtio_device *dev, uint ring);
+
+    void set_ring_polled(uint ring_index, ring_notify_callback notify);
+
+    // process up to budget used entries, returning how many
+    uint poll_ring(uint ring_index, uint budget);
+
+    // ask the device not to interrupt for a ring, or to again. Enabling returns true
+    // if entries were used in the meantime, which have to be polled for.
+    void ring_disable_interrupt(uint ring_index);
+    bool ring_enable_interrupt(uint ring_index);
+
+    bool ring_active(uint ring_index) const {
+        return ring_index < MAX_VIRTIO_RINGS && (active_rings_bitmap_ & (1u << ring_index));
+    }
+
+    // enough for a multiqueue network device with a queue pair per cpu and a control queue
+    static const size_t MAX_VIRTIO_RINGS = 32;
+
+    // Per ring counts, to see what notification suppression is saving.
+    struct ring_stats {
+        uint64_t submits;    // chains made available
+        uint64_t kicks;      // notifications of the device
+        uint64_t interrupts; // ring interrupts, polled or not
+        uint64_t used;       // used entries handed to the driver
+    };
+
+    // print every device's rings and their stats, zeroing the stats if reset
+    static void dump_devices(bool reset);
 
 private:
+    status_t alloc_packed_ring(uint index, uint16_t len);
+    uint process_used(uint ring_index, uint budget, handler_return *ret);
+    uint process_used_split(uint ring_index, uint budget, handler_return *ret);
+    uint process_used_packed(uint ring_index, uint budget, handler_return *ret);
+    void submit_packed(uint ring_index, uint16_t desc_index);
+    bool kick_needed_packed(uint ring_index);
+
+    // whether the device has used entries we haven't processed
+    bool ring_has_used(uint ring_index);
+
+    // ask for an interrupt on the next used entry, with event idx
+    void ring_write_used_event(uint ring_index);
+
+    // on the list of all devices
+    struct device_node {
+        struct list_node node;
+        virtio_device *dev;
+    } node_ = { LIST_INITIAL_CLEARED_VALUE, this };
+
     // mmio or pci
     virtio_bus *bus_ = {};
 
@@ -159,11 +247,27 @@ private:
     // interrupt handlers that the device-specific layer registers with our layer
     irq_driver_callback irq_driver_callback_ = {};
     config_change_callback config_change_callback_ = {};
+    ring_notify_callback ring_notify_callback_ = {};
 
     /* virtio rings */
     uint32_t active_rings_bitmap_ = {};
+    uint32_t polled_rings_bitmap_ = {};
     uint16_t ring_len_[MAX_VIRTIO_RINGS] = {};
     vring ring_[MAX_VIRTIO_RINGS] = {};
+    ring_stats ring_stats_[MAX_VIRTIO_RINGS] = {};
+
+    /* what the device sees of a packed ring, ring_ then holds the driver's descriptors */
+    vring_packed packed_ring_[MAX_VIRTIO_RINGS] = {};
+
+    /* negotiated ring features */
+    bool event_idx_ = {};
+    bool indirect_ = {};
+    bool packed_ = {};
+
+    /* indirect tables, indirect_len_ entries per descriptor */
+    vring_desc *indirect_table_[MAX_VIRTIO_RINGS] = {};
+    paddr_t indirect_pa_[MAX_VIRTIO_RINGS] = {};
+    uint16_t indirect_len_[MAX_VIRTIO_RINGS] = {};
 };
 
 
@@ -27,12 +27,16 @@ public:
     void virtio_kick(uint16_t ring_index) override;
 
     void register_ring(uint32_t page_size, uint32_t queue_sel, uint32_t queue_num, uint32_t queue_align, uint32_t queue_pfn) override;
+    status_t register_ring_areas(uint32_t queue_sel, uint32_t queue_num, uint64_t desc_pa, uint64_t driver_pa, uint64_t device_pa) override;
 
     bool virtio_is_legacy() const override { return mmio_version_ == 1; }
+    const char *name() const override { return "mmio"; }
 
     static handler_return virtio_mmio_irq(void *arg);
 
 private:
+    status_t select_ring(uint32_t queue_sel, uint32_t queue_num);
+
     volatile struct virtio_mmio_config *mmio_config_;
     uint32_t mmio_version_;
 };
@@ -20,7 +20,11 @@ class virtio_device;
 
 class virtio_pci_bus final : public virtio_bus {
 public:
-    virtio_pci_bus() = default;
+    virtio_pci_bus() {
+        for (auto &off : queue_notify_off_) {
+            off = USHRT_MAX;
+        }
+    }
     ~virtio_pci_bus() override = default;
 
     status_t init(virtio_device *dev, pci_location_t loc, size_t index);
@@ -32,8 +36,14 @@ public:
     void virtio_status_driver_ok() override;
     void virtio_kick(uint16_t ring_index) override;
     void register_ring(uint32_t page_size, uint32_t queue_sel, uint32_t queue_num, uint32_t queue_align, uint32_t queue_pfn) override;
+    status_t register_ring_areas(uint32_t queue_sel, uint32_t queue_num, uint64_t desc_pa, uint64_t driver_pa, uint64_t device_pa) override;
 
     bool virtio_is_legacy() const override { return legacy_; }
+    const char *name() const override { return "pci"; }
+
+    void mask_interrupt() override;
+    void unmask_interrupt() override;
+    status_t set_ring_irq_cpu(uint16_t ring_index, uint cpu) override;
 
     volatile virtio_pci_common_cfg *common_config() {
         return  reinterpret_cast<volatile virtio_pci_common_cfg *>(config_ptr(common_cfg_));
@@ -45,6 +55,7 @@ public:
 
 private:
     static handler_return virtio_pci_irq(void *arg);
+    static handler_return virtio_pci_ring_irq(void *arg);
 
     enum class irq_mode : uint8_t {
         Legacy,
@@ -79,8 +90,19 @@ private:
     irq_mode irq_mode_ = irq_mode::Legacy;
 
     uint32_t notify_offset_multiplier_ = {};
-    static constexpr size_t kMaxRings = 4;
-    uint16_t queue_notify_off_[kMaxRings] = { USHRT_MAX, USHRT_MAX, USHRT_MAX, USHRT_MAX };
+    static constexpr size_t kMaxRings = 32;
+    uint16_t queue_notify_off_[kMaxRings];
+
+    // With more than one MSI-X vector, vector 0 takes config changes and any ring
+    // without a vector of its own, and ring r gets vector r + 1 if there is one.
+    struct ring_irq {
+        virtio_pci_bus *bus;
+        uint16_t ring;
+    };
+    uint irq_base_ = {};
+    uint msix_vectors_ = {};
+    uint16_t ring_vector_[kMaxRings] = {};
+    ring_irq ring_irq_[kMaxRings] = {};
 
     // Given one of the config_pointer structs, return a uint8_t * pointer
     // to its mapping.
@@ -61,6 +61,10 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX     29
 
+/* The ring is a single ring of descriptors that the device writes back in place,
+ * rather than separate available and used rings. Up in feature word 1. */
+#define VIRTIO_RING_F_PACKED        34
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
     /* Address (guest-physical). */
@@ -240,6 +244,9 @@ struct vring {
 
     uint16_t last_used;
 
+    /* avail idx as of the last notification of the device */
+    uint16_t kicked_avail;
+
     struct vring_desc *desc;
 
     struct vring_avail *avail;
@@ -276,6 +283,15 @@ struct vring {
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
 #define vring_avail_event(vr) (*(uint16_t *)&(vr)->used->ring[(vr)->num])
 
+static inline uint16_t vring_read_avail_event(const struct vring *vr, bool modern) {
+    uint16_t val = vring_mem_read16((volatile uint16_t *)&vr->used->ring[vr->num]);
+    return modern ? LE16(val) : val;
+}
+
+static inline void vring_write_used_event(struct vring *vr, uint16_t idx, bool modern) {
+    vring_mem_write16(&vring_used_event(vr), modern ? LE16(idx) : idx);
+}
+
 static inline void vring_init(struct vring *vr, unsigned int num, void *p,
                               unsigned long align) {
     vr->num = num;
@@ -283,6 +299,7 @@ static inline void vring_init(struct vring *vr, unsigned int num, void *p,
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->kicked_avail = 0;
     vr->desc = (struct vring_desc *)p;
     vr->avail = (struct vring_avail *)((uintptr_t)p + num*sizeof(struct vring_desc));
     vr->used = (struct vring_used *)(((uintptr_t)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -308,6 +325,123 @@ static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_
     return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old);
 }
 
+/* Packed virtqueues, which only modern devices have, so these are always little endian.
+ *
+ * A descriptor is available when its avail flag matches the driver's wrap counter and
+ * its used flag doesn't, and used when both match the device's. The counters start at
+ * 1 and flip each time the ring wraps. A chain takes consecutive slots and is written
+ * back as a single used descriptor, in the slot of its first. */
+#define VRING_PACKED_DESC_F_AVAIL   7
+#define VRING_PACKED_DESC_F_USED    15
+
+/* event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+/* only for the descriptor in off_wrap, needs VIRTIO_RING_F_EVENT_IDX */
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+
+/* the wrap counter of the descriptor, above its offset in off_wrap */
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
+struct vring_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct vring_packed_desc_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+struct vring_packed {
+    uint32_t num;
+
+    struct vring_packed_desc *desc;
+
+    /* written by us to suppress interrupts, by the device to suppress notifications */
+    struct vring_packed_desc_event *driver;
+    struct vring_packed_desc_event *device;
+
+    uint16_t next_avail; /* slot the next descriptor goes in */
+    uint16_t last_used;  /* slot of the next used descriptor */
+    bool avail_wrap;
+    bool used_wrap;
+
+    /* free running count of descriptors made available, and its value at the last kick */
+    uint16_t avail_count;
+    uint16_t kicked_count;
+};
+
+/* The descriptors, followed by the driver and device event suppression structures. */
+static inline void vring_packed_init(struct vring_packed *vr, unsigned int num, void *p) {
+    vr->num = num;
+    vr->desc = (struct vring_packed_desc *)p;
+    vr->driver = (struct vring_packed_desc_event *)&vr->desc[num];
+    vr->device = vr->driver + 1;
+    vr->next_avail = 0;
+    vr->last_used = 0;
+    vr->avail_wrap = true;
+    vr->used_wrap = true;
+    vr->avail_count = 0;
+    vr->kicked_count = 0;
+}
+
+static inline unsigned vring_packed_size(unsigned int num) {
+    return sizeof(struct vring_packed_desc) * num + sizeof(struct vring_packed_desc_event) * 2;
+}
+
+/* everything but the flags, which make the descriptor available and go last */
+static inline void vring_packed_desc_write(struct vring_packed_desc *desc, uint64_t addr, uint32_t len, uint16_t id) {
+    vring_mem_write64(&desc->addr, addr, true);
+    vring_mem_write32(&desc->len, LE32(len));
+    vring_mem_write16(&desc->id, LE16(id));
+}
+
+static inline void vring_packed_desc_write_flags(struct vring_packed_desc *desc, uint16_t flags) {
+    vring_mem_write16(&desc->flags, LE16(flags));
+}
+
+static inline uint16_t vring_packed_desc_read_flags(const struct vring_packed_desc *desc) {
+    return LE16(vring_mem_read16((volatile uint16_t *)&desc->flags));
+}
+
+static inline uint16_t vring_packed_desc_read_id(const struct vring_packed_desc *desc) {
+    return LE16(vring_mem_read16((volatile uint16_t *)&desc->id));
+}
+
+static inline uint32_t vring_packed_desc_read_len(const struct vring_packed_desc *desc) {
+    return LE32(vring_mem_read32((volatile uint32_t *)&desc->len));
+}
+
+/* the flags that make a descriptor available in a lap of the ring */
+static inline uint16_t vring_packed_avail_flags(bool wrap) {
+    return wrap ? (1u << VRING_PACKED_DESC_F_AVAIL) : (1u << VRING_PACKED_DESC_F_USED);
+}
+
+static inline bool vring_packed_desc_is_used(const struct vring_packed_desc *desc, bool wrap) {
+    uint16_t flags = vring_packed_desc_read_flags(desc);
+    bool avail = flags & (1u << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1u << VRING_PACKED_DESC_F_USED);
+    return avail == used && used == wrap;
+}
+
+/* read both halves at once, so the offset goes with the flags it was written with */
+static inline void vring_packed_event_read(const struct vring_packed_desc_event *event, uint16_t *off_wrap, uint16_t *flags) {
+    uint32_t val = LE32(vring_mem_read32((volatile uint32_t *)event));
+    *off_wrap = (uint16_t)val;
+    *flags = (uint16_t)(val >> 16);
+}
+
+static inline void vring_packed_event_write_off_wrap(struct vring_packed_desc_event *event, uint16_t off_wrap) {
+    vring_mem_write16(&event->off_wrap, LE16(off_wrap));
+}
+
+static inline void vring_packed_event_write_flags(struct vring_packed_desc_event *event, uint16_t flags) {
+    vring_mem_write16(&event->flags, LE16(flags));
+}
+
 void virtio_dump_desc(const struct vring_desc *desc);
 
 #endif /* _UAPI_LINUX_VIRTIO_RING_H */
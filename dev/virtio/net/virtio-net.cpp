@@ -13,11 +13,14 @@
 #include <assert.h>
 #include <lk/trace.h>
 #include <lk/compiler.h>
+#include <limits.h>
 #include <lk/list.h>
+#include <lk/pow2.h>
 #include <string.h>
 #include <lk/err.h>
-#include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
@@ -106,34 +109,117 @@ STATIC_ASSERT(sizeof(struct virtio_net_hdr) == 12);
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-constexpr uint16_t TX_RING_SIZE = 64;
+/* control virtqueue commands, a class and command byte, the data, then an ack written back */
+struct virtio_net_ctrl_hdr {
+    uint8_t class_;
+    uint8_t cmd;
+};
+STATIC_ASSERT(sizeof(struct virtio_net_ctrl_hdr) == 2);
+
+#define VIRTIO_NET_OK                       0
+#define VIRTIO_NET_ERR                      1
+
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG       1
+
+#define VIRTIO_NET_HASH_TYPE_IPv4           (1<<0)
+#define VIRTIO_NET_HASH_TYPE_TCPv4          (1<<1)
+#define VIRTIO_NET_HASH_TYPE_UDPv4          (1<<2)
+
+/* the leading part of the RSS_CONFIG command, followed by the indirection table,
+ * max_tx_vq, the key length and the key */
+struct virtio_net_rss_config_hdr {
+    uint32_t hash_types;
+    uint16_t indirection_table_mask;
+    uint16_t unclassified_queue;
+};
+STATIC_ASSERT(sizeof(struct virtio_net_rss_config_hdr) == 8);
+
+/* the usual Toeplitz key, as used by most nics by default */
+const uint8_t rss_default_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* large enough for a few 64KB segmentation offload chains in flight */
+constexpr uint16_t TX_RING_SIZE = 256;
 constexpr uint16_t RX_RING_SIZE = 64;
 
-constexpr uint32_t RING_RX = 0;
-constexpr uint32_t RING_TX = 1;
+constexpr uint16_t CTRL_RING_SIZE = 16;
+
+/* queue pair i uses rings 2i and 2i + 1, and the control ring goes after the last pair the
+ * device has, so that has to fit too */
+constexpr uint MAX_QUEUE_PAIRS = (virtio_device::MAX_VIRTIO_RINGS - 1) / 2;
+
+/* largest RSS indirection table set up, spread evenly over the queues */
+constexpr uint RSS_TABLE_SIZE = 128;
 
 constexpr size_t VIRTIO_NET_MSS = 1514;
 
-struct virtio_net_dev {
-    virtio_device *dev;
+struct virtio_net_dev;
+
+/* a rx and tx ring pair, with its interrupts and rx processing kept on one cpu */
+struct virtio_net_queue {
+    virtio_net_dev *ndev;
+
+    uint16_t rx_ring;
+    uint16_t tx_ring;
+
+    /* the cpu this queue's interrupts are sent to and its packets processed on */
+    uint cpu;
 
     spin_lock_t lock;
-    event_t rx_event;
 
-    /* list of active tx/rx packets to be freed at irq time */
+    /* both rings are polled together, either one's interrupt kicks it off */
+    netif_poll poll;
+
+    /* list of active tx/rx packets to be freed once the device is done with them */
     pktbuf_t *pending_tx_packet[TX_RING_SIZE];
     pktbuf_t *pending_rx_packet[RX_RING_SIZE];
 
     uint tx_pending_count;
     struct list_node completed_rx_queue;
 
+    /* with mergeable rx buffers, a packet spread over several of them still being
+     * gathered by the poll, and how many more buffers it has coming */
+    pktbuf_t *rx_chain;
+    uint rx_chain_remaining;
+};
+
+struct virtio_net_dev {
+    virtio_device *dev;
+
+    /* one queue pair per cpu with multiqueue, otherwise just the one */
+    virtio_net_queue *queues;
+    uint queue_pairs;
+
+    /* the control ring, only there with multiqueue. Commands are only sent one at a time
+     * from init, the irq signals ctrl_event as each one completes */
+    uint16_t ctrl_ring;
+    spin_lock_t ctrl_lock;
+    event_t ctrl_event;
+
+    /* bytes of virtio_net_hdr in front of every packet, num_buffers is only there for
+     * modern devices and with mergeable rx buffers */
+    size_t hdr_len;
+
+    /* bytes of each rx pktbuf handed to the device */
+    size_t rx_buf_len;
+
+    bool mrg_rxbuf;
+
     /* the minip ethernet structure */
     netif_t netif;
 };
 
 enum handler_return virtio_net_irq_driver_callback(virtio_device *dev, uint ring, const vring_used_elem *e);
-int virtio_net_rx_worker(void *arg);
-status_t virtio_net_queue_rx(virtio_net_dev *ndev, pktbuf_t *p, bool do_kick = true);
+enum handler_return virtio_net_ring_notify(virtio_device *dev, uint ring);
+extern const netif_poll_ops virtio_net_poll_ops;
+status_t virtio_net_queue_rx(virtio_net_queue *q, pktbuf_t *p, bool do_kick = true);
 void virtio_net_get_mac_addr(virtio_net_dev *ndev, uint8_t mac_addr[6]);
 status_t virtio_net_send_minip_pkt(void *arg, pktbuf_t *p);
 
@@ -184,6 +270,33 @@ void virtio_net_get_mac_addr(virtio_net_dev *ndev, uint8_t mac_addr[6]) {
     }
 }
 
+uint16_t virtio_net_hdr16(const virtio_net_dev *ndev, uint16_t val) {
+    return ndev->dev->config_is_modern() ? LE16(val) : val;
+}
+
+/* fill in the offloads the stack left for the device to do */
+void virtio_net_fill_tx_hdr(const virtio_net_dev *ndev, virtio_net_hdr *hdr, const pktbuf_t *p) {
+    memset(hdr, 0, ndev->hdr_len);
+
+    if (p->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        /* csum_start is from the start of the buffer, the device wants it from the frame */
+        uint16_t csum_start = p->csum_start - (p->data - p->buffer);
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = virtio_net_hdr16(ndev, csum_start);
+        hdr->csum_offset = virtio_net_hdr16(ndev, p->csum_offset);
+
+        if (p->flags & PKTBUF_FLAG_GSO_TCPV4) {
+            /* the headers copied in front of every segment, through the tcp options */
+            const uint8_t *tcp = p->data + csum_start;
+            hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            hdr->gso_size = virtio_net_hdr16(ndev, p->gso_size);
+            hdr->hdr_len = virtio_net_hdr16(ndev, csum_start + (tcp[12] >> 4) * 4);
+        }
+    }
+}
+
+/* queue a packet, and every part chained behind it, as one descriptor chain behind the header,
+ * on the tx ring of the cpu we're running on */
 status_t virtio_net_queue_tx_pktbuf(virtio_net_dev *ndev, pktbuf_t *p2) {
     virtio_device *vdev = ndev->dev;
 
@@ -192,61 +305,70 @@ status_t virtio_net_queue_tx_pktbuf(virtio_net_dev *ndev, pktbuf_t *p2) {
 
     DEBUG_ASSERT(ndev);
 
+    virtio_net_queue *q = &ndev->queues[arch_curr_cpu_num() % ndev->queue_pairs];
+
+    uint16_t count = 1;
+    for (pktbuf_t *part = p2; part; part = part->next) {
+        count++;
+    }
+
     p = pktbuf_alloc();
     if (!p)
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    virtio_net_hdr *hdr = (virtio_net_hdr *)pktbuf_append(p, sizeof(virtio_net_hdr) - 2);
-    memset(hdr, 0, p->dlen);
+    virtio_net_hdr *hdr = (virtio_net_hdr *)pktbuf_append(p, ndev->hdr_len);
+    virtio_net_fill_tx_hdr(ndev, hdr, p2);
 
-    arch_interrupt_saved_state_t state = spin_lock_irqsave(&ndev->lock);
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
 
     vring_desc *desc = {};
 
     /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 <= TX_RING_SIZE) {
+    if (q->tx_pending_count + count <= TX_RING_SIZE) {
         /* allocate a chain of descriptors for our transfer */
-        desc = vdev->virtio_alloc_desc_chain(RING_TX, 2, &i);
+        desc = vdev->virtio_alloc_desc_chain(q->tx_ring, count, &i);
     }
     if (!desc) {
-        spin_unlock_irqrestore(&ndev->lock, state);
+        spin_unlock_irqrestore(&q->lock, state);
 
-        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", q->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    q->tx_pending_count += count;
 
     const bool modern = vdev->config_is_modern();
-    /* save a pointer to our pktbufs for the irq handler to free */
-    LTRACEF("saving pointer to pkt in index %u and %u\n", i, vring_desc_read_next(desc, modern));
-    DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[vring_desc_read_next(desc, modern)] == NULL);
-    ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[vring_desc_read_next(desc, modern)] = p2;
-
 
-    /* set up the descriptor pointing to the header */
-    vring_desc_write_addr(desc, pktbuf_data_phys(p), modern);
-    vring_desc_write_len(desc, p->dlen, modern);
-    vring_desc_write_flags(desc, vring_desc_read_flags(desc, modern) | VRING_DESC_F_NEXT, modern);
-
-    /* set up the descriptor pointing to the buffer */
-    desc = vdev->virtio_desc_index_to_desc(RING_TX, vring_desc_read_next(desc, modern));
-    vring_desc_write_addr(desc, pktbuf_data_phys(p2), modern);
-    vring_desc_write_len(desc, p2->dlen, modern);
-    vring_desc_write_flags(desc, 0, modern);
+    /* set up a descriptor for the header and each part of the packet, saving a pointer to
+     * each pktbuf for the irq handler to free */
+    uint16_t index = i;
+    p->next = p2;
+    for (pktbuf_t *part = p; part; part = part->next) {
+        LTRACEF("saving pointer to pkt in index %u\n", index);
+        DEBUG_ASSERT(q->pending_tx_packet[index] == NULL);
+        q->pending_tx_packet[index] = part;
+
+        vring_desc_write_addr(desc, pktbuf_data_phys(part), modern);
+        vring_desc_write_len(desc, part->dlen, modern);
+        if (part->next) {
+            vring_desc_write_flags(desc, vring_desc_read_flags(desc, modern) | VRING_DESC_F_NEXT, modern);
+            index = vring_desc_read_next(desc, modern);
+            desc = vdev->virtio_desc_index_to_desc(q->tx_ring, index);
+        } else {
+            vring_desc_write_flags(desc, 0, modern);
+        }
+    }
 
     /* submit the transfer */
-    vdev->virtio_submit_chain(RING_TX, i);
+    vdev->virtio_submit_chain(q->tx_ring, i);
 
     /* kick it off */
-    vdev->bus()->virtio_kick(RING_TX);
+    vdev->virtio_kick(q->tx_ring);
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
@@ -274,30 +396,31 @@ status_t virtio_net_queue_tx(virtio_net_dev *ndev, const void *buf, size_t len)
     return err;
 }
 
-status_t virtio_net_queue_rx(virtio_net_dev *ndev, pktbuf_t *p, bool do_kick) {
+status_t virtio_net_queue_rx(virtio_net_queue *q, pktbuf_t *p, bool do_kick) {
+    virtio_net_dev *ndev = q->ndev;
     virtio_device *vdev = ndev->dev;
 
-    DEBUG_ASSERT(ndev);
     DEBUG_ASSERT(p);
 
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
     p->flags = 0;
+    p->next = NULL;
     virtio_net_hdr *hdr = (virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(virtio_net_hdr) - 2);
+    memset(hdr, 0, ndev->hdr_len);
 
-    p->dlen = sizeof(virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = ndev->rx_buf_len;
 
-    arch_interrupt_saved_state_t state = spin_lock_irqsave(&ndev->lock);
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
 
     /* allocate a chain of descriptors for our transfer */
     uint16_t i;
-    vring_desc *desc = vdev->virtio_alloc_desc_chain(RING_RX, 1, &i);
+    vring_desc *desc = vdev->virtio_alloc_desc_chain(q->rx_ring, 1, &i);
     DEBUG_ASSERT(desc); /* shouldn't be possible not to have a descriptor ready */
 
     /* save a pointer to our pktbufs for the irq handler to use */
-    DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
-    ndev->pending_rx_packet[i] = p;
+    DEBUG_ASSERT(q->pending_rx_packet[i] == NULL);
+    q->pending_rx_packet[i] = p;
 
     const bool modern = vdev->config_is_modern();
     /* set up the descriptor pointing to the header */
@@ -306,24 +429,59 @@ status_t virtio_net_queue_rx(virtio_net_dev *ndev, pktbuf_t *p, bool do_kick) {
     vring_desc_write_flags(desc, VRING_DESC_F_WRITE, modern);
 
     /* submit the transfer */
-    vdev->virtio_submit_chain(RING_RX, i);
+    vdev->virtio_submit_chain(q->rx_ring, i);
 
     /* kick it off */
     if (do_kick) {
-        vdev->bus()->virtio_kick(RING_RX);
+        vdev->virtio_kick(q->rx_ring);
     }
 
-    spin_unlock_irqrestore(&ndev->lock, state);
+    spin_unlock_irqrestore(&q->lock, state);
 
     return NO_ERROR;
 }
 
+/* a control command finished, free its descriptors and wake up whoever sent it */
+enum handler_return virtio_net_ctrl_irq(virtio_net_dev *ndev, const vring_used_elem *e) {
+    virtio_device *dev = ndev->dev;
+    const bool modern = dev->config_is_modern();
+
+    spin_lock(&ndev->ctrl_lock);
+
+    uint16_t i = e->id;
+    for (;;) {
+        vring_desc *desc = dev->virtio_desc_index_to_desc(ndev->ctrl_ring, i);
+        uint16_t flags = vring_desc_read_flags(desc, modern);
+        uint16_t next = vring_desc_read_next(desc, modern);
+
+        dev->virtio_free_desc(ndev->ctrl_ring, i);
+
+        if (!(flags & VRING_DESC_F_NEXT))
+            break;
+        i = next;
+    }
+
+    spin_unlock(&ndev->ctrl_lock);
+
+    event_signal(&ndev->ctrl_event, false);
+
+    return INT_RESCHEDULE;
+}
+
 enum handler_return virtio_net_irq_driver_callback(virtio_device *dev, uint ring, const vring_used_elem *e) {
     virtio_net_dev *ndev = (virtio_net_dev *)dev->priv();
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    spin_lock(&ndev->lock);
+    if (ring == ndev->ctrl_ring) {
+        return virtio_net_ctrl_irq(ndev, e);
+    }
+
+    virtio_net_queue *q = &ndev->queues[ring / 2];
+    const bool is_rx = (ring == q->rx_ring);
+
+    /* the data rings are polled, so this is called from the queue's poll */
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
 
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
@@ -341,28 +499,28 @@ enum handler_return virtio_net_irq_driver_callback(virtio_device *dev, uint ring
 
         dev->virtio_free_desc(ring, i);
 
-        if (ring == RING_RX) {
+        if (is_rx) {
             /* put the freed rx buffer in a queue */
-            pktbuf_t *p = ndev->pending_rx_packet[i];
-            ndev->pending_rx_packet[i] = NULL;
+            pktbuf_t *p = q->pending_rx_packet[i];
+            q->pending_rx_packet[i] = NULL;
 
             DEBUG_ASSERT(p);
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > ndev->rx_buf_len) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
                 p->dlen = e->len;
             }
 
-            list_add_tail(&ndev->completed_rx_queue, &p->list);
-        } else { // ring == RING_TX
+            list_add_tail(&q->completed_rx_queue, &p->list);
+        } else {
             /* free the pktbuf associated with the tx packet we just consumed */
-            pktbuf_t *p = ndev->pending_tx_packet[i];
-            ndev->pending_tx_packet[i] = NULL;
-            ndev->tx_pending_count--;
+            pktbuf_t *p = q->pending_tx_packet[i];
+            q->pending_tx_packet[i] = NULL;
+            q->tx_pending_count--;
 
             DEBUG_ASSERT(p);
             LTRACEF("freeing pktbuf %p\n", p);
@@ -375,13 +533,22 @@ enum handler_return virtio_net_irq_driver_callback(virtio_device *dev, uint ring
         i = next;
     }
 
-    spin_unlock(&ndev->lock);
+    spin_unlock_irqrestore(&q->lock, state);
 
-    /* if rx ring, signal our event */
-    if (ring == 0) {
-        event_signal(&ndev->rx_event, false);
+    if (!is_rx) {
+        q->poll.tx_packets++;
     }
 
+    return INT_NO_RESCHEDULE;
+}
+
+/* an interrupt for one of a queue's rings, poll both of them on the queue's cpu. Normally that's
+ * the one the interrupt came in on, unless it could not be moved there or isn't up yet */
+enum handler_return virtio_net_ring_notify(virtio_device *dev, uint ring) {
+    virtio_net_dev *ndev = (virtio_net_dev *)dev->priv();
+
+    netif_poll_schedule(&ndev->queues[ring / 2].poll);
+
     return INT_RESCHEDULE;
 }
 
@@ -389,46 +556,109 @@ enum handler_return virtio_net_config_change_callback(virtio_device *dev) {
     return INT_NO_RESCHEDULE;
 }
 
-int virtio_net_rx_worker(void *arg) {
-    virtio_net_dev *ndev = (virtio_net_dev *)arg;
+/* hand a received packet to the stack, then give all of its buffers back to the device */
+void virtio_net_rx_deliver(virtio_net_queue *q, pktbuf_t *p) {
+    /* call up into the stack */
+    netif_poll_receive(&q->poll, p);
+
+    /* requeue the pktbufs in the rx queue */
+    while (p) {
+        pktbuf_t *next = p->next;
+        virtio_net_queue_rx(q, p, next == NULL);
+        p = next;
+    }
+}
 
+/* hand everything the last poll of the rx ring pulled off up the stack */
+void virtio_net_rx_drain(virtio_net_queue *q) {
+    virtio_net_dev *ndev = q->ndev;
+
+    /* pull packets from the received queue until it is empty */
     for (;;) {
-        event_wait(&ndev->rx_event);
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
 
-        /* pull some packets from the received queue */
-        for (;;) {
-            arch_interrupt_saved_state_t state = spin_lock_irqsave(&ndev->lock);
+        pktbuf_t *p = list_remove_head_type(&q->completed_rx_queue, pktbuf_t, list);
 
-            pktbuf_t *p = list_remove_head_type(&ndev->completed_rx_queue, pktbuf_t, list);
+        spin_unlock_irqrestore(&q->lock, state);
 
-            spin_unlock_irqrestore(&ndev->lock, state);
+        if (!p)
+            break; /* nothing left in the queue */
 
-            if (!p)
-                break; /* nothing left in the queue, go back to waiting */
+        LTRACEF("got packet len %u\n", p->dlen);
 
-            LTRACEF("got packet len %u\n", p->dlen);
+        /* the rest of a packet spread over several buffers */
+        if (q->rx_chain) {
+            pktbuf_chain(q->rx_chain, p);
+            if (--q->rx_chain_remaining > 0)
+                continue;
 
-            if (likely(netif_is_configured(&ndev->netif))) {
-                /* process our packet */
-                const auto *hdr = static_cast<const virtio_net_hdr *>(pktbuf_consume(p, sizeof(virtio_net_hdr) - 2));
-                if (hdr) {
-                    /* signal checksum offload to the stack if the device validated it */
-                    if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
-                        p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
-                    }
+            p = q->rx_chain;
+            q->rx_chain = NULL;
+            virtio_net_rx_deliver(q, p);
+            continue;
+        }
 
-                    /* call up into the stack */
-                    minip_rx_driver_callback(&ndev->netif, p);
-                }
-            }
+        const auto *hdr = static_cast<const virtio_net_hdr *>(pktbuf_consume(p, ndev->hdr_len));
+        if (!hdr) {
+            virtio_net_queue_rx(q, p);
+            continue;
+        }
+
+        /* signal checksum offload to the stack if the device validated it, or if it came from
+         * the host side with the checksum still to be filled in and so never crossed a wire */
+        if (hdr->flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+        }
 
-            /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
+        uint16_t num_buffers = ndev->mrg_rxbuf ? virtio_net_hdr16(ndev, hdr->num_buffers) : 1;
+        if (num_buffers > 1 && num_buffers < RX_RING_SIZE) {
+            /* gather the rest of it as it comes in, which may be the next poll */
+            q->rx_chain = p;
+            q->rx_chain_remaining = num_buffers - 1;
+            continue;
         }
+
+        virtio_net_rx_deliver(q, p);
     }
-    return 0;
 }
 
+int virtio_net_poll(netif_poll *np, int budget) {
+    auto *q = static_cast<virtio_net_queue *>(np->arg);
+    virtio_device *dev = q->ndev->dev;
+
+    /* reclaim everything that's been sent, it's cheap and makes room to send more */
+    dev->poll_ring(q->tx_ring, UINT_MAX);
+
+    /* then up to budget rx buffers */
+    int done = dev->poll_ring(q->rx_ring, budget);
+    virtio_net_rx_drain(q);
+
+    return done;
+}
+
+void virtio_net_poll_irq_disable(netif_poll *np) {
+    auto *q = static_cast<virtio_net_queue *>(np->arg);
+    virtio_device *dev = q->ndev->dev;
+
+    dev->ring_disable_interrupt(q->rx_ring);
+    dev->ring_disable_interrupt(q->tx_ring);
+}
+
+bool virtio_net_poll_irq_enable(netif_poll *np) {
+    auto *q = static_cast<virtio_net_queue *>(np->arg);
+    virtio_device *dev = q->ndev->dev;
+
+    bool more = dev->ring_enable_interrupt(q->rx_ring);
+    more |= dev->ring_enable_interrupt(q->tx_ring);
+    return more;
+}
+
+const netif_poll_ops virtio_net_poll_ops = {
+    .poll = virtio_net_poll,
+    .irq_disable = virtio_net_poll_irq_disable,
+    .irq_enable = virtio_net_poll_irq_enable,
+};
+
 status_t virtio_net_send_minip_pkt(void *arg, pktbuf_t *p) {
     auto *ndev = static_cast<virtio_net_dev *>(arg);
 
@@ -437,20 +667,165 @@ status_t virtio_net_send_minip_pkt(void *arg, pktbuf_t *p) {
     DEBUG_ASSERT(p && p->dlen);
     DEBUG_ASSERT(ndev);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
+    /* hand the pktbufs off to the nic, it owns them from now on out unless it fails */
+    status_t err = virtio_net_queue_tx_pktbuf(ndev, p);
+    if (err < 0) {
+        pktbuf_free_chain(p, true);
+    }
+
+    return err;
+}
+
+/* send a command down the control ring and wait for the device to ack it */
+status_t virtio_net_ctrl_cmd(virtio_net_dev *ndev, uint8_t class_, uint8_t cmd, const void *data, size_t len) {
+    virtio_device *vdev = ndev->dev;
 
-        return ERR_NOT_IMPLEMENTED;
+    DEBUG_ASSERT(data && len > 0);
+
+    /* the header, data and ack all go in one pktbuf, but each in a descriptor of its own
+     * since legacy devices may expect that layout */
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    auto *buf = static_cast<uint8_t *>(pktbuf_append(p, sizeof(virtio_net_ctrl_hdr) + len + 1));
+    if (!buf) {
+        pktbuf_free(p, true);
+        return ERR_TOO_BIG;
     }
 
-    /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
-    status_t err = virtio_net_queue_tx_pktbuf(ndev, p);
-    if (err < 0) {
+    auto *hdr = reinterpret_cast<virtio_net_ctrl_hdr *>(buf);
+    hdr->class_ = class_;
+    hdr->cmd = cmd;
+    memcpy(buf + sizeof(*hdr), data, len);
+    volatile uint8_t *ack = buf + sizeof(*hdr) + len;
+    *ack = VIRTIO_NET_ERR;
+
+    const paddr_t pa = pktbuf_data_phys(p);
+    const struct {
+        paddr_t addr;
+        uint32_t len;
+        uint16_t flags;
+    } parts[] = {
+        { pa, sizeof(*hdr), VRING_DESC_F_NEXT },
+        { pa + sizeof(*hdr), static_cast<uint32_t>(len), VRING_DESC_F_NEXT },
+        { pa + sizeof(*hdr) + len, 1, VRING_DESC_F_WRITE },
+    };
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&ndev->ctrl_lock);
+
+    uint16_t i;
+    vring_desc *desc = vdev->virtio_alloc_desc_chain(ndev->ctrl_ring, countof(parts), &i);
+    if (!desc) {
+        spin_unlock_irqrestore(&ndev->ctrl_lock, state);
         pktbuf_free(p, true);
+        return ERR_NO_MEMORY;
     }
 
-    return err;
+    const bool modern = vdev->config_is_modern();
+    for (const auto &part : parts) {
+        vring_desc_write_addr(desc, part.addr, modern);
+        vring_desc_write_len(desc, part.len, modern);
+        vring_desc_write_flags(desc, part.flags, modern);
+        if (part.flags & VRING_DESC_F_NEXT) {
+            desc = vdev->virtio_desc_index_to_desc(ndev->ctrl_ring, vring_desc_read_next(desc, modern));
+        }
+    }
+
+    vdev->virtio_submit_chain(ndev->ctrl_ring, i);
+    vdev->virtio_kick(ndev->ctrl_ring);
+
+    spin_unlock_irqrestore(&ndev->ctrl_lock, state);
+
+    status_t err = event_wait_timeout(&ndev->ctrl_event, 1000);
+    if (err < 0) {
+        /* the device still owns the buffer, so leave it be */
+        TRACEF("control command %u:%u timed out\n", class_, cmd);
+        return err;
+    }
+
+    uint8_t result = *ack;
+    pktbuf_free(p, true);
+
+    LTRACEF("control command %u:%u result %u\n", class_, cmd, result);
+
+    return (result == VIRTIO_NET_OK) ? NO_ERROR : ERR_NOT_SUPPORTED;
+}
+
+/* spread flows over all of the rx queues by hashing their addresses and ports, which keeps
+ * each tcp connection on one queue and so one cpu */
+status_t virtio_net_set_rss(virtio_net_dev *ndev) {
+    virtio_device *dev = ndev->dev;
+
+    uint32_t hash_types = dev->config_read32(offsetof(virtio_net_config, supported_hash_types)) &
+                          (VIRTIO_NET_HASH_TYPE_IPv4 | VIRTIO_NET_HASH_TYPE_TCPv4 | VIRTIO_NET_HASH_TYPE_UDPv4);
+    uint table_len = MIN(dev->config_read16(offsetof(virtio_net_config, rss_max_indirection_table_length)),
+                         RSS_TABLE_SIZE);
+    uint key_len = MIN(dev->config_read8(offsetof(virtio_net_config, rss_max_key_size)),
+                       sizeof(rss_default_key));
+    if (hash_types == 0 || table_len == 0 || key_len == 0) {
+        return ERR_NOT_SUPPORTED;
+    }
+
+    /* the table is indexed by the low bits of the hash */
+    table_len = 1U << log2_uint(table_len);
+
+    uint8_t buf[sizeof(virtio_net_rss_config_hdr) + RSS_TABLE_SIZE * 2 + 3 + sizeof(rss_default_key)];
+    auto *hdr = reinterpret_cast<virtio_net_rss_config_hdr *>(buf);
+    hdr->hash_types = LE32(hash_types);
+    hdr->indirection_table_mask = LE16(table_len - 1);
+    hdr->unclassified_queue = 0;
+
+    size_t len = sizeof(*hdr);
+    auto put16 = [&](uint16_t val) {
+        val = LE16(val);
+        memcpy(buf + len, &val, sizeof(val));
+        len += sizeof(val);
+    };
+    for (uint i = 0; i < table_len; i++) {
+        put16(i % ndev->queue_pairs);
+    }
+    put16(ndev->queue_pairs); // max_tx_vq
+    buf[len++] = key_len;
+    memcpy(buf + len, rss_default_key, key_len);
+    len += key_len;
+
+    return virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, buf, len);
+}
+
+/* the device only uses the first queue pair until told otherwise */
+// The pktbuf pool only has room for so many rx buffers, split them between the queues.
+static uint virtio_net_rx_depth(uint queue_pairs) {
+    if (queue_pairs <= 1) {
+        return RX_RING_SIZE - 1;
+    }
+
+    uint rx_depth = pktbuf_recommended_eth_rx_depth(queue_pairs * RX_RING_SIZE) / queue_pairs;
+    return MAX(MIN(rx_depth, RX_RING_SIZE - 1U), 1U);
+}
+
+status_t virtio_net_set_queue_pairs(virtio_net_dev *ndev, bool rss) {
+    if (rss) {
+        status_t err = virtio_net_set_rss(ndev);
+        if (err == NO_ERROR) {
+            return err;
+        }
+        dprintf(INFO, "virtio-net: rss config failed (%d), using the device's own steering\n", err);
+    }
+
+    uint16_t pairs = virtio_net_hdr16(ndev, ndev->queue_pairs);
+    return virtio_net_ctrl_cmd(ndev, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs));
+}
+
+/* number of cpus up and running to spread the queues over */
+uint virtio_net_active_cpus() {
+    uint count = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i)) {
+            count++;
+        }
+    }
+    return MAX(count, 1U);
 }
 
 } // namespace
@@ -466,9 +841,9 @@ status_t virtio_net_init(virtio_device *dev) {
     ndev->dev = dev;
     dev->set_priv(ndev);
 
-    ndev->lock = SPIN_LOCK_INITIAL_VALUE;
-    event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-    list_initialize(&ndev->completed_rx_queue);
+    ndev->ctrl_ring = UINT16_MAX;
+    ndev->ctrl_lock = SPIN_LOCK_INITIAL_VALUE;
+    event_init(&ndev->ctrl_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 
     /* start from a known reset state */
     dev->bus()->virtio_reset_device();
@@ -484,7 +859,24 @@ status_t virtio_net_init(virtio_device *dev) {
     uint64_t host_features = dev->bus()->virtio_read_host_feature_word_64(0);
     dump_feature_bits(host_features);
 
-    // Negotiate the small set of features this driver actually depends on.
+    // A queue pair per cpu if the device can steer flows between them, which is set up over
+    // the control ring. That ring comes after every pair the device has, so those have to fit.
+    const uint cpus = virtio_net_active_cpus();
+    uint max_pairs = 1;
+    if ((host_features & VIRTIO_NET_F_CTRL_VQ) && (host_features & VIRTIO_NET_F_MQ) && cpus > 1) {
+        max_pairs = dev->config_read16(offsetof(virtio_net_config, max_virtqueue_pairs));
+        if (max_pairs > MAX_QUEUE_PAIRS) {
+            dprintf(INFO, "virtio-net: device has %u queue pairs, more than the %u supported\n",
+                    max_pairs, MAX_QUEUE_PAIRS);
+            max_pairs = 1;
+        }
+    }
+    ndev->queue_pairs = MAX(MIN(max_pairs, cpus), 1U);
+    const bool use_rss = ndev->queue_pairs > 1 && modern && (host_features & VIRTIO_NET_F_RSS);
+
+    uint rx_depth = virtio_net_rx_depth(ndev->queue_pairs);
+
+    // Negotiate the features this driver depends on, and the offloads it knows how to use.
     uint32_t guest_features = 0;
     if (host_features & VIRTIO_NET_F_MAC) {
         guest_features |= VIRTIO_NET_F_MAC;
@@ -495,47 +887,153 @@ status_t virtio_net_init(virtio_device *dev) {
     if (host_features & VIRTIO_NET_F_GUEST_CSUM) {
         guest_features |= VIRTIO_NET_F_GUEST_CSUM;
     }
+    if (host_features & VIRTIO_NET_F_MRG_RXBUF) {
+        guest_features |= VIRTIO_NET_F_MRG_RXBUF;
+    }
+    if (host_features & VIRTIO_NET_F_CSUM) {
+        guest_features |= VIRTIO_NET_F_CSUM;
+
+        // segmentation offload needs the device to do the checksums too
+        if (host_features & VIRTIO_NET_F_HOST_TSO4) {
+            guest_features |= VIRTIO_NET_F_HOST_TSO4;
+        }
+    }
+    // large receives are only taken spread over mergeable buffers, not in 64KB ones of their own,
+    // and only if each queue has enough of them posted to hold one
+    const bool rx_fits_64k = rx_depth * (PKTBUF_SIZE - sizeof(virtio_net_hdr)) > 0x10000 + 14;
+    if ((guest_features & VIRTIO_NET_F_GUEST_CSUM) && (guest_features & VIRTIO_NET_F_MRG_RXBUF) &&
+            (host_features & VIRTIO_NET_F_GUEST_TSO4) && rx_fits_64k) {
+        guest_features |= VIRTIO_NET_F_GUEST_TSO4;
+    }
+    if (ndev->queue_pairs > 1) {
+        guest_features |= VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ;
+    }
+    // Only event idx is of use here, the chains are short enough that indirect tables
+    // would cost the device an extra read for no saving in the ring.
+    guest_features |= dev->negotiate_ring_features(static_cast<uint32_t>(host_features),
+                                                     1u << VIRTIO_RING_F_EVENT_IDX);
     dev->bus()->virtio_set_guest_features(0, guest_features);
-    dprintf(INFO, "virtio-net: guest features 0x%x%s%s%s\n",
+    // RSS is up in the second word, along with VERSION_1 and packed rings
+    uint32_t guest_features_word1 = dev->negotiate_ring_features_word1(static_cast<uint32_t>(host_features >> 32));
+    if (use_rss) {
+        guest_features_word1 |= static_cast<uint32_t>(VIRTIO_NET_F_RSS >> 32);
+    }
+    dev->bus()->virtio_set_guest_features(1, guest_features_word1);
+    dprintf(INFO, "virtio-net: guest features 0x%x%s%s%s%s%s%s%s%s%s%s%s%s\n",
             guest_features,
             (guest_features & VIRTIO_NET_F_MAC) ? " MAC" : "",
             (guest_features & VIRTIO_NET_F_STATUS) ? " STATUS" : "",
-            (guest_features & VIRTIO_NET_F_GUEST_CSUM) ? " GUEST_CSUM" : "");
+            (guest_features & VIRTIO_NET_F_GUEST_CSUM) ? " GUEST_CSUM" : "",
+            (guest_features & VIRTIO_NET_F_MRG_RXBUF) ? " MRG_RXBUF" : "",
+            (guest_features & VIRTIO_NET_F_CSUM) ? " CSUM" : "",
+            (guest_features & VIRTIO_NET_F_HOST_TSO4) ? " HOST_TSO4" : "",
+            (guest_features & VIRTIO_NET_F_GUEST_TSO4) ? " GUEST_TSO4" : "",
+            (guest_features & VIRTIO_NET_F_CTRL_VQ) ? " CTRL_VQ" : "",
+            (guest_features & VIRTIO_NET_F_MQ) ? " MQ" : "",
+            (guest_features & (1u << VIRTIO_RING_F_EVENT_IDX)) ? " EVENT_IDX" : "",
+            use_rss ? " RSS" : "",
+            dev->ring_packed() ? " RING_PACKED" : "");
+
+    // the header only has num_buffers on modern devices or with mergeable buffers
+    ndev->mrg_rxbuf = (guest_features & VIRTIO_NET_F_MRG_RXBUF) != 0;
+    if (modern || ndev->mrg_rxbuf) {
+        ndev->hdr_len = sizeof(virtio_net_hdr);
+    } else {
+        ndev->hdr_len = offsetof(virtio_net_hdr, num_buffers);
+    }
+
+    // mergeable buffers may be filled to the end, otherwise each one has to hold a full frame
+    if (ndev->mrg_rxbuf) {
+        ndev->rx_buf_len = PKTBUF_SIZE;
+    } else {
+        ndev->rx_buf_len = ndev->hdr_len + VIRTIO_NET_MSS;
+    }
 
-    /* set our irq handler */
+    /* the netif is registered with the stack once the device is up, but the queues' pollers
+     * hang off of it from the start */
+    char str[32];
+    static volatile int ndev_count = 0;
+    snprintf(str, sizeof(str), "virtio-net-%d", atomic_add(&ndev_count, 1));
+    netif_create(&ndev->netif, str);
+
+    /* queue pair i uses rings 2i and 2i + 1 and is looked after by cpu i */
+    ndev->queues = static_cast<virtio_net_queue *>(calloc(ndev->queue_pairs, sizeof(virtio_net_queue)));
+    if (!ndev->queues)
+        return ERR_NO_MEMORY;
+
+    for (uint i = 0; i < ndev->queue_pairs; i++) {
+        virtio_net_queue *q = &ndev->queues[i];
+        q->ndev = ndev;
+        q->rx_ring = 2 * i;
+        q->tx_ring = 2 * i + 1;
+        q->cpu = i;
+        q->lock = SPIN_LOCK_INITIAL_VALUE;
+        netif_poll_init(&q->poll, &ndev->netif, &virtio_net_poll_ops, q, NETIF_POLL_BUDGET, q->cpu);
+        list_initialize(&q->completed_rx_queue);
+    }
+
+    /* set our irq handler, the data rings only signal their queue's poll */
     dev->set_irq_callbacks(&virtio_net_irq_driver_callback, nullptr);
     dev->bus()->unmask_interrupt();
 
-    /* allocate a pair of virtio rings */
-    dev->virtio_alloc_ring(RING_RX, RX_RING_SIZE); // rx
-    dev->virtio_alloc_ring(RING_TX, TX_RING_SIZE); // tx
+    /* allocate a pair of virtio rings for each queue, and the control ring */
+    for (uint i = 0; i < ndev->queue_pairs; i++) {
+        virtio_net_queue *q = &ndev->queues[i];
+        dev->virtio_alloc_ring(q->rx_ring, RX_RING_SIZE);
+        dev->virtio_alloc_ring(q->tx_ring, TX_RING_SIZE);
+        dev->set_ring_polled(q->rx_ring, &virtio_net_ring_notify);
+        dev->set_ring_polled(q->tx_ring, &virtio_net_ring_notify);
+
+        /* have the interrupts for the queue go to its cpu, if the bus can do that */
+        if (ndev->queue_pairs > 1) {
+            dev->bus()->set_ring_irq_cpu(q->rx_ring, q->cpu);
+            dev->bus()->set_ring_irq_cpu(q->tx_ring, q->cpu);
+        }
+    }
+    if (guest_features & VIRTIO_NET_F_CTRL_VQ) {
+        ndev->ctrl_ring = 2 * max_pairs;
+        dev->virtio_alloc_ring(ndev->ctrl_ring, CTRL_RING_SIZE);
+    }
 
     /* set DRIVER_OK */
     dev->bus()->virtio_status_driver_ok();
 
-    /* start the rx worker thread */
-    thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, static_cast<void *>(ndev), HIGH_PRIORITY, DEFAULT_STACK_SIZE));
+    /* turn on the rest of the queues, falling back to the first one if the device won't.
+     * Done before any rx buffers go out so they're only spread over the queues in use. */
+    if (ndev->queue_pairs > 1) {
+        status_t err = virtio_net_set_queue_pairs(ndev, use_rss);
+        if (err != NO_ERROR) {
+            dprintf(INFO, "virtio-net: failed to enable %u queue pairs (%d)\n", ndev->queue_pairs, err);
+            ndev->queue_pairs = 1;
+            rx_depth = virtio_net_rx_depth(1);
+        }
+    }
 
-    /* queue up a bunch of rxes */
-    for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
-        pktbuf_t *p = pktbuf_alloc();
-        if (p) {
-            virtio_net_queue_rx(ndev, p, false);
+    /* queue up a bunch of rxes on each queue, kicking each all at once */
+    for (uint i = 0; i < ndev->queue_pairs; i++) {
+        virtio_net_queue *q = &ndev->queues[i];
+        for (uint j = 0; j < rx_depth; j++) {
+            pktbuf_t *p = pktbuf_alloc();
+            if (p) {
+                virtio_net_queue_rx(q, p, false);
+            }
         }
+        dev->virtio_kick(q->rx_ring);
     }
-    /* kick all at once */
-    ndev->dev->bus()->virtio_kick(RING_RX);
+    dprintf(INFO, "virtio-net: %u queue pair%s, %u rx buffers each\n", ndev->queue_pairs,
+            ndev->queue_pairs > 1 ? "s" : "", rx_depth);
 
-    /* construct and register the minip netif interface */
-    char str[32];
-    static volatile int ndev_count = 0;
-    snprintf(str, sizeof(str), "virtio-net-%d", atomic_add(&ndev_count, 1));
-    netif_create(&ndev->netif, str);
+    /* register the minip netif interface */
     uint8_t mac[6];
     virtio_net_get_mac_addr(ndev, mac);
     netif_set_eth(&ndev->netif, virtio_net_send_minip_pkt, ndev, mac);
+    if (guest_features & VIRTIO_NET_F_CSUM) {
+        ndev->netif.flags |= NETIF_FLAG_TX_CKSUM;
+    }
+    if (guest_features & VIRTIO_NET_F_HOST_TSO4) {
+        ndev->netif.flags |= NETIF_FLAG_TX_TSO4;
+    }
     netif_register(&ndev->netif);
 
     return NO_ERROR;
 }
-
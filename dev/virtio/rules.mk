@@ -8,4 +8,9 @@ MODULE_SRCS += $(LOCAL_DIR)/virtio-mmio-bus.cpp
 MODULE_SRCS += $(LOCAL_DIR)/virtio-pci-bus.cpp
 MODULE_SRCS += $(LOCAL_DIR)/virtio.cpp
 
+# Set to 1 to take packed rings from devices that offer them, to compare them with
+# split rings. Off until they've been run against a real device or qemu.
+VIRTIO_PACKED_RING ?= 0
+MODULE_DEFINES += VIRTIO_PACKED_RING=$(VIRTIO_PACKED_RING)
+
 include make/module.mk
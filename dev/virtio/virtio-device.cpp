@@ -13,10 +13,14 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <lk/pow2.h>
 #include <lk/reg.h>
 #include <arch/ops.h>
+#include <inttypes.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <kernel/mutex.h>
 #include <dev/virtio/virtio-mmio-bus.h>
 
 #if WITH_KERNEL_VM
@@ -27,6 +31,53 @@
 
 #define LOCAL_TRACE 0
 
+/* every device, for the debug console */
+static struct list_node device_list = LIST_INITIAL_VALUE(device_list);
+static mutex_t device_list_lock = MUTEX_INITIAL_VALUE(device_list_lock);
+
+virtio_device::virtio_device(virtio_bus *bus) : bus_(bus) {
+    mutex_acquire(&device_list_lock);
+    list_add_tail(&device_list, &node_.node);
+    mutex_release(&device_list_lock);
+}
+
+virtio_device::~virtio_device() {
+    mutex_acquire(&device_list_lock);
+    list_delete(&node_.node);
+    mutex_release(&device_list_lock);
+
+    delete bus_;
+}
+
+/* zeroed, physically contiguous memory shared with the device */
+static status_t alloc_shared_memory(const char *name, size_t size, void **va, paddr_t *pa) {
+#if WITH_KERNEL_VM
+    void *vptr;
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), name, size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    if (err < 0)
+        return ERR_NO_MEMORY;
+
+    /* compute the physical address */
+    paddr_t paddr = vaddr_to_paddr(vptr);
+    if (paddr == 0) {
+        return ERR_NO_MEMORY;
+    }
+#else
+    void *vptr = memalign(PAGE_SIZE, size);
+    if (!vptr)
+        return ERR_NO_MEMORY;
+
+    paddr_t paddr = (paddr_t)vptr;
+#endif
+
+    // Shared structures must start from a known state (flags/idx/event fields all zero).
+    memset(vptr, 0, size);
+
+    *va = vptr;
+    *pa = paddr;
+    return NO_ERROR;
+}
+
 void virtio_device::virtio_free_desc(uint ring_index, uint16_t desc_index) {
     LTRACEF("dev %p ring %u index %u free_count %u\n", this, ring_index, desc_index, ring_[ring_index].free_count);
 
@@ -103,6 +154,13 @@ void virtio_device::virtio_submit_chain(uint ring_index, uint16_t desc_index) {
     DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
     DEBUG_ASSERT(desc_index < ring_len_[ring_index]);
 
+    ring_stats_[ring_index].submits++;
+
+    if (packed_) {
+        submit_packed(ring_index, desc_index);
+        return;
+    }
+
     vring &ring = ring_[ring_index];
 
     /* add the chain to the available list */
@@ -121,6 +179,190 @@ void virtio_device::virtio_submit_chain(uint ring_index, uint16_t desc_index) {
 #endif
 }
 
+/* copy a chain into the packed ring, each descriptor in the slot after the last */
+void virtio_device::submit_packed(uint ring_index, uint16_t desc_index) {
+    vring &ring = ring_[ring_index];
+    vring_packed &packed = packed_ring_[ring_index];
+    const bool modern = config_is_modern();
+
+    uint16_t head = packed.next_avail;
+    uint16_t head_flags = 0;
+    uint16_t count = 0;
+    for (uint16_t i = desc_index;;) {
+        const vring_desc *desc = &ring.desc[i];
+        uint16_t flags = vring_desc_read_flags(desc, modern);
+        DEBUG_ASSERT(!(flags & VRING_DESC_F_INDIRECT));
+
+        /* every descriptor carries the index of the chain's first as its id */
+        vring_packed_desc *slot = &packed.desc[packed.next_avail];
+        vring_packed_desc_write(slot, vring_desc_read_addr(desc, modern), vring_desc_read_len(desc, modern), desc_index);
+
+        uint16_t slot_flags = (flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE)) |
+                              vring_packed_avail_flags(packed.avail_wrap);
+        if (count == 0) {
+            head_flags = slot_flags;
+        } else {
+            vring_packed_desc_write_flags(slot, slot_flags);
+        }
+        count++;
+
+        if (++packed.next_avail == packed.num) {
+            packed.next_avail = 0;
+            packed.avail_wrap = !packed.avail_wrap;
+        }
+
+        if (!(flags & VRING_DESC_F_NEXT))
+            break;
+        i = vring_desc_read_next(desc, modern);
+    }
+
+    // The device may look at the first descriptor at any time, so it is made available
+    // last, once the rest of the chain is visible.
+    wmb();
+    vring_packed_desc_write_flags(&packed.desc[head], head_flags);
+    packed.avail_count += count;
+}
+
+bool virtio_device::kick_needed_packed(uint ring_index) {
+    vring_packed &packed = packed_ring_[ring_index];
+
+    uint16_t added = packed.avail_count - packed.kicked_count;
+    packed.kicked_count = packed.avail_count;
+
+    // as for split rings, the descriptors have to be visible before looking
+    mb();
+
+    uint16_t off_wrap, flags;
+    vring_packed_event_read(packed.device, &off_wrap, &flags);
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC) {
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+
+    /* the slot the device wants to hear about, taken back a lap if it is from the last one */
+    uint16_t event = off_wrap & ~(1u << VRING_PACKED_EVENT_F_WRAP_CTR);
+    bool wrap = off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR;
+    if (wrap != packed.avail_wrap) {
+        event -= packed.num;
+    }
+
+    return vring_need_event(event, packed.next_avail, packed.next_avail - added);
+}
+
+void virtio_device::virtio_kick(uint ring_index) {
+    DEBUG_ASSERT(ring_active(ring_index));
+
+    if (packed_) {
+        if (kick_needed_packed(ring_index)) {
+            ring_stats_[ring_index].kicks++;
+            bus_->virtio_kick(ring_index);
+        }
+        return;
+    }
+
+    vring &ring = ring_[ring_index];
+    const bool modern = config_is_modern();
+
+    uint16_t old_idx = ring.kicked_avail;
+    uint16_t new_idx = vring_avail_read_idx(ring.avail, modern);
+    ring.kicked_avail = new_idx;
+
+    // The new avail idx has to be visible before looking at whether the device wants
+    // to hear about it, or it may go idle having seen neither.
+    mb();
+
+    bool kick;
+    if (event_idx_) {
+        /* only if the device's avail event is one of the entries added since the last kick */
+        kick = vring_need_event(vring_read_avail_event(&ring, modern), new_idx, old_idx);
+    } else {
+        kick = !(vring_used_read_flags(ring.used, modern) & VRING_USED_F_NO_NOTIFY);
+    }
+
+    if (kick) {
+        ring_stats_[ring_index].kicks++;
+        bus_->virtio_kick(ring_index);
+    }
+}
+
+uint32_t virtio_device::negotiate_ring_features(uint32_t host_features, uint32_t wanted) {
+    uint32_t features = host_features & wanted & (VIRTIO_F_EVENT_IDX | VIRTIO_F_INDIRECT_DESC);
+
+    event_idx_ = features & VIRTIO_F_EVENT_IDX;
+    indirect_ = features & VIRTIO_F_INDIRECT_DESC;
+
+    return features;
+}
+
+uint32_t virtio_device::negotiate_ring_features_word1(uint32_t host_features_word1, uint32_t wanted) {
+    constexpr uint32_t version1 = static_cast<uint32_t>(VIRTIO_F_VERSION_1 >> 32);
+
+    uint32_t features = host_features_word1 & version1;
+
+    packed_ = false;
+#if VIRTIO_PACKED_RING
+    constexpr uint32_t packed = static_cast<uint32_t>(VIRTIO_F_RING_PACKED >> 32);
+
+    /* packed rings are little endian, they come with VERSION_1 */
+    if ((features & version1) && config_is_modern() && (host_features_word1 & wanted & packed)) {
+        features |= packed;
+        packed_ = true;
+    }
+#endif
+
+    return features;
+}
+
+status_t virtio_device::virtio_alloc_indirect(uint ring_index, uint16_t count) {
+    DEBUG_ASSERT(ring_active(ring_index));
+    DEBUG_ASSERT(count > 0);
+
+    if (!indirect_ || packed_)
+        return ERR_NOT_SUPPORTED;
+    if (indirect_table_[ring_index])
+        return ERR_ALREADY_EXISTS;
+
+    size_t size = ROUNDUP((size_t)ring_len_[ring_index] * count * sizeof(vring_desc), PAGE_SIZE);
+
+    void *vptr;
+    paddr_t pa;
+    status_t err = alloc_shared_memory("virtio_indirect", size, &vptr, &pa);
+    if (err < 0)
+        return err;
+
+    LTRACEF("ring %u: %u indirect entries per descriptor at va %p pa 0x%lx\n", ring_index, count, vptr, pa);
+
+    indirect_table_[ring_index] = (vring_desc *)vptr;
+    indirect_pa_[ring_index] = pa;
+    indirect_len_[ring_index] = count;
+
+    return NO_ERROR;
+}
+
+vring_desc *virtio_device::virtio_indirect_table(uint ring_index, uint16_t desc_index, uint16_t *count) {
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(desc_index < ring_len_[ring_index]);
+
+    if (!indirect_table_[ring_index])
+        return nullptr;
+
+    if (count)
+        *count = indirect_len_[ring_index];
+    return &indirect_table_[ring_index][(size_t)desc_index * indirect_len_[ring_index]];
+}
+
+void virtio_device::virtio_set_indirect(uint ring_index, uint16_t desc_index, uint16_t count) {
+    DEBUG_ASSERT(indirect_table_[ring_index]);
+    DEBUG_ASSERT(count > 0 && count <= indirect_len_[ring_index]);
+
+    const bool modern = config_is_modern();
+    paddr_t table_pa = indirect_pa_[ring_index] + (size_t)desc_index * indirect_len_[ring_index] * sizeof(vring_desc);
+
+    vring_desc *desc = &ring_[ring_index].desc[desc_index];
+    vring_desc_write_addr(desc, table_pa, modern);
+    vring_desc_write_len(desc, count * sizeof(vring_desc), modern);
+    vring_desc_write_flags(desc, VRING_DESC_F_INDIRECT, modern);
+}
+
 status_t virtio_device::virtio_alloc_ring(uint index, uint16_t len) {
     LTRACEF("dev %p, index %u, len %u\n", this, index, len);
 
@@ -134,97 +376,289 @@ status_t virtio_device::virtio_alloc_ring(uint index, uint16_t len) {
 
     vring &ring = ring_[index];
 
+    if (packed_) {
+        return alloc_packed_ring(index, len);
+    }
+
     /* allocate a ring */
     size_t size = vring_size(len, PAGE_SIZE);
     LTRACEF("need %zu bytes\n", size);
 
-#if WITH_KERNEL_VM
     void *vptr;
-    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    paddr_t pa;
+    status_t err = alloc_shared_memory("virtio_ring", size, &vptr, &pa);
     if (err < 0)
-        return ERR_NO_MEMORY;
+        return err;
 
-    LTRACEF("allocated virtio_ring at va %p\n", vptr);
+    LTRACEF("virtio_ring at va %p pa 0x%lx\n", vptr, pa);
 
-    /* compute the physical address */
-    paddr_t pa;
-    pa = vaddr_to_paddr(vptr);
-    if (pa == 0) {
-        return ERR_NO_MEMORY;
+    /* initialize the ring */
+    vring_init(&ring, len, vptr, PAGE_SIZE);
+    ring.free_list = 0xffff;
+    ring.free_count = 0;
+    ring_len_[index] = len;
+
+    /* add all the descriptors to the free list */
+    for (uint i = 0; i < len; i++) {
+        virtio_free_desc(index, i);
     }
 
-    // Rings must start from a known state (flags/idx/event fields all zero).
-    memset(vptr, 0, size);
+    /* register the ring with the device */
+    bus()->register_ring(PAGE_SIZE, index, len, PAGE_SIZE, pa / PAGE_SIZE);
 
-    LTRACEF("virtio_ring at pa 0x%lx\n", pa);
-#else
-    void *vptr = memalign(PAGE_SIZE, size);
-    if (!vptr)
+    /* mark the ring active */
+    active_rings_bitmap_ |= (1u << index);
+
+    return NO_ERROR;
+}
+
+/* the device gets the packed ring, and ring_ a table of split descriptors for the driver */
+status_t virtio_device::alloc_packed_ring(uint index, uint16_t len) {
+    vring &ring = ring_[index];
+    vring_packed &packed = packed_ring_[index];
+
+    auto *table = static_cast<vring_desc *>(calloc(len, sizeof(vring_desc)));
+    if (!table)
         return ERR_NO_MEMORY;
 
-    LTRACEF("ptr %p\n", vptr);
-    memset(vptr, 0, size);
+    void *vptr;
+    paddr_t pa;
+    status_t err = alloc_shared_memory("virtio_ring", ROUNDUP(vring_packed_size(len), PAGE_SIZE), &vptr, &pa);
+    if (err < 0) {
+        free(table);
+        return err;
+    }
 
-    /* compute the physical address */
-    paddr_t pa = (paddr_t)vptr;
-#endif
+    LTRACEF("packed virtio_ring at va %p pa 0x%lx\n", vptr, pa);
 
-    /* initialize the ring */
-    vring_init(&ring, len, vptr, PAGE_SIZE);
+    vring_packed_init(&packed, len, vptr);
+
+    ring.num = len;
+    ring.num_mask = len - 1;
     ring.free_list = 0xffff;
     ring.free_count = 0;
+    ring.last_used = 0;
+    ring.kicked_avail = 0;
+    ring.desc = table;
+    ring.avail = nullptr;
+    ring.used = nullptr;
     ring_len_[index] = len;
 
-    /* add all the descriptors to the free list */
     for (uint i = 0; i < len; i++) {
         virtio_free_desc(index, i);
     }
 
-    /* register the ring with the device */
-    bus()->register_ring(PAGE_SIZE, index, len, PAGE_SIZE, pa / PAGE_SIZE);
+    paddr_t driver_pa = pa + ((uintptr_t)packed.driver - (uintptr_t)vptr);
+    paddr_t device_pa = pa + ((uintptr_t)packed.device - (uintptr_t)vptr);
+    err = bus()->register_ring_areas(index, len, pa, driver_pa, device_pa);
+    if (err < 0)
+        return err;
 
-    /* mark the ring active */
-    active_rings_bitmap_ |= (1 << index);
+    active_rings_bitmap_ |= (1u << index);
 
     return NO_ERROR;
 }
 
-handler_return virtio_device::handle_queue_interrupt() {
-    LTRACE_ENTRY;
-    handler_return ret = INT_NO_RESCHEDULE;
+/* hand up to budget used entries of a ring to the driver, returning how many */
+uint virtio_device::process_used(uint r, uint budget, handler_return *ret) {
+    uint count = packed_ ? process_used_packed(r, budget, ret) : process_used_split(r, budget, ret);
+    ring_stats_[r].used += count;
+    return count;
+}
 
-    /* cycle through all the active rings */
-    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
-        if ((active_rings_bitmap_ & (1<<r)) == 0)
-            continue;
+uint virtio_device::process_used_split(uint r, uint budget, handler_return *ret) {
+    vring &ring = ring_[r];
+    const bool modern = config_is_modern();
 
-        vring &ring = ring_[r];
-        const bool modern = config_is_modern();
+    LTRACEF("desc %p, avail %p, used %p\n", ring.desc, ring.avail, ring.used);
+    LTRACEF("ring %u: used flags 0x%hx idx 0x%hx last_used 0x%hx\n", r,
+        vring_used_read_flags(ring.used, modern), vring_used_read_idx(ring.used, modern), ring.last_used);
+
+    uint count = 0;
+    uint16_t cur_idx = vring_used_read_idx(ring.used, modern);
+    // Ensure device writes to used elements are visible after observing used->idx.
+    rmb();
+    for (uint16_t used_idx = ring.last_used; used_idx != cur_idx && count < budget; ++used_idx) {
+        uint i = used_idx & ring.num_mask;
+        LTRACEF("looking at idx %u\n", i);
+
+        // process chain
+        vring_used_elem used_elem = {
+            .id = vring_used_read_elem_id(ring.used, i, modern),
+            .len = vring_used_read_elem_len(ring.used, i, modern),
+        };
+        LTRACEF("id %u, len %u\n", used_elem.id, used_elem.len);
+
+        DEBUG_ASSERT(irq_driver_callback_);
+        if (irq_driver_callback_(this, r, &used_elem) == INT_RESCHEDULE) {
+            *ret = INT_RESCHEDULE;
+        }
+
+        ring.last_used++;
+        count++;
+    }
+
+    return count;
+}
 
-        LTRACEF("desc %p, avail %p, used %p\n", ring.desc, ring.avail, ring.used);
-        LTRACEF("ring %u: used flags 0x%hx idx 0x%hx last_used 0x%hx\n", r,
-            vring_used_read_flags(ring.used, modern), vring_used_read_idx(ring.used, modern), ring.last_used);
+uint virtio_device::process_used_packed(uint r, uint budget, handler_return *ret) {
+    vring &ring = ring_[r];
+    vring_packed &packed = packed_ring_[r];
+    const bool modern = config_is_modern();
 
-        uint16_t cur_idx = vring_used_read_idx(ring.used, modern);
-        // Ensure device writes to used elements are visible after observing used->idx.
+    uint count = 0;
+    while (count < budget) {
+        const vring_packed_desc *slot = &packed.desc[packed.last_used];
+        if (!vring_packed_desc_is_used(slot, packed.used_wrap))
+            break;
+        // Ensure the rest of the device's write of the descriptor is visible after its flags.
         rmb();
-        for (uint16_t used_idx = ring.last_used; used_idx != cur_idx; ++used_idx) {
-            uint i = used_idx & ring.num_mask;
-            LTRACEF("looking at idx %u\n", i);
-
-            // process chain
-            vring_used_elem used_elem = {
-                .id = vring_used_read_elem_id(ring.used, i, modern),
-                .len = vring_used_read_elem_len(ring.used, i, modern),
-            };
-            LTRACEF("id %u, len %u\n", used_elem.id, used_elem.len);
-
-            DEBUG_ASSERT(irq_driver_callback_);
-            if (irq_driver_callback_(this, r, &used_elem) == INT_RESCHEDULE) {
-                ret = INT_RESCHEDULE;
-            }
 
-            ring.last_used++;
+        vring_used_elem used_elem = {
+            .id = vring_packed_desc_read_id(slot),
+            .len = vring_packed_desc_read_len(slot),
+        };
+        LTRACEF("slot %u: id %u, len %u\n", packed.last_used, used_elem.id, used_elem.len);
+        DEBUG_ASSERT(used_elem.id < ring_len_[r]);
+
+        /* the chain took a slot per descriptor, count them before the driver frees them */
+        uint16_t slots = 1;
+        for (uint16_t i = used_elem.id; vring_desc_read_flags(&ring.desc[i], modern) & VRING_DESC_F_NEXT; slots++) {
+            i = vring_desc_read_next(&ring.desc[i], modern);
+        }
+
+        DEBUG_ASSERT(irq_driver_callback_);
+        if (irq_driver_callback_(this, r, &used_elem) == INT_RESCHEDULE) {
+            *ret = INT_RESCHEDULE;
+        }
+
+        packed.last_used += slots;
+        if (packed.last_used >= packed.num) {
+            packed.last_used -= packed.num;
+            packed.used_wrap = !packed.used_wrap;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+bool virtio_device::ring_has_used(uint r) {
+    if (packed_) {
+        const vring_packed &packed = packed_ring_[r];
+        return vring_packed_desc_is_used(&packed.desc[packed.last_used], packed.used_wrap);
+    }
+
+    return vring_used_read_idx(ring_[r].used, config_is_modern()) != ring_[r].last_used;
+}
+
+void virtio_device::ring_write_used_event(uint r) {
+    if (packed_) {
+        vring_packed &packed = packed_ring_[r];
+        uint16_t off_wrap = packed.last_used | (packed.used_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+        vring_packed_event_write_off_wrap(packed.driver, off_wrap);
+        // the device mustn't go by the flags before it sees the slot they refer to
+        wmb();
+        vring_packed_event_write_flags(packed.driver, VRING_PACKED_EVENT_FLAG_DESC);
+    } else {
+        vring_write_used_event(&ring_[r], ring_[r].last_used, config_is_modern());
+    }
+}
+
+handler_return virtio_device::handle_ring_interrupt(uint r) {
+    DEBUG_ASSERT(r < MAX_VIRTIO_RINGS);
+    handler_return ret = INT_NO_RESCHEDULE;
+
+    if (!ring_active(r))
+        return ret;
+
+    ring_stats_[r].interrupts++;
+
+    /* a polled ring is only processed by its driver, just let it know */
+    if (polled_rings_bitmap_ & (1u << r)) {
+        DEBUG_ASSERT(ring_notify_callback_);
+        return ring_notify_callback_(this, r);
+    }
+
+    for (;;) {
+        process_used(r, UINT_MAX, &ret);
+        if (!event_idx_)
+            break;
+
+        // Ask for an interrupt on the next used entry. Anything the device used before
+        // it could see that won't interrupt, so check again once it's visible.
+        ring_write_used_event(r);
+        mb();
+        if (!ring_has_used(r))
+            break;
+    }
+
+    return ret;
+}
+
+void virtio_device::set_ring_polled(uint ring_index, ring_notify_callback notify) {
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(notify);
+
+    ring_notify_callback_ = notify;
+    polled_rings_bitmap_ |= (1u << ring_index);
+}
+
+uint virtio_device::poll_ring(uint ring_index, uint budget) {
+    DEBUG_ASSERT(ring_active(ring_index));
+    DEBUG_ASSERT(polled_rings_bitmap_ & (1u << ring_index));
+
+    handler_return ret = INT_NO_RESCHEDULE;
+    return process_used(ring_index, budget, &ret);
+}
+
+void virtio_device::ring_disable_interrupt(uint ring_index) {
+    DEBUG_ASSERT(ring_active(ring_index));
+
+    if (packed_) {
+        vring_packed_event_write_flags(packed_ring_[ring_index].driver, VRING_PACKED_EVENT_FLAG_DISABLE);
+        return;
+    }
+
+    vring &ring = ring_[ring_index];
+    const bool modern = config_is_modern();
+
+    /* only a hint, the device may still interrupt for a while */
+    if (event_idx_) {
+        /* an event a full lap of the index away, which polling will have moved before */
+        vring_write_used_event(&ring, ring.last_used - 1, modern);
+    } else {
+        vring_avail_write_flags(ring.avail, vring_avail_read_flags(ring.avail, modern) | VRING_AVAIL_F_NO_INTERRUPT, modern);
+    }
+}
+
+bool virtio_device::ring_enable_interrupt(uint ring_index) {
+    DEBUG_ASSERT(ring_active(ring_index));
+
+    vring &ring = ring_[ring_index];
+    const bool modern = config_is_modern();
+
+    if (event_idx_) {
+        ring_write_used_event(ring_index);
+    } else if (packed_) {
+        vring_packed_event_write_flags(packed_ring_[ring_index].driver, VRING_PACKED_EVENT_FLAG_ENABLE);
+    } else {
+        vring_avail_write_flags(ring.avail, vring_avail_read_flags(ring.avail, modern) & ~VRING_AVAIL_F_NO_INTERRUPT, modern);
+    }
+
+    /* anything the device used before it saw the flag won't interrupt, so look for it */
+    mb();
+    return ring_has_used(ring_index);
+}
+
+handler_return virtio_device::handle_queue_interrupt() {
+    LTRACE_ENTRY;
+    handler_return ret = INT_NO_RESCHEDULE;
+
+    /* cycle through all the active rings */
+    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+        if (handle_ring_interrupt(r) == INT_RESCHEDULE) {
+            ret = INT_RESCHEDULE;
         }
     }
 
@@ -242,3 +676,31 @@ handler_return virtio_device::handle_config_interrupt() {
 
     return ret;
 }
+
+void virtio_device::dump_devices(bool reset) {
+    mutex_acquire(&device_list_lock);
+
+    device_node *node;
+    list_for_every_entry(&device_list, node, device_node, node) {
+        virtio_device *dev = node->dev;
+        printf("virtio device %p: %s bus, %s, %s rings%s%s\n", dev, dev->bus_->name(),
+               dev->bus_->virtio_is_legacy() ? "legacy" : "modern", dev->packed_ ? "packed" : "split",
+               dev->event_idx_ ? ", event idx" : "", dev->ring_indirect() ? ", indirect" : "");
+
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if (!dev->ring_active(r))
+                continue;
+
+            ring_stats &stats = dev->ring_stats_[r];
+            printf("\tring %u: len %u%s submits %" PRIu64 " kicks %" PRIu64 " interrupts %" PRIu64
+                   " used %" PRIu64 "\n", r, dev->ring_len_[r],
+                   (dev->polled_rings_bitmap_ & (1u << r)) ? " polled" : "",
+                   stats.submits, stats.kicks, stats.interrupts, stats.used);
+            if (reset) {
+                stats = {};
+            }
+        }
+    }
+
+    mutex_release(&device_list_lock);
+}
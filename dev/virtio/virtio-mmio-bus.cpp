@@ -172,7 +172,7 @@ void virtio_mmio_bus::virtio_kick(uint16_t ring_index) {
     virtio_mmio_write32(&mmio_config_->queue_notify, ring_index);
 }
 
-void virtio_mmio_bus::register_ring(uint32_t page_size, uint32_t queue_sel, uint32_t queue_num, uint32_t queue_align, uint32_t queue_pfn) {
+status_t virtio_mmio_bus::select_ring(uint32_t queue_sel, uint32_t queue_num) {
     DEBUG_ASSERT(mmio_config_);
 
     virtio_mmio_write32(&mmio_config_->queue_sel, queue_sel);
@@ -180,34 +180,53 @@ void virtio_mmio_bus::register_ring(uint32_t page_size, uint32_t queue_sel, uint
     uint32_t queue_num_max = virtio_mmio_read32(&mmio_config_->queue_num_max);
     if (queue_num_max == 0 || queue_num > queue_num_max) {
         printf("virtio-mmio: invalid queue size %u (max %u) for queue %u\n", queue_num, queue_num_max, queue_sel);
-        return;
+        return ERR_INVALID_ARGS;
     }
 
     virtio_mmio_write32(&mmio_config_->queue_num, queue_num);
+    return NO_ERROR;
+}
 
+void virtio_mmio_bus::register_ring(uint32_t page_size, uint32_t queue_sel, uint32_t queue_num, uint32_t queue_align, uint32_t queue_pfn) {
     if (mmio_version_ == 1) {
+        if (select_ring(queue_sel, queue_num) < 0) {
+            return;
+        }
         virtio_mmio_write32(&mmio_config_->guest_page_size, page_size);
         virtio_mmio_write32(&mmio_config_->queue_align, queue_align);
         virtio_mmio_write32(&mmio_config_->queue_pfn, queue_pfn);
         return;
     }
 
-    if (mmio_version_ == 2) {
-        uint64_t queue_pa = static_cast<uint64_t>(queue_pfn) * page_size;
-        uint64_t desc_pa = queue_pa;
-        uint64_t avail_pa = queue_pa + static_cast<uint64_t>(queue_num) * sizeof(vring_desc);
-        uint64_t used_pa = (avail_pa + sizeof(uint16_t) * (3 + queue_num) + queue_align - 1) &
-                           ~(static_cast<uint64_t>(queue_align) - 1);
-
-        virtio_mmio_write32(&mmio_config_->queue_ready, 0);
-        virtio_mmio_write32(&mmio_config_->queue_desc_low, static_cast<uint32_t>(desc_pa));
-        virtio_mmio_write32(&mmio_config_->queue_desc_high, static_cast<uint32_t>(desc_pa >> 32));
-        virtio_mmio_write32(&mmio_config_->queue_avail_low, static_cast<uint32_t>(avail_pa));
-        virtio_mmio_write32(&mmio_config_->queue_avail_high, static_cast<uint32_t>(avail_pa >> 32));
-        virtio_mmio_write32(&mmio_config_->queue_used_low, static_cast<uint32_t>(used_pa));
-        virtio_mmio_write32(&mmio_config_->queue_used_high, static_cast<uint32_t>(used_pa >> 32));
-        virtio_mmio_write32(&mmio_config_->queue_ready, 1);
+    uint64_t queue_pa = static_cast<uint64_t>(queue_pfn) * page_size;
+    uint64_t desc_pa = queue_pa;
+    uint64_t avail_pa = queue_pa + static_cast<uint64_t>(queue_num) * sizeof(vring_desc);
+    uint64_t used_pa = (avail_pa + sizeof(uint16_t) * (3 + queue_num) + queue_align - 1) &
+                       ~(static_cast<uint64_t>(queue_align) - 1);
+
+    register_ring_areas(queue_sel, queue_num, desc_pa, avail_pa, used_pa);
+}
+
+status_t virtio_mmio_bus::register_ring_areas(uint32_t queue_sel, uint32_t queue_num, uint64_t desc_pa, uint64_t driver_pa, uint64_t device_pa) {
+    if (mmio_version_ != 2) {
+        return ERR_NOT_SUPPORTED;
     }
+
+    status_t err = select_ring(queue_sel, queue_num);
+    if (err < 0) {
+        return err;
+    }
+
+    virtio_mmio_write32(&mmio_config_->queue_ready, 0);
+    virtio_mmio_write32(&mmio_config_->queue_desc_low, static_cast<uint32_t>(desc_pa));
+    virtio_mmio_write32(&mmio_config_->queue_desc_high, static_cast<uint32_t>(desc_pa >> 32));
+    virtio_mmio_write32(&mmio_config_->queue_avail_low, static_cast<uint32_t>(driver_pa));
+    virtio_mmio_write32(&mmio_config_->queue_avail_high, static_cast<uint32_t>(driver_pa >> 32));
+    virtio_mmio_write32(&mmio_config_->queue_used_low, static_cast<uint32_t>(device_pa));
+    virtio_mmio_write32(&mmio_config_->queue_used_high, static_cast<uint32_t>(device_pa >> 32));
+    virtio_mmio_write32(&mmio_config_->queue_ready, 1);
+
+    return NO_ERROR;
 }
 
 void dump_mmio_config(const volatile virtio_mmio_config *mmio) {
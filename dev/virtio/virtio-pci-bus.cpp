@@ -176,7 +176,7 @@ void virtio_pci_bus::virtio_set_guest_features(uint32_t word, uint32_t features)
 }
 
 void virtio_pci_bus::virtio_kick(uint16_t ring_index) {
-    DEBUG_ASSERT(ring_index < virtio_device::MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(ring_index < kMaxRings);
 
     uint16_t notify_off = queue_notify_off_[ring_index];
     if (notify_off == USHRT_MAX) {
@@ -195,35 +195,58 @@ void virtio_pci_bus::virtio_kick(uint16_t ring_index) {
 }
 
 void virtio_pci_bus::register_ring(uint32_t page_size, uint32_t queue_sel, uint32_t queue_num, uint32_t queue_align, uint32_t queue_pfn) {
-    auto *ccfg = common_config();
-
     // Using legacy split virtqueues packing strategy
     uint64_t ring_descriptor_paddr = static_cast<uint64_t>(queue_pfn) * page_size;
     uint64_t ring_available_paddr = ALIGN(ring_descriptor_paddr + static_cast<uint64_t>(16 * queue_num), 2);
     uint64_t ring_used_paddr = ALIGN(ring_available_paddr + 6 + static_cast<uint64_t>(2 * queue_num), queue_align);
 
-    LTRACEF("queue %u size %u pfn %#x paddr (%#" PRIx64 ", %#" PRIx64 ", %#" PRIx64 ")\n",
-             queue_sel, queue_num, queue_pfn, ring_descriptor_paddr, ring_available_paddr, ring_used_paddr);
+    LTRACEF("queue %u size %u pfn %#x\n", queue_sel, queue_num, queue_pfn);
+
+    register_ring_areas(queue_sel, queue_num, ring_descriptor_paddr, ring_available_paddr, ring_used_paddr);
+}
+
+status_t virtio_pci_bus::register_ring_areas(uint32_t queue_sel, uint32_t queue_num, uint64_t desc_pa, uint64_t driver_pa, uint64_t device_pa) {
+    auto *ccfg = common_config();
+
+    LTRACEF("queue %u size %u paddr (%#" PRIx64 ", %#" PRIx64 ", %#" PRIx64 ")\n",
+             queue_sel, queue_num, desc_pa, driver_pa, device_pa);
 
     ccfg->queue_select = queue_sel;
 
     LTRACEF("existing queue_size %u\n", ccfg->queue_size);
     LTRACEF("existing notify off %u\n", ccfg->queue_notify_off);
 
-    if (queue_sel < virtio_device::MAX_VIRTIO_RINGS) {
+    if (queue_sel < kMaxRings) {
         queue_notify_off_[queue_sel] = ccfg->queue_notify_off;
     }
 
     ccfg->queue_size = queue_num;
-    ccfg->queue_desc = ring_descriptor_paddr;
-    ccfg->queue_driver = ring_available_paddr;
-    ccfg->queue_device = ring_used_paddr;
+    ccfg->queue_desc = desc_pa;
+    ccfg->queue_driver = driver_pa;
+    ccfg->queue_device = device_pa;
     if (irq_mode_ == irq_mode::Msix) {
-        ccfg->queue_msix_vector = 0;
+        // give the ring its own vector if there are enough to go around
+        uint16_t vector = 0;
+        if (queue_sel < kMaxRings && queue_sel + 1 < msix_vectors_) {
+            vector = queue_sel + 1;
+        }
+        ccfg->queue_msix_vector = vector;
+
+        // the device reads back 0xffff if it could not take it
+        if (ccfg->queue_msix_vector != vector) {
+            vector = 0;
+            ccfg->queue_msix_vector = vector;
+        }
+        if (queue_sel < kMaxRings) {
+            ring_vector_[queue_sel] = vector;
+        }
+        LTRACEF("queue %u msix vector %u\n", queue_sel, vector);
     } else {
         ccfg->queue_msix_vector = 0xffff;
     }
     ccfg->queue_enable = 1;
+
+    return NO_ERROR;
 }
 
 handler_return virtio_pci_bus::virtio_pci_irq(void *arg) {
@@ -231,18 +254,23 @@ handler_return virtio_pci_bus::virtio_pci_irq(void *arg) {
 
     LTRACEF("dev %p, bus %p\n", bus->dev_, bus);
 
-    // With MSI-X, vector delivery itself is supposed to identify an interrupt,
-    // but the current MSI-X setup allocates one vector and maps both queue and
-    // config interrupts to it, so process both paths.
+    // With MSI-X, vector delivery itself identifies an interrupt. This is vector
+    // 0, which carries config changes and every ring that did not get a vector
+    // of its own, so process both paths.
     if (bus->irq_mode_ == irq_mode::Msix) {
         enum handler_return ret = INT_NO_RESCHEDULE;
 
-        auto _ret = bus->dev_->handle_queue_interrupt();
-        if (_ret == INT_RESCHEDULE) {
-            ret = _ret;
+        for (uint r = 0; r < kMaxRings; r++) {
+            if (bus->ring_vector_[r] != 0) {
+                continue;
+            }
+            auto _ret = bus->dev_->handle_ring_interrupt(r);
+            if (_ret == INT_RESCHEDULE) {
+                ret = _ret;
+            }
         }
 
-        _ret = bus->dev_->handle_config_interrupt();
+        auto _ret = bus->dev_->handle_config_interrupt();
         if (_ret == INT_RESCHEDULE) {
             ret = _ret;
         }
@@ -278,10 +306,42 @@ handler_return virtio_pci_bus::virtio_pci_irq(void *arg) {
     return ret;;
 }
 
+// A ring with an MSI-X vector of its own, on whichever cpu the vector was sent to.
+handler_return virtio_pci_bus::virtio_pci_ring_irq(void *arg) {
+    auto *ri = reinterpret_cast<ring_irq *>(arg);
+
+    LTRACEF("bus %p ring %u\n", ri->bus, ri->ring);
+
+    return ri->bus->dev_->handle_ring_interrupt(ri->ring);
+}
+
+void virtio_pci_bus::mask_interrupt() {
+    virtio_bus::mask_interrupt();
+    for (uint i = 1; i < msix_vectors_; i++) {
+        ::mask_interrupt(irq_base_ + i);
+    }
+}
+
+void virtio_pci_bus::unmask_interrupt() {
+    virtio_bus::unmask_interrupt();
+    for (uint i = 1; i < msix_vectors_; i++) {
+        ::unmask_interrupt(irq_base_ + i);
+    }
+}
+
+status_t virtio_pci_bus::set_ring_irq_cpu(uint16_t ring_index, uint cpu) {
+    if (irq_mode_ != irq_mode::Msix || ring_index >= kMaxRings || ring_vector_[ring_index] == 0) {
+        return ERR_NOT_SUPPORTED;
+    }
+
+    return pci_bus_mgr_set_msix_cpu(loc_, ring_vector_[ring_index], cpu);
+}
+
 status_t virtio_pci_bus::init(virtio_device *dev, pci_location_t loc, size_t index) {
     LTRACE_ENTRY;
 
     DEBUG_ASSERT(!dev_ && dev);
+    static_assert(kMaxRings == virtio_device::MAX_VIRTIO_RINGS);
 
     dev_ = dev;
     loc_ = loc;
@@ -408,10 +468,20 @@ common:
     // Prefer MSI-X, then MSI, then legacy IRQs.
     bool uses_msi = false;
     if (pci_bus_mgr_has_msix(loc_)) {
-        err = pci_bus_mgr_allocate_msix(loc_, 1, &irq_base);
+        // a vector per ring plus one for config changes if the device has them, then just the one
+        uint count = MIN(pci_bus_mgr_msix_table_count(loc_), kMaxRings + 1);
+        err = ERR_NO_RESOURCES;
+        if (count > 1) {
+            err = pci_bus_mgr_allocate_msix(loc_, count, &irq_base);
+        }
+        if (err != NO_ERROR) {
+            count = 1;
+            err = pci_bus_mgr_allocate_msix(loc_, count, &irq_base);
+        }
         if (err == NO_ERROR) {
             uses_msi = true;
             irq_mode_ = irq_mode::Msix;
+            msix_vectors_ = count;
         } else {
             printf("virtio: MSI-X allocation failed (%d), falling back to legacy IRQ\n", err);
         }
@@ -445,8 +515,16 @@ common:
         register_int_handler(irq_base, virtio_pci_irq, this);
     }
     set_irq(irq_base);
+    irq_base_ = irq_base;
     LTRACEF("IRQ number %#x\n", irq_base);
 
+    // the rest of the MSI-X vectors each go to one ring
+    for (uint i = 1; i < msix_vectors_; i++) {
+        ring_irq_[i - 1] = { this, static_cast<uint16_t>(i - 1) };
+        ::mask_interrupt(irq_base + i);
+        register_int_handler_msi(irq_base + i, virtio_pci_ring_irq, &ring_irq_[i - 1], true);
+    }
+
     return NO_ERROR;
 }
 
@@ -7,10 +7,13 @@
  */
 #include <dev/virtio.h>
 #include <dev/virtio/virtio_ring.h>
+#include <dev/virtio/virtio-device.h>
 
+#include <lk/console_cmd.h>
 #include <lk/debug.h>
 #include <lk/init.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include "virtio_priv.h"
@@ -43,4 +46,33 @@ void virtio_dump_device_independent_features_bits(uint64_t feature) {
 static void virtio_init(uint level) {
 }
 
+#if LK_DEBUGLEVEL > 0
+// Compare buses and ring layouts by the notifications a workload costs, for example
+// 'virtio reset', 'bio bench virtio0 10 4' and 'virtio stats' on an mmio and a pci
+// device, and again built with VIRTIO_PACKED_RING=1.
+static int cmd_virtio(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+        printf("usage:\n");
+        printf("%s stats\n", argv[0].str);
+        printf("%s reset\n", argv[0].str);
+        return -1;
+    }
+
+    if (!strcmp(argv[1].str, "stats")) {
+        virtio_device::dump_devices(false);
+    } else if (!strcmp(argv[1].str, "reset")) {
+        virtio_device::dump_devices(true);
+    } else {
+        printf("unrecognized subcommand\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("virtio", "virtio ring stats", &cmd_virtio)
+STATIC_COMMAND_END(virtio);
+#endif
+
 LK_INIT_HOOK(virtio, &virtio_init, LK_INIT_LEVEL_THREADING);
@@ -78,6 +78,8 @@ static int cmd_threadstats(int argc, const console_cmd_args *argv) {
         printf("\treschedules: %lu\n", thread_stats[i].reschedules);
 #if WITH_SMP
         printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+        printf("\tsteals: %lu\n", thread_stats[i].steals);
+        printf("\tbalances: %lu\n", thread_stats[i].balances);
 #endif
         printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
         printf("\tpreempts: %lu\n", thread_stats[i].preempts);
@@ -163,23 +165,33 @@ static int cmd_threadload(int argc, const console_cmd_args *argv) {
 
 #include <lib/evlog.h>
 
-static evlog_t kernel_evlog;
+static evlog_t kernel_evlog[SMP_MAX_CPUS];
 volatile bool kernel_evlog_enable;
 
 void kernel_evlog_init(void) {
-    evlog_init(&kernel_evlog, KERNEL_EVLOG_LEN, 4);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (evlog_init(&kernel_evlog[i], KERNEL_EVLOG_LEN, 4) < 0)
+            return;
+    }
 
     kernel_evlog_enable = true;
 }
 
 void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1) {
     if (kernel_evlog_enable) {
-        uint index = evlog_bump_head(&kernel_evlog);
+        /* only this cpu writes its log, so keeping interrupts off is enough */
+        arch_interrupt_saved_state_t state = arch_interrupt_save();
+
+        uint cpu = arch_curr_cpu_num();
+        evlog_t *e = &kernel_evlog[cpu];
+        uint index = evlog_bump_head(e);
 
-        kernel_evlog.items[index] = (uintptr_t)current_time_hires();
-        kernel_evlog.items[index+1] = (arch_curr_cpu_num() << 16) | id;
-        kernel_evlog.items[index+2] = arg0;
-        kernel_evlog.items[index+3] = arg1;
+        e->items[index] = (uintptr_t)current_time_hires();
+        e->items[index+1] = (cpu << 16) | id;
+        e->items[index+2] = arg0;
+        e->items[index+3] = arg1;
+
+        arch_interrupt_restore(state);
     }
 }
 
@@ -203,6 +215,9 @@ static void kevdump_cb(const uintptr_t *i) {
         case KERNEL_EVLOG_IRQ_EXIT:
             printf("%lu.%lu: irq exit  %lu\n", i[0], i[1] >> 16, i[2]);
             break;
+        case KERNEL_EVLOG_WAKEUP:
+            printf("%lu.%lu: wakeup thread %p on cpu %lu\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
         default:
             printf("%lu: unknown id 0x%lx 0x%lx 0x%lx\n", i[0], i[1], i[2], i[3]);
     }
@@ -210,7 +225,13 @@ static void kevdump_cb(const uintptr_t *i) {
 
 void kernel_evlog_dump(void) {
     kernel_evlog_enable = false;
-    evlog_dump(&kernel_evlog, &kevdump_cb);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!kernel_evlog[i].items)
+            continue;
+
+        printf("cpu %u:\n", i);
+        evlog_dump(&kernel_evlog[i], &kevdump_cb);
+    }
     kernel_evlog_enable = true;
 }
 
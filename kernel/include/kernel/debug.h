@@ -11,14 +11,18 @@
 
 __BEGIN_CDECLS
 
+#include <kernel/sched_trace.h>
 #include <lk/debug.h>
 
 // This file defines the kernel event log, which is a simple logging mechanism
 // for kernel events. It is primarily used for debugging and performance analysis.
+// Each cpu logs into its own ring with interrupts disabled, so adding an event
+// takes no locks.
 #if WITH_KERNEL_EVLOG
 
 #include <lib/evlog.h>
 
+// length of each cpu's log in words, 4 per event
 #ifndef KERNEL_EVLOG_LEN
 #define KERNEL_EVLOG_LEN 1024
 #endif
@@ -45,13 +49,23 @@ enum {
     KERNEL_EVLOG_TIMER_CALL,
     KERNEL_EVLOG_IRQ_ENTER,
     KERNEL_EVLOG_IRQ_EXIT,
+    KERNEL_EVLOG_WAKEUP,
 };
 
 #define KEVLOG_THREAD_SWITCH(from, to) kernel_evlog_add(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)(from), (uintptr_t)(to))
 #define KEVLOG_THREAD_PREEMPT(thread) kernel_evlog_add(KERNEL_EVLOG_PREEMPT, (uintptr_t)(thread), 0)
 #define KEVLOG_TIMER_TICK() kernel_evlog_add(KERNEL_EVLOG_TIMER_TICK, 0, 0)
 #define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)(ptr), (uintptr_t)(arg))
-#define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)(irqn), 0)
-#define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)(irqn), 0)
+#define KEVLOG_THREAD_WAKEUP(thread, cpu) kernel_evlog_add(KERNEL_EVLOG_WAKEUP, (uintptr_t)(thread), (uintptr_t)(cpu))
+
+// irq entry and exit also bracket an irq off section for the scheduler trace
+#define KEVLOG_IRQ_ENTER(irqn) do { \
+    SCHED_TRACE_IRQ_ENTER(); \
+    kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)(irqn), 0); \
+} while (0)
+#define KEVLOG_IRQ_EXIT(irqn) do { \
+    kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)(irqn), 0); \
+    SCHED_TRACE_IRQ_EXIT(); \
+} while (0)
 
 __END_CDECLS
@@ -0,0 +1,86 @@
+// Copyright (c) 2026 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <kernel/spinlock.h>
+#include <lk/compiler.h>
+#include <stdbool.h>
+
+__BEGIN_CDECLS
+
+// Lock classes for the core kernel spinlocks, from outermost to innermost.
+//
+// A lock may only be acquired while every other classed lock held by the cpu
+// belongs to a strictly lower class. In particular two locks of the same class
+// may never be nested with a blocking acquire; code that needs a second
+// scheduler lock (work stealing) must use spin_trylock_class().
+//
+//  LOCK_CLASS_THREAD      thread_lock: the thread list and thread lifecycle
+//                         (join/detach/exit) state.
+//  LOCK_CLASS_PORT        port_lock: port objects and their buffers.
+//  LOCK_CLASS_WAIT_QUEUE  per wait queue lock: the waiters on the queue and the
+//                         state of the object that embeds it (mutex, event, ...).
+//  LOCK_CLASS_SCHEDULER   per cpu run queue lock, held across context switches.
+//  LOCK_CLASS_TIMER       per cpu timer queue lock.
+enum lock_class {
+    LOCK_CLASS_NONE = 0,
+    LOCK_CLASS_THREAD,
+    LOCK_CLASS_PORT,
+    LOCK_CLASS_WAIT_QUEUE,
+    LOCK_CLASS_SCHEDULER,
+    LOCK_CLASS_TIMER,
+};
+
+// Runtime lock order checking, off by default. Enable in debug builds with
+// GLOBAL_DEFINES += WITH_KERNEL_LOCK_ORDER_CHECK=1
+#if WITH_KERNEL_LOCK_ORDER_CHECK
+
+void lock_order_acquire(const spin_lock_t *lock, enum lock_class lock_class);
+void lock_order_trylock(const spin_lock_t *lock, enum lock_class lock_class);
+void lock_order_release(const spin_lock_t *lock);
+
+// number of classed locks currently held by the local cpu
+uint lock_order_held_count(void);
+
+#else
+
+static inline void lock_order_acquire(const spin_lock_t *lock, enum lock_class lock_class) {}
+static inline void lock_order_trylock(const spin_lock_t *lock, enum lock_class lock_class) {}
+static inline void lock_order_release(const spin_lock_t *lock) {}
+
+#endif
+
+// classed versions of the basic spinlock routines; interrupts should already be disabled
+static inline void spin_lock_class(spin_lock_t *lock, enum lock_class lock_class) {
+    lock_order_acquire(lock, lock_class);
+    spin_lock(lock);
+}
+
+// Returns 0 on success, non-0 on failure
+static inline int spin_trylock_class(spin_lock_t *lock, enum lock_class lock_class) {
+    int ret = spin_trylock(lock);
+    if (ret == 0)
+        lock_order_trylock(lock, lock_class);
+    return ret;
+}
+
+static inline void spin_unlock_class(spin_lock_t *lock) {
+    lock_order_release(lock);
+    spin_unlock(lock);
+}
+
+static inline arch_interrupt_saved_state_t spin_lock_irqsave_class(spin_lock_t *lock, enum lock_class lock_class) {
+    arch_interrupt_saved_state_t state = sched_trace_interrupt_save();
+    spin_lock_class(lock, lock_class);
+    return state;
+}
+
+static inline void spin_unlock_irqrestore_class(spin_lock_t *lock, arch_interrupt_saved_state_t old_state) {
+    spin_unlock_class(lock);
+    sched_trace_interrupt_restore(old_state);
+}
+
+__END_CDECLS
@@ -20,9 +20,25 @@ __BEGIN_CDECLS
 
 #define MUTEX_MAGIC (0x6D757478)  // 'mutx'
 
+// Lock word states. An uncontended acquire or release is a single atomic
+// operation on the lock word and never touches the wait queue.
+#define MUTEX_UNLOCKED  0
+#define MUTEX_LOCKED    1 // held, nobody is waiting
+#define MUTEX_CONTENDED 2 // held, there may be threads in the wait queue
+
+// Number of times an acquiring thread polls the lock word while the holder is
+// running on another cpu, before it falls back to blocking. 0 disables spinning.
+#ifndef MUTEX_SPIN_COUNT
+#if WITH_SMP
+#define MUTEX_SPIN_COUNT 1000
+#else
+#define MUTEX_SPIN_COUNT 0
+#endif
+#endif
+
 typedef struct mutex {
     uint32_t magic;
-    int count;
+    volatile int val;
     thread_t *holder;
     wait_queue_t wait;
 } mutex_t;
@@ -32,7 +48,7 @@ typedef struct mutex {
 #define MUTEX_INITIAL_VALUE(m) \
 { \
     .magic = MUTEX_MAGIC, \
-    .count = 0, \
+    .val = MUTEX_UNLOCKED, \
     .holder = NULL, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
 }
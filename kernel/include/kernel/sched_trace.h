@@ -0,0 +1,81 @@
+// Copyright (c) 2026 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <arch/interrupts.h>
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Scheduler latency tracing.
+//
+// When built with WITH_KERNEL_SCHED_TRACE (KERNEL_SCHED_TRACE=1 on the make
+// line) the scheduler, the interrupt entry paths and the irqsave spinlocks feed
+// per cpu histograms of:
+//
+//  wakeup     time from a thread being made ready to it running, in usecs
+//  timeslice  time a thread ran before switching out, in usecs
+//  irqoff     time spent in an irq handler or holding a spinlock with
+//             interrupts saved off, in usecs
+//  rqdepth    number of ready threads on a run queue after a wakeup
+//
+// Each cpu only ever updates its own histograms with interrupts disabled, so
+// recording takes no locks. The 'schedlat' console command prints percentiles.
+// Tracing also turns on the kernel event log, which records the same events
+// into per cpu rings for the 'kevlog' command.
+//
+// Irq off time is measured from a spin_lock_irqsave() that turned interrupts off
+// to the matching restore. Sections opened with a bare arch_interrupt_save()
+// are only seen if a traced spinlock is taken inside them.
+
+__BEGIN_CDECLS
+
+struct thread;
+
+#if WITH_KERNEL_SCHED_TRACE
+
+// hooks called from the scheduler, with interrupts disabled
+void sched_trace_wakeup(struct thread *t, uint rq_depth);
+void sched_trace_switch(struct thread *oldthread, struct thread *newthread);
+
+// hooks around irq handlers and irqsave spinlocks
+void sched_trace_irqoff_begin(bool ints_were_enabled);
+void sched_trace_irqoff_end(void);
+
+static inline arch_interrupt_saved_state_t sched_trace_interrupt_save(void) {
+    bool ints_were_enabled = !arch_ints_disabled();
+    arch_interrupt_saved_state_t state = arch_interrupt_save();
+    sched_trace_irqoff_begin(ints_were_enabled);
+    return state;
+}
+
+static inline void sched_trace_interrupt_restore(arch_interrupt_saved_state_t state) {
+    sched_trace_irqoff_end();
+    arch_interrupt_restore(state);
+}
+
+#define SCHED_TRACE_IRQ_ENTER() sched_trace_irqoff_begin(true)
+#define SCHED_TRACE_IRQ_EXIT() sched_trace_irqoff_end()
+
+#else // !WITH_KERNEL_SCHED_TRACE
+
+static inline void sched_trace_wakeup(struct thread *t, uint rq_depth) {}
+static inline void sched_trace_switch(struct thread *oldthread, struct thread *newthread) {}
+
+static inline arch_interrupt_saved_state_t sched_trace_interrupt_save(void) {
+    return arch_interrupt_save();
+}
+
+static inline void sched_trace_interrupt_restore(arch_interrupt_saved_state_t state) {
+    arch_interrupt_restore(state);
+}
+
+#define SCHED_TRACE_IRQ_ENTER() do { } while (0)
+#define SCHED_TRACE_IRQ_EXIT() do { } while (0)
+
+#endif
+
+__END_CDECLS
@@ -7,6 +7,7 @@
 
 #include <arch/interrupts.h>
 #include <arch/spinlock.h>
+#include <kernel/sched_trace.h>
 #include <lk/compiler.h>
 
 __BEGIN_CDECLS
@@ -36,7 +37,7 @@ static inline bool spin_lock_held(spin_lock_t *lock) {
 
 // same as spin lock, but save disable and save interrupt state first
 static inline arch_interrupt_saved_state_t spin_lock_irqsave(spin_lock_t *lock) {
-    arch_interrupt_saved_state_t state = arch_interrupt_save();
+    arch_interrupt_saved_state_t state = sched_trace_interrupt_save();
     spin_lock(lock);
     return state;
 }
@@ -44,7 +45,7 @@ static inline arch_interrupt_saved_state_t spin_lock_irqsave(spin_lock_t *lock)
 // restore interrupt state before unlocking
 static inline void spin_unlock_irqrestore(spin_lock_t *lock, arch_interrupt_saved_state_t old_state) {
     spin_unlock(lock);
-    arch_interrupt_restore(old_state);
+    sched_trace_interrupt_restore(old_state);
 }
 
 __END_CDECLS
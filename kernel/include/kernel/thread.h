@@ -17,6 +17,9 @@
 #include <lk/list.h>
 #include <sys/types.h>
 #include <stdint.h>
+#if WITH_KERNEL_SCHED_DEADLINE
+#include <kernel/timer.h>
+#endif
 
 __BEGIN_CDECLS
 
@@ -62,6 +65,7 @@ enum thread_tls_list {
 #define THREAD_FLAG_REAL_TIME                 (1<<3)
 #define THREAD_FLAG_IDLE                      (1<<4)
 #define THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK  (1<<5)
+#define THREAD_FLAG_DEADLINE                  (1<<6)
 
 #define THREAD_MAGIC (0x74687264) // 'thrd'
 
@@ -73,6 +77,22 @@ struct thread_specific_stats {
 };
 #endif
 
+#if WITH_KERNEL_SCHED_DEADLINE
+// parameters and current job of a deadline scheduled thread, all in usecs
+struct thread_deadline {
+    lk_bigtime_t runtime; // budget per period
+    lk_bigtime_t deadline; // relative to the start of each period
+    lk_bigtime_t period;
+
+    lk_bigtime_t abs_deadline; // deadline of the current job
+    int64_t budget; // runtime left in the current job
+
+    uint cpu; // the cpu whose bandwidth the thread was admitted on
+    uint util;
+    struct timer timer; // releases the thread once throttled
+};
+#endif
+
 typedef struct thread {
     uint32_t magic;
     struct list_node thread_list_node;
@@ -81,11 +101,12 @@ typedef struct thread {
     struct list_node queue_node;
     int priority;
     enum thread_state state;
-    int remaining_quantum;
+    int remaining_quantum; // usecs left in the current time slice
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
     int pinned_cpu; // only run on pinned_cpu if >= 0
+    int last_cpu; // cpu this thread last ran on, used for cache affinity
 #endif
 #if WITH_KERNEL_VM
     struct vmm_aspace *aspace;
@@ -94,6 +115,7 @@ typedef struct thread {
     // if blocked, a pointer to the wait queue the thread is blocked on
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
+    bool wait_queue_timeout; // blocked with a timeout timer armed
 
     // architecture-specific thread state
     struct arch_thread arch;
@@ -118,6 +140,13 @@ typedef struct thread {
 #if THREAD_STATS
     struct thread_specific_stats stats;
 #endif
+#if WITH_KERNEL_SCHED_TRACE
+    // when the thread was last made ready by a wakeup, 0 once it has run
+    lk_bigtime_t wakeup_time;
+#endif
+#if WITH_KERNEL_SCHED_DEADLINE
+    struct thread_deadline dl;
+#endif
 } thread_t;
 
 // thread priority
@@ -155,6 +184,11 @@ status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
 status_t thread_set_real_time(thread_t *t);
+#if WITH_KERNEL_SCHED_DEADLINE
+// earliest deadline first scheduling ahead of the priority levels, see thread.c
+status_t thread_set_deadline(thread_t *t, lk_time_t runtime, lk_time_t deadline, lk_time_t period);
+void thread_deadline_yield(void);
+#endif
 
 void dump_thread(const thread_t *t);
 void arch_dump_thread(const thread_t *t);
@@ -165,7 +199,7 @@ void dump_threads_stats(void);
 // scheduler routines
 void thread_yield(void); // give up the cpu voluntarily
 void thread_preempt(void); // get preempted (inserted into head of run queue)
-void thread_block(void); // block on something and reschedule
+void thread_block(void); // block on something and reschedule, local scheduler lock held
 void thread_unblock(thread_t *t, bool resched); // go back in the run queue
 
 #ifdef WITH_LIB_UTHREAD
@@ -188,16 +222,25 @@ static inline void set_current_thread(thread_t *t) {
 // list of all threads, unsafe to traverse without holding thread_lock
 extern struct list_node thread_list;
 
-// scheduler lock
+// thread list and thread lifecycle lock. Scheduling itself is done under the
+// per cpu scheduler locks below, see kernel/lockorder.h for the lock hierarchy.
 extern spin_lock_t thread_lock;
 
-#define THREAD_LOCK(state) arch_interrupt_saved_state_t state = spin_lock_irqsave(&thread_lock)
-#define THREAD_UNLOCK(state) spin_unlock_irqrestore(&thread_lock, state)
+#define THREAD_LOCK(state) arch_interrupt_saved_state_t state = spin_lock_irqsave_class(&thread_lock, LOCK_CLASS_THREAD)
+#define THREAD_UNLOCK(state) spin_unlock_irqrestore_class(&thread_lock, state)
 
 static inline bool thread_lock_held(void) {
     return spin_lock_held(&thread_lock);
 }
 
+// Per cpu scheduler lock, protecting the local run queue. Must be called with
+// interrupts disabled. The lock is held across a context switch: the thread that
+// gets switched to releases it, which is why arch code that starts a new thread
+// calls thread_sched_unlock().
+void thread_sched_lock(void);
+void thread_sched_unlock(void);
+bool thread_sched_lock_held(void);
+
 // SMP related accessors
 static inline int thread_curr_cpu(const thread_t *t) {
 #if WITH_SMP
@@ -215,9 +258,20 @@ static inline int thread_pinned_cpu(const thread_t *t) {
 #endif
 }
 
+static inline int thread_last_cpu(const thread_t *t) {
+#if WITH_SMP
+    return t->last_cpu;
+#else
+    return 0;
+#endif
+}
+
 static inline void thread_set_curr_cpu(thread_t *t, int cpu) {
 #if WITH_SMP
     t->curr_cpu = cpu;
+    if (cpu >= 0) {
+        t->last_cpu = cpu;
+    }
 #endif
 }
 
@@ -259,6 +313,8 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; // threads pulled from another cpu's run queue while idle
+    ulong balances; // threads pulled from another cpu's run queue by the load balancer
 #endif
 };
 
@@ -7,6 +7,7 @@
 
 #include <lk/compiler.h>
 #include <lk/list.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <stdint.h>
 
@@ -28,13 +29,21 @@ typedef enum handler_return (*timer_callback)(struct timer *, lk_time_t now, voi
 
 typedef struct timer {
     uint32_t magic;
-    struct list_node node;
+
+    // links in the per cpu timer heap, private to kernel/timer.c
+    struct timer *heap_child;
+    struct timer *heap_sibling;
+    struct timer *heap_prev;
 
     lk_time_t scheduled_time;
     lk_time_t periodic_time;
 
     timer_callback callback;
     void *arg;
+
+    // cpu whose queue the timer was last set on
+    uint cpu;
+    bool queued;
 } timer_t;
 
 // Initializes a timer to the default state. Can statically initialize a timer
@@ -42,11 +51,15 @@ typedef struct timer {
 #define TIMER_INITIAL_VALUE(t) \
 { \
     .magic = TIMER_MAGIC, \
-    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .heap_child = NULL, \
+    .heap_sibling = NULL, \
+    .heap_prev = NULL, \
     .scheduled_time = 0, \
     .periodic_time = 0, \
     .callback = NULL, \
     .arg = NULL, \
+    .cpu = 0, \
+    .queued = false, \
 }
 
 void timer_initialize(timer_t *);
@@ -58,9 +71,14 @@ void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
 
 // Cancels a timer, removing it from the timer queue and preventing it from firing.
-// If the timer is currently running, it will not be canceled until the callback returns.
 // May be called from interrupt or thread context.
-// The callback will not be called again after this.
+// The callback will not be called again after this, though a callback that is
+// already running on another cpu may still be in progress when this returns.
 void timer_cancel(timer_t *);
 
+// Same as timer_cancel(), but if the callback is running on another cpu, wait for
+// it to return. Use this before freeing or reusing the timer's memory. Must not be
+// called while holding a lock that the callback takes.
+void timer_cancel_sync(timer_t *);
+
 __END_CDECLS
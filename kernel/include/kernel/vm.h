@@ -71,10 +71,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; // size of the free buddy block this page heads, if any
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_CACHED   (0x2) // sitting in a per cpu page cache, also NONFREE
 
 // Kernel address space
 // Must be declared by the platform or architecture.
@@ -106,6 +108,13 @@ static inline bool is_user_address(vaddr_t va) {
 }
 
 // physical allocator
+
+// Free pages are kept in naturally aligned power of two blocks (buddies) of
+// up to 1 << (PMM_MAX_ORDER - 1) pages, one free list per block size.
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 11
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -119,7 +128,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER]; // free blocks, indexed by order
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) // this arena is already mapped and useful for kallocs
@@ -5,6 +5,8 @@
 // https://opensource.org/licenses/MIT
 #pragma once
 
+#include <kernel/lockorder.h>
+#include <kernel/spinlock.h>
 #include <lk/compiler.h>
 #include <lk/list.h>
 #include <stdbool.h>
@@ -26,6 +28,7 @@ typedef struct wait_queue {
     uint32_t magic;
     int count;
     struct list_node list;
+    spin_lock_t lock;
 } wait_queue_t;
 
 // Initialize a wait queue to the default state. Can statically initialize a wait queue
@@ -34,12 +37,27 @@ typedef struct wait_queue {
 { \
     .magic = WAIT_QUEUE_MAGIC, \
     .count = 0, \
-    .list = LIST_INITIAL_VALUE((q).list) \
+    .list = LIST_INITIAL_VALUE((q).list), \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
 }
 void wait_queue_init(wait_queue_t *wait);
 
-// All of the below apis must be called with interrupts disabled and the main thread
-// lock held (see kernel/thread.h for details).
+// Each wait queue carries its own spinlock, which also protects the state of the
+// object the queue is embedded in (the count of a mutex, the signaled state of an
+// event, etc). See kernel/lockorder.h for where it sits in the lock hierarchy.
+static inline arch_interrupt_saved_state_t wait_queue_lock_irqsave(wait_queue_t *wait) {
+    return spin_lock_irqsave_class(&wait->lock, LOCK_CLASS_WAIT_QUEUE);
+}
+
+// Release the wait queue lock. If a wake call made while holding the lock asked
+// for a reschedule, the reschedule happens here, once no wait queue lock is held.
+void wait_queue_unlock_irqrestore(wait_queue_t *wait, arch_interrupt_saved_state_t state);
+
+#define WAIT_QUEUE_LOCK(wait, state) arch_interrupt_saved_state_t state = wait_queue_lock_irqsave(wait)
+#define WAIT_QUEUE_UNLOCK(wait, state) wait_queue_unlock_irqrestore(wait, state)
+
+// All of the below apis must be called with interrupts disabled and the wait
+// queue's lock held.
 
 // Release all the threads on this wait queue with a return code of ERR_OBJECT_DESTROYED.
 // the caller must assure that no other threads are operating on the wait queue during or
@@ -50,10 +68,14 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
 // Return status is whatever the caller of wait_queue_wake_*() specifies.
 // A timeout other than INFINITE_TIME will set abort after the specified time
 // and return ERR_TIMED_OUT. A timeout of 0 will immediately return.
+// The wait queue lock is always released on return, with interrupts still
+// disabled. The caller must reacquire it if it needs to touch the object again,
+// which is only safe if the object was not destroyed while blocked.
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
 // Release one or more threads from the wait queue.
-// reschedule = should the system reschedule if any is released.
+// reschedule = should the system reschedule if any is released. The reschedule
+// is deferred until the lock is dropped with wait_queue_unlock_irqrestore().
 // wait_queue_error = what wait_queue_block() should return for the blocking thread.
 // Returns the number of threads released from the wait queue.
 //
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+/**
+ * @file
+ * @brief  Runtime lock ordering checker
+ *
+ * Tracks the classed spinlocks held by each cpu and panics if a lock is
+ * acquired out of the order documented in <kernel/lockorder.h>. Spinlocks are
+ * only ever held with interrupts disabled, so a simple per cpu stack is enough;
+ * the scheduler lock that is handed across a context switch stays on the same
+ * cpu and so stays on the same stack.
+ */
+#include <kernel/lockorder.h>
+
+#if WITH_KERNEL_LOCK_ORDER_CHECK
+
+#include <arch/ops.h>
+#include <assert.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+
+#define MAX_HELD_LOCKS 8
+
+struct held_lock {
+    const spin_lock_t *lock;
+    enum lock_class lock_class;
+};
+
+struct lock_order_state {
+    uint count;
+    struct held_lock held[MAX_HELD_LOCKS];
+} __CPU_ALIGN;
+
+static struct lock_order_state lock_order_state[SMP_MAX_CPUS];
+
+static const char *lock_class_name(enum lock_class lock_class) {
+    switch (lock_class) {
+        case LOCK_CLASS_THREAD:
+            return "thread";
+        case LOCK_CLASS_PORT:
+            return "port";
+        case LOCK_CLASS_WAIT_QUEUE:
+            return "wait_queue";
+        case LOCK_CLASS_SCHEDULER:
+            return "scheduler";
+        case LOCK_CLASS_TIMER:
+            return "timer";
+        default:
+            return "unknown";
+    }
+}
+
+static void lock_order_push(struct lock_order_state *s, const spin_lock_t *lock, enum lock_class lock_class) {
+    if (unlikely(s->count == MAX_HELD_LOCKS)) {
+        panic("lock order: cpu %u holds too many locks acquiring %p (%s)\n",
+              arch_curr_cpu_num(), lock, lock_class_name(lock_class));
+    }
+    s->held[s->count].lock = lock;
+    s->held[s->count].lock_class = lock_class;
+    s->count++;
+}
+
+void lock_order_acquire(const spin_lock_t *lock, enum lock_class lock_class) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    struct lock_order_state *s = &lock_order_state[arch_curr_cpu_num()];
+
+    for (uint i = 0; i < s->count; i++) {
+        if (unlikely(s->held[i].lock == lock)) {
+            panic("lock order: recursive acquire of %p (%s)\n", lock, lock_class_name(lock_class));
+        }
+        if (unlikely(s->held[i].lock_class >= lock_class)) {
+            panic("lock order: acquiring %p (%s) while holding %p (%s)\n",
+                  lock, lock_class_name(lock_class),
+                  s->held[i].lock, lock_class_name(s->held[i].lock_class));
+        }
+    }
+
+    lock_order_push(s, lock, lock_class);
+}
+
+void lock_order_trylock(const spin_lock_t *lock, enum lock_class lock_class) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    /* a trylock cannot deadlock, so it is exempt from the ordering rules */
+    lock_order_push(&lock_order_state[arch_curr_cpu_num()], lock, lock_class);
+}
+
+void lock_order_release(const spin_lock_t *lock) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    struct lock_order_state *s = &lock_order_state[arch_curr_cpu_num()];
+
+    /* locks are usually, but not always, released in reverse order */
+    for (uint i = s->count; i > 0; i--) {
+        if (s->held[i - 1].lock == lock) {
+            for (uint j = i; j < s->count; j++) {
+                s->held[j - 1] = s->held[j];
+            }
+            s->count--;
+            return;
+        }
+    }
+
+    panic("lock order: releasing %p which is not held by cpu %u\n", lock, arch_curr_cpu_num());
+}
+
+uint lock_order_held_count(void) {
+    return lock_order_state[arch_curr_cpu_num()].count;
+}
+
+#endif // WITH_KERNEL_LOCK_ORDER_CHECK
@@ -17,11 +17,15 @@
 
 #include <kernel/mutex.h>
 
+#include <arch/atomic.h>
+#include <arch/ops.h>
 #include <assert.h>
 #include <kernel/thread.h>
+#include <lk/compiler.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/init.h>
+#include <platform.h>
 
 static bool mutex_threading_ready;
 
@@ -57,13 +61,48 @@ void mutex_destroy(mutex_t *m) {
               get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&m->wait, state);
     m->magic = 0;
-    m->count = 0;
+    m->val = MUTEX_UNLOCKED;
     wait_queue_destroy(&m->wait, true);
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
 }
 
+/* try to take an unlocked mutex without touching the wait queue */
+static inline bool mutex_trylock_fast(mutex_t *m) {
+    if (likely(atomic_cmpxchg(&m->val, MUTEX_UNLOCKED, MUTEX_LOCKED) == MUTEX_UNLOCKED)) {
+        smp_mb();
+        return true;
+    }
+    return false;
+}
+
+#if MUTEX_SPIN_COUNT > 0
+/*
+ * Adaptive spinning: as long as the holder is running on another cpu it is
+ * likely to drop the mutex soon, so poll the lock word for a bit instead of
+ * paying for a block and a wakeup. Gives up as soon as the holder is
+ * preempted or blocks, or after MUTEX_SPIN_COUNT polls.
+ *
+ * The holder is sampled without any lock, it may be released and even freed
+ * underneath us. That only costs a stale read of its state, which ends the
+ * spin early or late but never affects correctness.
+ */
+static bool mutex_spin(mutex_t *m) {
+    for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+        if (m->val == MUTEX_UNLOCKED && mutex_trylock_fast(m))
+            return true;
+
+        thread_t *holder = __atomic_load_n(&m->holder, __ATOMIC_RELAXED);
+        if (holder && holder->state != THREAD_RUNNING)
+            break;
+
+        CF;
+    }
+    return false;
+}
+#endif
+
 /**
  * @brief  Mutex wait with timeout
  *
@@ -71,6 +110,10 @@ void mutex_destroy(mutex_t *m) {
  * Timeout may be zero, in which case this function returns immediately if
  * the mutex is not free.
  *
+ * An uncontended acquire is a single compare and swap on the lock word. The
+ * wait queue, and with it the interrupt disable, is only involved once the
+ * mutex is found held.
+ *
  * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
  * other values on error
  */
@@ -84,33 +127,57 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout) {
 #endif
     DEBUG_ASSERT(!mutex_threading_ready || !timeout || !arch_ints_disabled());
 
-    THREAD_LOCK(state);
-
-    status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
-        ret = wait_queue_block(&m->wait, timeout);
-        if (unlikely(ret < NO_ERROR)) {
-            /* if the acquisition timed out, back out the acquire and exit */
-            if (likely(ret == ERR_TIMED_OUT)) {
-                /*
-                 * race: the mutex may have been destroyed after the timeout,
-                 * but before we got scheduled again which makes messing with the
-                 * count variable dangerous.
-                 */
-                m->count--;
-            }
-            /* if there was a general error, it may have been destroyed out from
-             * underneath us, so just exit (which is really an invalid state anyway)
-             */
-            goto err;
+    if (likely(mutex_trylock_fast(m)))
+        goto acquired;
+
+    if (timeout == 0)
+        return ERR_TIMED_OUT;
+
+#if MUTEX_SPIN_COUNT > 0
+    if (mutex_spin(m))
+        goto acquired;
+#endif
+
+    lk_time_t deadline = current_time() + timeout;
+
+    for (;;) {
+        WAIT_QUEUE_LOCK(&m->wait, state);
+
+        /*
+         * Mark the mutex contended so the holder takes the slow path on release.
+         * If it was released in the meantime we own it now, conservatively marked
+         * contended since other threads may still be queued.
+         */
+        if (atomic_swap(&m->val, MUTEX_CONTENDED) == MUTEX_UNLOCKED) {
+            WAIT_QUEUE_UNLOCK(&m->wait, state);
+            smp_mb();
+            break;
+        }
+
+        lk_time_t block_timeout = timeout;
+        if (timeout != INFINITE_TIME) {
+            lk_time_t now = current_time();
+            block_timeout = TIME_GTE(now, deadline) ? 0 : deadline - now;
         }
+
+        /* drops the wait queue lock */
+        status_t ret = wait_queue_block(&m->wait, block_timeout);
+        arch_interrupt_restore(state);
+
+        /*
+         * A release only wakes us up to retry, a thread coming in through the
+         * fast path may have beaten us to it. On timeout there is nothing to
+         * back out, a stale contended mark just costs a spurious wake call.
+         * On any other error the mutex may have been destroyed out from
+         * underneath us.
+         */
+        if (unlikely(ret < NO_ERROR))
+            return ret;
     }
 
+acquired:
     m->holder = get_current_thread();
-
-err:
-    THREAD_UNLOCK(state);
-    return ret;
+    return NO_ERROR;
 }
 
 /**
@@ -126,16 +193,16 @@ status_t mutex_release(mutex_t *m) {
     }
 #endif
 
-    THREAD_LOCK(state);
-
     m->holder = 0;
 
-    if (unlikely(--m->count >= 1)) {
-        /* release a thread */
-        wait_queue_wake_one(&m->wait, true, NO_ERROR);
-    }
+    smp_mb();
+    if (likely(atomic_swap(&m->val, MUTEX_UNLOCKED) == MUTEX_LOCKED))
+        return NO_ERROR;
+
+    /* there may be waiters, release one to retry the acquire */
+    WAIT_QUEUE_LOCK(&m->wait, state);
+    wait_queue_wake_one(&m->wait, true, NO_ERROR);
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
 
-    THREAD_UNLOCK(state);
     return NO_ERROR;
 }
-
@@ -16,6 +16,7 @@
 #include <kernel/port.h>
 
 #include <kernel/init.h>
+#include <kernel/lockorder.h>
 #include <kernel/thread.h>
 #include <lk/debug.h>
 #include <lk/err.h>
@@ -78,6 +79,46 @@ typedef struct {
 
 static struct list_node write_port_list;
 
+// protects the port list, all port objects and their buffers. nests outside
+// of the per wait queue locks.
+static spin_lock_t port_lock = SPIN_LOCK_INITIAL_VALUE;
+
+#define PORT_LOCK(state) arch_interrupt_saved_state_t state = spin_lock_irqsave_class(&port_lock, LOCK_CLASS_PORT)
+#define PORT_UNLOCK(state) spin_unlock_irqrestore_class(&port_lock, state)
+
+static int port_wake_one(wait_queue_t *wait) {
+    spin_lock_class(&wait->lock, LOCK_CLASS_WAIT_QUEUE);
+    int ret = wait_queue_wake_one(wait, false, NO_ERROR);
+    spin_unlock_class(&wait->lock);
+    return ret;
+}
+
+static void port_wake_all(wait_queue_t *wait, status_t error) {
+    spin_lock_class(&wait->lock, LOCK_CLASS_WAIT_QUEUE);
+    wait_queue_wake_all(wait, false, error);
+    spin_unlock_class(&wait->lock);
+}
+
+// returns the number of threads that were waiting
+static int port_destroy_wait(wait_queue_t *wait) {
+    spin_lock_class(&wait->lock, LOCK_CLASS_WAIT_QUEUE);
+    int count = wait->count;
+    wait_queue_destroy(wait, false);
+    spin_unlock_class(&wait->lock);
+    return count;
+}
+
+// block on a port's wait queue, handing over from the port lock to the wait
+// queue lock so a write can't slip in between. the port lock is held again on
+// return, but if an error is returned the port may already be gone.
+static status_t port_block(wait_queue_t *wait, lk_time_t timeout) {
+    spin_lock_class(&wait->lock, LOCK_CLASS_WAIT_QUEUE);
+    spin_unlock_class(&port_lock);
+    status_t ret = wait_queue_block(wait, timeout);
+    spin_lock_class(&port_lock, LOCK_CLASS_PORT);
+    return ret;
+}
+
 
 static port_buf_t *make_buf(bool big) {
     uint pk_count = big ? PORT_BUFF_SIZE_BIG : PORT_BUFF_SIZE;
@@ -143,14 +184,14 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port) {
 
     // lookup for existing port, return that if found.
     write_port_t *wp = NULL;
-    THREAD_LOCK(state1);
+    PORT_LOCK(state1);
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0) {
             // can't return closed or partial ports.
             if (wp->magic == WRITEPORT_MAGIC_X ||
                 wp->magic == PORTHOLD_MAGIC)
                 wp = NULL;
-            THREAD_UNLOCK(state1);
+            PORT_UNLOCK(state1);
             if (wp) {
                 *port = (void *) wp;
                 return ERR_ALREADY_EXISTS;
@@ -160,14 +201,14 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port) {
         }
     }
     list_add_tail(&write_port_list, &stack_wp.node);
-    THREAD_UNLOCK(state1);
+    PORT_UNLOCK(state1);
 
     // not found, create the write port and the circular buffer.
     wp = calloc(1, sizeof(write_port_t));
     if (!wp) {
-        THREAD_LOCK(state2);
+        PORT_LOCK(state2);
         list_delete(&stack_wp.node);
-        THREAD_UNLOCK(state2);
+        PORT_UNLOCK(state2);
         return ERR_NO_MEMORY;
     }
 
@@ -179,19 +220,19 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port) {
     wp->buf = make_buf(mode & PORT_MODE_BIG_BUFFER);
     if (!wp->buf) {
         free(wp);
-        THREAD_LOCK(state2);
+        PORT_LOCK(state2);
         list_delete(&stack_wp.node);
-        THREAD_UNLOCK(state2);
+        PORT_UNLOCK(state2);
         return ERR_NO_MEMORY;
     }
 
     // Avoid a name collision by swapping the temporary placeholder out of the
     // list for the actual port.
-    THREAD_LOCK(state2);
+    PORT_LOCK(state2);
     // Let's reserve a stack allocated entry then swap it for the allocated one.
     list_add_tail(&write_port_list, &wp->node);
     list_delete(&stack_wp.node);
-    THREAD_UNLOCK(state2);
+    PORT_UNLOCK(state2);
 
     *port = (void *)wp;
     return NO_ERROR;
@@ -222,7 +263,7 @@ status_t port_open(const char *name, void *ctx, port_t *port) {
     // find the named write port and associate it with read port.
     status_t rc = ERR_NOT_FOUND;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     write_port_t *wp = NULL;
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0 &&
@@ -254,7 +295,7 @@ status_t port_open(const char *name, void *ctx, port_t *port) {
             break;
         }
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     if (buf)
         free(buf);
@@ -289,7 +330,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group) {
 
     status_t rc = NO_ERROR;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     for (size_t ix = 0; ix != count; ix++) {
         read_port_t *rp = (read_port_t *)ports[ix];
         if ((rp->magic != READPORT_MAGIC) || rp->gport) {
@@ -305,7 +346,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group) {
         rp->gport = pg;
         list_add_tail(&pg->rp_list, &rp->g_node);
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     if (rc == NO_ERROR) {
         *group = (port_t *)pg;
@@ -329,7 +370,7 @@ status_t port_group_add(port_t group, port_t port) {
         return ERR_BAD_HANDLE;
 
     status_t rc = NO_ERROR;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     if (list_length(&pg->rp_list) == MAX_PORT_GROUP_COUNT) {
         rc = ERR_TOO_BIG;
@@ -340,11 +381,11 @@ status_t port_group_add(port_t group, port_t port) {
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
-            wait_queue_wake_one(&pg->wait, false, NO_ERROR);
+            port_wake_one(&pg->wait);
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return rc;
 }
@@ -362,7 +403,7 @@ status_t port_group_remove(port_t group, port_t port) {
     if (rp->magic != READPORT_MAGIC || rp->gport != pg)
         return ERR_BAD_HANDLE;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     bool found = false;
     read_port_t *current_rp;
@@ -373,13 +414,13 @@ status_t port_group_remove(port_t group, port_t port) {
     }
 
     if (!found) {
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
     list_delete(&rp->g_node);
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return NO_ERROR;
 }
@@ -389,10 +430,10 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count) {
         return ERR_INVALID_ARGS;
 
     write_port_t *wp = (write_port_t *)port;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
@@ -415,17 +456,17 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count) {
 
             int awaken = 0;
             if (rp->gport) {
-                awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
+                awaken = port_wake_one(&rp->gport->wait);
             }
             if (!awaken) {
-                awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
+                awaken = port_wake_one(&rp->wait);
             }
 
             awake_count += awaken;
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
 #if RESCHEDULE_POLICY
     if (awake_count)
@@ -446,7 +487,7 @@ static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_res
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
+    status_t wr = port_block(&rp->wait, timeout);
     if (wr != NO_ERROR)
         return wr;
     // recursive tail call is usually optimized away with a goto.
@@ -460,7 +501,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result) {
     status_t rc = ERR_GENERIC;
     read_port_t *rp = (read_port_t *)port;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
         rc = read_no_lock(rp, timeout, result);
@@ -476,7 +517,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result) {
                     goto read_exit;
             }
             // no data, block on the group waitqueue.
-            rc = wait_queue_block(&pg->wait, timeout);
+            rc = port_block(&pg->wait, timeout);
         } while (rc == NO_ERROR);
     } else {
         // wrong port type.
@@ -484,7 +525,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result) {
     }
 
 read_exit:
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
     return rc;
 }
 
@@ -495,10 +536,10 @@ status_t port_destroy(port_t port) {
     write_port_t *wp = (write_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_X) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
     // remove self from global named ports list.
@@ -512,9 +553,9 @@ status_t port_destroy(port_t port) {
         read_port_t *rp;
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
             // wake the read and group ports.
-            wait_queue_wake_all(&rp->wait, false, ERR_CANCELLED);
+            port_wake_all(&rp->wait, ERR_CANCELLED);
             if (rp->gport) {
-                wait_queue_wake_all(&rp->gport->wait, false, ERR_CANCELLED);
+                port_wake_all(&rp->gport->wait, ERR_CANCELLED);
             }
             // remove self from reader ports.
             rp->wport = NULL;
@@ -522,7 +563,7 @@ status_t port_destroy(port_t port) {
     }
 
     wp->magic = 0;
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     free(buf);
     free(wp);
@@ -535,8 +576,9 @@ status_t port_close(port_t port) {
 
     read_port_t *rp = (read_port_t *) port;
     port_buf_t *buf = NULL;
+    int woken = 0;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
         if (rp->wport) {
@@ -554,14 +596,14 @@ status_t port_close(port_t port) {
             list_delete(&rp->g_node);
         }
         // wake up waiters, the return code is ERR_OBJECT_DESTROYED.
-        wait_queue_destroy(&rp->wait, true);
+        woken = port_destroy_wait(&rp->wait);
         rp->magic = 0;
 
     } else if (rp->magic == PORTGROUP_MAGIC) {
         // dealing with a port group.
         port_group_t *pg = (port_group_t *) port;
         // wake up waiters.
-        wait_queue_destroy(&pg->wait, true);
+        woken = port_destroy_wait(&pg->wait);
         // remove self from reader ports.
         rp = NULL;
         list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
@@ -574,18 +616,23 @@ status_t port_close(port_t port) {
         write_port_t *wp = (write_port_t *) port;
         // mark it as closed. Now it can be read but not written to.
         wp->magic = WRITEPORT_MAGIC_X;
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return NO_ERROR;
 
     } else {
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     free(buf);
     free(port);
+
+    // let the waiters run now that the port lock is dropped.
+    if (woken)
+        thread_yield();
+
     return NO_ERROR;
 }
 
@@ -10,7 +10,9 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/event.c \
 	$(LOCAL_DIR)/init.c \
+	$(LOCAL_DIR)/lockorder.c \
 	$(LOCAL_DIR)/mutex.c \
+	$(LOCAL_DIR)/sched_trace.c \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
@@ -19,10 +21,28 @@ MODULE_SRCS := \
 
 ifeq ($(WITH_KERNEL_VM),1)
 MODULE_DEPS += kernel/vm
+MODULE_DEPS += lib/slab
 else
 MODULE_DEPS += kernel/novm
 endif
 
+# KERNEL_SCHED_TRACE=1 records scheduler latency histograms, see kernel/sched_trace.h.
+# It turns on the kernel event log as well, which KERNEL_EVLOG=1 enables on its own.
+ifeq (true,$(call TOBOOL,$(KERNEL_SCHED_TRACE)))
+GLOBAL_DEFINES += WITH_KERNEL_SCHED_TRACE=1
+KERNEL_EVLOG := 1
+endif
+ifeq (true,$(call TOBOOL,$(KERNEL_EVLOG)))
+GLOBAL_DEFINES += WITH_KERNEL_EVLOG=1
+MODULE_DEPS += lib/evlog
+endif
+
+# KERNEL_SCHED_DEADLINE=1 adds an earliest deadline first class ahead of the
+# priority levels, see thread_set_deadline().
+ifeq (true,$(call TOBOOL,$(KERNEL_SCHED_DEADLINE)))
+GLOBAL_DEFINES += WITH_KERNEL_SCHED_DEADLINE=1
+endif
+
 MODULE_OPTIONS := extra_warnings
 
 include make/module.mk
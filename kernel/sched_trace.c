@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+/**
+ * @file
+ * @brief  Scheduler latency histograms
+ *
+ * Each cpu records into its own set of histograms with interrupts disabled,
+ * so nothing here takes a lock. Buckets are exact below 16 and then split
+ * each power of two into 4, which keeps the error of a reported percentile
+ * under 25% in 128 buckets.
+ */
+#include <kernel/sched_trace.h>
+
+#if WITH_KERNEL_SCHED_TRACE
+
+#include <arch/ops.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIST_LINEAR 16
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS (HIST_LINEAR + (32 - 4) * (1 << HIST_SUB_BITS))
+
+enum {
+    HIST_WAKEUP,
+    HIST_TIMESLICE,
+    HIST_IRQOFF,
+    HIST_RQDEPTH,
+    HIST_COUNT,
+};
+
+static const char *hist_name[HIST_COUNT] = {
+    [HIST_WAKEUP] = "wakeup",
+    [HIST_TIMESLICE] = "timeslice",
+    [HIST_IRQOFF] = "irqoff",
+    [HIST_RQDEPTH] = "rqdepth",
+};
+
+static const char *hist_units[HIST_COUNT] = {
+    [HIST_WAKEUP] = "us",
+    [HIST_TIMESLICE] = "us",
+    [HIST_IRQOFF] = "us",
+    [HIST_RQDEPTH] = "threads",
+};
+
+struct sched_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t bucket[HIST_BUCKETS];
+};
+
+struct sched_trace_cpu {
+    struct sched_hist hist[HIST_COUNT];
+
+    /* when the current thread was switched in */
+    lk_bigtime_t switch_time;
+
+    /* the irq off section in progress, if any */
+    lk_bigtime_t irqoff_start;
+    uint irqoff_depth;
+} __CPU_ALIGN;
+
+static struct sched_trace_cpu sched_trace_cpu[SMP_MAX_CPUS];
+
+static uint hist_bucket(uint64_t val) {
+    if (val < HIST_LINEAR)
+        return val;
+    if (val > UINT32_MAX)
+        val = UINT32_MAX;
+
+    uint log = 31 - __builtin_clz((uint32_t)val);
+    uint sub = (val >> (log - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return HIST_LINEAR + ((log - 4) << HIST_SUB_BITS) + sub;
+}
+
+/* smallest value that lands in a bucket */
+static uint64_t hist_bucket_base(uint bucket) {
+    if (bucket < HIST_LINEAR)
+        return bucket;
+
+    bucket -= HIST_LINEAR;
+    uint log = (bucket >> HIST_SUB_BITS) + 4;
+    uint sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    return (uint64_t)((1 << HIST_SUB_BITS) + sub) << (log - HIST_SUB_BITS);
+}
+
+static void hist_add(uint hist, uint64_t val) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    struct sched_hist *h = &sched_trace_cpu[arch_curr_cpu_num()].hist[hist];
+
+    h->bucket[hist_bucket(val)]++;
+    h->count++;
+    h->sum += val;
+    if (val > h->max)
+        h->max = val;
+}
+
+void sched_trace_wakeup(thread_t *t, uint rq_depth) {
+    t->wakeup_time = current_time_hires();
+    hist_add(HIST_RQDEPTH, rq_depth);
+}
+
+void sched_trace_switch(thread_t *oldthread, thread_t *newthread) {
+    struct sched_trace_cpu *c = &sched_trace_cpu[arch_curr_cpu_num()];
+    lk_bigtime_t now = current_time_hires();
+
+    if (!(oldthread->flags & THREAD_FLAG_IDLE) && c->switch_time)
+        hist_add(HIST_TIMESLICE, now - c->switch_time);
+    c->switch_time = now;
+
+    if (newthread->wakeup_time) {
+        hist_add(HIST_WAKEUP, now - newthread->wakeup_time);
+        newthread->wakeup_time = 0;
+    }
+
+    /*
+     * An irq off section that is still open here belongs to a thread that is
+     * blocking with interrupts saved off and will be closed on whatever cpu it
+     * resumes on, so don't try to time it.
+     */
+    c->irqoff_start = 0;
+    c->irqoff_depth = 0;
+}
+
+void sched_trace_irqoff_begin(bool ints_were_enabled) {
+    struct sched_trace_cpu *c = &sched_trace_cpu[arch_curr_cpu_num()];
+
+    if (ints_were_enabled) {
+        /* the outermost section, anything left over was never closed */
+        c->irqoff_depth = 1;
+        c->irqoff_start = current_time_hires();
+    } else {
+        c->irqoff_depth++;
+    }
+}
+
+void sched_trace_irqoff_end(void) {
+    struct sched_trace_cpu *c = &sched_trace_cpu[arch_curr_cpu_num()];
+
+    if (c->irqoff_depth == 0)
+        return;
+    if (--c->irqoff_depth > 0)
+        return;
+
+    /* clear the start first, reading the time may take a traced spinlock */
+    lk_bigtime_t start = c->irqoff_start;
+    c->irqoff_start = 0;
+    if (start)
+        hist_add(HIST_IRQOFF, current_time_hires() - start);
+}
+
+static void hist_merge(struct sched_hist *out, uint hist, int cpu) {
+    memset(out, 0, sizeof(*out));
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (cpu >= 0 && (uint)cpu != i)
+            continue;
+
+        const struct sched_hist *h = &sched_trace_cpu[i].hist[hist];
+        for (uint b = 0; b < HIST_BUCKETS; b++)
+            out->bucket[b] += h->bucket[b];
+        out->count += h->count;
+        out->sum += h->sum;
+        if (h->max > out->max)
+            out->max = h->max;
+    }
+}
+
+/* upper bound of the value below which permille of the samples fall */
+static uint64_t hist_percentile(const struct sched_hist *h, uint permille) {
+    uint64_t target = (h->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (uint b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= target && seen > 0) {
+            uint64_t top = (b + 1 < HIST_BUCKETS) ? hist_bucket_base(b + 1) - 1 : h->max;
+            return MIN(top, h->max);
+        }
+    }
+    return h->max;
+}
+
+static void hist_print_summary(const struct sched_hist *h, const char *label) {
+    if (h->count == 0) {
+        printf("%-10s no samples\n", label);
+        return;
+    }
+
+    printf("%-10s %10" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+           " %8" PRIu64 "\n", label, h->count,
+           h->sum / h->count, hist_percentile(h, 500), hist_percentile(h, 900),
+           hist_percentile(h, 990), hist_percentile(h, 999), h->max);
+}
+
+static void hist_print_header(uint hist) {
+    printf("%s (%s):\n", hist_name[hist], hist_units[hist]);
+    printf("%-10s %10s %8s %8s %8s %8s %8s %8s\n", "", "count", "avg", "p50", "p90", "p99",
+           "p99.9", "max");
+}
+
+static void hist_print_buckets(const struct sched_hist *h) {
+    for (uint b = 0; b < HIST_BUCKETS; b++) {
+        if (h->bucket[b] == 0)
+            continue;
+
+        uint64_t base = hist_bucket_base(b);
+        uint64_t top = (b + 1 < HIST_BUCKETS) ? hist_bucket_base(b + 1) - 1 : UINT32_MAX;
+        printf("\t%10" PRIu64 " - %10" PRIu64 ": %u\n", base, top, h->bucket[b]);
+    }
+}
+
+static int cmd_schedlat(int argc, const console_cmd_args *argv) {
+    struct sched_hist h;
+
+    if (argc < 2) {
+        for (uint i = 0; i < HIST_COUNT; i++) {
+            hist_print_header(i);
+            hist_merge(&h, i, -1);
+            hist_print_summary(&h, "all cpus");
+        }
+        return NO_ERROR;
+    }
+
+    if (!strcmp(argv[1].str, "reset")) {
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            memset(sched_trace_cpu[i].hist, 0, sizeof(sched_trace_cpu[i].hist));
+        }
+        return NO_ERROR;
+    }
+
+    for (uint i = 0; i < HIST_COUNT; i++) {
+        if (strcmp(argv[1].str, hist_name[i]))
+            continue;
+
+        hist_print_header(i);
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (!mp_is_cpu_active(cpu))
+                continue;
+
+            char label[16];
+            snprintf(label, sizeof(label), "cpu %u", cpu);
+            hist_merge(&h, i, cpu);
+            hist_print_summary(&h, label);
+        }
+        hist_merge(&h, i, -1);
+        hist_print_summary(&h, "all cpus");
+
+        if (argc >= 3 && !strcmp(argv[2].str, "-v"))
+            hist_print_buckets(&h);
+
+        return NO_ERROR;
+    }
+
+    printf("usage:\n");
+    printf("%s                                  summary of all histograms\n", argv[0].str);
+    printf("%s wakeup|timeslice|irqoff|rqdepth [-v]  per cpu percentiles, -v for buckets\n", argv[0].str);
+    printf("%s reset                            clear all histograms\n", argv[0].str);
+    return ERR_INVALID_ARGS;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("schedlat", "scheduler latency histograms", &cmd_schedlat)
+STATIC_COMMAND_END(schedlat);
+
+#endif // WITH_KERNEL_SCHED_TRACE
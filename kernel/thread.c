@@ -21,6 +21,7 @@
 #include <kernel/debug.h>
 #include <kernel/init.h>
 #include <kernel/mp.h>
+#include <kernel/sched_trace.h>
 #include <kernel/timer.h>
 #include <lib/heap.h>
 #include <lk/debug.h>
@@ -30,11 +31,15 @@
 #include <malloc.h>
 #include <platform.h>
 #include <printf.h>
+#include <stdlib.h>
 #include <string.h>
 #include <target.h>
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
+#if WITH_LIB_SLAB
+#include <lib/slab.h>
+#endif
 
 #if THREAD_STATS
 struct thread_stats thread_stats[SMP_MAX_CPUS];
@@ -48,15 +53,66 @@ struct thread_stats thread_stats[SMP_MAX_CPUS];
 /* global thread list */
 struct list_node thread_list;
 
-/* master thread spinlock */
+/* thread list and lifecycle spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* the per cpu run queues, each protected by its own scheduler lock */
+struct run_queue {
+    spin_lock_t lock;
+    struct list_node queue[NUM_PRIORITIES];
+    uint32_t bitmap;
+    uint count; /* number of ready threads in all of the queues */
+#if WITH_KERNEL_SCHED_DEADLINE
+    /* ready deadline threads, earliest deadline first */
+    struct list_node deadline_queue;
+#endif
+
+    /* threads woken with reschedule set, run once the wait queue lock is dropped */
+    struct list_node resched_list;
+
+    /* detached thread exiting on this cpu, freed after it has switched out */
+    thread_t *dead_thread;
+
+    /* when the running thread was last charged for its time on the cpu */
+    lk_bigtime_t slice_start;
+#if WITH_SMP
+    lk_bigtime_t next_balance;
+#endif
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* one shot preemption timer and when it is due, 0 if it is not armed */
+    timer_t preempt_timer;
+    lk_bigtime_t preempt_time;
+#endif
+} __CPU_ALIGN;
+
+static struct run_queue run_queues[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queues[0].bitmap) * 8);
+
+/* time slice of a normal thread, in usecs */
+#ifndef THREAD_QUANTUM
+#define THREAD_QUANTUM 50000
+#endif
+
+#if WITH_SMP
+/* how often (in msecs) each busy cpu runs a load balancing pass */
+#ifndef THREAD_BALANCE_INTERVAL
+#define THREAD_BALANCE_INTERVAL 100
+#endif
+#endif
+
+#if WITH_KERNEL_SCHED_DEADLINE
+/* share of each cpu deadline threads may reserve, in 1/1024ths */
+#ifndef THREAD_DEADLINE_MAX_UTIL
+#define THREAD_DEADLINE_MAX_UTIL 972
+#endif
+/* longest period a deadline thread may ask for, in msecs */
+#define THREAD_DEADLINE_MAX_PERIOD 60000
+
+/* bandwidth reserved by deadline threads on each cpu, protected by the thread lock */
+static uint deadline_util[SMP_MAX_CPUS];
+#endif
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -67,53 +123,460 @@ static thread_t _idle_thread;
 #define idle_thread(cpu) (&_idle_thread)
 #endif
 
+#if WITH_LIB_SLAB
+/* dynamically allocated thread structures */
+static slab_cache_t thread_cache =
+    SLAB_CACHE_INITIAL_VALUE(thread_cache, "thread_t", sizeof(thread_t), __alignof(thread_t));
+#define thread_struct_alloc() ((thread_t *)slab_alloc(&thread_cache))
+#define thread_struct_free(t) slab_free(&thread_cache, (t))
+#else
+#define thread_struct_alloc() ((thread_t *)malloc(sizeof(thread_t)))
+#define thread_struct_free(t) free(t)
+#endif
+
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
-static timer_t preempt_timer[SMP_MAX_CPUS];
+/* scheduler lock of an arbitrary cpu, for code that does not switch threads */
+static inline void sched_lock(uint cpu) {
+    spin_lock_class(&run_queues[cpu].lock, LOCK_CLASS_SCHEDULER);
+}
+
+static inline int sched_trylock(uint cpu) {
+    return spin_trylock_class(&run_queues[cpu].lock, LOCK_CLASS_SCHEDULER);
+}
+
+static inline void sched_unlock(uint cpu) {
+    spin_unlock_class(&run_queues[cpu].lock);
+}
+
+#define SCHED_LOCK(state) arch_interrupt_saved_state_t state = arch_interrupt_save(); thread_sched_lock()
+#define SCHED_UNLOCK(state) do { thread_sched_unlock(); arch_interrupt_restore(state); } while (0)
+
+static bool thread_is_realtime(thread_t *t) {
+    return (t->flags & THREAD_FLAG_REAL_TIME) && t->priority > DEFAULT_PRIORITY;
+}
+
+static bool thread_is_idle(thread_t *t) {
+    return !!(t->flags & THREAD_FLAG_IDLE);
+}
+
+static bool thread_is_real_time_or_idle(thread_t *t) {
+    return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
+}
+
+static bool thread_is_deadline(thread_t *t) {
+#if WITH_KERNEL_SCHED_DEADLINE
+    return !!(t->flags & THREAD_FLAG_DEADLINE);
+#else
+    return false;
 #endif
+}
 
-/* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t) {
-    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
-    DEBUG_ASSERT(t->state == THREAD_READY);
-    DEBUG_ASSERT(!list_in_list(&t->queue_node));
+static void thread_free_dead(thread_t *t) {
+    /* interrupts are disabled here, so let the heap free them later */
+    if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
+        heap_delayed_free(t->stack);
+
+    if (t->flags & THREAD_FLAG_FREE_STRUCT) {
+#if WITH_LIB_SLAB
+        /* slab_free is safe with interrupts disabled */
+        thread_struct_free(t);
+#else
+        heap_delayed_free(t);
+#endif
+    }
+}
+
+void thread_sched_lock(void) {
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    sched_lock(arch_curr_cpu_num());
+}
+
+void thread_sched_unlock(void) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    struct run_queue *rq = &run_queues[arch_curr_cpu_num()];
+
+    /* a detached thread that exited on this cpu is now off its stack */
+    thread_t *dead = rq->dead_thread;
+    rq->dead_thread = NULL;
+
+    spin_unlock_class(&rq->lock);
+
+    if (unlikely(dead))
+        thread_free_dead(dead);
+}
+
+bool thread_sched_lock_held(void) {
+    return spin_lock_held(&run_queues[arch_curr_cpu_num()].lock);
 }
 
-static void insert_in_run_queue_tail(thread_t *t) {
+/* run queue manipulation, with the queue's scheduler lock held */
+static void run_queue_insert(struct run_queue *rq, thread_t *t, bool head) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&rq->lock));
+
+#if WITH_KERNEL_SCHED_DEADLINE
+    if (thread_is_deadline(t)) {
+        /* keep the queue sorted by deadline, head only matters among equal ones */
+        thread_t *pos;
+        list_for_every_entry(&rq->deadline_queue, pos, thread_t, queue_node) {
+            if (t->dl.abs_deadline < pos->dl.abs_deadline ||
+                    (head && t->dl.abs_deadline == pos->dl.abs_deadline)) {
+                list_add_before(&pos->queue_node, &t->queue_node);
+                rq->count++;
+                return;
+            }
+        }
+        list_add_tail(&rq->deadline_queue, &t->queue_node);
+        rq->count++;
+        return;
+    }
+#endif
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    if (head)
+        list_add_head(&rq->queue[t->priority], &t->queue_node);
+    else
+        list_add_tail(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U<<t->priority);
+    rq->count++;
 }
 
-static void wakeup_cpu_for_thread(thread_t *t)
-{
-    /* Wake up the core to which this thread is pinned
-     * or wake up all if thread is unpinned */
+static void run_queue_remove(struct run_queue *rq, thread_t *t) {
+    DEBUG_ASSERT(list_in_list(&t->queue_node));
+    DEBUG_ASSERT(spin_lock_held(&rq->lock));
+
+    list_delete(&t->queue_node);
+    if (!thread_is_deadline(t) && list_is_empty(&rq->queue[t->priority]))
+        rq->bitmap &= ~(1U<<t->priority);
+    rq->count--;
+}
+
+/*
+ * Pick the cpu whose run queue a ready thread should go on. Pinned threads
+ * always go to their cpu. Otherwise prefer, in order, an idle cpu with an empty
+ * run queue (starting with the one the thread last ran on, then this one), the local cpu if
+ * the thread would preempt what is running here, and then the last cpu the
+ * thread ran on to keep its cache warm.
+ */
+static uint thread_target_cpu(thread_t *t) {
+#if WITH_SMP
     int pinned_cpu = thread_pinned_cpu(t);
-    if (pinned_cpu < 0)
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-    else
-        mp_reschedule(1U << pinned_cpu, 0);
+    if (pinned_cpu >= 0)
+        return pinned_cpu;
+
+    uint local_cpu = arch_curr_cpu_num();
+    int last_cpu = thread_last_cpu(t);
+
+    mp_cpu_mask_t idle = mp_get_idle_mask() & mp.active_cpus & ~mp_get_realtime_mask();
+    if (idle) {
+        if (last_cpu >= 0 && (idle & (1U << last_cpu)) && run_queues[last_cpu].count == 0)
+            return last_cpu;
+        if ((idle & (1U << local_cpu)) && run_queues[local_cpu].count == 0)
+            return local_cpu;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if ((idle & (1U << i)) && run_queues[i].count == 0)
+                return i;
+        }
+    }
+
+    if (t->priority > get_current_thread()->priority)
+        return local_cpu;
+
+    if (last_cpu >= 0 && mp_is_cpu_active(last_cpu))
+        return last_cpu;
+
+    return local_cpu;
+#else
+    return 0;
+#endif
+}
+
+/* put the current thread back on the local run queue, local scheduler lock held */
+static void insert_in_local_run_queue(thread_t *t, bool head) {
+    DEBUG_ASSERT(t == get_current_thread());
+
+    run_queue_insert(&run_queues[arch_curr_cpu_num()], t, head);
 }
 
+static void wakeup_cpu(uint cpu) {
+    /* mp_reschedule masks off the local cpu for us */
+    mp_reschedule(1U << cpu, 0);
+}
+
+/*
+ * A thread that has just blocked may still be in the middle of switching out
+ * on the cpu it last ran on, with that cpu's scheduler lock held. Wait for the
+ * switch to finish before letting anything else run it or free it.
+ */
+static void thread_wait_switched_out(thread_t *t, uint cpu) {
+#if WITH_SMP
+    int last_cpu = thread_last_cpu(t);
+    if (last_cpu >= 0 && (uint)last_cpu != cpu) {
+        sched_lock(last_cpu);
+        sched_unlock(last_cpu);
+    }
+#endif
+}
+
+/*
+ * Charge the running thread for the time since it was last charged, against
+ * its time slice or its deadline budget. Local scheduler lock held.
+ */
+static void thread_charge_slice(struct run_queue *rq, thread_t *t, lk_bigtime_t now) {
+    lk_bigtime_t ran = now - rq->slice_start;
+    rq->slice_start = now;
+
+#if WITH_KERNEL_SCHED_DEADLINE
+    if (thread_is_deadline(t)) {
+        t->dl.budget -= (int64_t)ran;
+        return;
+    }
+#endif
+    if (!thread_is_real_time_or_idle(t))
+        t->remaining_quantum -= (int)MIN(ran, (lk_bigtime_t)THREAD_QUANTUM);
+}
+
+/* true if a ready deadline thread on this run queue should take the cpu from t */
+static bool thread_deadline_preempts(struct run_queue *rq, thread_t *t) {
+#if WITH_KERNEL_SCHED_DEADLINE
+    thread_t *first = list_peek_head_type(&rq->deadline_queue, thread_t, queue_node);
+    if (!first)
+        return false;
+    return !thread_is_deadline(t) || first->dl.abs_deadline < t->dl.abs_deadline;
+#else
+    return false;
+#endif
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * The scheduler does not tick on platforms with a one shot timer. The
+ * preemption timer is only armed for the next point the thread running here
+ * could lose the cpu: the end of its time slice while a thread of the same or
+ * higher priority is waiting, the end of a deadline thread's budget, or the
+ * next load balancing pass. A cpu running its idle thread or a real time
+ * thread takes no scheduler interrupts at all. Local scheduler lock held.
+ */
+static void thread_update_preempt_timer(uint cpu, thread_t *t, lk_bigtime_t now) {
+    struct run_queue *rq = &run_queues[cpu];
+    bool arm = false;
+    lk_bigtime_t when = 0;
+
+    if (thread_deadline_preempts(rq, t)) {
+        arm = true;
+        when = now;
+#if WITH_KERNEL_SCHED_DEADLINE
+    } else if (thread_is_deadline(t)) {
+        arm = true;
+        when = rq->slice_start + MAX(t->dl.budget, 0);
+#endif
+    } else if (!thread_is_real_time_or_idle(t)) {
+        if (rq->bitmap >> t->priority) {
+            arm = true;
+            when = rq->slice_start + MAX(t->remaining_quantum, 0);
+        }
+#if WITH_SMP
+        if (!arm || rq->next_balance < when) {
+            arm = true;
+            when = rq->next_balance;
+        }
+#endif
+    }
+
+    /* preempt_time is never 0 while armed, when is at least now */
+    if (arm)
+        when = MAX(when, now);
+    if (when == rq->preempt_time)
+        return;
+
+    if (rq->preempt_time)
+        timer_cancel(&rq->preempt_timer);
+    rq->preempt_time = when;
+    if (arm)
+        timer_set_oneshot(&rq->preempt_timer, (lk_time_t)((when - now + 999) / 1000), &thread_timer_tick, NULL);
+}
+#endif
+
+#if WITH_KERNEL_SCHED_DEADLINE
+/*
+ * A deadline thread that wakes up keeps its deadline and what is left of its
+ * budget, unless it has missed the deadline or running out the budget before
+ * the deadline would take more than its reserved share of the cpu. Then it
+ * starts a fresh job, as a constant bandwidth server would.
+ */
+static void thread_deadline_wakeup(thread_t *t, lk_bigtime_t now) {
+    struct thread_deadline *dl = &t->dl;
+
+    if (now >= dl->abs_deadline ||
+            dl->budget * (int64_t)dl->period > (int64_t)(dl->abs_deadline - now) * (int64_t)dl->runtime) {
+        dl->abs_deadline = now + dl->deadline;
+        dl->budget = dl->runtime;
+    }
+}
+#endif
+
+/*
+ * Put a thread that was just woken at the head of cpu's run queue, with that
+ * cpu's scheduler lock held. Every wakeup goes through here, so deadline
+ * budgets are replenished and the trace and event log see all of them.
+ */
+static void run_queue_insert_woken(uint cpu, thread_t *t) {
+#if WITH_KERNEL_SCHED_DEADLINE
+    if (thread_is_deadline(t))
+        thread_deadline_wakeup(t, current_time_hires());
+#endif
+
+    run_queue_insert(&run_queues[cpu], t, true);
+    sched_trace_wakeup(t, run_queues[cpu].count);
+
+    KEVLOG_THREAD_WAKEUP(t, cpu);
+}
+
+/*
+ * Put a thread that just became ready at the head of a run queue picked by
+ * thread_target_cpu(). Must be called with interrupts disabled and no
+ * scheduler lock held. Returns the cpu the thread was queued on.
+ */
+static uint thread_make_runnable(thread_t *t) {
+    DEBUG_ASSERT(t->state == THREAD_READY);
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    uint cpu = thread_target_cpu(t);
+
+    thread_wait_switched_out(t, cpu);
+
+    sched_lock(cpu);
+    run_queue_insert_woken(cpu, t);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* other cpus get an ipi, but this one may have to arm its timer to be preempted */
+    if (cpu == arch_curr_cpu_num())
+        thread_update_preempt_timer(cpu, get_current_thread(), current_time_hires());
+#endif
+    sched_unlock(cpu);
+
+    return cpu;
+}
+
+#if WITH_KERNEL_SCHED_DEADLINE
+/* timer callback that releases a throttled deadline thread into its next period */
+static enum handler_return thread_deadline_release(timer_t *timer, lk_time_t now, void *arg) {
+    thread_t *t = (thread_t *)arg;
+
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(t->state == THREAD_SLEEPING);
+
+    t->state = THREAD_READY;
+    wakeup_cpu(thread_make_runnable(t));
+
+    return INT_RESCHEDULE;
+}
+#endif
+
+/*
+ * Called with the current thread charged and on its way back to the run queue.
+ * A deadline thread that has used up its budget gets a fresh one for its next
+ * period, and sleeps until that period starts unless it is already overdue.
+ * Returns true if the thread was put to sleep. Local scheduler lock held.
+ */
+static bool thread_deadline_throttle(thread_t *t, lk_bigtime_t now) {
+#if WITH_KERNEL_SCHED_DEADLINE
+    if (!thread_is_deadline(t) || t->dl.budget > 0)
+        return false;
+
+    struct thread_deadline *dl = &t->dl;
+    lk_bigtime_t release = dl->abs_deadline - dl->deadline + dl->period;
+
+    dl->abs_deadline = MAX(release, now) + dl->deadline;
+    dl->budget = dl->runtime;
+    if (release <= now)
+        return false;
+
+    t->state = THREAD_SLEEPING;
+    timer_set_oneshot(&dl->timer, (lk_time_t)((release - now + 999) / 1000), &thread_deadline_release, t);
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if WITH_SMP
+/* find the highest priority thread on another cpu's run queue that may run on this cpu */
+static thread_t *run_queue_find_migratable(struct run_queue *rq, uint cpu) {
+    uint32_t bitmap = rq->bitmap;
+
+    while (bitmap) {
+        uint prio = sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
+
+        thread_t *t;
+        list_for_every_entry(&rq->queue[prio], t, thread_t, queue_node) {
+            int pinned_cpu = thread_pinned_cpu(t);
+            if (pinned_cpu < 0 || pinned_cpu == (int)cpu)
+                return t;
+        }
+
+        bitmap &= ~(1U << prio);
+    }
+
+    return NULL;
+}
+
+/*
+ * Pull one thread from the busiest other cpu onto this one. Only cpus with at
+ * least min_imbalance more ready threads than this one are considered.
+ */
+static thread_t *steal_thread(uint cpu, uint min_imbalance) {
+    DEBUG_ASSERT(spin_lock_held(&run_queues[cpu].lock));
+
+    uint local_count = run_queues[cpu].count;
+    mp_cpu_mask_t tried = 1U << cpu;
+
+    for (;;) {
+        struct run_queue *busiest = NULL;
+        uint busiest_cpu = 0;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if ((tried & (1U << i)) || !mp_is_cpu_active(i))
+                continue;
+            struct run_queue *rq = &run_queues[i];
+            if (rq->count == 0 || rq->count < local_count + min_imbalance)
+                continue;
+            if (!busiest || rq->count > busiest->count) {
+                busiest = rq;
+                busiest_cpu = i;
+            }
+        }
+        if (!busiest)
+            return NULL;
+
+        /* we already hold our own scheduler lock, so never wait on another one */
+        if (sched_trylock(busiest_cpu) == 0) {
+            thread_t *t = run_queue_find_migratable(busiest, cpu);
+            if (t)
+                run_queue_remove(busiest, t);
+            sched_unlock(busiest_cpu);
+            if (t)
+                return t;
+        }
+
+        /* contended, or everything on that queue is pinned to its cpu, try the next busiest */
+        tried |= 1U << busiest_cpu;
+    }
+}
+#endif
+
 static void init_thread_struct(thread_t *t, const char *name) {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
     thread_set_pinned_cpu(t, -1);
+#if WITH_SMP
+    t->last_cpu = -1;
+#endif
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -148,7 +611,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     unsigned int flags = 0;
 
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        t = thread_struct_alloc();
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -180,7 +643,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         t->stack = malloc(stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
+                thread_struct_free(t);
             return NULL;
         }
         flags |= THREAD_FLAG_FREE_STACK;
@@ -241,29 +704,90 @@ status_t thread_set_real_time(thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
     THREAD_LOCK(state);
+    t->flags |= THREAD_FLAG_REAL_TIME;
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
-        /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        /* if we're currently running, the preemption timer is no longer needed */
+        uint cpu = arch_curr_cpu_num();
+        sched_lock(cpu);
+        thread_update_preempt_timer(cpu, t, current_time_hires());
+        sched_unlock(cpu);
     }
 #endif
-    t->flags |= THREAD_FLAG_REAL_TIME;
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
 }
 
-static bool thread_is_realtime(thread_t *t) {
-    return (t->flags & THREAD_FLAG_REAL_TIME) && t->priority > DEFAULT_PRIORITY;
-}
+#if WITH_KERNEL_SCHED_DEADLINE
+/**
+ * @brief Make a thread deadline scheduled
+ *
+ * The thread gets runtime msecs of cpu time every period msecs, to be used up
+ * within deadline msecs of the start of each period. Ready deadline threads
+ * run ahead of every priority level, earliest deadline first, and one that has
+ * used up its runtime sleeps until its next period starts. Each thread stays on
+ * one cpu and is only admitted if that cpu has enough bandwidth left.
+ *
+ * Must be called before the thread is first resumed. A periodic thread ends
+ * each of its jobs with thread_deadline_yield().
+ *
+ * @param t Thread to schedule by deadline
+ * @param runtime Budget per period, in msecs
+ * @param deadline Deadline relative to the start of each period, in msecs
+ * @param period Length of the period, in msecs
+ *
+ * @return NO_ERROR on success, ERR_NO_RESOURCES if the cpu has no bandwidth left
+ */
+status_t thread_set_deadline(thread_t *t, lk_time_t runtime, lk_time_t deadline, lk_time_t period) {
+    if (!t || runtime == 0 || runtime > deadline || deadline > period ||
+            period > THREAD_DEADLINE_MAX_PERIOD)
+        return ERR_INVALID_ARGS;
 
-static bool thread_is_idle(thread_t *t) {
-    return !!(t->flags & THREAD_FLAG_IDLE);
-}
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
-static bool thread_is_real_time_or_idle(thread_t *t) {
-    return !!(t->flags & (THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE));
+    uint util = (uint)(((uint64_t)runtime * 1024 + period - 1) / period);
+    status_t err = NO_ERROR;
+
+    THREAD_LOCK(state);
+    if (t->state != THREAD_SUSPENDED ||
+            (t->flags & (THREAD_FLAG_DEADLINE | THREAD_FLAG_REAL_TIME | THREAD_FLAG_IDLE))) {
+        err = ERR_BAD_STATE;
+    } else {
+        /* a pinned thread has to fit on its cpu, otherwise take the least loaded one */
+        int cpu = thread_pinned_cpu(t);
+        if (cpu < 0) {
+            cpu = 0;
+            for (uint i = 1; i < SMP_MAX_CPUS; i++) {
+                if (mp_is_cpu_active(i) && deadline_util[i] < deadline_util[cpu])
+                    cpu = i;
+            }
+        }
+
+        if (deadline_util[cpu] + util > THREAD_DEADLINE_MAX_UTIL) {
+            err = ERR_NO_RESOURCES;
+        } else {
+            deadline_util[cpu] += util;
+
+            struct thread_deadline *dl = &t->dl;
+            dl->runtime = runtime * 1000ULL;
+            dl->deadline = deadline * 1000ULL;
+            dl->period = period * 1000ULL;
+            dl->abs_deadline = 0;
+            dl->budget = 0;
+            dl->cpu = cpu;
+            dl->util = util;
+            timer_initialize(&dl->timer);
+
+            thread_set_pinned_cpu(t, cpu);
+            t->flags |= THREAD_FLAG_DEADLINE;
+        }
+    }
+    THREAD_UNLOCK(state);
+
+    return err;
 }
+#endif
 
 /**
  * @brief  Make a suspended thread executable.
@@ -284,12 +808,12 @@ status_t thread_resume(thread_t *t) {
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        uint cpu = thread_make_runnable(t);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
-    }
 
-    wakeup_cpu_for_thread(t);
+        wakeup_cpu(cpu);
+    }
 
     THREAD_UNLOCK(state);
 
@@ -320,7 +844,14 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
 
     /* wait for the thread to die */
     if (t->state != THREAD_DEATH) {
+        /* take the wait queue lock before dropping the thread lock so the exit
+         * wakeup can't be missed, then block without the thread lock */
+        spin_lock_class(&t->retcode_wait_queue.lock, LOCK_CLASS_WAIT_QUEUE);
+        spin_unlock_class(&thread_lock);
+
         status_t err = wait_queue_block(&t->retcode_wait_queue, timeout);
+
+        spin_lock_class(&thread_lock, LOCK_CLASS_THREAD);
         if (err < 0) {
             THREAD_UNLOCK(state);
             return err;
@@ -342,6 +873,9 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
     /* clear the structure's magic */
     t->magic = 0;
 
+    /* it may still be on its way out of its final context switch */
+    thread_wait_switched_out(t, arch_curr_cpu_num());
+
     THREAD_UNLOCK(state);
 
     /* free its stack and the thread structure itself */
@@ -349,7 +883,7 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
         free(t->stack);
 
     if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        thread_struct_free(t);
 
     return NO_ERROR;
 }
@@ -361,7 +895,9 @@ status_t thread_detach(thread_t *t) {
 
     /* if another thread is blocked inside thread_join() on this thread,
      * wake them up with a specific return code */
+    spin_lock_class(&t->retcode_wait_queue.lock, LOCK_CLASS_WAIT_QUEUE);
     wait_queue_wake_all(&t->retcode_wait_queue, false, ERR_THREAD_DETACHED);
+    spin_unlock_class(&t->retcode_wait_queue.lock);
 
     /* if it's already dead, then just do what join would have and exit */
     if (t->state == THREAD_DEATH) {
@@ -398,29 +934,35 @@ void thread_exit(int retcode) {
     current_thread->state = THREAD_DEATH;
     current_thread->retcode = retcode;
 
+#if WITH_KERNEL_SCHED_DEADLINE
+    /* hand back the bandwidth a deadline thread reserved */
+    if (thread_is_deadline(current_thread))
+        deadline_util[current_thread->dl.cpu] -= current_thread->dl.util;
+#endif
+
     /* if we're detached, then do our teardown here */
-    if (current_thread->flags & THREAD_FLAG_DETACHED) {
+    bool detached = current_thread->flags & THREAD_FLAG_DETACHED;
+    if (detached) {
         /* remove it from the master thread list */
         list_delete(&current_thread->thread_list_node);
 
         /* clear the structure's magic */
         current_thread->magic = 0;
-
-        /* free its stack and the thread structure itself */
-        if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack) {
-            heap_delayed_free(current_thread->stack);
-
-            /* make sure its not going to get a bounds check performed on the half-freed stack */
-            current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
-        }
-
-        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
     } else {
         /* signal if anyone is waiting */
+        spin_lock_class(&current_thread->retcode_wait_queue.lock, LOCK_CLASS_WAIT_QUEUE);
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
+        spin_unlock_class(&current_thread->retcode_wait_queue.lock);
     }
 
+    /* switch to the scheduler lock, which the next thread to run here releases */
+    thread_sched_lock();
+    spin_unlock_class(&thread_lock);
+
+    /* the stack and structure are freed once we are off of them */
+    if (detached)
+        run_queues[arch_curr_cpu_num()].dead_thread = current_thread;
+
     /* reschedule */
     thread_resched();
 
@@ -433,29 +975,56 @@ static void idle_thread_routine(void) {
 }
 
 static thread_t *get_top_thread(int cpu) {
+    struct run_queue *rq = &run_queues[cpu];
+    uint32_t bitmap = rq->bitmap;
     thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    thread_t *temp;
+
+#if WITH_KERNEL_SCHED_DEADLINE
+    /* deadline threads never migrate, and run ahead of everything else */
+    newthread = list_peek_head_type(&rq->deadline_queue, thread_t, queue_node);
+    if (newthread) {
+        run_queue_remove(rq, newthread);
+        return newthread;
+    }
+#endif
 
-    while (local_run_queue_bitmap) {
+    while (bitmap) {
         /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+        uint next_queue = sizeof(bitmap) * 8 - 1 - __builtin_clz(bitmap);
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
+        list_for_every_entry_safe(&rq->queue[next_queue], newthread, temp, thread_t, queue_node) {
 #if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
-#endif
-            {
-                list_delete(&newthread->queue_node);
-
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
-
-                return newthread;
+            /* the thread may have been pinned to another cpu since it was queued here.
+             * hand it over if that cpu's queue is free, otherwise leave it for later.
+             * the current thread is still on this cpu's stack and can't be moved yet. */
+            int pinned_cpu = thread_pinned_cpu(newthread);
+            if (unlikely(pinned_cpu >= 0 && pinned_cpu != cpu)) {
+                if (newthread != get_current_thread() && sched_trylock(pinned_cpu) == 0) {
+                    run_queue_remove(rq, newthread);
+                    run_queue_insert(&run_queues[pinned_cpu], newthread, false);
+                    sched_unlock(pinned_cpu);
+                    wakeup_cpu(pinned_cpu);
+                }
+                continue;
             }
+#endif
+            run_queue_remove(rq, newthread);
+            return newthread;
         }
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+        bitmap &= ~(1U << next_queue);
+    }
+
+#if WITH_SMP
+    /* nothing to run locally, try to take some work from a busier cpu */
+    newthread = steal_thread(cpu, 1);
+    if (newthread) {
+        THREAD_STATS_INC(steals);
+        return newthread;
     }
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
@@ -467,6 +1036,10 @@ static thread_t *get_top_thread(int cpu) {
  * state and queues it needs to be in. This routine simply picks the next thread and
  * switches to it.
  *
+ * Must be called with the local scheduler lock held and no other spinlock. The
+ * lock is released by whichever thread runs next on this cpu, so callers must
+ * release it with thread_sched_unlock() rather than cache the lock.
+ *
  * This is probably not the function you're looking for. See
  * thread_yield() instead.
  */
@@ -478,27 +1051,39 @@ void thread_resched(void) {
     uint cpu = arch_curr_cpu_num();
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&run_queues[cpu].lock));
     DEBUG_ASSERT(current_thread->state != THREAD_RUNNING);
+    DEBUG_ASSERT(list_is_empty(&run_queues[cpu].resched_list));
+#if WITH_KERNEL_LOCK_ORDER_CHECK
+    /* nothing but the scheduler lock may be carried across a context switch */
+    DEBUG_ASSERT(lock_order_held_count() == 1);
+#endif
 
     THREAD_STATS_INC(reschedules);
 
+    lk_bigtime_t now = current_time_hires();
+    thread_charge_slice(&run_queues[cpu], current_thread, now);
+
     newthread = get_top_thread(cpu);
 
     DEBUG_ASSERT(newthread);
 
     newthread->state = THREAD_RUNNING;
 
+    /* set up quantum for the new thread if it was consumed */
+    if (newthread->remaining_quantum <= 0) {
+        newthread->remaining_quantum = THREAD_QUANTUM;
+    }
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    thread_update_preempt_timer(cpu, newthread, now);
+#endif
+
     oldthread = current_thread;
 
     if (newthread == oldthread)
         return;
 
-    /* set up quantum for the new thread if it was consumed */
-    if (newthread->remaining_quantum <= 0) {
-        newthread->remaining_quantum = 5; // XXX make this smarter
-    }
-
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
@@ -520,7 +1105,6 @@ void thread_resched(void) {
 #if THREAD_STATS
     THREAD_STATS_INC(context_switches);
 
-    lk_bigtime_t now = current_time_hires();
     if (thread_is_idle(oldthread)) {
         thread_stats[cpu].idle_time += now - thread_stats[cpu].last_idle_timestamp;
     } else {
@@ -535,28 +1119,7 @@ void thread_resched(void) {
 #endif
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
-
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-        timer_set_periodic(&preempt_timer[cpu], 10, thread_timer_tick, NULL);
-    }
-#endif
+    sched_trace_switch(oldthread, newthread);
 
     /* set some optional target debug leds */
     target_set_debug_led(0, !thread_is_idle(newthread));
@@ -618,21 +1181,56 @@ void thread_yield(void) {
     DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
 
-    THREAD_LOCK(state);
+    SCHED_LOCK(state);
 
     THREAD_STATS_INC(yields);
 
+    lk_bigtime_t now = current_time_hires();
+    thread_charge_slice(&run_queues[arch_curr_cpu_num()], current_thread, now);
+
     /* we are yielding the cpu, so stick ourselves into the tail of the run queue and reschedule */
     current_thread->state = THREAD_READY;
     current_thread->remaining_quantum = 0;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        insert_in_run_queue_tail(current_thread);
+        if (!thread_deadline_throttle(current_thread, now))
+            insert_in_local_run_queue(current_thread, false);
     }
     thread_resched();
 
-    THREAD_UNLOCK(state);
+    SCHED_UNLOCK(state);
 }
 
+#if WITH_KERNEL_SCHED_DEADLINE
+/**
+ * @brief  Finish the current job of a deadline thread
+ *
+ * Gives up what is left of the budget, so the thread sleeps until its next
+ * period starts.
+ */
+void thread_deadline_yield(void) {
+    thread_t *current_thread = get_current_thread();
+
+    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
+    DEBUG_ASSERT(thread_is_deadline(current_thread));
+
+    SCHED_LOCK(state);
+
+    THREAD_STATS_INC(yields);
+
+    lk_bigtime_t now = current_time_hires();
+    thread_charge_slice(&run_queues[arch_curr_cpu_num()], current_thread, now);
+
+    current_thread->state = THREAD_READY;
+    current_thread->dl.budget = 0;
+    if (!thread_deadline_throttle(current_thread, now))
+        insert_in_local_run_queue(current_thread, false);
+    thread_resched();
+
+    SCHED_UNLOCK(state);
+}
+#endif
+
 /**
  * @brief  Briefly yield cpu to another thread
  *
@@ -661,19 +1259,25 @@ void thread_preempt(void) {
 
     KEVLOG_THREAD_PREEMPT(current_thread);
 
-    THREAD_LOCK(state);
+    SCHED_LOCK(state);
+
+    lk_bigtime_t now = current_time_hires();
+    thread_charge_slice(&run_queues[arch_curr_cpu_num()], current_thread, now);
 
     /* we are being preempted, so we get to go back into the front of the run queue if we have quantum left */
     current_thread->state = THREAD_READY;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        if (current_thread->remaining_quantum > 0)
-            insert_in_run_queue_head(current_thread);
-        else
-            insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+        if (thread_deadline_throttle(current_thread, now)) {
+            /* out of budget, sleeps until its next period */
+        } else if (current_thread->remaining_quantum > 0) {
+            insert_in_local_run_queue(current_thread, true);
+        } else {
+            insert_in_local_run_queue(current_thread, false); /* if we're out of quantum, go to the tail of the queue */
+        }
     }
     thread_resched();
 
-    THREAD_UNLOCK(state);
+    SCHED_UNLOCK(state);
 }
 
 /**
@@ -691,39 +1295,110 @@ void thread_block(void) {
 
     DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_BLOCKED);
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(thread_sched_lock_held());
     DEBUG_ASSERT(!thread_is_idle(current_thread));
 
     /* we are blocking on something. the blocking code should have already stuck us on a queue */
     thread_resched();
 }
 
+/*
+ * Make a blocked thread runnable again. The caller holds whatever lock protects
+ * the thread's blocked state, but no scheduler lock. If resched is set the
+ * current thread is preempted, so no spinlock may be held at all.
+ */
 void thread_unblock(thread_t *t, bool resched) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_BLOCKED);
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(arch_ints_disabled());
     DEBUG_ASSERT(!thread_is_idle(t));
 
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    wakeup_cpu_for_thread(t);
+    wakeup_cpu(thread_make_runnable(t));
 
     if (resched)
-        thread_resched();
+        thread_preempt();
 }
 
+#if WITH_SMP
+/*
+ * Periodic load balancing, run from the scheduler tick of a busy cpu. Pulls a
+ * thread over from a cpu that has noticeably more ready threads than this one,
+ * and kicks any idle cpus if there is work queued up here for them to steal.
+ * Returns true if a thread was pulled that should preempt the current one.
+ */
+static bool thread_balance(uint cpu) {
+    bool resched = false;
+
+    sched_lock(cpu);
+
+    thread_t *t = steal_thread(cpu, 2);
+    if (t) {
+        THREAD_STATS_INC(balances);
+        run_queue_insert(&run_queues[cpu], t, false);
+        resched = t->priority > get_current_thread()->priority;
+    }
+
+    if (run_queues[cpu].count > 0) {
+        mp_cpu_mask_t idle = mp_get_idle_mask() & mp.active_cpus;
+        if (idle)
+            mp_reschedule(idle, 0);
+    }
+
+    sched_unlock(cpu);
+
+    return resched;
+}
+#endif
+
+/*
+ * Scheduler timer callback. Runs from the periodic timer tick on platforms
+ * without a one shot timer, and otherwise only when the preemption timer set
+ * up by thread_update_preempt_timer() fires.
+ */
 enum handler_return thread_timer_tick(struct timer *t, lk_time_t now, void *arg) {
     thread_t *current_thread = get_current_thread();
+    uint cpu = arch_curr_cpu_num();
+    struct run_queue *rq = &run_queues[cpu];
+    bool resched = false;
 
-    if (thread_is_real_time_or_idle(current_thread))
-        return INT_NO_RESCHEDULE;
+    lk_bigtime_t now_hires = current_time_hires();
 
-    current_thread->remaining_quantum--;
-    if (current_thread->remaining_quantum <= 0) {
-        return INT_RESCHEDULE;
-    } else {
-        return INT_NO_RESCHEDULE;
+#if WITH_SMP
+    /* only this cpu touches its balance time, and only with interrupts disabled */
+    if (!thread_is_real_time_or_idle(current_thread) && !thread_is_deadline(current_thread) &&
+            now_hires >= rq->next_balance) {
+        rq->next_balance = now_hires + THREAD_BALANCE_INTERVAL * 1000ULL;
+        resched = thread_balance(cpu);
     }
+#endif
+
+    sched_lock(cpu);
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* it just fired */
+    rq->preempt_time = 0;
+#endif
+
+    thread_charge_slice(rq, current_thread, now_hires);
+    if (thread_deadline_preempts(rq, current_thread))
+        resched = true;
+#if WITH_KERNEL_SCHED_DEADLINE
+    else if (thread_is_deadline(current_thread))
+        resched = resched || current_thread->dl.budget <= 0;
+#endif
+    else if (!thread_is_real_time_or_idle(current_thread))
+        resched = resched || current_thread->remaining_quantum <= 0;
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* otherwise the reschedule sets it up again */
+    if (!resched)
+        thread_update_preempt_timer(cpu, current_thread, now_hires);
+#endif
+
+    sched_unlock(cpu);
+
+    return resched ? INT_RESCHEDULE : INT_NO_RESCHEDULE;
 }
 
 /* timer callback to wake up a sleeping thread */
@@ -733,12 +1408,8 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_SLEEPING);
 
-    THREAD_LOCK(state);
-
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-
-    THREAD_UNLOCK(state);
+    wakeup_cpu(thread_make_runnable(t));
 
     return INT_RESCHEDULE;
 }
@@ -764,11 +1435,11 @@ void thread_sleep(lk_time_t delay) {
 
     timer_initialize(&timer);
 
-    THREAD_LOCK(state);
+    SCHED_LOCK(state);
     timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
     thread_resched();
-    THREAD_UNLOCK(state);
+    SCHED_UNLOCK(state);
 }
 
 /**
@@ -782,8 +1453,15 @@ void thread_init_early(void) {
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&run_queues[cpu].lock);
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queues[cpu].queue[i]);
+#if WITH_KERNEL_SCHED_DEADLINE
+        list_initialize(&run_queues[cpu].deadline_queue);
+#endif
+        list_initialize(&run_queues[cpu].resched_list);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -811,7 +1489,7 @@ void thread_init_early(void) {
 void thread_init(void) {
 #if PLATFORM_HAS_DYNAMIC_TIMER
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        timer_initialize(&preempt_timer[i]);
+        timer_initialize(&run_queues[i].preempt_timer);
     }
 #endif
 }
@@ -832,7 +1510,7 @@ void thread_set_name(const char *name) {
 void thread_set_priority(int priority) {
     thread_t *current_thread = get_current_thread();
 
-    THREAD_LOCK(state);
+    SCHED_LOCK(state);
 
     if (priority <= IDLE_PRIORITY)
         priority = IDLE_PRIORITY + 1;
@@ -841,10 +1519,10 @@ void thread_set_priority(int priority) {
     current_thread->priority = priority;
 
     current_thread->state = THREAD_READY;
-    insert_in_run_queue_head(current_thread);
+    insert_in_local_run_queue(current_thread, true);
     thread_resched();
 
-    THREAD_UNLOCK(state);
+    SCHED_UNLOCK(state);
 }
 
 /**
@@ -992,6 +1670,12 @@ void dump_thread(const thread_t *t) {
             t->stack, t->stack_size, thread_stack_used(t));
 #else
     dprintf(INFO, "\tstack %p, stack_size %zd\n", t->stack, t->stack_size);
+#endif
+#if WITH_KERNEL_SCHED_DEADLINE
+    if (t->flags & THREAD_FLAG_DEADLINE) {
+        dprintf(INFO, "\tdeadline: runtime %llu period %llu deadline %llu us, budget %lld us, due %llu\n",
+                t->dl.runtime, t->dl.period, t->dl.deadline, (long long)t->dl.budget, t->dl.abs_deadline);
+    }
 #endif
     dprintf(INFO, "\tentry %p, arg %p, flags 0x%x\n", t->entry, t->arg, t->flags);
     dprintf(INFO, "\twait queue %p, wait queue ret %d\n", t->blocking_wait_queue, t->wait_queue_block_ret);
@@ -1067,23 +1751,117 @@ void wait_queue_init(wait_queue_t *wait) {
     *wait = (wait_queue_t)WAIT_QUEUE_INITIAL_VALUE(*wait);
 }
 
+/*
+ * Clear the wait queue a thread is blocked on as it comes off the queue, with the
+ * queue's lock held. The timeout handler looks the queue up without holding its
+ * lock, under the scheduler lock of the cpu the thread blocked on, so for a thread
+ * with a timeout armed the pointer only changes under that lock as well. Once the
+ * handler has seen it still set, the queue can't be woken and freed underneath it.
+ */
+static void wait_queue_clear_blocking(thread_t *t) {
+    if (t->wait_queue_timeout) {
+        uint cpu = thread_last_cpu(t);
+        sched_lock(cpu);
+        t->blocking_wait_queue = NULL;
+        sched_unlock(cpu);
+    } else {
+        t->blocking_wait_queue = NULL;
+    }
+}
+
 static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t now, void *arg) {
     thread_t *thread = (thread_t *)arg;
 
     DEBUG_ASSERT(thread->magic == THREAD_MAGIC);
 
-    spin_lock(&thread_lock);
+    /* the thread can't leave wait_queue_block() until this handler has returned,
+     * since it cancels the timer synchronously, and it doesn't run again until it
+     * is woken, so the cpu it last ran on stays put. The queue it is blocked on can
+     * be woken and freed by another cpu at any point though, so it is only looked
+     * up under that cpu's scheduler lock, see wait_queue_clear_blocking(). Waking
+     * takes the queue lock first, so only try for it here and back off if busy. */
+    uint cpu = thread_last_cpu(thread);
+    wait_queue_t *wait;
+    for (;;) {
+        sched_lock(cpu);
+        wait = thread->blocking_wait_queue;
+        if (!wait) {
+            sched_unlock(cpu);
+            return INT_NO_RESCHEDULE;
+        }
+        if (spin_trylock_class(&wait->lock, LOCK_CLASS_WAIT_QUEUE) == 0)
+            break;
+        sched_unlock(cpu);
+    }
+    /* with the queue lock held it can't be freed, and making the thread runnable
+     * needs the scheduler lock back */
+    sched_unlock(cpu);
 
     enum handler_return ret = INT_NO_RESCHEDULE;
     if (thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
         ret = INT_RESCHEDULE;
     }
 
-    spin_unlock(&thread_lock);
+    spin_unlock_class(&wait->lock);
 
     return ret;
 }
 
+/*
+ * Run the threads that were woken with reschedule set while a wait queue lock
+ * was held, ahead of the current thread. Called with interrupts disabled and no
+ * spinlocks held.
+ */
+static void thread_resched_woken(void) {
+    uint cpu = arch_curr_cpu_num();
+    struct run_queue *rq = &run_queues[cpu];
+    thread_t *current_thread = get_current_thread();
+    struct list_node woken = LIST_INITIAL_VALUE(woken);
+    thread_t *t;
+
+    /* threads pinned elsewhere go to their own cpu, the rest need to be off of
+     * the cpu they blocked on before they can run here */
+    while ((t = list_remove_head_type(&rq->resched_list, thread_t, queue_node))) {
+        int pinned_cpu = thread_pinned_cpu(t);
+        if (pinned_cpu >= 0 && (uint)pinned_cpu != cpu) {
+            wakeup_cpu(thread_make_runnable(t));
+        } else {
+            thread_wait_switched_out(t, cpu);
+            list_add_tail(&woken, &t->queue_node);
+        }
+    }
+
+    if (list_is_empty(&woken))
+        return;
+
+    thread_sched_lock();
+
+    /* stick the current thread on the head of the run queue first, so that the newly
+     * awakened threads get a chance to run before the current one, but the current
+     * one doesn't get unnecessarilly punished. */
+    current_thread->state = THREAD_READY;
+    if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
+        insert_in_local_run_queue(current_thread, true);
+    }
+
+    /* push them on in reverse so the first one woken runs first */
+    while ((t = list_remove_tail_type(&woken, thread_t, queue_node))) {
+        run_queue_insert_woken(cpu, t);
+    }
+
+    thread_resched();
+    thread_sched_unlock();
+}
+
+void wait_queue_unlock_irqrestore(wait_queue_t *wait, arch_interrupt_saved_state_t state) {
+    spin_unlock_class(&wait->lock);
+
+    if (unlikely(!list_is_empty(&run_queues[arch_curr_cpu_num()].resched_list)))
+        thread_resched_woken();
+
+    arch_interrupt_restore(state);
+}
+
 /**
  * @brief  Block until a wait queue is notified.
  *
@@ -1110,16 +1888,19 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
-    if (timeout == 0)
+    if (timeout == 0) {
+        spin_unlock_class(&wait->lock);
         return ERR_TIMED_OUT;
+    }
 
     list_add_tail(&wait->list, &current_thread->queue_node);
     wait->count++;
     current_thread->state = THREAD_BLOCKED;
     current_thread->blocking_wait_queue = wait;
     current_thread->wait_queue_block_ret = NO_ERROR;
+    current_thread->wait_queue_timeout = (timeout != INFINITE_TIME);
 
     /* if the timeout is nonzero or noninfinite, set a callback to yank us out of the queue */
     if (timeout != INFINITE_TIME) {
@@ -1127,11 +1908,19 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
         timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
     }
 
+    /* grab the scheduler lock before letting go of the queue, so whoever wakes
+     * us up has to wait until we are all the way switched out */
+    thread_sched_lock();
+    spin_unlock_class(&wait->lock);
+
     thread_resched();
 
-    /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
+    thread_sched_unlock();
+
+    /* we don't really know if the timer fired or not, so it's better safe to try to cancel it.
+     * it lives on our stack, so wait for the callback if it is running on another cpu */
     if (timeout != INFINITE_TIME) {
-        timer_cancel(&timer);
+        timer_cancel_sync(&timer);
     }
 
     return current_thread->wait_queue_block_ret;
@@ -1155,11 +1944,9 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
     thread_t *t;
     int ret = 0;
 
-    thread_t *current_thread = get_current_thread();
-
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     t = list_remove_head_type(&wait->list, thread_t, queue_node);
     if (t) {
@@ -1167,20 +1954,15 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
-        t->blocking_wait_queue = NULL;
+        wait_queue_clear_blocking(t);
 
-        /* if we're instructed to reschedule, stick the current thread on the head
-         * of the run queue first, so that the newly awakened thread gets a chance to run
-         * before the current one, but the current one doesn't get unnecessarilly punished.
+        /* if we're instructed to reschedule, the woken thread runs on this cpu ahead of
+         * us once the wait queue lock is dropped, see wait_queue_unlock_irqrestore().
          */
         if (reschedule) {
-            current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
-        }
-        insert_in_run_queue_head(t);
-        wakeup_cpu_for_thread(t);
-        if (reschedule) {
-            thread_resched();
+            list_add_tail(&run_queues[arch_curr_cpu_num()].resched_list, &t->queue_node);
+        } else {
+            wakeup_cpu(thread_make_runnable(t));
         }
         ret = 1;
 
@@ -1209,47 +1991,32 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
     int ret = 0;
     uint32_t cpu_mask = 0;
 
-    thread_t *current_thread = get_current_thread();
-
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
-
-    if (reschedule && wait->count > 0) {
-        /* if we're instructed to reschedule, stick the current thread on the head
-         * of the run queue first, so that the newly awakened threads get a chance to run
-         * before the current one, but the current one doesn't get unnecessarilly punished.
-         */
-        current_thread->state = THREAD_READY;
-        insert_in_run_queue_head(current_thread);
-    }
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
-    /* pop all the threads off the wait queue into the run queue */
+    /* pop all the threads off the wait queue into the run queue. if we're instructed
+     * to reschedule, they run on this cpu ahead of us once the wait queue lock is
+     * dropped, see wait_queue_unlock_irqrestore().
+     */
     while ((t = list_remove_tail_type(&wait->list, thread_t, queue_node))) {
         wait->count--;
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
-        t->blocking_wait_queue = NULL;
-        int pinned_cpu = thread_pinned_cpu(t);
-        if (pinned_cpu < 0) {
-            /* assumes MP_CPU_ALL_BUT_LOCAL is defined as all bits on */
-            cpu_mask = MP_CPU_ALL_BUT_LOCAL;
+        wait_queue_clear_blocking(t);
+        if (reschedule) {
+            list_add_head(&run_queues[arch_curr_cpu_num()].resched_list, &t->queue_node);
         } else {
-            cpu_mask |= (1U << pinned_cpu);
+            cpu_mask |= 1U << thread_make_runnable(t);
         }
-        insert_in_run_queue_head(t);
         ret++;
     }
 
     DEBUG_ASSERT(wait->count == 0);
 
-    if (ret > 0) {
+    if (cpu_mask)
         mp_reschedule(cpu_mask, 0);
-        if (reschedule) {
-            thread_resched();
-        }
-    }
 
     return ret;
 }
@@ -1262,7 +2029,7 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 void wait_queue_destroy(wait_queue_t *wait, bool reschedule) {
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     wait_queue_wake_all(wait, reschedule, ERR_OBJECT_DESTROYED);
     wait->magic = 0;
@@ -1278,27 +2045,28 @@ void wait_queue_destroy(wait_queue_t *wait, bool reschedule) {
  * @param wait_queue_error  The return value which the new thread will receive
  *   from wait_queue_block().
  *
+ * The caller must hold the lock of the wait queue the thread is blocked on.
+ *
  * @return ERR_NOT_BLOCKED if thread was not in any wait queue.
  */
 status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
     if (t->state != THREAD_BLOCKED)
         return ERR_NOT_BLOCKED;
 
     DEBUG_ASSERT(t->blocking_wait_queue != NULL);
     DEBUG_ASSERT(t->blocking_wait_queue->magic == WAIT_QUEUE_MAGIC);
+    DEBUG_ASSERT(spin_lock_held(&t->blocking_wait_queue->lock));
     DEBUG_ASSERT(list_in_list(&t->queue_node));
 
     list_delete(&t->queue_node);
     t->blocking_wait_queue->count--;
-    t->blocking_wait_queue = NULL;
+    wait_queue_clear_blocking(t);
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    wakeup_cpu_for_thread(t);
+    wakeup_cpu(thread_make_runnable(t));
 
     return NO_ERROR;
 }
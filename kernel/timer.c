@@ -17,6 +17,11 @@
  *
  * Timer callback functions are called in interrupt context.
  *
+ * Each cpu keeps its pending timers in a pairing heap ordered by expiration
+ * time. The heap is intrusive, so arming a timer never allocates, and it
+ * makes arming O(1) and canceling or expiring a timer O(log n) amortized,
+ * where a sorted list would be O(n) with interrupts disabled.
+ *
  * @{
  */
 #include <kernel/timer.h>
@@ -24,6 +29,7 @@
 #include <assert.h>
 #include <kernel/debug.h>
 #include <kernel/init.h>
+#include <kernel/lockorder.h>
 #include <kernel/spinlock.h>
 #include <kernel/thread.h>
 #include <lk/debug.h>
@@ -34,10 +40,13 @@
 
 #define LOCAL_TRACE 0
 
-spin_lock_t timer_lock;
-
+/* each cpu has its own timer queue, protected by its own lock */
 struct timer_state {
-    struct list_node timer_queue;
+    spin_lock_t lock;
+    timer_t *heap; /* root of the pairing heap, the next timer to expire */
+
+    /* timer whose callback is currently running on this cpu, if any */
+    timer_t *running;
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
@@ -51,22 +60,112 @@ void timer_initialize(timer_t *timer) {
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
-static void insert_timer_in_queue(uint cpu, timer_t *timer) {
-    timer_t *entry;
+static inline void timer_queue_lock(uint cpu) {
+    spin_lock_class(&timers[cpu].lock, LOCK_CLASS_TIMER);
+}
+
+static inline void timer_queue_unlock(uint cpu) {
+    spin_unlock_class(&timers[cpu].lock);
+}
+
+/*
+ * Pairing heap primitives. Each node points at its first child and next
+ * sibling; heap_prev points at the previous sibling, or at the parent for a
+ * first child, so any node can be unlinked in O(1).
+ */
+
+/* link two heap roots, the later one becomes the first child of the earlier one */
+static timer_t *heap_meld(timer_t *a, timer_t *b) {
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+
+    if (TIME_LT(b->scheduled_time, a->scheduled_time)) {
+        timer_t *temp = a;
+        a = b;
+        b = temp;
+    }
+
+    b->heap_prev = a;
+    b->heap_sibling = a->heap_child;
+    if (a->heap_child)
+        a->heap_child->heap_prev = b;
+    a->heap_child = b;
+
+    return a;
+}
+
+/* standard two pass merge of a list of siblings into a single heap */
+static timer_t *heap_merge_pairs(timer_t *first) {
+    timer_t *pairs = NULL;
 
+    /* left to right, meld each pair and stack the results up through heap_sibling */
+    while (first) {
+        timer_t *a = first;
+        timer_t *b = a->heap_sibling;
+        first = b ? b->heap_sibling : NULL;
+
+        a->heap_sibling = a->heap_prev = NULL;
+        if (b) {
+            b->heap_sibling = b->heap_prev = NULL;
+            a = heap_meld(a, b);
+        }
+        a->heap_sibling = pairs;
+        pairs = a;
+    }
+
+    /* then right to left, meld the pairs back into one */
+    timer_t *root = NULL;
+    while (pairs) {
+        timer_t *next = pairs->heap_sibling;
+        pairs->heap_sibling = NULL;
+        root = heap_meld(root, pairs);
+        pairs = next;
+    }
+
+    return root;
+}
+
+static inline timer_t *timer_queue_peek(uint cpu) {
+    return timers[cpu].heap;
+}
+
+static void insert_timer_in_queue(uint cpu, timer_t *timer) {
     DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&timers[cpu].lock));
+    DEBUG_ASSERT(!timer->queued);
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
-        }
+    timer->heap_child = timer->heap_sibling = timer->heap_prev = NULL;
+    timer->queued = true;
+    timers[cpu].heap = heap_meld(timers[cpu].heap, timer);
+}
+
+static void remove_timer_from_queue(uint cpu, timer_t *timer) {
+    struct timer_state *ts = &timers[cpu];
+
+    DEBUG_ASSERT(spin_lock_held(&ts->lock));
+    DEBUG_ASSERT(timer->queued);
+
+    if (timer == ts->heap) {
+        ts->heap = heap_merge_pairs(timer->heap_child);
+    } else {
+        /* unlink it from its parent or previous sibling */
+        if (timer->heap_prev->heap_child == timer)
+            timer->heap_prev->heap_child = timer->heap_sibling;
+        else
+            timer->heap_prev->heap_sibling = timer->heap_sibling;
+        if (timer->heap_sibling)
+            timer->heap_sibling->heap_prev = timer->heap_prev;
+
+        /* its children become a heap of their own, put it back in the main one */
+        ts->heap = heap_meld(ts->heap, heap_merge_pairs(timer->heap_child));
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    timer->heap_child = timer->heap_sibling = timer->heap_prev = NULL;
+    timer->queued = false;
 }
 
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg) {
@@ -76,7 +175,7 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-    if (list_in_list(&timer->node)) {
+    if (timer->queued) {
         panic("timer %p already in list\n", timer);
     }
 
@@ -88,20 +187,24 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
 
     LTRACEF("scheduled time %u\n", timer->scheduled_time);
 
-    arch_interrupt_saved_state_t state = spin_lock_irqsave(&timer_lock);
+    arch_interrupt_saved_state_t state = arch_interrupt_save();
 
     uint cpu = arch_curr_cpu_num();
+    timer_queue_lock(cpu);
+
+    timer->cpu = cpu;
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
+    if (timer_queue_peek(cpu) == timer) {
         /* we just modified the head of the timer queue */
         LTRACEF("setting new timer for %u msecs\n", delay);
         platform_set_oneshot_timer(timer_tick, NULL, delay);
     }
 #endif
 
-    spin_unlock_irqrestore(&timer_lock, state);
+    timer_queue_unlock(cpu);
+    arch_interrupt_restore(state);
 }
 
 /**
@@ -144,22 +247,36 @@ void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callbac
     timer_set(timer, period, period, callback, arg);
 }
 
-/**
- * @brief  Cancel a pending timer
- */
-void timer_cancel(timer_t *timer) {
+/* lock the queue of the cpu the timer was last set on, returns the cpu */
+static uint timer_lock_queue_of(timer_t *timer) {
+#if WITH_SMP
+    for (;;) {
+        uint cpu = __atomic_load_n(&timer->cpu, __ATOMIC_RELAXED);
+        timer_queue_lock(cpu);
+        if (likely(timer->cpu == cpu))
+            return cpu;
+        /* raced with it being set on another cpu */
+        timer_queue_unlock(cpu);
+    }
+#else
+    timer_queue_lock(0);
+    return 0;
+#endif
+}
+
+static void timer_cancel_etc(timer_t *timer, bool sync) {
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
-    arch_interrupt_saved_state_t state = spin_lock_irqsave(&timer_lock);
+    arch_interrupt_saved_state_t state = arch_interrupt_save();
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num();
+    uint cpu = timer_lock_queue_of(timer);
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    timer_t *oldhead = timer_queue_peek(cpu);
 #endif
 
-    if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+    if (timer->queued)
+        remove_timer_from_queue(cpu, timer);
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -169,12 +286,15 @@ void timer_cancel(timer_t *timer) {
     timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
+    /* see if we've just modified the head of the timer queue. the hardware timer of
+     * another cpu is left alone, at worst it takes one spurious tick. */
+    timer_t *newhead = timer_queue_peek(cpu);
+    if (newhead == oldhead || cpu != arch_curr_cpu_num()) {
+        /* nothing to reprogram */
+    } else if (newhead == NULL) {
         LTRACEF("clearing old hw timer, nothing in the queue\n");
         platform_stop_timer();
-    } else if (newhead != oldhead) {
+    } else {
         lk_time_t delay;
         lk_time_t now = current_time();
 
@@ -188,7 +308,34 @@ void timer_cancel(timer_t *timer) {
     }
 #endif
 
-    spin_unlock_irqrestore(&timer_lock, state);
+    bool running = timers[cpu].running == timer;
+
+    timer_queue_unlock(cpu);
+
+    /* the callback may still be running on another cpu, wait for it to finish.
+     * if it is running on this one we were called from within it. */
+    if (sync && running && cpu != arch_curr_cpu_num()) {
+        while (__atomic_load_n(&timers[cpu].running, __ATOMIC_ACQUIRE) == timer)
+            ;
+    }
+
+    arch_interrupt_restore(state);
+}
+
+/**
+ * @brief  Cancel a pending timer
+ */
+void timer_cancel(timer_t *timer) {
+    timer_cancel_etc(timer, false);
+}
+
+/**
+ * @brief  Cancel a pending timer and wait for its callback to finish
+ *
+ * Must not be called while holding a lock the callback may take.
+ */
+void timer_cancel_sync(timer_t *timer) {
+    timer_cancel_etc(timer, true);
 }
 
 /* called at interrupt time to process any pending timers */
@@ -199,17 +346,17 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
     DEBUG_ASSERT(arch_ints_disabled());
 
     THREAD_STATS_INC(timer_ints);
-//  KEVLOG_TIMER_TICK(); // enable only if necessary
+    KEVLOG_TIMER_TICK();
 
     uint cpu = arch_curr_cpu_num();
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
-    spin_lock(&timer_lock);
+    timer_queue_lock(cpu);
 
     for (;;) {
         /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+        timer = timer_queue_peek(cpu);
         if (likely(timer == 0))
             break;
         LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
@@ -219,10 +366,11 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
         /* process it */
         LTRACEF("timer %p\n", timer);
         DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+        remove_timer_from_queue(cpu, timer);
 
         /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+        timers[cpu].running = timer;
+        timer_queue_unlock(cpu);
 
         LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
 
@@ -236,12 +384,15 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
             ret = INT_RESCHEDULE;
 
         /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+        timer_queue_lock(cpu);
+
+        /* a synchronous cancel on another cpu may be waiting for us to finish */
+        __atomic_store_n(&timers[cpu].running, NULL, __ATOMIC_RELEASE);
 
         /* if it was a periodic timer and it hasn't been requeued
          * by the callback put it back in the list
          */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+        if (periodic && !timer->queued && timer->periodic_time > 0) {
             LTRACEF("periodic timer, period %u\n", timer->periodic_time);
             timer->scheduled_time += timer->periodic_time;
             if (unlikely(TIME_LT(timer->scheduled_time, now))) {
@@ -253,7 +404,7 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+    timer = timer_queue_peek(cpu);
     if (timer) {
         /* has to be the case or it would have fired already */
         DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
@@ -265,10 +416,10 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
     }
 
     /* we're done manipulating the timer queue */
-    spin_unlock(&timer_lock);
+    timer_queue_unlock(cpu);
 #else
     /* release the timer lock before calling the tick handler */
-    spin_unlock(&timer_lock);
+    timer_queue_unlock(cpu);
 
     /* let the scheduler have a shot to do quantum expiration, etc */
     /* in case of dynamic timer, the scheduler will set up a periodic timer */
@@ -280,9 +431,10 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 }
 
 void timer_init(void) {
-    timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        spin_lock_init(&timers[i].lock);
+        timers[i].heap = NULL;
+        timers[i].running = NULL;
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
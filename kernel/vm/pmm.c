@@ -8,7 +8,9 @@
 #include <kernel/vm.h>
 
 #include <assert.h>
+#include <arch/ops.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lk/console_cmd.h>
 #include <lk/err.h>
 #include <lk/list.h>
@@ -21,9 +23,48 @@
 
 #define LOCAL_TRACE 0
 
+/*
+ * Physical pages are handed out by a binary buddy allocator per arena. Free
+ * pages are grouped into blocks of 1 << order pages that are naturally aligned
+ * in physical address space, with a free list per order. Only the first page
+ * of a free block is linked into a free list and carries the block's order;
+ * the rest of its pages have an unlinked list node. Freeing a block merges it
+ * with its buddy for as long as the buddy is free and of the same order.
+ *
+ * In front of that sits a small cache of single pages per cpu, refilled from
+ * and drained back to the buddy allocator in batches, so most single page
+ * allocations and frees only take the cache's own spinlock instead of the
+ * global pmm mutex. Cached pages are marked NONFREE | CACHED and are pulled
+ * back into the arenas when the buddy allocator runs dry or when one of them
+ * is asked for by address.
+ */
+
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+/* number of pages moved between a cpu cache and the arenas at a time */
+#ifndef PMM_PCP_BATCH
+#define PMM_PCP_BATCH 16
+#endif
+
+/* a cpu cache holding more than this many pages spills a batch back */
+#ifndef PMM_PCP_HIGH
+#define PMM_PCP_HIGH (PMM_PCP_BATCH * 4)
+#endif
+
+static struct pmm_pcp {
+    spin_lock_t lock;
+    struct list_node pages;
+    uint count;
+
+    /* stats */
+    ulong hits;
+    ulong refills;
+    ulong spills;
+} pcp[SMP_MAX_CPUS] __CPU_ALIGN;
+
+static bool pcp_initialized;
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -61,6 +102,306 @@ vm_page_t *paddr_to_vm_page(paddr_t addr) {
     return NULL;
 }
 
+static pmm_arena_t *page_to_arena(const vm_page_t *page) {
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (PAGE_BELONGS_TO_ARENA(page, a)) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+/* buddy allocator, all of these must be called with the pmm lock held */
+
+static inline size_t arena_page_count(const pmm_arena_t *a) {
+    return a->size / PAGE_SIZE;
+}
+
+/* physical page frame number of a page in the arena */
+static inline paddr_t arena_pfn(const pmm_arena_t *a, size_t index) {
+    return a->base / PAGE_SIZE + index;
+}
+
+static inline bool page_is_free_block(vm_page_t *page, uint order) {
+    return page_is_free(page) && list_in_list(&page->node) && page->order == order;
+}
+
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order) {
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(order < PMM_MAX_ORDER);
+    DEBUG_ASSERT(!list_in_list(&page->node));
+
+    page->order = order;
+    list_add_head(&a->free_list[order], &page->node);
+}
+
+/* add a naturally aligned free block back to the arena, merging it with its buddies */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order) {
+    const paddr_t base_pfn = arena_pfn(a, 0);
+
+    while (order < PMM_MAX_ORDER - 1) {
+        paddr_t buddy_pfn = arena_pfn(a, index) ^ (1UL << order);
+        if (buddy_pfn < base_pfn)
+            break;
+
+        size_t buddy = buddy_pfn - base_pfn;
+        if (buddy + (1UL << order) > arena_page_count(a))
+            break;
+
+        vm_page_t *b = &a->page_array[buddy];
+        if (!page_is_free_block(b, order))
+            break;
+
+        list_delete(&b->node);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* add an arbitrary run of free pages back to the arena as the largest aligned blocks that fit */
+static void buddy_free_run(pmm_arena_t *a, size_t index, size_t count) {
+    while (count > 0) {
+        uint order = 0;
+        while (order < PMM_MAX_ORDER - 1 &&
+                (arena_pfn(a, index) & ((2UL << order) - 1)) == 0 &&
+                (2UL << order) <= count) {
+            order++;
+        }
+
+        buddy_free_block(a, index, order);
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* mark a run of pages as allocated */
+static void buddy_mark_allocated(pmm_arena_t *a, size_t index, size_t count) {
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *page = &a->page_array[i];
+
+        DEBUG_ASSERT(page_is_free(page));
+        DEBUG_ASSERT(!list_in_list(&page->node));
+
+        page->flags |= VM_PAGE_FLAG_NONFREE;
+    }
+    a->free_count -= count;
+}
+
+/* allocate a block of 1 << order pages, splitting a larger one if need be */
+static vm_page_t *buddy_alloc_block(pmm_arena_t *a, uint order) {
+    for (uint o = order; o < PMM_MAX_ORDER; o++) {
+        vm_page_t *page = list_remove_head_type(&a->free_list[o], vm_page_t, node);
+        if (!page)
+            continue;
+
+        /* give back the upper halves until the block is the requested size */
+        size_t index = page - a->page_array;
+        while (o > order) {
+            o--;
+            buddy_add_block(a, index + (1UL << o), o);
+        }
+
+        buddy_mark_allocated(a, index, 1UL << order);
+        return page;
+    }
+
+    return NULL;
+}
+
+/* pull one specific free page out of the block containing it */
+static void buddy_take_page(pmm_arena_t *a, size_t index) {
+    const paddr_t base_pfn = arena_pfn(a, 0);
+
+    for (uint order = 0; order < PMM_MAX_ORDER; order++) {
+        paddr_t head_pfn = arena_pfn(a, index) & ~((paddr_t)(1UL << order) - 1);
+        if (head_pfn < base_pfn)
+            break;
+
+        size_t head = head_pfn - base_pfn;
+        vm_page_t *page = &a->page_array[head];
+        if (!page_is_free_block(page, order))
+            continue;
+
+        /* split the block down, keeping the half with our page in it */
+        list_delete(&page->node);
+        while (order > 0) {
+            order--;
+            size_t upper = head + (1UL << order);
+            if (index >= upper) {
+                buddy_add_block(a, head, order);
+                head = upper;
+            } else {
+                buddy_add_block(a, upper, order);
+            }
+        }
+
+        buddy_mark_allocated(a, index, 1);
+        return;
+    }
+
+    panic("pmm: free page %p in arena %p is not in any free block\n", &a->page_array[index], a);
+}
+
+static void buddy_free_page(pmm_arena_t *a, vm_page_t *page) {
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    page->flags &= ~(VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_CACHED);
+    buddy_free_block(a, page - a->page_array, 0);
+    a->free_count++;
+}
+
+/* allocate up to count pages, in as large blocks as are available */
+static size_t buddy_alloc_pages(size_t count, struct list_node *list) {
+    size_t allocated = 0;
+
+    /* walk the arenas in order, allocating as many pages as we can from each */
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        while (allocated < count && a->free_count > 0) {
+            uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER - 1);
+
+            vm_page_t *page;
+            while (!(page = buddy_alloc_block(a, order))) {
+                DEBUG_ASSERT(order > 0);
+                order--;
+            }
+
+            for (size_t i = 0; i < (1UL << order); i++) {
+                list_add_tail(list, &page[i].node);
+            }
+            allocated += 1UL << order;
+        }
+
+        if (allocated == count)
+            break;
+    }
+
+    return allocated;
+}
+
+/* per cpu page caches */
+
+static void move_pages(struct list_node *dst, struct list_node *src) {
+    struct list_node *node;
+    while ((node = list_remove_head(src))) {
+        list_add_tail(dst, node);
+    }
+}
+
+static void pcp_init(void) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        spin_lock_init(&pcp[i].lock);
+        list_initialize(&pcp[i].pages);
+    }
+    pcp_initialized = true;
+}
+
+/* give a list of cached or allocated pages back to the arenas, pmm lock held */
+static size_t free_list_locked(struct list_node *list) {
+    size_t count = 0;
+    vm_page_t *page;
+    while ((page = list_remove_head_type(list, vm_page_t, node))) {
+        pmm_arena_t *a = page_to_arena(page);
+        if (a) {
+            buddy_free_page(a, page);
+            count++;
+        }
+    }
+    return count;
+}
+
+/* flush every cpu's cache back into the arenas, pmm lock held */
+static void pcp_drain_all_locked(void) {
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct pmm_pcp *c = &pcp[i];
+
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+        move_pages(&list, &c->pages);
+        c->count = 0;
+        spin_unlock_irqrestore(&c->lock, state);
+    }
+
+    free_list_locked(&list);
+}
+
+static vm_page_t *pcp_alloc_page(void) {
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    vm_page_t *page = list_remove_head_type(&c->pages, vm_page_t, node);
+    if (page) {
+        c->count--;
+        c->hits++;
+    }
+    spin_unlock_irqrestore(&c->lock, state);
+
+    if (likely(page)) {
+        page->flags &= ~VM_PAGE_FLAG_CACHED;
+        return page;
+    }
+
+    /* cache is empty, pull a batch out of the arenas */
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+
+    mutex_acquire(&lock);
+    size_t count = buddy_alloc_pages(PMM_PCP_BATCH, &batch);
+    if (count == 0) {
+        /* out of memory, except perhaps for whatever the other cpus are hoarding */
+        pcp_drain_all_locked();
+        count = buddy_alloc_pages(1, &batch);
+    }
+    mutex_release(&lock);
+
+    page = list_remove_head_type(&batch, vm_page_t, node);
+    if (!page || count == 1)
+        return page;
+
+    vm_page_t *p;
+    list_for_every_entry(&batch, p, vm_page_t, node) {
+        p->flags |= VM_PAGE_FLAG_CACHED;
+    }
+
+    c = &pcp[arch_curr_cpu_num()];
+    state = spin_lock_irqsave(&c->lock);
+    move_pages(&c->pages, &batch);
+    c->count += count - 1;
+    c->refills++;
+    spin_unlock_irqrestore(&c->lock, state);
+
+    return page;
+}
+
+static void pcp_free_page(vm_page_t *page) {
+    struct list_node spill = LIST_INITIAL_VALUE(spill);
+
+    page->flags |= VM_PAGE_FLAG_CACHED;
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    list_add_head(&c->pages, &page->node);
+    if (unlikely(++c->count > PMM_PCP_HIGH)) {
+        /* hand the coldest pages back to the arenas */
+        for (uint i = 0; i < PMM_PCP_BATCH; i++) {
+            list_add_head(&spill, list_remove_tail(&c->pages));
+        }
+        c->count -= PMM_PCP_BATCH;
+        c->spills++;
+    }
+    spin_unlock_irqrestore(&c->lock, state);
+
+    if (unlikely(!list_is_empty(&spill))) {
+        mutex_acquire(&lock);
+        free_list_locked(&spill);
+        mutex_release(&lock);
+    }
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena) {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
 
@@ -68,6 +409,9 @@ status_t pmm_add_arena(pmm_arena_t *arena) {
     DEBUG_ASSERT(IS_PAGE_ALIGNED(arena->size));
     DEBUG_ASSERT(arena->size > 0);
 
+    if (!pcp_initialized)
+        pcp_init();
+
     /* walk the arena list and add arena based on priority order */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -84,7 +428,9 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i < PMM_MAX_ORDER; i++) {
+        list_initialize(&arena->free_list[i]);
+    }
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -93,14 +439,9 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
-    }
+    /* add them to the free lists */
+    buddy_free_run(arena, 0, page_count);
+    arena->free_count = page_count;
 
     return NO_ERROR;
 }
@@ -111,45 +452,33 @@ size_t pmm_alloc_pages(uint count, struct list_node *list) {
     /* list must be initialized prior to calling this */
     DEBUG_ASSERT(list);
 
-    uint allocated = 0;
     if (count == 0)
         return 0;
 
-    mutex_acquire(&lock);
-
-    /* walk the arenas in order, allocating as many pages as we can from each */
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        while (allocated < count && a->free_count > 0) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+    /* single pages come out of the local cpu's cache */
+    if (count == 1) {
+        vm_page_t *page = pcp_alloc_page();
+        if (!page)
+            return 0;
 
-            a->free_count--;
+        list_add_tail(list, &page->node);
+        return 1;
+    }
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+    mutex_acquire(&lock);
 
-            allocated++;
-        }
+    size_t allocated = buddy_alloc_pages(count, list);
+    if (allocated < count) {
+        pcp_drain_all_locked();
+        allocated += buddy_alloc_pages(count - allocated, list);
     }
 
-done:
     mutex_release(&lock);
     return allocated;
 }
 
 vm_page_t *pmm_alloc_page(void) {
-    struct list_node list = LIST_INITIAL_VALUE(list);
-
-    size_t ret = pmm_alloc_pages(1, &list);
-    if (ret == 0) {
-        return NULL;
-    }
-
-    DEBUG_ASSERT(ret == 1);
-
-    return list_peek_head_type(&list, vm_page_t, node);
+    return pcp_alloc_page();
 }
 
 size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
@@ -174,18 +503,18 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
             DEBUG_ASSERT(index < a->size / PAGE_SIZE);
 
             vm_page_t *page = &a->page_array[index];
+            if (page->flags & VM_PAGE_FLAG_CACHED) {
+                /* free, but parked in a cpu cache */
+                pcp_drain_all_locked();
+            }
             if (page->flags & VM_PAGE_FLAG_NONFREE) {
                 /* we hit an allocated page */
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
-
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
+            buddy_take_page(a, index);
             list_add_tail(list, &page->node);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -203,30 +532,20 @@ size_t pmm_free(struct list_node *list) {
 
     DEBUG_ASSERT(list);
 
-    mutex_acquire(&lock);
-
-    size_t count = 0;
-    while (!list_is_empty(list)) {
-        vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
-
-        DEBUG_ASSERT(!list_in_list(&page->node));
+    /* single pages go to the local cpu's cache */
+    vm_page_t *page = list_peek_head_type(list, vm_page_t, node);
+    if (page && page == list_peek_tail_type(list, vm_page_t, node) && page_to_arena(page)) {
         DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
 
-        /* see which arena this page belongs to and add it */
-        pmm_arena_t *a;
-        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-            if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
-
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
-                count++;
-                break;
-            }
-        }
+        list_delete(&page->node);
+        pcp_free_page(page);
+        return 1;
     }
 
+    mutex_acquire(&lock);
+    size_t count = free_list_locked(list);
     mutex_release(&lock);
+
     return count;
 }
 
@@ -282,16 +601,30 @@ size_t pmm_free_kpages(void *_ptr, uint count) {
     return pmm_free(&list);
 }
 
-size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list) {
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
+/* hand out the first count pages of a freshly allocated block, returning the tail */
+static void alloc_contiguous_trim(pmm_arena_t *a, vm_page_t *page, uint count, uint order,
+                                  paddr_t *pa, struct list_node *list) {
+    size_t index = page - a->page_array;
+    size_t block_count = 1UL << order;
 
-    if (count == 0)
-        return 0;
-    if (alignment_log2 < PAGE_SIZE_SHIFT)
-        alignment_log2 = PAGE_SIZE_SHIFT;
+    for (size_t i = index + count; i < index + block_count; i++) {
+        a->page_array[i].flags &= ~VM_PAGE_FLAG_NONFREE;
+    }
+    a->free_count += block_count - count;
+    buddy_free_run(a, index + count, block_count - count);
 
-    mutex_acquire(&lock);
+    if (list) {
+        for (uint i = 0; i < count; i++) {
+            list_add_tail(list, &page[i].node);
+        }
+    }
+
+    if (pa)
+        *pa = a->base + index * PAGE_SIZE;
+}
 
+/* linear search for an aligned run, for requests larger than the biggest buddy block */
+static size_t alloc_contiguous_scan(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list) {
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
@@ -330,30 +663,67 @@ retry:
                 /* we found a run */
                 LTRACEF("found run from pn %u to %u\n", start, start + count);
 
-                /* remove the pages from the run out of the free list */
+                /* carve the pages of the run out of their free blocks */
                 for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
+                    buddy_take_page(a, i);
 
                     if (list)
-                        list_add_tail(list, &p->node);
+                        list_add_tail(list, &a->page_array[i].node);
                 }
 
                 if (pa)
                     *pa = a->base + start * PAGE_SIZE;
 
-                mutex_release(&lock);
-
                 return count;
             }
         }
     }
 
+    return 0;
+}
+
+size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list) {
+    LTRACEF("count %u, align %u\n", count, alignment_log2);
+
+    if (count == 0)
+        return 0;
+    if (alignment_log2 < PAGE_SIZE_SHIFT)
+        alignment_log2 = PAGE_SIZE_SHIFT;
+
+    /* buddy blocks are naturally aligned, so the smallest block that covers both
+     * the count and the alignment satisfies the request */
+    uint order = MAX(log2_uint(round_up_pow2_u32(count)), (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
+    mutex_acquire(&lock);
+
+    for (uint pass = 0; pass < 2; pass++) {
+        if (order < PMM_MAX_ORDER) {
+            pmm_arena_t *a;
+            list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+                if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+                    continue;
+
+                vm_page_t *page = buddy_alloc_block(a, order);
+                if (page) {
+                    LTRACEF("found block of order %u at pn %zu\n", order, (size_t)(page - a->page_array));
+
+                    alloc_contiguous_trim(a, page, count, order, pa, list);
+                    mutex_release(&lock);
+                    return count;
+                }
+            }
+        } else {
+            size_t ret = alloc_contiguous_scan(count, alignment_log2, pa, list);
+            if (ret > 0) {
+                mutex_release(&lock);
+                return ret;
+            }
+        }
+
+        /* try again with whatever the cpu caches were holding on to */
+        pcp_drain_all_locked();
+    }
+
     mutex_release(&lock);
 
     LTRACEF("couldn't find run\n");
@@ -364,7 +734,7 @@ static void dump_page(const vm_page_t *page) {
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
+static void dump_arena(pmm_arena_t *arena, bool dump_pages) {
     printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
@@ -377,6 +747,19 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
         }
     }
 
+    /* buddy free lists and how fragmented they are. For each order, the
+     * unusable index is the share of free memory sitting in blocks too small
+     * to satisfy an allocation of that order. */
+    printf("\tfree blocks:\n");
+    size_t smaller = 0;
+    for (uint order = 0; order < PMM_MAX_ORDER; order++) {
+        size_t blocks = list_length(&arena->free_list[order]);
+        size_t unusable = arena->free_count ? smaller * 100 / arena->free_count : 0;
+        printf("\t\torder %2u (%6lu pages): %6zu blocks, %3zu%% of free pages unusable\n",
+               order, 1UL << order, blocks, unusable);
+        smaller += blocks << order;
+    }
+
     /* dump the free pages */
     printf("\tfree ranges:\n");
     ssize_t last = -1;
@@ -398,6 +781,15 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
     }
 }
 
+static void dump_pcp(void) {
+    printf("per cpu page caches:\n");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        const struct pmm_pcp *c = &pcp[i];
+        printf("\tcpu %u: %u pages, %lu hits, %lu refills, %lu spills\n",
+               i, c->count, c->hits, c->refills, c->spills);
+    }
+}
+
 static int cmd_pmm(int argc, const console_cmd_args *argv) {
     if (argc < 2) {
 notenoughargs:
@@ -421,6 +813,7 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+        dump_pcp();
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
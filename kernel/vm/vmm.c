@@ -729,10 +729,10 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace) {
     /* make sure the current thread does not map the aspace */
     thread_t *current_thread = get_current_thread();
     if (current_thread->aspace == aspace) {
-        THREAD_LOCK(state);
+        arch_interrupt_saved_state_t state = arch_interrupt_save();
         current_thread->aspace = NULL;
         vmm_context_switch(aspace, NULL);
-        THREAD_UNLOCK(state);
+        arch_interrupt_restore(state);
     }
 
     /* destroy the arch portion of the aspace */
@@ -745,7 +745,8 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace) {
 }
 
 void vmm_context_switch(vmm_aspace_t *oldspace, vmm_aspace_t *newaspace) {
-    DEBUG_ASSERT(thread_lock_held());
+    /* only ever switches the local cpu, so just needs to not race with a reschedule */
+    DEBUG_ASSERT(arch_ints_disabled());
 
     arch_mmu_context_switch(newaspace ? &newaspace->arch_aspace : NULL);
 }
@@ -759,14 +760,14 @@ vmm_aspace_t* vmm_set_active_aspace(vmm_aspace_t *aspace) {
     if (aspace == t->aspace)
         return aspace;
 
-    /* grab the thread lock and switch to the new address space */
-    THREAD_LOCK(state);
+    /* keep from getting rescheduled and switch to the new address space */
+    arch_interrupt_saved_state_t state = arch_interrupt_save();
     vmm_aspace_t *old = t->aspace;
     if (old != aspace) {
         t->aspace = aspace;
         vmm_context_switch(old, t->aspace);
     }
-    THREAD_UNLOCK(state);
+    arch_interrupt_restore(state);
     return old;
 }
 
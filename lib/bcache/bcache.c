@@ -15,14 +15,71 @@
 #include <lk/err.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/thread.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
 
+/*
+ * The cache is split into shards, picked by a hash of the block number, each
+ * with its own lock, hash table, share of the blocks and replacement queues.
+ *
+ * Replacement is 2Q: blocks come in on a FIFO (a1in), and only move to the LRU
+ * (am) if they're asked for again after falling off it, which is remembered in
+ * a short list of block numbers (a1out). A one pass scan, or a run of
+ * readahead that isn't used, goes through a1in without pushing out what's hot.
+ *
+ * A block being read is in the hash table so anyone else after it waits on its
+ * io_lock instead of reading it again. Misses that follow on from the last
+ * read pull in the blocks after them too, in one bio read.
+ *
+ * Dirty blocks are written back by a thread per cache, once they've been dirty
+ * for a while or sooner if too many of them build up. Runs of dirty blocks are
+ * written with one bio write.
+ */
+
+#define BCACHE_MAX_SHARDS 8
+#define BCACHE_SHARD_MIN_BLOCKS 16
+
+// most blocks read ahead at once, and no more than this fraction of the cache
+#define BCACHE_READAHEAD_MAX 32
+#define BCACHE_READAHEAD_DIV 4
+
+// most blocks gathered into one write
+#define BCACHE_WRITE_RUN_MAX 16
+
+// how long a miss waits for a block to be let go before giving up
+#define BCACHE_RECLAIM_WAIT 1000
+
+// dirty blocks older than this are written by the next pass, which runs this often
+#define BCACHE_WRITEBACK_AGE 5000
+#define BCACHE_WRITEBACK_INTERVAL 1000
+
+enum bcache_block_state {
+    BLOCK_FREE,
+    BLOCK_LOADING,
+    BLOCK_VALID,
+};
+
+enum bcache_queue {
+    QUEUE_NONE,
+    QUEUE_FREE,
+    QUEUE_A1IN,
+    QUEUE_AM,
+};
+
 struct bcache_block {
     struct list_node node;
+    struct bcache_block *hash_next;
     bnum_t blocknum;
     int ref_count;
+    uint8_t state;
+    uint8_t queue;
     bool is_dirty;
+    lk_time_t dirty_time;
+    mutex_t io_lock; // held while the block is read in
     void *ptr;
 };
 
@@ -31,182 +88,757 @@ struct bcache_stats {
     uint32_t depth;
     uint32_t misses;
     uint32_t reads;
+    uint32_t readahead;
     uint32_t writes;
 };
 
+struct bcache_shard {
+    mutex_t lock;
+
+    struct bcache_block **hash;
+    uint hash_mask;
+
+    struct list_node free_list;
+    struct list_node a1in;
+    struct list_node am;
+    uint a1in_count;
+    uint kin;
+
+    // blocks held by someone, and threads waiting for one to be let go
+    uint blocks;
+    uint busy;
+    uint waiters;
+    event_t unpinned;
+
+    // ring of block numbers recently pushed off a1in
+    bnum_t *ghosts;
+    uint ghost_head;
+    uint kout;
+
+    struct bcache_stats stats;
+};
+
 struct bcache {
     bdev_t *dev;
     size_t block_size;
     int count;
-    struct bcache_stats stats;
-
-    struct list_node free_list;
-    struct list_node lru_list;
+    bnum_t dev_blocks;
+    bool read_only;
 
+    struct bcache_shard *shards;
+    uint shard_shift;
     struct bcache_block *blocks;
-    bool read_only;
+
+    // sequential read detection, racy by design
+    bnum_t ra_next;
+    uint ra_window;
+    uint ra_max;
+    mutex_t ra_lock;
+    void *ra_buf;
+
+    // write back
+    int dirty_count;
+    int dirty_high;
+    int dirty_low;
+    mutex_t wb_lock;
+    void *wb_buf;
+    uint32_t wb_blocks;
+    event_t wb_event;
+    thread_t *wb_thread;
+    volatile bool wb_stop;
 };
 
-bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
-    struct bcache *cache;
+#define BNUM_NONE ((bnum_t)-1)
 
-    cache = malloc(sizeof(struct bcache));
+static struct bcache_shard *block_shard(struct bcache *cache, bnum_t blocknum) {
+    if (cache->shard_shift == 0)
+        return &cache->shards[0];
+    return &cache->shards[(blocknum * 0x9e3779b1u) >> (32 - cache->shard_shift)];
+}
 
-    cache->dev = dev;
-    cache->block_size = block_size;
-    cache->count = block_count;
-    cache->read_only = false;
-    memset(&cache->stats, 0, sizeof(cache->stats));
+static int write_blocks(struct bcache *cache, const void *buf, bnum_t blocknum, uint count) {
+    if (cache->read_only)
+        return ERR_NOT_ALLOWED;
+
+    ssize_t len = (ssize_t)(count * cache->block_size);
+    ssize_t rc = bio_write(cache->dev, buf, (off_t)blocknum * cache->block_size, len);
+    if (rc < 0)
+        return (int)rc;
+    if (rc != len)
+        return ERR_IO;
+    return 0;
+}
 
-    list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
+static void set_dirty(struct bcache *cache, struct bcache_block *block) {
+    if (block->is_dirty)
+        return;
 
-    cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
-    int i;
-    for (i=0; i < block_count; i++) {
-        cache->blocks[i].ref_count = 0;
-        cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
-        // add to the free list
-        list_add_head(&cache->free_list, &cache->blocks[i].node);
+    block->is_dirty = true;
+    block->dirty_time = current_time();
+    int dirty = __atomic_add_fetch(&cache->dirty_count, 1, __ATOMIC_RELAXED);
+    if (dirty == cache->dirty_high && cache->wb_thread)
+        event_signal(&cache->wb_event, false);
+}
+
+static void pin_block(struct bcache_shard *shard, struct bcache_block *block) {
+    if (block->ref_count++ == 0)
+        shard->busy++;
+}
+
+static void unpin_block(struct bcache_shard *shard, struct bcache_block *block) {
+    DEBUG_ASSERT(block->ref_count > 0);
+    if (--block->ref_count == 0) {
+        shard->busy--;
+        if (shard->waiters)
+            event_signal(&shard->unpinned, false);
     }
+}
 
-    return (bcache_t)cache;
+static void clear_dirty(struct bcache *cache, struct bcache_block *block) {
+    if (!block->is_dirty)
+        return;
+
+    block->is_dirty = false;
+    __atomic_sub_fetch(&cache->dirty_count, 1, __ATOMIC_RELAXED);
 }
 
-void bcache_set_read_only(bcache_t _cache, bool ro) {
-    struct bcache *cache = _cache;
-    cache->read_only = ro;
+static struct bcache_block *hash_find(struct bcache_shard *shard, bnum_t blocknum, uint32_t *depth) {
+    struct bcache_block *block = shard->hash[blocknum & shard->hash_mask];
+    for (; block; block = block->hash_next) {
+        if (depth)
+            (*depth)++;
+        if (block->blocknum == blocknum)
+            return block;
+    }
+    return NULL;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block) {
-    int rc;
+static void hash_insert(struct bcache_shard *shard, struct bcache_block *block) {
+    struct bcache_block **bucket = &shard->hash[block->blocknum & shard->hash_mask];
+    block->hash_next = *bucket;
+    *bucket = block;
+}
 
-    if (cache->read_only)
-        return ERR_NOT_ALLOWED;
+static void hash_remove(struct bcache_shard *shard, struct bcache_block *block) {
+    struct bcache_block **prev = &shard->hash[block->blocknum & shard->hash_mask];
+    while (*prev != block) {
+        DEBUG_ASSERT(*prev);
+        prev = &(*prev)->hash_next;
+    }
+    *prev = block->hash_next;
+    block->hash_next = NULL;
+}
 
-    rc = bio_write(cache->dev, block->ptr,
-                   (off_t)block->blocknum * cache->block_size,
-                   cache->block_size);
-    if (rc < 0)
-        goto exit;
+static void queue_remove(struct bcache_shard *shard, struct bcache_block *block) {
+    if (block->queue == QUEUE_NONE)
+        return;
+    if (block->queue == QUEUE_A1IN)
+        shard->a1in_count--;
+    list_delete(&block->node);
+    block->queue = QUEUE_NONE;
+}
 
-    block->is_dirty = false;
-    cache->stats.writes++;
-    rc = 0;
-exit:
-    return (rc);
+static void queue_add(struct bcache_shard *shard, struct bcache_block *block, enum bcache_queue queue) {
+    queue_remove(shard, block);
+    switch (queue) {
+        case QUEUE_FREE:
+            list_add_head(&shard->free_list, &block->node);
+            break;
+        case QUEUE_A1IN:
+            list_add_tail(&shard->a1in, &block->node);
+            shard->a1in_count++;
+            break;
+        case QUEUE_AM:
+            list_add_tail(&shard->am, &block->node);
+            break;
+        case QUEUE_NONE:
+            return;
+    }
+    block->queue = queue;
 }
 
-void bcache_destroy(bcache_t _cache) {
-    struct bcache *cache = _cache;
-    int i;
+static void ghost_add(struct bcache_shard *shard, bnum_t blocknum) {
+    shard->ghosts[shard->ghost_head] = blocknum;
+    shard->ghost_head = (shard->ghost_head + 1) % shard->kout;
+}
 
-    for (i=0; i < cache->count; i++) {
-        DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
+// only looked at on a miss, where it's cheap next to the read
+static bool ghost_take(struct bcache_shard *shard, bnum_t blocknum) {
+    for (uint i = 0; i < shard->kout; i++) {
+        if (shard->ghosts[i] == blocknum) {
+            shard->ghosts[i] = BNUM_NONE;
+            return true;
+        }
+    }
+    return false;
+}
 
-        if (cache->blocks[i].is_dirty)
-            printf("warning: freeing dirty block %u\n",
-                   cache->blocks[i].blocknum);
+/* find an unused block on a queue, clean ones first */
+static struct bcache_block *pick_victim(struct list_node *queue, bool clean_only) {
+    struct bcache_block *block;
+    struct bcache_block *dirty = NULL;
 
-        free(cache->blocks[i].ptr);
+    list_for_every_entry(queue, block, struct bcache_block, node) {
+        if (block->ref_count > 0)
+            continue;
+        if (!block->is_dirty)
+            return block;
+        if (!dirty)
+            dirty = block;
     }
 
-    free(cache);
+    return clean_only ? NULL : dirty;
 }
 
-/* find a block if it's already present */
-static struct bcache_block *find_block(struct bcache *cache, uint blocknum) {
-    uint32_t depth = 0;
+/* take a block away from whatever it holds so it can be reused, with the shard locked.
+ * Readahead only takes free blocks or clean ones that came in on a1in, and leaves
+ * at least half the shard for everyone else.
+ */
+static status_t reclaim_block(struct bcache *cache, struct bcache_shard *shard, bool readahead,
+                              struct bcache_block **out) {
     struct bcache_block *block;
 
-    LTRACEF("num %u\n", blocknum);
+    DEBUG_ASSERT(is_mutex_held(&shard->lock));
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
+    if (readahead && shard->busy >= shard->blocks / 2)
+        return ERR_NO_RESOURCES;
 
-        if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
+    list_for_every_entry(&shard->free_list, block, struct bcache_block, node) {
+        if (block->ref_count == 0) {
+            queue_remove(shard, block);
+            LTRACEF("found block %p on free list\n", block);
+            *out = block;
+            return NO_ERROR;
         }
     }
 
-    cache->stats.misses++;
-    return NULL;
+    if (readahead) {
+        block = pick_victim(&shard->a1in, true);
+    } else if (shard->a1in_count > shard->kin) {
+        block = pick_victim(&shard->a1in, false);
+        if (!block)
+            block = pick_victim(&shard->am, false);
+    } else {
+        block = pick_victim(&shard->am, false);
+        if (!block)
+            block = pick_victim(&shard->a1in, false);
+    }
+    if (!block)
+        return ERR_NO_RESOURCES;
+
+    LTRACEF("evicting block %p, num %u\n", block, block->blocknum);
+
+    if (block->is_dirty) {
+        /* write back got behind, write it here */
+        clear_dirty(cache, block);
+        int err = write_blocks(cache, block->ptr, block->blocknum, 1);
+        if (err < 0) {
+            set_dirty(cache, block);
+            return err;
+        }
+        shard->stats.writes++;
+        if (cache->wb_thread)
+            event_signal(&cache->wb_event, false);
+    }
+
+    if (block->queue == QUEUE_A1IN)
+        ghost_add(shard, block->blocknum);
+    queue_remove(shard, block);
+    hash_remove(shard, block);
+    block->state = BLOCK_FREE;
+
+    *out = block;
+    return NO_ERROR;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache) {
-    int err;
+/* as above, waiting a while for a block if they're all in use. The shard lock is
+ * dropped while waiting, so whatever the caller looked up may have changed if
+ * this returns ERR_BUSY.
+ */
+static status_t alloc_block(struct bcache *cache, struct bcache_shard *shard, lk_time_t *waited,
+                            struct bcache_block **out) {
+    status_t err = reclaim_block(cache, shard, false, out);
+    if (err != ERR_NO_RESOURCES)
+        return err;
+
+    if (*waited >= BCACHE_RECLAIM_WAIT) {
+        TRACEF("all %u blocks busy\n", shard->blocks);
+        return err;
+    }
+
+    /* unpins signal under the shard lock, so one after this can't be missed */
+    lk_time_t start = current_time();
+    shard->waiters++;
+    event_unsignal(&shard->unpinned);
+    mutex_release(&shard->lock);
+    event_wait_timeout(&shard->unpinned, BCACHE_RECLAIM_WAIT - *waited);
+    mutex_acquire(&shard->lock);
+    shard->waiters--;
+    *waited += current_time() - start;
+
+    return ERR_BUSY;
+}
+
+/* claim block for blocknum and put it in the hash table to be read in, holding its
+ * io_lock and a ref.
+ */
+static void start_load(struct bcache_shard *shard, struct bcache_block *block, bnum_t blocknum,
+                       bool readahead) {
+    mutex_acquire(&block->io_lock);
+
+    block->blocknum = blocknum;
+    block->state = BLOCK_LOADING;
+    block->is_dirty = false;
+    pin_block(shard, block);
+    hash_insert(shard, block);
+    queue_add(shard, block, (!readahead && ghost_take(shard, blocknum)) ? QUEUE_AM : QUEUE_A1IN);
+}
+
+static void finish_load(struct bcache *cache, struct bcache_block *block, bool ok, bool keep_ref) {
+    struct bcache_shard *shard = block_shard(cache, block->blocknum);
+
+    mutex_acquire(&shard->lock);
+    if (ok) {
+        block->state = BLOCK_VALID;
+    } else {
+        hash_remove(shard, block);
+        queue_add(shard, block, QUEUE_FREE);
+        block->state = BLOCK_FREE;
+    }
+    mutex_release(&block->io_lock);
+    if (!keep_ref || !ok)
+        unpin_block(shard, block);
+    mutex_release(&shard->lock);
+}
+
+/* read in blocknum and, if the reads look sequential, the uncached blocks after it */
+static struct bcache_block *load_blocks(struct bcache *cache, struct bcache_shard *shard,
+                                        struct bcache_block *block, bnum_t blocknum) {
+    struct bcache_block *ra[BCACHE_READAHEAD_MAX];
+    uint count = 1;
+
+    uint window = 1;
+    if (cache->ra_max > 1 && blocknum == cache->ra_next)
+        window = MIN(MAX(cache->ra_window * 2, 4u), cache->ra_max);
+    window = MIN(window, cache->dev_blocks - blocknum);
+
+    start_load(shard, block, blocknum, false);
+    shard->stats.misses++;
+    mutex_release(&shard->lock);
+
+    /* claim what follows, up to the first block that's already here */
+    ra[0] = block;
+    for (; count < window; count++) {
+        bnum_t num = blocknum + count;
+        struct bcache_shard *s = block_shard(cache, num);
+
+        mutex_acquire(&s->lock);
+        struct bcache_block *b = NULL;
+        if (!hash_find(s, num, NULL) && reclaim_block(cache, s, true, &b) == NO_ERROR)
+            start_load(s, b, num, true);
+        mutex_release(&s->lock);
+
+        if (!b)
+            break;
+        ra[count] = b;
+    }
+
+    ssize_t err;
+    if (count == 1) {
+        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
+    } else {
+        mutex_acquire(&cache->ra_lock);
+        err = bio_read(cache->dev, cache->ra_buf, (off_t)blocknum * cache->block_size,
+                       count * cache->block_size);
+        for (uint i = 0; err >= 0 && i < count; i++) {
+            if ((size_t)err < (i + 1) * cache->block_size)
+                break;
+            memcpy(ra[i]->ptr, (uint8_t *)cache->ra_buf + i * cache->block_size, cache->block_size);
+        }
+        mutex_release(&cache->ra_lock);
+    }
+
+    LTRACEF("read %u blocks at %u, err %ld\n", count, blocknum, (long)err);
+
+    for (uint i = 0; i < count; i++) {
+        bool ok = err >= 0 && (size_t)err >= (i + 1) * cache->block_size;
+        finish_load(cache, ra[i], ok, i == 0);
+    }
+
+    if (err < 0 || (size_t)err < cache->block_size)
+        return NULL;
+
+    mutex_acquire(&shard->lock);
+    shard->stats.reads++;
+    shard->stats.readahead += count - 1;
+    mutex_release(&shard->lock);
+
+    cache->ra_next = blocknum + count;
+    cache->ra_window = count;
+
+    return block;
+}
+
+/* find blocknum, reading it in if need be, and return it with a ref held */
+static struct bcache_block *get_block_ref(struct bcache *cache, bnum_t blocknum) {
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+
+    LTRACEF("num %u\n", blocknum);
+
+    if (blocknum >= cache->dev_blocks)
+        return NULL;
+
+    lk_time_t waited = 0;
     struct bcache_block *block;
+    mutex_acquire(&shard->lock);
+    for (;;) {
+        uint32_t depth = 0;
+        block = hash_find(shard, blocknum, &depth);
+        if (!block) {
+            status_t err = alloc_block(cache, shard, &waited, &block);
+            if (err == NO_ERROR)
+                break;
+            if (err == ERR_BUSY)
+                continue;
+            mutex_release(&shard->lock);
+            return NULL;
+        }
+
+        pin_block(shard, block);
+        if (block->state == BLOCK_LOADING) {
+            /* someone else is reading it, wait for them and look again */
+            mutex_release(&shard->lock);
+            mutex_acquire(&block->io_lock);
+            mutex_release(&block->io_lock);
+            mutex_acquire(&shard->lock);
+            if (block->state != BLOCK_VALID) {
+                unpin_block(shard, block);
+                continue;
+            }
+        }
 
-    /* pop one off the free list if it's present */
-    block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
-    if (block) {
-        block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
-        LTRACEF("found block %p on free list\n", block);
+        /* seen again after falling off a1in is handled on the miss, a hit
+         * on a1in leaves it there */
+        if (block->queue == QUEUE_AM)
+            queue_add(shard, block, QUEUE_AM);
+
+        shard->stats.hits++;
+        shard->stats.depth += depth;
+        mutex_release(&shard->lock);
+
+        if (blocknum == cache->ra_next)
+            cache->ra_next = blocknum + 1;
         return block;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                /* if the oldest block in the list that's available is dirty, write
-                 * it back first.
-                 */
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
+    return load_blocks(cache, shard, block, blocknum);
+}
+
+static void put_block_ref(struct bcache *cache, struct bcache_block *block) {
+    struct bcache_shard *shard = block_shard(cache, block->blocknum);
+
+    mutex_acquire(&shard->lock);
+    unpin_block(shard, block);
+    mutex_release(&shard->lock);
+}
+
+/* find a cached block without changing its place, with its shard locked */
+static struct bcache_block *find_block(struct bcache *cache, struct bcache_shard *shard, bnum_t blocknum) {
+    struct bcache_block *block = hash_find(shard, blocknum, NULL);
+    if (block && block->state != BLOCK_VALID)
+        return NULL;
+    return block;
+}
+
+static bool can_write(struct bcache *cache, bnum_t blocknum, bool only_idle) {
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+
+    mutex_acquire(&shard->lock);
+    struct bcache_block *block = find_block(cache, shard, blocknum);
+    bool dirty = block && block->is_dirty && !(only_idle && block->ref_count > 0);
+    mutex_release(&shard->lock);
+
+    return dirty;
+}
+
+/* write the run of dirty blocks starting at blocknum in one go, unless only_idle and
+ * something's using them. Returns the number of blocks written.
+ */
+static int write_run(struct bcache *cache, bnum_t blocknum, bool only_idle) {
+    struct bcache_block *run[BCACHE_WRITE_RUN_MAX];
+    uint count;
+
+    DEBUG_ASSERT(is_mutex_held(&cache->wb_lock));
+
+    for (count = 0; count < BCACHE_WRITE_RUN_MAX; count++) {
+        struct bcache_shard *shard = block_shard(cache, blocknum + count);
+
+        mutex_acquire(&shard->lock);
+        struct bcache_block *block = find_block(cache, shard, blocknum + count);
+        if (block && (!block->is_dirty || (only_idle && block->ref_count > 0)))
+            block = NULL;
+        if (block) {
+            pin_block(shard, block);
+            clear_dirty(cache, block);
+        }
+        mutex_release(&shard->lock);
+
+        if (!block)
+            break;
+        run[count] = block;
+    }
+
+    if (count == 0)
+        return 0;
+
+    int err;
+    if (count == 1) {
+        err = write_blocks(cache, run[0]->ptr, blocknum, 1);
+    } else {
+        for (uint i = 0; i < count; i++)
+            memcpy((uint8_t *)cache->wb_buf + i * cache->block_size, run[i]->ptr, cache->block_size);
+        err = write_blocks(cache, cache->wb_buf, blocknum, count);
+    }
+
+    LTRACEF("wrote %u blocks at %u, err %d\n", count, blocknum, err);
+
+    for (uint i = 0; i < count; i++) {
+        struct bcache_shard *shard = block_shard(cache, run[i]->blocknum);
+
+        mutex_acquire(&shard->lock);
+        if (err < 0)
+            set_dirty(cache, run[i]);
+        else if (i == 0)
+            shard->stats.writes++;
+        unpin_block(shard, run[i]);
+        mutex_release(&shard->lock);
+    }
+
+    return err < 0 ? err : (int)count;
+}
+
+#define WB_BATCH 16
+
+static int bnum_compare(const void *a, const void *b) {
+    bnum_t x = *(const bnum_t *)a;
+    bnum_t y = *(const bnum_t *)b;
+    return x < y ? -1 : (x > y);
+}
+
+/* write dirty blocks until no more than target are left. Blocks dirtied since
+ * newer_than are skipped, and so are ones in use if only_idle.
+ */
+static int writeback(struct bcache *cache, int target, lk_time_t newer_than, bool only_idle) {
+    int written = 0;
+
+    DEBUG_ASSERT(is_mutex_held(&cache->wb_lock));
+
+    for (uint s = 0; s < (1u << cache->shard_shift); s++) {
+        struct bcache_shard *shard = &cache->shards[s];
+
+        for (;;) {
+            bnum_t batch[WB_BATCH];
+            uint count = 0;
+
+            if (__atomic_load_n(&cache->dirty_count, __ATOMIC_RELAXED) <= target)
+                return written;
+
+            mutex_acquire(&shard->lock);
+            struct list_node *queues[] = { &shard->a1in, &shard->am };
+            for (uint q = 0; q < countof(queues) && count < WB_BATCH; q++) {
+                struct bcache_block *block;
+                list_for_every_entry(queues[q], block, struct bcache_block, node) {
+                    if (!block->is_dirty || (only_idle && block->ref_count > 0))
+                        continue;
+                    if (TIME_GT(block->dirty_time, newer_than))
+                        continue;
+                    batch[count++] = block->blocknum;
+                    if (count == WB_BATCH)
+                        break;
+                }
             }
+            mutex_release(&shard->lock);
+
+            if (count == 0)
+                break;
+
+            /* in order, so the ones next to each other go out together, from
+             * the start of the run they're in, which may be in another shard */
+            qsort(batch, count, sizeof(bnum_t), bnum_compare);
+            for (uint i = 0; i < count; i++) {
+                bnum_t start = batch[i];
+                while (start > 0 && batch[i] - start < BCACHE_WRITE_RUN_MAX - 1 &&
+                        can_write(cache, start - 1, only_idle))
+                    start--;
+
+                int err = write_run(cache, start, only_idle);
+                if (err < 0)
+                    return err;
+                written += err;
+            }
+        }
+    }
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
+    return written;
+}
+
+static int writeback_thread(void *arg) {
+    struct bcache *cache = arg;
+
+    for (;;) {
+        event_wait_timeout(&cache->wb_event, BCACHE_WRITEBACK_INTERVAL);
+        if (cache->wb_stop)
+            break;
+
+        mutex_acquire(&cache->wb_lock);
+        int written;
+        if (__atomic_load_n(&cache->dirty_count, __ATOMIC_RELAXED) >= cache->dirty_high) {
+            written = writeback(cache, cache->dirty_low, current_time(), true);
+        } else {
+            written = writeback(cache, 0, current_time() - BCACHE_WRITEBACK_AGE, true);
         }
+        if (written > 0)
+            cache->wb_blocks += written;
+        mutex_release(&cache->wb_lock);
+    }
+
+    return 0;
+}
+
+static uint shard_shift_for(int block_count) {
+    uint shift = 0;
+    while ((1u << (shift + 1)) <= BCACHE_MAX_SHARDS &&
+            (int)((1u << (shift + 1)) * BCACHE_SHARD_MIN_BLOCKS) <= block_count)
+        shift++;
+    return shift;
+}
+
+bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
+    struct bcache *cache;
+
+    DEBUG_ASSERT(block_count > 0);
+
+    cache = calloc(1, sizeof(struct bcache));
+    if (!cache)
+        return NULL;
+
+    cache->dev = dev;
+    cache->block_size = block_size;
+    cache->count = block_count;
+    cache->dev_blocks = dev->total_size / block_size;
+    cache->read_only = false;
+
+    cache->shard_shift = shard_shift_for(block_count);
+    uint nshards = 1u << cache->shard_shift;
+    cache->shards = calloc(nshards, sizeof(struct bcache_shard));
+    cache->blocks = calloc(block_count, sizeof(struct bcache_block));
+    if (!cache->shards || !cache->blocks)
+        goto err;
+
+    for (uint s = 0; s < nshards; s++) {
+        struct bcache_shard *shard = &cache->shards[s];
+        uint blocks = block_count / nshards + (s < block_count % nshards);
+        uint buckets = 1;
+        while (buckets < blocks)
+            buckets <<= 1;
+
+        mutex_init(&shard->lock);
+        shard->hash = calloc(buckets, sizeof(struct bcache_block *));
+        shard->hash_mask = buckets - 1;
+        list_initialize(&shard->free_list);
+        list_initialize(&shard->a1in);
+        list_initialize(&shard->am);
+        shard->blocks = blocks;
+        event_init(&shard->unpinned, false, 0);
+        shard->kin = MAX(blocks / 4, 1u);
+        shard->kout = MAX(blocks / 2, 1u);
+        shard->ghosts = malloc(shard->kout * sizeof(bnum_t));
+        if (!shard->hash || !shard->ghosts)
+            goto err;
+        for (uint i = 0; i < shard->kout; i++)
+            shard->ghosts[i] = BNUM_NONE;
     }
 
+    /* hand the blocks out round robin */
+    for (int i = 0; i < block_count; i++) {
+        struct bcache_block *block = &cache->blocks[i];
+        struct bcache_shard *shard = &cache->shards[i % nshards];
+
+        block->ptr = malloc(block_size);
+        if (!block->ptr)
+            goto err;
+        mutex_init(&block->io_lock);
+        // add to the free list
+        queue_add(shard, block, QUEUE_FREE);
+    }
+
+    cache->ra_next = BNUM_NONE;
+    cache->ra_max = MIN(BCACHE_READAHEAD_MAX, block_count / BCACHE_READAHEAD_DIV);
+    mutex_init(&cache->ra_lock);
+    if (cache->ra_max > 1) {
+        cache->ra_buf = malloc(cache->ra_max * block_size);
+        if (!cache->ra_buf)
+            cache->ra_max = 1;
+    }
+
+    cache->dirty_high = MAX(block_count / 2, 1);
+    cache->dirty_low = block_count / 4;
+    mutex_init(&cache->wb_lock);
+    event_init(&cache->wb_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    cache->wb_buf = malloc(BCACHE_WRITE_RUN_MAX * block_size);
+    if (!cache->wb_buf)
+        goto err;
+
+    cache->wb_thread = thread_create("bcache wb", writeback_thread, cache, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!cache->wb_thread)
+        goto err;
+    thread_resume(cache->wb_thread);
+
+    return (bcache_t)cache;
+
+err:
+    bcache_destroy(cache);
     return NULL;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum) {
-    int err;
+void bcache_set_read_only(bcache_t _cache, bool ro) {
+    struct bcache *cache = _cache;
+    cache->read_only = ro;
+}
 
-    LTRACEF("block %u\n", blocknum);
+void bcache_destroy(bcache_t _cache) {
+    struct bcache *cache = _cache;
 
-    /* see if it's already in the cache */
-    struct bcache_block *block = find_block(cache, blocknum);
-    if (block == NULL) {
-        LTRACEF("wasn't allocated\n");
+    if (cache->wb_thread) {
+        cache->wb_stop = true;
+        event_signal(&cache->wb_event, true);
+        thread_join(cache->wb_thread, NULL, INFINITE_TIME);
+    }
 
-        /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+    if (cache->blocks) {
+        for (int i = 0; i < cache->count; i++) {
+            DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
-        LTRACEF("wasn't allocated, new block %p\n", block);
+            if (cache->blocks[i].is_dirty)
+                printf("warning: freeing dirty block %u\n",
+                       cache->blocks[i].blocknum);
 
-        block->blocknum = blocknum;
-        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
-        if (err < 0) {
-            /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
-            return NULL;
+            free(cache->blocks[i].ptr);
         }
-
-        cache->stats.reads++;
     }
 
-    DEBUG_ASSERT(block->blocknum == blocknum);
+    if (cache->shards) {
+        for (uint s = 0; s < (1u << cache->shard_shift); s++) {
+            free(cache->shards[s].hash);
+            free(cache->shards[s].ghosts);
+        }
+    }
 
-    return block;
+    free(cache->ra_buf);
+    free(cache->wb_buf);
+    free(cache->blocks);
+    free(cache->shards);
+    free(cache);
 }
 
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum) {
@@ -214,13 +846,14 @@ int bcache_read_block(bcache_t _cache, void *buf, uint blocknum) {
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    struct bcache_block *block = get_block_ref(cache, blocknum);
     if (block == NULL) {
         /* error */
         return -1;
     }
 
     memcpy(buf, block->ptr, cache->block_size);
+    put_block_ref(cache, block);
     return 0;
 }
 
@@ -231,14 +864,13 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum) {
 
     DEBUG_ASSERT(ptr);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    /* the ref keeps it from being freed */
+    struct bcache_block *block = get_block_ref(cache, blocknum);
     if (block == NULL) {
         /* error */
         return -1;
     }
 
-    /* increment the ref count to keep it from being freed */
-    block->ref_count++;
     *ptr = block->ptr;
 
     return 0;
@@ -246,16 +878,19 @@ int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum) {
 
 int bcache_put_block(bcache_t _cache, uint blocknum) {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    struct bcache_block *block = find_block(cache, shard, blocknum);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
-    block->ref_count--;
+    unpin_block(shard, block);
+    mutex_release(&shard->lock);
 
     return 0;
 }
@@ -263,80 +898,157 @@ int bcache_put_block(bcache_t _cache, uint blocknum) {
 int bcache_mark_block_dirty(bcache_t priv, uint blocknum) {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
 
     if (cache->read_only)
         return ERR_NOT_ALLOWED;
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+    block = find_block(cache, shard, blocknum);
     if (!block) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    set_dirty(cache, block);
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
 int bcache_zero_block(bcache_t priv, uint blocknum) {
-    int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
     if (cache->read_only)
         return ERR_NOT_ALLOWED;
 
-    block = find_block(cache, blocknum);
-    if (!block) {
-        block = alloc_block(cache);
-        if (!block) {
-            err = -1;
-            goto exit;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    struct bcache_block *block;
+
+    lk_time_t waited = 0;
+    mutex_acquire(&shard->lock);
+    for (;;) {
+        block = hash_find(shard, blocknum, NULL);
+        if (block && block->state == BLOCK_LOADING) {
+            /* let the read finish so it doesn't land on top of the zeros */
+            mutex_release(&shard->lock);
+            block = get_block_ref(cache, blocknum);
+            if (!block)
+                return -1;
+            mutex_acquire(&shard->lock);
+            unpin_block(shard, block);
+            break;
+        }
+        if (block)
+            break;
+
+        status_t err = alloc_block(cache, shard, &waited, &block);
+        if (err == ERR_BUSY)
+            continue;
+        if (err < 0) {
+            mutex_release(&shard->lock);
+            return -1;
         }
 
         block->blocknum = blocknum;
+        block->state = BLOCK_VALID;
+        hash_insert(shard, block);
+        queue_add(shard, block, QUEUE_A1IN);
+        break;
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
-    err = 0;
-exit:
-    return (err);
+    set_dirty(cache, block);
+    mutex_release(&shard->lock);
+
+    return 0;
 }
 
 int bcache_flush(bcache_t priv) {
-    int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
+    mutex_acquire(&cache->wb_lock);
+    int err = writeback(cache, 0, current_time(), false);
+    mutex_release(&cache->wb_lock);
+
+    return err < 0 ? err : 0;
+}
+
+int bcache_flush_range(bcache_t priv, uint blocknum, uint count) {
+    struct bcache *cache = priv;
+    int err = 0;
+
+    /* under wb_lock so a write the writer has started is done before the caller reads */
+    mutex_acquire(&cache->wb_lock);
+    for (uint i = 0; i < count && __atomic_load_n(&cache->dirty_count, __ATOMIC_RELAXED) > 0;) {
+        err = write_run(cache, blocknum + i, false);
+        if (err < 0)
+            break;
+        i += MAX(err, 1);
+    }
+    mutex_release(&cache->wb_lock);
+
+    return err < 0 ? err : 0;
+}
+
+int bcache_invalidate_range(bcache_t priv, uint blocknum, uint count) {
+    struct bcache *cache = priv;
+    int err = 0;
+
+    if (cache->read_only)
+        return ERR_NOT_ALLOWED;
+
+    /* under wb_lock so the writer isn't partway through putting an old copy out */
+    mutex_acquire(&cache->wb_lock);
+    for (uint i = 0; i < count && err == 0; i++) {
+        struct bcache_shard *shard = block_shard(cache, blocknum + i);
+
+        mutex_acquire(&shard->lock);
+        struct bcache_block *block = hash_find(shard, blocknum + i, NULL);
+        if (block && block->ref_count > 0) {
+            err = ERR_BUSY;
+        } else if (block) {
+            clear_dirty(cache, block);
+            hash_remove(shard, block);
+            queue_add(shard, block, QUEUE_FREE);
+            block->state = BLOCK_FREE;
         }
+        mutex_release(&shard->lock);
     }
+    mutex_release(&cache->wb_lock);
 
-    err = 0;
-exit:
-    return (err);
+    return err;
 }
 
 void bcache_dump(bcache_t priv, const char *name) {
     uint32_t finds;
     struct bcache *cache = priv;
+    struct bcache_stats stats = {0};
+
+    for (uint s = 0; s < (1u << cache->shard_shift); s++) {
+        struct bcache_stats *ss = &cache->shards[s].stats;
+        stats.hits += ss->hits;
+        stats.depth += ss->depth;
+        stats.misses += ss->misses;
+        stats.reads += ss->reads;
+        stats.readahead += ss->readahead;
+        stats.writes += ss->writes;
+    }
 
-    finds = cache->stats.hits + cache->stats.misses;
+    finds = stats.hits + stats.misses;
 
-    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+    printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u readahead=%u writes=%u writeback=%u dirty=%d\n",
            name,
-           cache->stats.hits,
-           finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-           cache->stats.misses,
-           finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           stats.hits,
+           finds ? (stats.hits * 100) / finds : 0,
+           stats.hits ? stats.depth / stats.hits : 0,
+           stats.misses,
+           finds ? (stats.misses * 100) / finds : 0,
+           stats.reads,
+           stats.readahead,
+           stats.writes,
+           cache->wb_blocks,
+           cache->dirty_count);
 }
@@ -14,6 +14,10 @@ __BEGIN_CDECLS
 
 typedef void *bcache_t;
 
+// A cache of a block device's blocks, safe to use from several threads. Dirty
+// blocks are written back in the background, bcache_flush() writes whatever is
+// still dirty and returns once it's on the device.
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count);
 void bcache_set_read_only(bcache_t priv, bool ro);
 void bcache_destroy(bcache_t);
@@ -26,6 +30,14 @@ int bcache_put_block(bcache_t, uint block);
 int bcache_mark_block_dirty(bcache_t priv, uint blocknum);
 int bcache_zero_block(bcache_t priv, uint blocknum);
 int bcache_flush(bcache_t priv);
+
+// For callers that move blocks to or from the device themselves. Flush a range
+// before reading it from the device, so it has the latest of any dirty blocks.
+// Invalidate one before writing it, which drops the cached copies, dirty or
+// not; ERR_BUSY if one is in use, in which case the range may be partly
+// dropped and should be written through the cache instead.
+int bcache_flush_range(bcache_t priv, uint blocknum, uint count);
+int bcache_invalidate_range(bcache_t priv, uint blocknum, uint count);
 void bcache_dump(bcache_t priv, const char *name);
 
 __END_CDECLS
@@ -7,4 +7,6 @@ MODULE_DEPS += lib/bio
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bcache.c
 
+MODULE_OPTIONS := test
+
 include make/module.mk
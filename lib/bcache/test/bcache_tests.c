@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/bcache.h>
+#include <lib/bio.h>
+#include <lib/unittest.h>
+#include <kernel/thread.h>
+#include <lk/err.h>
+#include <string.h>
+
+#define BLOCK_SIZE 512
+#define DEV_BLOCKS 256
+#define CACHE_BLOCKS 64
+
+// a memory device that counts what it's asked to do
+static struct {
+    bdev_t dev;
+    uint reads;
+    uint writes;
+    uint8_t data[DEV_BLOCKS * BLOCK_SIZE];
+} tdev;
+
+static ssize_t tdev_read(bdev_t *dev, void *buf, off_t offset, size_t len) {
+    tdev.reads++;
+    memcpy(buf, tdev.data + offset, len);
+    return len;
+}
+
+static ssize_t tdev_write(bdev_t *dev, const void *buf, off_t offset, size_t len) {
+    tdev.writes++;
+    memcpy(tdev.data + offset, buf, len);
+    return len;
+}
+
+// every block is filled with its own number
+static bdev_t *tdev_create(void) {
+    memset(&tdev, 0, sizeof(tdev));
+    for (uint i = 0; i < DEV_BLOCKS; i++) {
+        memset(tdev.data + i * BLOCK_SIZE, i, BLOCK_SIZE);
+    }
+
+    bio_initialize_bdev(&tdev.dev, "bcachetest", BLOCK_SIZE, DEV_BLOCKS, 0, NULL, BIO_FLAGS_NONE);
+    tdev.dev.read = tdev_read;
+    tdev.dev.write = tdev_write;
+    bio_register_device(&tdev.dev);
+
+    return bio_open("bcachetest");
+}
+
+static void tdev_destroy(bdev_t *dev) {
+    bio_close(dev);
+    bio_unregister_device(dev);
+}
+
+static bool block_is(const uint8_t *buf, uint8_t val) {
+    for (uint i = 0; i < BLOCK_SIZE; i++) {
+        if (buf[i] != val)
+            return false;
+    }
+    return true;
+}
+
+static bool hits_and_readahead(void) {
+    BEGIN_TEST;
+
+    bdev_t *dev = tdev_create();
+    ASSERT_NONNULL(dev, "");
+    bcache_t cache = bcache_create(dev, BLOCK_SIZE, CACHE_BLOCKS);
+    ASSERT_NONNULL(cache, "");
+
+    uint8_t buf[BLOCK_SIZE];
+    EXPECT_EQ(0, bcache_read_block(cache, buf, 100), "");
+    EXPECT_TRUE(block_is(buf, 100), "");
+    EXPECT_EQ(1U, tdev.reads, "");
+
+    // hits don't touch the device
+    EXPECT_EQ(0, bcache_read_block(cache, buf, 100), "");
+    EXPECT_EQ(1U, tdev.reads, "");
+
+    // a sequential run is read ahead in growing chunks
+    for (uint i = 0; i < 32; i++) {
+        EXPECT_EQ(0, bcache_read_block(cache, buf, i), "");
+        EXPECT_TRUE(block_is(buf, i), "");
+    }
+    EXPECT_LE(tdev.reads, 1U + 8U, "");
+
+    // pointers into the cache stay put while held
+    void *ptr;
+    EXPECT_EQ(0, bcache_get_block(cache, &ptr, 200), "");
+    EXPECT_TRUE(block_is(ptr, 200), "");
+    for (uint i = 0; i < DEV_BLOCKS; i++) {
+        EXPECT_EQ(0, bcache_read_block(cache, buf, i), "");
+    }
+    EXPECT_TRUE(block_is(ptr, 200), "");
+    EXPECT_EQ(0, bcache_put_block(cache, 200), "");
+
+    // past the end of the device
+    EXPECT_NE(0, bcache_read_block(cache, buf, DEV_BLOCKS), "");
+
+    EXPECT_EQ(0U, tdev.writes, "");
+
+    bcache_destroy(cache);
+    tdev_destroy(dev);
+
+    END_TEST;
+}
+
+static bool flush_and_writeback(void) {
+    BEGIN_TEST;
+
+    bdev_t *dev = tdev_create();
+    ASSERT_NONNULL(dev, "");
+    bcache_t cache = bcache_create(dev, BLOCK_SIZE, CACHE_BLOCKS);
+    ASSERT_NONNULL(cache, "");
+
+    // a run of dirty blocks goes out in one write
+    for (uint i = 10; i < 18; i++) {
+        void *ptr;
+        ASSERT_EQ(0, bcache_get_block(cache, &ptr, i), "");
+        memset(ptr, 0xa5, BLOCK_SIZE);
+        EXPECT_EQ(0, bcache_mark_block_dirty(cache, i), "");
+        EXPECT_EQ(0, bcache_put_block(cache, i), "");
+    }
+    EXPECT_EQ(0, bcache_zero_block(cache, 18), "");
+    EXPECT_TRUE(block_is(tdev.data + 18 * BLOCK_SIZE, 18), "not written yet");
+
+    EXPECT_EQ(0, bcache_flush(cache), "");
+    EXPECT_EQ(1U, tdev.writes, "");
+    for (uint i = 10; i < 18; i++) {
+        EXPECT_TRUE(block_is(tdev.data + i * BLOCK_SIZE, 0xa5), "");
+    }
+    EXPECT_TRUE(block_is(tdev.data + 18 * BLOCK_SIZE, 0), "");
+
+    // nothing left to write
+    EXPECT_EQ(0, bcache_flush(cache), "");
+    EXPECT_EQ(1U, tdev.writes, "");
+
+    // dirtying most of the cache wakes the writer without a flush
+    for (uint i = 0; i < CACHE_BLOCKS * 3 / 4; i++) {
+        EXPECT_EQ(0, bcache_zero_block(cache, 100 + i), "");
+    }
+    for (int i = 0; i < 100 && tdev.writes == 1; i++) {
+        thread_sleep(10);
+    }
+    EXPECT_GT(tdev.writes, 1U, "");
+
+    EXPECT_EQ(0, bcache_flush(cache), "");
+    for (uint i = 0; i < CACHE_BLOCKS * 3 / 4; i++) {
+        EXPECT_TRUE(block_is(tdev.data + (100 + i) * BLOCK_SIZE, 0), "");
+    }
+
+    // read only caches won't take changes
+    bcache_set_read_only(cache, true);
+    EXPECT_EQ(ERR_NOT_ALLOWED, bcache_zero_block(cache, 1), "");
+    EXPECT_EQ(ERR_NOT_ALLOWED, bcache_mark_block_dirty(cache, 10), "");
+
+    bcache_destroy(cache);
+    tdev_destroy(dev);
+
+    END_TEST;
+}
+
+// callers going around the cache see and leave it consistent
+static bool flush_and_invalidate_range(void) {
+    BEGIN_TEST;
+
+    bdev_t *dev = tdev_create();
+    ASSERT_NONNULL(dev, "");
+    bcache_t cache = bcache_create(dev, BLOCK_SIZE, CACHE_BLOCKS);
+    ASSERT_NONNULL(cache, "");
+
+    // only the dirty blocks in the range go out
+    EXPECT_EQ(0, bcache_zero_block(cache, 20), "");
+    EXPECT_EQ(0, bcache_zero_block(cache, 21), "");
+    EXPECT_EQ(0, bcache_zero_block(cache, 40), "");
+    EXPECT_EQ(0, bcache_flush_range(cache, 16, 8), "");
+    EXPECT_EQ(1U, tdev.writes, "");
+    EXPECT_TRUE(block_is(tdev.data + 21 * BLOCK_SIZE, 0), "");
+    EXPECT_TRUE(block_is(tdev.data + 40 * BLOCK_SIZE, 40), "");
+
+    // invalidated blocks are read again, dirty ones are thrown away
+    uint8_t buf[BLOCK_SIZE];
+    EXPECT_EQ(0, bcache_read_block(cache, buf, 30), "");
+    memset(tdev.data + 30 * BLOCK_SIZE, 0x5a, BLOCK_SIZE);
+    memset(tdev.data + 40 * BLOCK_SIZE, 0x5a, BLOCK_SIZE);
+    EXPECT_EQ(0, bcache_invalidate_range(cache, 30, 11), "");
+    uint reads = tdev.reads;
+    EXPECT_EQ(0, bcache_read_block(cache, buf, 30), "");
+    EXPECT_TRUE(block_is(buf, 0x5a), "");
+    EXPECT_EQ(0, bcache_read_block(cache, buf, 40), "");
+    EXPECT_TRUE(block_is(buf, 0x5a), "");
+    EXPECT_GT(tdev.reads, reads, "");
+    EXPECT_EQ(0, bcache_flush(cache), "");
+    EXPECT_EQ(1U, tdev.writes, "");
+
+    // blocks in use stay
+    void *ptr;
+    ASSERT_EQ(0, bcache_get_block(cache, &ptr, 50), "");
+    EXPECT_EQ(ERR_BUSY, bcache_invalidate_range(cache, 50, 1), "");
+    EXPECT_EQ(0, bcache_put_block(cache, 50), "");
+    EXPECT_EQ(0, bcache_invalidate_range(cache, 50, 1), "");
+
+    bcache_destroy(cache);
+    tdev_destroy(dev);
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(bcache_tests)
+RUN_TEST(hits_and_readahead)
+RUN_TEST(flush_and_writeback)
+RUN_TEST(flush_and_invalidate_range)
+END_TEST_CASE(bcache_tests)
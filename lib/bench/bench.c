@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/bench.h>
+
+#include <kernel/event.h>
+#include <kernel/mp.h>
+#include <lk/debug.h>
+#include <platform.h>
+
+struct bench_ctx {
+    const struct bench_run *run;
+    event_t start;
+    volatile bool stop;
+};
+
+struct bench_thread {
+    struct bench_ctx *ctx;
+    uint index;
+    uint64_t ops;
+};
+
+static int bench_thread_entry(void *arg) {
+    struct bench_thread *t = arg;
+
+    event_wait(&t->ctx->start);
+    t->ops = t->ctx->run->fn(t->ctx->run->arg, t->index, &t->ctx->stop);
+
+    return 0;
+}
+
+status_t bench_run_threads(struct bench_run *run) {
+    if (!run->fn || run->thread_count == 0 || run->thread_count > BENCH_MAX_THREADS) {
+        return ERR_INVALID_ARGS;
+    }
+
+    thread_t *threads[BENCH_MAX_THREADS];
+    struct bench_thread args[BENCH_MAX_THREADS];
+    struct bench_ctx ctx = { .run = run, .stop = false };
+    status_t err = NO_ERROR;
+
+    event_init(&ctx.start, false, 0);
+
+    uint count;
+    for (count = 0; count < run->thread_count; count++) {
+        args[count] = (struct bench_thread) { .ctx = &ctx, .index = count, .ops = 0 };
+        threads[count] = thread_create(run->name ? run->name : "bench", bench_thread_entry,
+                                       &args[count], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!threads[count]) {
+            err = ERR_NO_MEMORY;
+            ctx.stop = true;
+            break;
+        }
+        thread_resume(threads[count]);
+    }
+
+    /* give them all time to get to the starting line */
+    thread_sleep(10);
+
+    lk_bigtime_t t = current_time_hires();
+    event_signal(&ctx.start, true);
+    if (run->duration > 0 && err == NO_ERROR) {
+        thread_sleep(run->duration);
+        ctx.stop = true;
+    }
+
+    run->ops = 0;
+    for (uint i = 0; i < count; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        run->ops += args[i].ops;
+    }
+    run->elapsed = current_time_hires() - t;
+
+    event_destroy(&ctx.start);
+
+    return err;
+}
+
+uint bench_cpu_count(void) {
+#if WITH_SMP
+    return __builtin_popcount(mp.active_cpus);
+#else
+    return 1;
+#endif
+}
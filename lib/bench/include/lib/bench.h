@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/err.h>
+#include <kernel/thread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+#define BENCH_MAX_THREADS 16
+
+/*
+ * The body of a multi threaded benchmark, run once on each thread. index is
+ * the thread's number from 0. Timed runs loop until *stop turns true, the rest
+ * do a fixed amount of work. Returns the number of operations it did.
+ */
+typedef uint64_t (*bench_fn)(void *arg, uint index, const volatile bool *stop);
+
+struct bench_run {
+    const char *name;
+    bench_fn fn;
+    void *arg;
+    uint thread_count;
+    lk_time_t duration; /* ms to run for, 0 to wait for every thread to return */
+
+    /* filled in by bench_run_threads() */
+    uint64_t ops;         /* what the threads returned, added up */
+    lk_bigtime_t elapsed; /* usecs from the start to the last thread finishing */
+};
+
+/* start the threads, release them all at once and wait for them to finish */
+status_t bench_run_threads(struct bench_run *run);
+
+/* the cpus a benchmark can spread across */
+uint bench_cpu_count(void);
+
+__END_CDECLS
@@ -6,6 +6,7 @@
  * https://opensource.org/licenses/MIT
  */
 #include <lib/bio.h>
+#include <lib/bio/queue.h>
 
 #include <arch/atomic.h>
 #include <assert.h>
@@ -571,6 +572,8 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->erase = bio_default_erase;
     dev->ioctl = NULL;
     dev->close = NULL;
+    dev->submit = NULL;
+    dev->queue = NULL;
 }
 
 void bio_register_device(bdev_t *dev) {
@@ -635,6 +638,7 @@ void bio_dump_devices(void) {
         }
 
         printf("\n");
+        bio_queue_dump(entry);
     }
     mutex_release(&bdevs.lock);
 }
@@ -6,7 +6,9 @@
  * https://opensource.org/licenses/MIT
  */
 #include <assert.h>
+#include <inttypes.h>
 #include <kernel/thread.h>
+#include <lib/bench.h>
 #include <lib/bio.h>
 #include <lk/console_cmd.h>
 #include <lk/debug.h>
@@ -33,6 +35,7 @@
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const console_cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench_device(bdev_t *device, lk_time_t duration, uint threads, size_t len);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -54,6 +57,7 @@ usage:
         printf("%s remove <device>\n", argv[0].str);
         printf("%s create_memdev <device> <blocks>\n", argv[0].str);
         printf("%s test <device> *destructive*\n", argv[0].str);
+        printf("%s bench <device> <seconds> [threads] [len]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -244,6 +248,21 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) {
+            goto notenoughargs;
+        }
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        uint threads = (argc > 4) ? argv[4].u : 1;
+        size_t len = (argc > 5) ? argv[5].u : dev->block_size;
+        rc = bio_bench_device(dev, argv[3].u * 1000, threads, len);
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) {
@@ -590,3 +609,67 @@ static int bio_test_device(bdev_t *device) {
 
     return 0;
 }
+
+struct bio_bench_args {
+    bdev_t *device;
+    size_t len;
+    uint64_t count; // of len sized pieces of the device
+};
+
+// Read len bytes at a time from random offsets, until told to stop.
+static uint64_t bio_bench_thread(void *_args, uint index, const volatile bool *stop) {
+    struct bio_bench_args *args = _args;
+
+    uint8_t *buf = memalign(DMA_ALIGNMENT, args->len);
+    if (!buf) {
+        return 0;
+    }
+
+    uint64_t seed = index + 1;
+    uint64_t reads = 0;
+    while (!*stop) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        off_t offset = (off_t)((seed >> 33) % args->count) * args->len;
+
+        if (bio_read(args->device, buf, offset, args->len) != (ssize_t)args->len) {
+            printf("error reading at offset 0x%llx\n", (unsigned long long)offset);
+            break;
+        }
+        reads++;
+    }
+
+    free(buf);
+    return reads;
+}
+
+static int bio_bench_device(bdev_t *device, lk_time_t duration, uint threads, size_t len) {
+    if (duration == 0 || len == 0 || (off_t)len > device->total_size) {
+        printf("invalid duration or length\n");
+        return -1;
+    }
+
+    struct bio_bench_args args = {
+        .device = device,
+        .len = len,
+        .count = device->total_size / len,
+    };
+    struct bench_run run = {
+        .name = "bio bench",
+        .fn = bio_bench_thread,
+        .arg = &args,
+        .thread_count = threads,
+        .duration = duration,
+    };
+
+    status_t err = bench_run_threads(&run);
+    if (err < 0) {
+        printf("error %d running benchmark\n", err);
+        return err;
+    }
+
+    uint64_t usecs = MAX(run.elapsed, 1);
+    printf("%" PRIu64 " reads of %zu bytes on %u threads in %" PRIu64 " usecs: %" PRIu64 " reads/sec, %" PRIu64 " KB/sec\n",
+           run.ops, len, threads, usecs, run.ops * 1000000 / usecs, run.ops * len * 1000000 / usecs / 1024);
+
+    return 0;
+}
@@ -60,6 +60,9 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bio_request;
+struct bio_queue;
+
 // Block device descriptor.
 // Filled by drivers and registered via bio_register_device(). Most fields are
 // read-only to users; access the device via the provided API functions.
@@ -107,6 +110,11 @@ typedef struct bdev {
     // Close hook for drivers (optional). The BIO layer handles refcounts and
     // will call this when the last handle is closed.
     void (*close)(struct bdev *);
+
+    // Take a request, see lib/bio/queue.h. Set up by bio_queue_attach() and by
+    // subdevices; when NULL, requests are run through the block hooks.
+    status_t (*submit)(struct bdev *, struct bio_request *);
+    struct bio_queue *queue; // request queue, if the driver has one
 } bdev_t;
 
 typedef void (*bio_async_callback_t)(void *cookie, bdev_t *dev, ssize_t status);
@@ -0,0 +1,166 @@
+// Copyright (c) 2026 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+// Block I/O requests and request queues
+//
+// A request moves whole blocks between a device and a list of buffers (iovecs).
+// It is handed to bio_submit(), which returns right away, and finishes by calling
+// its done callback. Any number of requests can be outstanding on a device.
+//
+// A driver takes requests by attaching a queue to its bdev with bio_queue_attach()
+// rather than implementing the block and async hooks itself. The queue:
+// - holds requests until the driver has room for them, keeping up to a per device
+//   depth of them with the driver at once,
+// - merges a request with a waiting one it directly follows or precedes, so a run
+//   of small requests reaches the device as a single transfer, within the limits
+//   the driver gives,
+// - holds everything back while plugged, so a caller can build up a batch,
+// - calls done callbacks from a dpc, as many as have finished at a time, rather
+//   than from the driver's interrupt handler.
+//
+// Devices without a queue take requests too: bio_submit() performs them through
+// the block hooks before returning. Subdevices pass requests on to their parent.
+//
+// Done callbacks run in dpc context, or the submitter's for devices without a
+// queue, and must not block. In particular they mustn't wait on more I/O, though
+// they may submit it.
+
+#include <iovec.h>
+#include <lib/bio.h>
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+// NOLINTBEGIN(modernize-use-using)
+
+enum bio_op {
+    BIO_OP_READ = 0,
+    BIO_OP_WRITE,
+};
+
+typedef struct bio_request bio_request_t;
+typedef void (*bio_request_done_t)(bio_request_t *req);
+
+struct bio_queue;
+
+struct bio_request {
+    // Filled in by the submitter, see bio_request_init().
+    uint op;                // BIO_OP_*
+    bnum_t block;           // first block
+    uint count;             // number of blocks
+    const iovec_t *iov;     // buffers, each a multiple of the block size long
+    uint iov_count;
+    bio_request_done_t done;
+    void *cookie;
+
+    // Bytes transferred or a negative error, set before done is called.
+    ssize_t result;
+
+    // Private to the bio layer and the driver while the request is outstanding.
+    bdev_t *dev;            // device it was submitted to
+    bnum_t dev_block;       // first block on the device doing the transfer
+    uint segments;          // pages touched by the buffers
+    struct bio_queue *queue;
+    struct list_node node;
+
+    // Requests merged behind this one, in block order, and the totals of them all.
+    // The driver transfers merge_count blocks starting at dev_block.
+    bio_request_t *merge_next;
+    bio_request_t *merge_tail;
+    uint merge_count;
+    uint merge_segments;
+
+    // For the driver while it has the request.
+    uintptr_t driver_data[2];
+};
+
+static inline void bio_request_init(bio_request_t *req, uint op, bnum_t block, uint count,
+                                    const iovec_t *iov, uint iov_count,
+                                    bio_request_done_t done, void *cookie) {
+    req->op = op;
+    req->block = block;
+    req->count = count;
+    req->iov = iov;
+    req->iov_count = iov_count;
+    req->done = done;
+    req->cookie = cookie;
+    req->result = 0;
+}
+
+// Start a request on dev. Returns an error without calling done if the request is
+// malformed or out of range, otherwise done will be called exactly once. The
+// request and its iovec array must stay put until then. Call from thread or dpc
+// context.
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+
+// Submit req and wait for it, returning its result. Replaces done and cookie.
+ssize_t bio_submit_wait(bdev_t *dev, bio_request_t *req);
+
+// Hold back requests to dev until the matching unplug, so that the ones submitted
+// in between can be merged. Plugs nest. Devices without a queue ignore them.
+void bio_plug(bdev_t *dev);
+void bio_unplug(bdev_t *dev);
+
+// Change how many requests dev's driver is given at once, between 1 and the depth
+// it attached with.
+status_t bio_queue_set_depth(bdev_t *dev, uint depth);
+
+// Print the state of dev's queue, if it has one.
+void bio_queue_dump(const bdev_t *dev);
+
+// Driver interface.
+
+struct bio_queue_config {
+    // Start the transfer for req and everything merged behind it. Returns
+    // ERR_BUSY to have the request given back later, when another finishes, or
+    // an error to fail it. Otherwise the driver calls bio_request_complete()
+    // once, possibly before returning.
+    status_t (*issue)(bdev_t *dev, bio_request_t *req);
+
+    uint depth;         // most requests issued at once, at least 1
+    uint max_blocks;    // most blocks merged into one request, 0 for no limit
+    uint max_segments;  // most pages merged into one request, 0 for no limit
+
+    // issue may block, so call it from a thread of the queue's own
+    bool blocking;
+};
+
+// Give dev a request queue, routing its block and async hooks through it. Call
+// after bio_initialize_bdev() and before bio_register_device().
+status_t bio_queue_attach(bdev_t *dev, const struct bio_queue_config *config);
+
+// Tear down dev's queue. Nothing may be outstanding.
+void bio_queue_detach(bdev_t *dev);
+
+// Finish an issued request with the bytes transferred or an error. Safe to call
+// from interrupt context.
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
+// Pass a request already submitted elsewhere to dev, for devices stacked on
+// another. dev_block must have been moved to dev's numbering.
+status_t bio_submit_lower(bdev_t *dev, bio_request_t *req);
+
+// Walk the buffers of an issued request and those merged behind it.
+typedef struct bio_sg_iter {
+    const bio_request_t *req;
+    uint index;
+    size_t offset;
+    size_t remaining; // in the current request
+} bio_sg_iter_t;
+
+void bio_sg_iter_init(bio_sg_iter_t *iter, const bio_request_t *req);
+
+// Get the next piece of at most max bytes, or false at the end. Pieces never
+// straddle two buffers.
+bool bio_sg_iter_next(bio_sg_iter_t *iter, size_t max, void **buf, size_t *len);
+
+// NOLINTEND(modernize-use-using)
+
+__END_CDECLS
@@ -0,0 +1,604 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/bio/queue.h>
+
+#include <assert.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lib/bio.h>
+#include <lib/dpc.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/list.h>
+#include <lk/trace.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+// how far back from the newest waiting request to look for one to merge with
+#define MERGE_SCAN 16
+
+struct bio_queue {
+    bdev_t *dev;
+    struct bio_queue_config config;
+    uint depth;
+
+    spin_lock_t lock;
+    struct list_node pending;   // submitted, waiting to be issued
+    struct list_node done;      // completed by the driver, waiting for the dpc
+    uint in_flight;
+    uint plugged;
+
+    dpc_t done_dpc;
+
+    // drivers that block while issuing are fed from a thread
+    thread_t *thread;
+    event_t kick;
+    bool stop;
+
+    // stats
+    uint64_t submitted;
+    uint64_t merged;
+    uint64_t issued;
+    uint64_t busy;
+    uint64_t completed;
+    uint64_t batches;
+    uint max_in_flight;
+};
+
+static void queue_run(struct bio_queue *q);
+
+static uint buffer_segments(const void *buf, size_t len) {
+#if WITH_KERNEL_VM
+    vaddr_t va = (vaddr_t)buf;
+    return (PAGE_ALIGN(va + len) - ROUNDDOWN(va, PAGE_SIZE)) / PAGE_SIZE;
+#else
+    return 1;
+#endif
+}
+
+// Look for a waiting request that req goes directly behind or in front of and
+// join them. Stops at anything req would have to pass that overlaps it and
+// isn't just another read.
+static bool queue_merge(struct bio_queue *q, bio_request_t *req) {
+    uint scanned = 0;
+    for (struct list_node *n = list_peek_tail(&q->pending); n && scanned < MERGE_SCAN;
+            n = list_prev(&q->pending, n), scanned++) {
+        bio_request_t *head = containerof(n, bio_request_t, node);
+
+        if (bio_does_overlap(head->dev_block, head->merge_count, req->dev_block, req->count)) {
+            if (head->op == BIO_OP_WRITE || req->op == BIO_OP_WRITE) {
+                break;
+            }
+            continue;
+        }
+        if (head->op != req->op) {
+            continue;
+        }
+
+        uint count = head->merge_count + req->count;
+        uint segments = head->merge_segments + req->segments;
+        if (count < head->merge_count ||
+                (q->config.max_blocks && count > q->config.max_blocks) ||
+                (q->config.max_segments && segments > q->config.max_segments)) {
+            continue;
+        }
+
+        if (head->dev_block + head->merge_count == req->dev_block) {
+            head->merge_tail->merge_next = req;
+            head->merge_tail = req;
+        } else if (req->dev_block + req->count == head->dev_block) {
+            // req takes over head's place in line
+            req->merge_next = head;
+            req->merge_tail = head->merge_tail;
+            list_add_before(&head->node, &req->node);
+            list_delete(&head->node);
+            head = req;
+        } else {
+            continue;
+        }
+
+        head->merge_count = count;
+        head->merge_segments = segments;
+        q->merged++;
+        return true;
+    }
+
+    return false;
+}
+
+static status_t queue_submit(bdev_t *dev, bio_request_t *req) {
+    struct bio_queue *q = dev->queue;
+    DEBUG_ASSERT(q);
+
+    req->queue = q;
+    req->merge_next = NULL;
+    req->merge_tail = req;
+    req->merge_count = req->count;
+    req->merge_segments = req->segments;
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    q->submitted++;
+    if (!queue_merge(q, req)) {
+        list_add_tail(&q->pending, &req->node);
+    }
+    bool run = !q->plugged && q->in_flight < q->depth;
+    spin_unlock_irqrestore(&q->lock, state);
+
+    if (run) {
+        queue_run(q);
+    }
+
+    return NO_ERROR;
+}
+
+// Hand waiting requests to the driver while it has room.
+static void queue_dispatch(struct bio_queue *q) {
+    for (;;) {
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+        if (q->plugged || q->in_flight >= q->depth || list_is_empty(&q->pending)) {
+            spin_unlock_irqrestore(&q->lock, state);
+            return;
+        }
+        bio_request_t *req = list_remove_head_type(&q->pending, bio_request_t, node);
+        // whether something ahead of it can still finish and free up the driver
+        bool others = q->in_flight > 0;
+        q->in_flight++;
+        q->max_in_flight = MAX(q->max_in_flight, q->in_flight);
+        q->issued++;
+        spin_unlock_irqrestore(&q->lock, state);
+
+        LTRACEF("issue %p op %u block %u count %u\n", req, req->op, req->dev_block, req->merge_count);
+
+        status_t err = q->config.issue(q->dev, req);
+        if (err == ERR_BUSY) {
+            // the driver is out of room, try again once something else finishes
+            state = spin_lock_irqsave(&q->lock);
+            q->busy++;
+            if (others) {
+                q->in_flight--;
+                list_add_head(&q->pending, &req->node);
+                // if they all finished while it was being issued, their completions
+                // may have come and gone without seeing it, so go around again
+                bool retry = q->in_flight == 0;
+                spin_unlock_irqrestore(&q->lock, state);
+                if (retry) {
+                    continue;
+                }
+                return;
+            }
+            spin_unlock_irqrestore(&q->lock, state);
+
+            // nothing else is going to finish, give up on it. Completing it takes
+            // it back out of in_flight.
+            err = ERR_NO_RESOURCES;
+        }
+        if (err < 0) {
+            bio_request_complete(req, err);
+        }
+    }
+}
+
+static int queue_thread(void *arg) {
+    struct bio_queue *q = arg;
+
+    for (;;) {
+        event_wait(&q->kick);
+        if (q->stop) {
+            break;
+        }
+        queue_dispatch(q);
+    }
+
+    return 0;
+}
+
+static void queue_run(struct bio_queue *q) {
+    if (q->thread) {
+        event_signal(&q->kick, false);
+    } else {
+        queue_dispatch(q);
+    }
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result) {
+    struct bio_queue *q = req->queue;
+    DEBUG_ASSERT(q);
+
+    LTRACEF("req %p result %ld\n", req, (long)result);
+
+    req->result = result;
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    DEBUG_ASSERT(q->in_flight > 0);
+    q->in_flight--;
+    list_add_tail(&q->done, &req->node);
+    spin_unlock_irqrestore(&q->lock, state);
+
+    dpc_queue_etc(&q->done_dpc, DPC_CPU_CURRENT, DPC_FLAG_NORESCHED);
+}
+
+// Split the result of a finished request across it and everything merged behind
+// it, in block order.
+static void request_finish(bio_request_t *head) {
+    ssize_t result = head->result;
+    size_t left = (result > 0) ? (size_t)result : 0;
+
+    bio_request_t *next;
+    for (bio_request_t *req = head; req; req = next) {
+        next = req->merge_next;
+
+        if (result < 0) {
+            req->result = result;
+        } else {
+            size_t len = (size_t)req->count << req->dev->block_shift;
+            if (left == 0) {
+                req->result = ERR_IO;
+            } else {
+                req->result = MIN(len, left);
+                left -= req->result;
+            }
+        }
+
+        req->done(req);
+    }
+}
+
+static void queue_done_dpc(void *arg) {
+    struct bio_queue *q = arg;
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    uint count = 0;
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    struct list_node *n;
+    while ((n = list_remove_head(&q->done))) {
+        list_add_tail(&done, n);
+        count++;
+    }
+    q->completed += count;
+    q->batches++;
+    spin_unlock_irqrestore(&q->lock, state);
+
+    bio_request_t *req;
+    while ((req = list_remove_head_type(&done, bio_request_t, node))) {
+        request_finish(req);
+    }
+
+    queue_run(q);
+}
+
+// Requests to devices without a queue are run right away through the block hooks.
+static void request_run_sync(bdev_t *dev, bio_request_t *req) {
+    bnum_t block = req->dev_block;
+    uint left = req->count;
+    ssize_t total = 0;
+
+    for (uint i = 0; i < req->iov_count && left > 0; i++) {
+        uint count = MIN(left, req->iov[i].iov_len >> dev->block_shift);
+        if (count == 0) {
+            continue;
+        }
+
+        ssize_t err;
+        if (req->op == BIO_OP_WRITE) {
+            err = dev->write_block(dev, req->iov[i].iov_base, block, count);
+        } else {
+            err = dev->read_block(dev, req->iov[i].iov_base, block, count);
+        }
+        if (err < 0) {
+            total = err;
+            break;
+        }
+        total += err;
+        if ((size_t)err != (size_t)count << dev->block_shift) {
+            break;
+        }
+
+        block += count;
+        left -= count;
+    }
+
+    req->result = total;
+    req->done(req);
+}
+
+status_t bio_submit_lower(bdev_t *dev, bio_request_t *req) {
+    if (dev->submit) {
+        return dev->submit(dev, req);
+    }
+
+    request_run_sync(dev, req);
+    return NO_ERROR;
+}
+
+status_t bio_submit(bdev_t *dev, bio_request_t *req) {
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req && req->done);
+
+    LTRACEF("dev '%s', op %u, block %u, count %u\n", dev->name, req->op, req->block, req->count);
+
+    if (req->op > BIO_OP_WRITE || req->count == 0 || !req->iov) {
+        return ERR_INVALID_ARGS;
+    }
+    if (bio_trim_block_range(dev, req->block, req->count) != req->count) {
+        return ERR_OUT_OF_RANGE;
+    }
+
+    size_t len = 0;
+    uint segments = 0;
+    for (uint i = 0; i < req->iov_count; i++) {
+        if (req->iov[i].iov_len & (dev->block_size - 1)) {
+            return ERR_INVALID_ARGS;
+        }
+        len += req->iov[i].iov_len;
+        segments += buffer_segments(req->iov[i].iov_base, req->iov[i].iov_len);
+    }
+    if (len < ((size_t)req->count << dev->block_shift)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    req->dev = dev;
+    req->dev_block = req->block;
+    req->segments = segments;
+    req->result = 0;
+
+    return bio_submit_lower(dev, req);
+}
+
+static void submit_wait_done(bio_request_t *req) {
+    event_signal((event_t *)req->cookie, false);
+}
+
+ssize_t bio_submit_wait(bdev_t *dev, bio_request_t *req) {
+    event_t event;
+    event_init(&event, false, 0);
+
+    req->done = submit_wait_done;
+    req->cookie = &event;
+
+    status_t err = bio_submit(dev, req);
+    if (err >= 0) {
+        event_wait(&event);
+    }
+    event_destroy(&event);
+
+    return (err < 0) ? err : req->result;
+}
+
+void bio_plug(bdev_t *dev) {
+    struct bio_queue *q = dev->queue;
+    if (!q) {
+        return;
+    }
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    q->plugged++;
+    spin_unlock_irqrestore(&q->lock, state);
+}
+
+void bio_unplug(bdev_t *dev) {
+    struct bio_queue *q = dev->queue;
+    if (!q) {
+        return;
+    }
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    DEBUG_ASSERT(q->plugged > 0);
+    bool run = --q->plugged == 0;
+    spin_unlock_irqrestore(&q->lock, state);
+
+    if (run) {
+        queue_run(q);
+    }
+}
+
+status_t bio_queue_set_depth(bdev_t *dev, uint depth) {
+    struct bio_queue *q = dev->queue;
+    if (!q) {
+        return ERR_NOT_SUPPORTED;
+    }
+    if (depth == 0 || depth > q->config.depth) {
+        return ERR_INVALID_ARGS;
+    }
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    q->depth = depth;
+    spin_unlock_irqrestore(&q->lock, state);
+
+    queue_run(q);
+    return NO_ERROR;
+}
+
+// The block and async hooks of a queued device.
+
+static ssize_t queue_rw_block(bdev_t *dev, uint op, void *buf, bnum_t block, uint count) {
+    iovec_t iov = { buf, (size_t)count << dev->block_shift };
+    bio_request_t req;
+
+    bio_request_init(&req, op, block, count, &iov, 1, NULL, NULL);
+    return bio_submit_wait(dev, &req);
+}
+
+static ssize_t queue_read_block(bdev_t *dev, void *buf, bnum_t block, uint count) {
+    return queue_rw_block(dev, BIO_OP_READ, buf, block, count);
+}
+
+static ssize_t queue_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count) {
+    return queue_rw_block(dev, BIO_OP_WRITE, (void *)buf, block, count);
+}
+
+struct async_request {
+    bio_request_t req;
+    iovec_t iov;
+    bio_async_callback_t callback;
+    void *cookie;
+};
+
+static void async_done(bio_request_t *req) {
+    struct async_request *a = containerof(req, struct async_request, req);
+
+    a->callback(a->cookie, req->dev, req->result);
+    free(a);
+}
+
+static status_t queue_rw_async(bdev_t *dev, uint op, void *buf, off_t offset, size_t len,
+                               bio_async_callback_t callback, void *cookie) {
+    if ((offset | len) & (dev->block_size - 1)) {
+        return ERR_INVALID_ARGS;
+    }
+
+    struct async_request *a = malloc(sizeof(*a));
+    if (!a) {
+        return ERR_NO_MEMORY;
+    }
+    a->iov.iov_base = buf;
+    a->iov.iov_len = len;
+    a->callback = callback;
+    a->cookie = cookie;
+
+    bio_request_init(&a->req, op, offset >> dev->block_shift, len >> dev->block_shift,
+                     &a->iov, 1, async_done, NULL);
+    status_t err = bio_submit(dev, &a->req);
+    if (err < 0) {
+        free(a);
+    }
+    return err;
+}
+
+static status_t queue_read_async(bdev_t *dev, void *buf, off_t offset, size_t len,
+                                 bio_async_callback_t callback, void *cookie) {
+    return queue_rw_async(dev, BIO_OP_READ, buf, offset, len, callback, cookie);
+}
+
+static status_t queue_write_async(bdev_t *dev, const void *buf, off_t offset, size_t len,
+                                  bio_async_callback_t callback, void *cookie) {
+    return queue_rw_async(dev, BIO_OP_WRITE, (void *)buf, offset, len, callback, cookie);
+}
+
+status_t bio_queue_attach(bdev_t *dev, const struct bio_queue_config *config) {
+    DEBUG_ASSERT(dev && !dev->queue);
+    DEBUG_ASSERT(config && config->issue);
+
+    if (config->depth == 0) {
+        return ERR_INVALID_ARGS;
+    }
+
+    struct bio_queue *q = calloc(1, sizeof(*q));
+    if (!q) {
+        return ERR_NO_MEMORY;
+    }
+
+    q->dev = dev;
+    q->config = *config;
+    q->depth = config->depth;
+    spin_lock_init(&q->lock);
+    list_initialize(&q->pending);
+    list_initialize(&q->done);
+    dpc_init(&q->done_dpc, queue_done_dpc, q);
+
+    if (config->blocking) {
+        event_init(&q->kick, false, EVENT_FLAG_AUTOUNSIGNAL);
+        q->thread = thread_create("bio queue", queue_thread, q, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!q->thread) {
+            event_destroy(&q->kick);
+            free(q);
+            return ERR_NO_MEMORY;
+        }
+        thread_resume(q->thread);
+    }
+
+    dev->queue = q;
+    dev->submit = queue_submit;
+    dev->read_block = queue_read_block;
+    dev->write_block = queue_write_block;
+    dev->read_async = queue_read_async;
+    dev->write_async = queue_write_async;
+
+    return NO_ERROR;
+}
+
+void bio_queue_detach(bdev_t *dev) {
+    struct bio_queue *q = dev->queue;
+    if (!q) {
+        return;
+    }
+
+    DEBUG_ASSERT(q->in_flight == 0 && list_is_empty(&q->pending));
+
+    if (q->thread) {
+        q->stop = true;
+        event_signal(&q->kick, true);
+        thread_join(q->thread, NULL, INFINITE_TIME);
+        event_destroy(&q->kick);
+    }
+
+    // let a completion batch that's still going finish with the queue
+    dpc_flush(&q->done_dpc);
+    DEBUG_ASSERT(list_is_empty(&q->done));
+
+    dev->submit = NULL;
+    dev->queue = NULL;
+    free(q);
+}
+
+void bio_queue_dump(const bdev_t *dev) {
+    struct bio_queue *q = dev->queue;
+    if (!q) {
+        return;
+    }
+
+    printf("\t\tqueue depth %u/%u, in flight %u (max %u), plugged %u\n",
+           q->depth, q->config.depth, q->in_flight, q->max_in_flight, q->plugged);
+    printf("\t\tsubmitted %llu merged %llu issued %llu busy %llu completed %llu in %llu batches\n",
+           q->submitted, q->merged, q->issued, q->busy, q->completed, q->batches);
+}
+
+void bio_sg_iter_init(bio_sg_iter_t *iter, const bio_request_t *req) {
+    iter->req = req;
+    iter->index = 0;
+    iter->offset = 0;
+    iter->remaining = (size_t)req->count << req->dev->block_shift;
+}
+
+bool bio_sg_iter_next(bio_sg_iter_t *iter, size_t max, void **buf, size_t *len) {
+    while (iter->req) {
+        const bio_request_t *req = iter->req;
+
+        if (iter->remaining > 0 && iter->index < req->iov_count) {
+            const iovec_t *iov = &req->iov[iter->index];
+            size_t avail = MIN(iov->iov_len - iter->offset, iter->remaining);
+            if (avail > 0) {
+                size_t n = MIN(avail, max);
+                *buf = (uint8_t *)iov->iov_base + iter->offset;
+                *len = n;
+                iter->offset += n;
+                iter->remaining -= n;
+                return true;
+            }
+            iter->index++;
+            iter->offset = 0;
+            continue;
+        }
+
+        // on to the next request merged behind this one
+        iter->req = req->merge_next;
+        iter->index = 0;
+        iter->offset = 0;
+        if (iter->req) {
+            iter->remaining = (size_t)iter->req->count << iter->req->dev->block_shift;
+        }
+    }
+
+    return false;
+}
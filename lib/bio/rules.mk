@@ -6,8 +6,13 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/bio.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/mem.c \
+	$(LOCAL_DIR)/queue.c \
 	$(LOCAL_DIR)/subdev.c
 
+MODULE_DEPS += \
+	lib/bench \
+	lib/dpc
+
 MODULE_OPTIONS := test
 
 include make/module.mk
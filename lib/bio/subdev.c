@@ -6,6 +6,7 @@
  * https://opensource.org/licenses/MIT
  */
 #include <lib/bio.h>
+#include <lib/bio/queue.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/trace.h>
@@ -74,6 +75,13 @@ static status_t subdev_write_async(struct bdev *_dev, const void *buf, off_t off
                            callback, callback_context);
 }
 
+static status_t subdev_submit(struct bdev *_dev, bio_request_t *req) {
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    req->dev_block += subdev->offset;
+    return bio_submit_lower(subdev->parent, req);
+}
+
 static void subdev_close(struct bdev *_dev) {
     subdev_t *subdev = (subdev_t *)_dev;
 
@@ -185,6 +193,7 @@ status_t bio_publish_subdevice(const char *parent_dev,
     sub->dev.erase = &subdev_erase;
     sub->dev.read_async = &subdev_read_async;
     sub->dev.write_async = &subdev_write_async;
+    sub->dev.submit = &subdev_submit;
     sub->dev.close = &subdev_close;
 
     bio_register_device(&sub->dev);
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/bio.h>
+#include <lib/bio/queue.h>
+#include <lib/unittest.h>
+#include <kernel/thread.h>
+#include <lk/err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE 512
+#define DEV_BLOCKS 64
+#define MAX_ISSUED 16
+
+// A queued device that moves the data when a request is issued but only
+// completes it when the test says so. While busy is set it turns requests
+// away with ERR_BUSY instead.
+static struct {
+    bdev_t dev;
+    uint8_t data[DEV_BLOCKS * BLOCK_SIZE];
+    bio_request_t *issued[MAX_ISSUED];
+    uint issued_count;
+    uint completed;
+    volatile bool busy;
+    uint busy_count;
+} qdev;
+
+static status_t qdev_issue(bdev_t *dev, bio_request_t *req) {
+    if (qdev.busy) {
+        qdev.busy_count++;
+        return ERR_BUSY;
+    }
+
+    uint8_t *ptr = qdev.data + req->dev_block * BLOCK_SIZE;
+
+    bio_sg_iter_t iter;
+    bio_sg_iter_init(&iter, req);
+    void *buf;
+    size_t len;
+    while (bio_sg_iter_next(&iter, SIZE_MAX, &buf, &len)) {
+        if (req->op == BIO_OP_WRITE) {
+            memcpy(ptr, buf, len);
+        } else {
+            memcpy(buf, ptr, len);
+        }
+        ptr += len;
+    }
+
+    if (qdev.issued_count < MAX_ISSUED) {
+        qdev.issued[qdev.issued_count++] = req;
+    }
+    return NO_ERROR;
+}
+
+static void qdev_complete_all(void) {
+    for (; qdev.completed < qdev.issued_count; qdev.completed++) {
+        bio_request_t *req = qdev.issued[qdev.completed];
+        bio_request_complete(req, (ssize_t)req->merge_count * BLOCK_SIZE);
+    }
+}
+
+static bdev_t *qdev_create(uint depth) {
+    memset(&qdev, 0, sizeof(qdev));
+    for (uint i = 0; i < DEV_BLOCKS; i++) {
+        memset(qdev.data + i * BLOCK_SIZE, i, BLOCK_SIZE);
+    }
+
+    bio_initialize_bdev(&qdev.dev, "bioqueuetest", BLOCK_SIZE, DEV_BLOCKS, 0, NULL, BIO_FLAGS_NONE);
+    const struct bio_queue_config config = {
+        .issue = qdev_issue,
+        .depth = depth,
+        .max_blocks = 8,
+    };
+    if (bio_queue_attach(&qdev.dev, &config) < 0) {
+        return NULL;
+    }
+    bio_register_device(&qdev.dev);
+
+    return bio_open("bioqueuetest");
+}
+
+static void qdev_destroy(bdev_t *dev) {
+    bio_close(dev);
+    bio_unregister_device(dev);
+    bio_queue_detach(dev);
+}
+
+struct test_req {
+    bio_request_t req;
+    iovec_t iov;
+    uint8_t buf[BLOCK_SIZE];
+    volatile bool done;
+};
+
+static void test_req_done(bio_request_t *req) {
+    ((struct test_req *)req->cookie)->done = true;
+}
+
+static void test_req_init(struct test_req *t, uint op, bnum_t block) {
+    memset(t, 0, sizeof(*t));
+    t->iov.iov_base = t->buf;
+    t->iov.iov_len = sizeof(t->buf);
+    bio_request_init(&t->req, op, block, 1, &t->iov, 1, test_req_done, t);
+}
+
+// done callbacks run from a dpc
+static bool wait_done(struct test_req *t, uint count) {
+    for (int tries = 0; tries < 100; tries++) {
+        uint done = 0;
+        for (uint i = 0; i < count; i++) {
+            done += t[i].done;
+        }
+        if (done == count) {
+            return true;
+        }
+        thread_sleep(10);
+    }
+    return false;
+}
+
+static bool merge_and_plug(void) {
+    BEGIN_TEST;
+
+    bdev_t *dev = qdev_create(4);
+    ASSERT_NONNULL(dev, "");
+
+    static struct test_req r[6];
+
+    // out of order neighbours end up as one run, the write and the far block don't join it
+    bio_plug(dev);
+    test_req_init(&r[0], BIO_OP_READ, 2);
+    test_req_init(&r[1], BIO_OP_READ, 1);
+    test_req_init(&r[2], BIO_OP_READ, 3);
+    test_req_init(&r[3], BIO_OP_WRITE, 4);
+    test_req_init(&r[4], BIO_OP_READ, 20);
+    test_req_init(&r[5], BIO_OP_READ, 0);
+    memset(r[3].buf, 0xa5, BLOCK_SIZE);
+    for (uint i = 0; i < countof(r); i++) {
+        EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[i].req), "");
+    }
+    EXPECT_EQ(0U, qdev.issued_count, "plugged");
+    bio_unplug(dev);
+
+    ASSERT_EQ(3U, qdev.issued_count, "");
+    EXPECT_EQ(0U, qdev.issued[0]->dev_block, "");
+    EXPECT_EQ(4U, qdev.issued[0]->merge_count, "");
+    EXPECT_EQ((uint)BIO_OP_WRITE, qdev.issued[1]->op, "");
+    EXPECT_EQ(20U, qdev.issued[2]->dev_block, "");
+    EXPECT_EQ(1U, qdev.issued[2]->merge_count, "");
+
+    qdev_complete_all();
+    ASSERT_TRUE(wait_done(r, countof(r)), "");
+    for (uint i = 0; i < countof(r); i++) {
+        EXPECT_EQ((ssize_t)BLOCK_SIZE, r[i].req.result, "");
+        EXPECT_EQ(r[i].req.block, r[i].buf[0], "");
+    }
+    EXPECT_EQ(0xa5, qdev.data[4 * BLOCK_SIZE], "");
+
+    // a read of a block being written doesn't jump ahead of the write
+    bio_plug(dev);
+    test_req_init(&r[0], BIO_OP_WRITE, 10);
+    test_req_init(&r[1], BIO_OP_READ, 10);
+    test_req_init(&r[2], BIO_OP_READ, 11);
+    test_req_init(&r[3], BIO_OP_WRITE, 11);
+    memset(r[0].buf, 0x11, BLOCK_SIZE);
+    memset(r[3].buf, 0x22, BLOCK_SIZE);
+    for (uint i = 0; i < 4; i++) {
+        EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[i].req), "");
+    }
+    bio_unplug(dev);
+    qdev_complete_all();
+    ASSERT_TRUE(wait_done(r, 4), "");
+    EXPECT_EQ(0x11, r[1].buf[0], "");
+    EXPECT_EQ(11, r[2].buf[0], "");
+    EXPECT_EQ(0x22, qdev.data[11 * BLOCK_SIZE], "");
+
+    qdev_destroy(dev);
+
+    END_TEST;
+}
+
+static bool depth_and_errors(void) {
+    BEGIN_TEST;
+
+    bdev_t *dev = qdev_create(2);
+    ASSERT_NONNULL(dev, "");
+
+    // only depth requests are with the driver at once
+    static struct test_req r[4];
+    for (uint i = 0; i < countof(r); i++) {
+        test_req_init(&r[i], BIO_OP_READ, i * 10);
+        EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[i].req), "");
+    }
+    EXPECT_EQ(2U, qdev.issued_count, "");
+
+    qdev_complete_all();
+    ASSERT_TRUE(wait_done(r, 2), "");
+    for (int tries = 0; tries < 100 && qdev.issued_count < 4; tries++) {
+        thread_sleep(10);
+    }
+    EXPECT_EQ(4U, qdev.issued_count, "the rest go when room frees up");
+
+    EXPECT_EQ(NO_ERROR, bio_queue_set_depth(dev, 1), "");
+    EXPECT_EQ(ERR_INVALID_ARGS, bio_queue_set_depth(dev, 3), "");
+    qdev_complete_all();
+    ASSERT_TRUE(wait_done(r, countof(r)), "");
+
+    // malformed requests are turned away without a callback
+    struct test_req bad;
+    test_req_init(&bad, BIO_OP_READ, DEV_BLOCKS);
+    EXPECT_EQ(ERR_OUT_OF_RANGE, bio_submit(dev, &bad.req), "");
+    test_req_init(&bad, BIO_OP_READ, 0);
+    bad.iov.iov_len = 100;
+    EXPECT_EQ(ERR_INVALID_ARGS, bio_submit(dev, &bad.req), "");
+    EXPECT_FALSE(bad.done, "");
+    EXPECT_EQ(4U, qdev.issued_count, "");
+
+    qdev_destroy(dev);
+
+    END_TEST;
+}
+
+static bool wait_issued(uint count) {
+    for (int tries = 0; tries < 100 && qdev.issued_count < count; tries++) {
+        thread_sleep(10);
+    }
+    return qdev.issued_count == count;
+}
+
+static bool busy_driver(void) {
+    BEGIN_TEST;
+
+    bdev_t *dev = qdev_create(4);
+    ASSERT_NONNULL(dev, "");
+
+    static struct test_req r[4];
+
+    // busy with something else in flight: it waits for that to finish and goes again
+    test_req_init(&r[0], BIO_OP_READ, 1);
+    EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[0].req), "");
+    EXPECT_EQ(1U, qdev.issued_count, "");
+
+    qdev.busy = true;
+    test_req_init(&r[1], BIO_OP_READ, 20);
+    EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[1].req), "");
+    EXPECT_EQ(1U, qdev.busy_count, "");
+    EXPECT_EQ(1U, qdev.issued_count, "");
+    EXPECT_FALSE(r[1].done, "");
+
+    qdev.busy = false;
+    qdev_complete_all();
+    ASSERT_TRUE(wait_issued(2), "issued again once the first finished");
+    EXPECT_EQ(20U, qdev.issued[1]->dev_block, "");
+    qdev_complete_all();
+    ASSERT_TRUE(wait_done(r, 2), "");
+    EXPECT_EQ((ssize_t)BLOCK_SIZE, r[1].req.result, "");
+    EXPECT_EQ(20, r[1].buf[0], "");
+
+    // busy with nothing in flight: nothing would ever retry it, so it fails
+    qdev.busy = true;
+    test_req_init(&r[2], BIO_OP_READ, 30);
+    EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[2].req), "");
+    ASSERT_TRUE(wait_done(&r[2], 1), "");
+    EXPECT_EQ((ssize_t)ERR_NO_RESOURCES, r[2].req.result, "");
+    EXPECT_EQ(2U, qdev.issued_count, "");
+
+    // and the queue still has all of its depth afterwards
+    qdev.busy = false;
+    static struct test_req more[4];
+    for (uint i = 0; i < countof(more); i++) {
+        test_req_init(&more[i], BIO_OP_READ, 40 + i * 2);
+        EXPECT_EQ(NO_ERROR, bio_submit(dev, &more[i].req), "");
+    }
+    EXPECT_EQ(6U, qdev.issued_count, "");
+    test_req_init(&r[3], BIO_OP_READ, 60);
+    EXPECT_EQ(NO_ERROR, bio_submit(dev, &r[3].req), "");
+    EXPECT_EQ(6U, qdev.issued_count, "no more than depth at once");
+
+    qdev_complete_all();
+    ASSERT_TRUE(wait_issued(7), "");
+    qdev_complete_all();
+    ASSERT_TRUE(wait_done(more, countof(more)), "");
+    ASSERT_TRUE(wait_done(&r[3], 1), "");
+    EXPECT_EQ((ssize_t)BLOCK_SIZE, r[3].req.result, "");
+
+    qdev_destroy(dev);
+
+    END_TEST;
+}
+
+// devices without a queue run requests through their block hooks before returning
+static bool unqueued_device(void) {
+    BEGIN_TEST;
+
+    const size_t size = 16 * BLOCK_SIZE;
+    uint8_t *mem = malloc(size);
+    ASSERT_NONNULL(mem, "");
+    for (uint i = 0; i < 16; i++) {
+        memset(mem + i * BLOCK_SIZE, i, BLOCK_SIZE);
+    }
+    EXPECT_EQ(0, create_membdev("bioqueuemem", mem, size), "");
+    bdev_t *dev = bio_open("bioqueuemem");
+    ASSERT_NONNULL(dev, "");
+
+    static uint8_t a[BLOCK_SIZE], b[2 * BLOCK_SIZE];
+    iovec_t iov[2] = { { a, sizeof(a) }, { b, sizeof(b) } };
+    struct test_req t;
+    bio_request_init(&t.req, BIO_OP_READ, 5, 3, iov, 2, test_req_done, &t);
+    t.done = false;
+    EXPECT_EQ(NO_ERROR, bio_submit(dev, &t.req), "");
+    EXPECT_TRUE(t.done, "");
+    EXPECT_EQ((ssize_t)(3 * BLOCK_SIZE), t.req.result, "");
+    EXPECT_EQ(5, a[0], "");
+    EXPECT_EQ(6, b[0], "");
+    EXPECT_EQ(7, b[BLOCK_SIZE], "");
+
+    bio_close(dev);
+    bio_unregister_device(dev);
+    free(mem);
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(bio_queue_tests)
+RUN_TEST(merge_and_plug)
+RUN_TEST(depth_and_errors)
+RUN_TEST(busy_driver)
+RUN_TEST(unqueued_device)
+END_TEST_CASE(bio_queue_tests)
@@ -3,6 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += $(LOCAL_DIR)/bio_tests.c
+MODULE_SRCS += $(LOCAL_DIR)/queue_tests.c
 
 MODULE_DEPS += \
 	lib/bio \
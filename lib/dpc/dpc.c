@@ -5,73 +5,263 @@
  * license that can be found in the LICENSE file or at
  * https://opensource.org/licenses/MIT
  */
+#include <assert.h>
 #include <lk/debug.h>
 #include <stddef.h>
 #include <lk/list.h>
 #include <malloc.h>
 #include <lk/err.h>
 #include <lib/dpc.h>
+#include <arch/atomic.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
+#include <lk/console_cmd.h>
 #include <lk/init.h>
+#include <platform.h>
+#include <stdio.h>
 
-struct dpc {
-    struct list_node node;
+/* most dpcs a queue's thread pulls off at once */
+#ifndef DPC_BATCH
+#define DPC_BATCH 16
+#endif
 
-    dpc_callback cb;
-    void *arg;
-};
+/* dpc state bits */
+#define DPC_STATE_QUEUED  0x1
+#define DPC_STATE_RUNNING 0x2
+#define DPC_STATE_RERUN   0x4 /* queued again while running */
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+struct dpc_queue {
+    spin_lock_t lock;
+    struct list_node list;
+    event_t event;
+    thread_t *thread;
 
-static int dpc_thread_routine(void *arg);
+    /* stats */
+    uint depth;
+    uint max_depth;
+    ulong queued;
+    ulong executed;
+    ulong batches;
+    lk_bigtime_t total_latency;
+    lk_bigtime_t max_latency;
+} __CPU_ALIGN;
 
-status_t dpc_queue(dpc_callback cb, void *arg, uint flags) {
-    struct dpc *dpc;
+static struct dpc_queue dpc_queues[SMP_MAX_CPUS];
+
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg) {
+    *dpc = (dpc_t)DPC_INITIAL_VALUE(*dpc, cb, arg);
+}
+
+/* append a dpc that has just been marked queued to a cpu's queue */
+static void dpc_enqueue(dpc_t *dpc, uint cpu, uint flags) {
+    struct dpc_queue *q = &dpc_queues[cpu];
+
+    dpc->cpu = cpu;
+    dpc->queued_time = current_time_hires();
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+    list_add_tail(&q->list, &dpc->node);
+    q->queued++;
+    if (++q->depth > q->max_depth)
+        q->max_depth = q->depth;
+    spin_unlock_irqrestore(&q->lock, state);
+
+    event_signal(&q->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
+}
+
+status_t dpc_queue_etc(dpc_t *dpc, int cpu, uint flags) {
+    DEBUG_ASSERT(dpc && dpc->cb);
+    DEBUG_ASSERT(cpu == DPC_CPU_CURRENT || (cpu >= 0 && cpu < SMP_MAX_CPUS));
+
+    /* publish whatever the caller did before queueing to the cpu that will run it */
+    smp_mb();
+
+    for (;;) {
+        int old = dpc->state;
+        if (old & (DPC_STATE_QUEUED | DPC_STATE_RERUN))
+            return ERR_ALREADY_EXISTS;
+
+        if (old & DPC_STATE_RUNNING) {
+            /* the cpu running it will queue it again once the callback returns */
+            if (atomic_cmpxchg(&dpc->state, old, old | DPC_STATE_RERUN) == old)
+                return NO_ERROR;
+        } else {
+            if (atomic_cmpxchg(&dpc->state, old, DPC_STATE_QUEUED) == old)
+                break;
+        }
+    }
+
+    dpc_enqueue(dpc, (cpu == DPC_CPU_CURRENT) ? arch_curr_cpu_num() : (uint)cpu, flags);
 
-    dpc = malloc(sizeof(struct dpc));
+    return NO_ERROR;
+}
 
+status_t dpc_queue_on(uint cpu, dpc_callback cb, void *arg, uint flags) {
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    dpc_t *dpc = malloc(sizeof(dpc_t));
     if (dpc == NULL)
         return ERR_NO_MEMORY;
 
-    dpc->cb = cb;
-    dpc->arg = arg;
-    enter_critical_section();
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
+    dpc_init(dpc, cb, arg);
+    dpc->allocated = true;
+    dpc->state = DPC_STATE_QUEUED;
+
+    dpc_enqueue(dpc, cpu, flags);
 
     return NO_ERROR;
 }
 
+status_t dpc_queue(dpc_callback cb, void *arg, uint flags) {
+    return dpc_queue_on(arch_curr_cpu_num(), cb, arg, flags);
+}
+
+static void dpc_flush_marker(void *arg) {
+    event_signal((event_t *)arg, false);
+}
+
+void dpc_flush(dpc_t *dpc) {
+    DEBUG_ASSERT(dpc && !dpc->allocated);
+
+    /* a cpu's queue runs in order, so once a marker queued behind the dpc has run,
+     * so has the dpc. Going around again catches it being queued again while it ran. */
+    while (dpc->state != 0) {
+        uint cpu = dpc->cpu;
+        DEBUG_ASSERT(get_current_thread() != dpc_queues[cpu].thread);
+
+        event_t done;
+        event_init(&done, false, 0);
+        dpc_t marker = DPC_INITIAL_VALUE(marker, dpc_flush_marker, &done);
+        dpc_queue_etc(&marker, cpu, 0);
+        event_wait(&done);
+
+        /* the marker is done with once its callback returns and the state drops */
+        while (marker.state != 0)
+            thread_yield();
+        event_destroy(&done);
+    }
+
+    smp_mb();
+}
+
+static void dpc_run(struct dpc_queue *q, uint cpu, dpc_t *dpc) {
+    int old = atomic_cmpxchg(&dpc->state, DPC_STATE_QUEUED, DPC_STATE_RUNNING);
+    DEBUG_ASSERT(old == DPC_STATE_QUEUED);
+
+    lk_bigtime_t latency = current_time_hires() - dpc->queued_time;
+    q->total_latency += latency;
+    if (latency > q->max_latency)
+        q->max_latency = latency;
+    q->executed++;
+
+//  dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
+    dpc->cb(dpc->arg);
+
+    if (dpc->allocated) {
+        free(dpc);
+        return;
+    }
+
+    /* make the callback's work visible before anyone can see the dpc as idle */
+    smp_mb();
+
+    for (;;) {
+        old = dpc->state;
+        if (old & DPC_STATE_RERUN) {
+            if (atomic_cmpxchg(&dpc->state, old, DPC_STATE_QUEUED) == old) {
+                dpc_enqueue(dpc, cpu, DPC_FLAG_NORESCHED);
+                break;
+            }
+        } else {
+            if (atomic_cmpxchg(&dpc->state, old, 0) == old)
+                break;
+        }
+    }
+}
+
 static int dpc_thread_routine(void *arg) {
+    uint cpu = (uint)(uintptr_t)arg;
+    struct dpc_queue *q = &dpc_queues[cpu];
+
     for (;;) {
-        event_wait(&dpc_event);
+        event_wait(&q->event);
 
-        enter_critical_section();
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        exit_critical_section();
+        for (;;) {
+            /* pull a batch off the queue, then run it without the lock held */
+            struct list_node batch = LIST_INITIAL_VALUE(batch);
+            uint count = 0;
 
-        if (dpc) {
-//          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
+            arch_interrupt_saved_state_t state = spin_lock_irqsave(&q->lock);
+            dpc_t *dpc;
+            while (count < DPC_BATCH && (dpc = list_remove_head_type(&q->list, dpc_t, node))) {
+                list_add_tail(&batch, &dpc->node);
+                count++;
+            }
+            q->depth -= count;
+            if (count > 0)
+                q->batches++;
+            spin_unlock_irqrestore(&q->lock, state);
 
-            free(dpc);
+            if (count == 0)
+                break;
+
+            while ((dpc = list_remove_head_type(&batch, dpc_t, node))) {
+                dpc_run(q, cpu, dpc);
+            }
         }
     }
 
     return 0;
 }
 
-static void dpc_init(uint level) {
-    event_init(&dpc_event, false, 0);
+static void dpc_init_early(uint level) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_queue *q = &dpc_queues[i];
 
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
+        spin_lock_init(&q->lock);
+        list_initialize(&q->list);
+        event_init(&q->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    }
 }
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+/* start the dpc thread for the cpu this runs on */
+static void dpc_init_percpu(uint level) {
+    uint cpu = arch_curr_cpu_num();
+    struct dpc_queue *q = &dpc_queues[cpu];
+    char name[16];
+
+    snprintf(name, sizeof(name), "dpc-%u", cpu);
+    q->thread = thread_create(name, &dpc_thread_routine, (void *)(uintptr_t)cpu, DPC_PRIORITY,
+                              DEFAULT_STACK_SIZE);
+    if (!q->thread) {
+        dprintf(CRITICAL, "dpc: failed to create thread for cpu %u\n", cpu);
+        return;
+    }
+    thread_set_pinned_cpu(q->thread, cpu);
+    thread_detach_and_resume(q->thread);
+}
 
+LK_INIT_HOOK(libdpc, &dpc_init_early, LK_INIT_LEVEL_THREADING - 1);
+LK_INIT_HOOK_FLAGS(libdpc_percpu, &dpc_init_percpu, LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_ALL_CPUS);
+
+static int cmd_dpc(int argc, const console_cmd_args *argv) {
+    printf("cpu  queued   executed batches  depth max depth avg latency max latency\n");
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_queue *q = &dpc_queues[i];
+        if (!q->thread)
+            continue;
+
+        printf("%3u %8lu %8lu %8lu %6u %9u %9llu us %9llu us\n", i, q->queued, q->executed,
+               q->batches, q->depth, q->max_depth,
+               q->executed ? q->total_latency / q->executed : 0ULL, q->max_latency);
+    }
+
+    return NO_ERROR;
+}
 
+STATIC_COMMAND_START
+STATIC_COMMAND("dpc", "dpc queue stats", &cmd_dpc)
+STATIC_COMMAND_END(dpc);
@@ -7,12 +7,77 @@
  */
 #pragma once
 
+#include <lk/compiler.h>
 #include <lk/list.h>
+#include <platform/time.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
+__BEGIN_CDECLS
+
+/*
+ * Deferred procedure calls.
+ *
+ * Each cpu has its own dpc queue, drained in order by a dpc thread pinned to
+ * that cpu, so work queued from an interrupt handler runs on the cpu that took
+ * the interrupt unless another cpu is asked for explicitly.
+ */
+
 typedef void (*dpc_callback)(void *arg);
 
 #define DPC_FLAG_NORESCHED 0x1
 
-status_t dpc_queue(dpc_callback, void *arg, uint flags);
+/* queue on whichever cpu the caller is running on */
+#define DPC_CPU_CURRENT (-1)
+
+/*
+ * A dpc embedded in the caller's own structure. Queueing one never allocates, so
+ * it is safe from interrupt context. A dpc is queued at most once at a time and
+ * never runs on two cpus at once: queueing it while its callback is running makes
+ * it run again afterwards, on the same cpu.
+ *
+ * It must not be freed while queued or running.
+ */
+typedef struct dpc {
+    struct list_node node;
+    dpc_callback cb;
+    void *arg;
+
+    /* private */
+    volatile int state;
+    bool allocated; /* by dpc_queue, freed once it has run */
+    uint cpu; /* last queued on */
+    lk_bigtime_t queued_time;
+} dpc_t;
+
+#define DPC_INITIAL_VALUE(d, _cb, _arg) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .cb = (_cb), \
+    .arg = (_arg), \
+    .state = 0, \
+    .allocated = false, \
+    .cpu = 0, \
+    .queued_time = 0, \
+}
+
+void dpc_init(dpc_t *dpc, dpc_callback cb, void *arg);
+
+/*
+ * Queue an embedded dpc on cpu, or DPC_CPU_CURRENT. Returns ERR_ALREADY_EXISTS
+ * if it is already queued or already due to run again.
+ */
+status_t dpc_queue_etc(dpc_t *dpc, int cpu, uint flags);
+
+/*
+ * Wait until an embedded dpc is neither queued nor running, including any run it
+ * was queued again for. It may still be queued again afterwards by someone else.
+ * Must be called from a thread, and not from a dpc on the cpu it was queued on.
+ */
+void dpc_flush(dpc_t *dpc);
+
+/* Allocate a one shot dpc for cb and queue it on the current cpu, or on cpu. */
+status_t dpc_queue(dpc_callback cb, void *arg, uint flags);
+status_t dpc_queue_on(uint cpu, dpc_callback cb, void *arg, uint flags);
 
+__END_CDECLS
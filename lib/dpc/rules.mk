@@ -5,4 +5,6 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/dpc.c
 
+MODULE_OPTIONS := test
+
 include make/module.mk
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <arch/atomic.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
+#include <lib/dpc.h>
+#include <lib/unittest.h>
+#include <lk/err.h>
+
+// a dpc that holds up its queue until the test lets it go, and queues itself
+// again while it runs as many times as asked
+struct flush_test {
+    dpc_t dpc;
+    event_t running;
+    event_t release;
+    volatile int runs;
+    volatile int requeues;
+};
+
+static void flush_test_cb(void *arg) {
+    struct flush_test *t = arg;
+
+    event_signal(&t->running, false);
+    event_wait(&t->release);
+
+    if (t->requeues > 0) {
+        t->requeues--;
+        dpc_queue_etc(&t->dpc, DPC_CPU_CURRENT, DPC_FLAG_NORESCHED);
+    }
+    atomic_add(&t->runs, 1);
+}
+
+static void flush_test_init(struct flush_test *t, int requeues) {
+    dpc_init(&t->dpc, flush_test_cb, t);
+    event_init(&t->running, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&t->release, false, 0);
+    t->runs = 0;
+    t->requeues = requeues;
+}
+
+static void flush_test_destroy(struct flush_test *t) {
+    event_destroy(&t->running);
+    event_destroy(&t->release);
+}
+
+// let the dpc go from another thread once the flush has had time to start waiting
+static int flush_test_releaser(void *arg) {
+    struct flush_test *t = arg;
+
+    thread_sleep(20);
+    event_signal(&t->release, false);
+    return 0;
+}
+
+static bool flush_idle(void) {
+    BEGIN_TEST;
+
+    struct flush_test t;
+    flush_test_init(&t, 0);
+
+    // never queued, and run to completion
+    dpc_flush(&t.dpc);
+    EXPECT_EQ(0, t.runs, "");
+
+    event_signal(&t.release, false);
+    ASSERT_EQ(NO_ERROR, dpc_queue_etc(&t.dpc, DPC_CPU_CURRENT, 0), "");
+    dpc_flush(&t.dpc);
+    EXPECT_EQ(1, t.runs, "");
+    EXPECT_EQ(0, t.dpc.state, "");
+
+    dpc_flush(&t.dpc);
+    EXPECT_EQ(1, t.runs, "");
+
+    flush_test_destroy(&t);
+    END_TEST;
+}
+
+static bool flush_waits_for_running(void) {
+    BEGIN_TEST;
+
+    struct flush_test t;
+    flush_test_init(&t, 0);
+
+    ASSERT_EQ(NO_ERROR, dpc_queue_etc(&t.dpc, DPC_CPU_CURRENT, 0), "");
+    event_wait(&t.running);
+
+    thread_t *releaser = thread_create("dpc releaser", flush_test_releaser, &t,
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    ASSERT_NONNULL(releaser, "");
+    thread_resume(releaser);
+
+    // the callback is still blocked, the flush has to wait for it
+    EXPECT_EQ(0, t.runs, "");
+    dpc_flush(&t.dpc);
+    EXPECT_EQ(1, t.runs, "");
+    EXPECT_EQ(0, t.dpc.state, "");
+
+    thread_join(releaser, NULL, INFINITE_TIME);
+    flush_test_destroy(&t);
+    END_TEST;
+}
+
+static bool flush_waits_for_requeue(void) {
+    BEGIN_TEST;
+
+    struct flush_test t;
+    flush_test_init(&t, 2);
+
+    ASSERT_EQ(NO_ERROR, dpc_queue_etc(&t.dpc, DPC_CPU_CURRENT, 0), "");
+    event_wait(&t.running);
+
+    thread_t *releaser = thread_create("dpc releaser", flush_test_releaser, &t,
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    ASSERT_NONNULL(releaser, "");
+    thread_resume(releaser);
+
+    // the first run queues it again twice over, all three count
+    dpc_flush(&t.dpc);
+    EXPECT_EQ(3, t.runs, "");
+    EXPECT_EQ(0, t.requeues, "");
+    EXPECT_EQ(0, t.dpc.state, "");
+
+    thread_join(releaser, NULL, INFINITE_TIME);
+    flush_test_destroy(&t);
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(dpc_tests)
+RUN_TEST(flush_idle)
+RUN_TEST(flush_waits_for_running)
+RUN_TEST(flush_waits_for_requeue)
+END_TEST_CASE(dpc_tests)
@@ -52,10 +52,6 @@ status_t v9fs_open_file(fscookie *cookie, const char *path,
         goto err;
     }
 
-    file->pg_buf.size = 0;
-    file->pg_buf.index = 0;
-    file->pg_buf.dirty = false;
-    file->pg_buf.need_update = true;
     mutex_init(&file->lock);
 
     file->fid.fid = get_unused_fid(v9fs);
@@ -137,10 +133,6 @@ status_t v9fs_create_file(fscookie *cookie, const char *path,
         goto err;
     }
 
-    file->pg_buf.size = 0;
-    file->pg_buf.index = 0;
-    file->pg_buf.dirty = false;
-    file->pg_buf.need_update = true;
     mutex_init(&file->lock);
 
     file->fid.fid = get_unused_fid(v9fs);
@@ -217,84 +209,124 @@ err:
     return ret;
 }
 
-static ssize_t read_file_impl(v9fs_file_t *file, void *buf, off_t offset,
-                              size_t len) {
+struct v9fs_io {
+    uint16_t tag;
+    size_t pos;
+    uint32_t count;
+};
+
+// Move len bytes between buf and the file at offset, in the largest pieces the
+// transport takes, halving them while the transport can't allocate buffers that
+// big, and keeping a few of them in flight at once. Reads stop at the
+// end of the file, short writes are picked up again from where they stopped.
+static ssize_t transfer_impl(v9fs_file_t *file, uint8_t *buf, off_t offset,
+                             size_t len, bool write) {
+    struct virtio_device *dev = file->v9fs->dev;
+    struct v9fs_io io[V9FS_FILE_IO_DEPTH];
+    uint head = 0, count = 0;
+    size_t issued = 0, done = 0;
+    bool stop = false, retry = false;
     status_t err = NO_ERROR;
-    ssize_t rlen = 0;
-    uint32_t readcount;
-
-    while (len > 0) {
-        virtio_9p_msg_t tread = {
-            .msg_type = P9_TREAD,
-            .tag = P9_TAG_DEFAULT,
-            .msg.tread = {
-                .fid = file->fid.fid, .offset = offset, .count = MIN(len, PAGE_SIZE)}};
-        virtio_9p_msg_t rread = {};
-
-        if ((err = virtio_9p_rpc(file->v9fs->dev, &tread, &rread)) != NO_ERROR) {
-            break;
-        }
 
-        if (rread.msg_type != P9_RREAD) {
-            err = ERR_IO;
-            break;
-        }
-
-        readcount = rread.msg.rread.count;
-
-        memcpy(&((uint8_t *)buf)[rlen], rread.msg.rread.data, readcount);
-
-        offset += readcount;
-        rlen += readcount;
-        len -= readcount;
+    uint32_t chunk = virtio_9p_max_io(dev);
+    if (file->fid.iounit > 0) {
+        chunk = MIN(chunk, file->fid.iounit);
+    }
 
-        virtio_9p_msg_destroy(&rread);
+    for (;;) {
+        if (count == 0) {
+            if (retry) {
+                issued = done;
+                stop = retry = false;
+            }
+            if (stop || err != NO_ERROR || issued >= len) {
+                break;
+            }
+        }
 
-        // read to the end of the file
-        if (rread.msg.rread.count == 0) {
-            break;
+        // keep the pipe full
+        if (!stop && err == NO_ERROR && issued < len && count < V9FS_FILE_IO_DEPTH) {
+            uint32_t n = MIN(len - issued, chunk);
+            virtio_9p_msg_t tmsg;
+            if (write) {
+                tmsg = (virtio_9p_msg_t){
+                    .msg_type = P9_TWRITE,
+                    .tag = P9_TAG_DEFAULT,
+                    .msg.twrite = {
+                        .fid = file->fid.fid, .offset = offset + issued, .count = n, .data = buf + issued}};
+            } else {
+                tmsg = (virtio_9p_msg_t){
+                    .msg_type = P9_TREAD,
+                    .tag = P9_TAG_DEFAULT,
+                    .msg.tread = {
+                        .fid = file->fid.fid, .offset = offset + issued, .count = n}};
+            }
+
+            // only block for a request slot with none of ours outstanding
+            uint16_t tag;
+            status_t ret = virtio_9p_rpc_start(dev, &tmsg, &tag, count == 0);
+            if (ret == NO_ERROR) {
+                io[(head + count) % V9FS_FILE_IO_DEPTH] = (struct v9fs_io){tag, issued, n};
+                count++;
+                issued += n;
+                continue;
+            }
+            // no room for a buffer that big, go on in smaller pieces
+            if (ret == ERR_NO_MEMORY && chunk > PAGE_SIZE) {
+                chunk = MAX(chunk / 2, (uint32_t)PAGE_SIZE);
+                continue;
+            }
+            if (ret != ERR_BUSY || count == 0) {
+                err = ret;
+                continue;
+            }
         }
-    }
 
-    return err == NO_ERROR ? rlen : err;
-}
+        // take the oldest reply
+        struct v9fs_io cur = io[head];
+        head = (head + 1) % V9FS_FILE_IO_DEPTH;
+        count--;
 
-static ssize_t write_file_impl(v9fs_file_t *file, const void *buf, off_t offset,
-                               size_t len) {
-    status_t err = NO_ERROR;
-    ssize_t wlen = 0;
-    uint32_t writecount;
-    const uint8_t *cpos = buf;
-
-    while (len > 0) {
-        virtio_9p_msg_t twrite = {
-            .msg_type = P9_TWRITE,
-            .tag = P9_TAG_DEFAULT,
-            .msg.twrite = {
-                .fid = file->fid.fid, .offset = offset, .data = cpos, .count = MIN(len, PAGE_SIZE)}};
-        virtio_9p_msg_t rwrite = {};
-
-        if ((err = virtio_9p_rpc(file->v9fs->dev, &twrite, &rwrite)) !=
-            NO_ERROR) {
-            break;
+        virtio_9p_msg_t rmsg = {};
+        status_t ret = virtio_9p_rpc_wait(dev, cur.tag, &rmsg);
+        if (ret == NO_ERROR && rmsg.msg_type != (write ? P9_RWRITE : P9_RREAD)) {
+            ret = ERR_IO;
         }
 
-        if (rwrite.msg_type != P9_RWRITE) {
-            err = ERR_IO;
-            break;
+        if (ret != NO_ERROR) {
+            if (err == NO_ERROR) {
+                err = ret;
+            }
+        } else if (!stop && err == NO_ERROR) {
+            uint32_t got = MIN(write ? rmsg.msg.rwrite.count : rmsg.msg.rread.count, cur.count);
+            if (!write) {
+                memcpy(buf + cur.pos, rmsg.msg.rread.data, got);
+            }
+            done = cur.pos + got;
+
+            // the end of the file, or a write the server only took part of.
+            // whatever went out after it doesn't count.
+            if (got < cur.count) {
+                stop = true;
+                retry = write && got > 0;
+            }
         }
 
-        writecount = rwrite.msg.rwrite.count;
+        virtio_9p_msg_destroy(&rmsg);
+    }
 
-        offset += writecount;
-        cpos += writecount;
-        wlen += writecount;
-        len -= writecount;
+    return err == NO_ERROR ? (ssize_t)done : err;
+}
 
-        virtio_9p_msg_destroy(&rwrite);
-    }
+static ssize_t read_file_impl(v9fs_file_t *file, void *buf, off_t offset,
+                              size_t len) {
+    return transfer_impl(file, buf, offset, len, false);
+}
 
-    return err == NO_ERROR ? wlen : err;
+static ssize_t write_file_impl(v9fs_file_t *file, const void *buf, off_t offset,
+                               size_t len) {
+    // only read from when writing
+    return transfer_impl(file, (uint8_t *)buf, offset, len, true);
 }
 
 #define fs_page_index(off) ((off) / V9FS_FILE_PAGE_BUFFER_SIZE)
@@ -317,57 +349,258 @@ static bool fs_valid_page(off_t offset, off_t size) {
     return fs_page_index(offset) == fs_page_index(offset + size - 1);
 }
 
-static bool fs_page_hit(struct fs_page_buffer *buf, off_t offset) {
-    return fs_page_index(offset) == buf->index;
+static uint8_t *fs_page_data(v9fs_file_t *file, struct fs_page *page) {
+    return file->cache.data +
+           (page - file->cache.pages) * V9FS_FILE_PAGE_BUFFER_SIZE;
 }
 
-static void fs_page_update(v9fs_file_t *file, off_t offset) {
-    ssize_t rsize;
+static struct fs_page *fs_page_lookup(v9fs_file_t *file, off_t index) {
+    for (uint i = 0; i < V9FS_FILE_CACHE_PAGES; i++) {
+        struct fs_page *page = &file->cache.pages[i];
+        if (page->valid && page->index == index) {
+            return page;
+        }
+    }
 
-    if (fs_page_hit(&file->pg_buf, offset) &&
-        !file->pg_buf.need_update) {
-        // page hit and don't need to update
+    return NULL;
+}
+
+// write back every dirty page, runs of neighbouring ones in a single transfer
+static status_t fs_cache_writeback(v9fs_file_t *file) {
+    status_t err = NO_ERROR;
+
+    for (;;) {
+        // the lowest dirty page starts the next run
+        struct fs_page *run[V9FS_FILE_READAHEAD_PAGES];
+        uint n = 0;
+        for (uint i = 0; i < V9FS_FILE_CACHE_PAGES; i++) {
+            struct fs_page *page = &file->cache.pages[i];
+            if (page->valid && page->dirty &&
+                (n == 0 || page->index < run[0]->index)) {
+                run[0] = page;
+                n = 1;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+
+        // the run goes on for as long as the pages before are full
+        while (n < countof(run) &&
+               run[n - 1]->size == V9FS_FILE_PAGE_BUFFER_SIZE) {
+            struct fs_page *next = fs_page_lookup(file, run[n - 1]->index + 1);
+            if (!next || !next->dirty) {
+                break;
+            }
+            run[n++] = next;
+        }
+
+        size_t len = (n - 1) * V9FS_FILE_PAGE_BUFFER_SIZE + run[n - 1]->size;
+        uint8_t *bounce = (n > 1) ? malloc(len) : NULL;
+        if (!bounce) {
+            n = 1;
+            len = run[0]->size;
+        }
+        for (uint i = 0; bounce && i < n; i++) {
+            memcpy(bounce + i * V9FS_FILE_PAGE_BUFFER_SIZE,
+                   fs_page_data(file, run[i]), run[i]->size);
+        }
+
+        ssize_t wlen = write_file_impl(file, bounce ? bounce : fs_page_data(file, run[0]),
+                                       fs_page_start_by_index(run[0]->index), len);
+        free(bounce);
+
+        // clean even if it failed, the error is reported and not retried
+        for (uint i = 0; i < n; i++) {
+            run[i]->dirty = false;
+        }
+        if (wlen < 0 && err == NO_ERROR) {
+            err = wlen;
+        } else if (wlen >= 0 && (size_t)wlen < len && err == NO_ERROR) {
+            err = ERR_IO;
+        }
+    }
+
+    return err;
+}
+
+// Pages are only ever partly filled at the end of the file, but the end can move
+// past one while it's cached, by a short write further on that is still in the
+// cache. Everything before the last page holding data is part of the file then,
+// so fill out the partial ones with zeroes, as the server would the hole.
+static void fs_cache_extend(v9fs_file_t *file) {
+    struct fs_page *last = NULL;
+    for (uint i = 0; i < V9FS_FILE_CACHE_PAGES; i++) {
+        struct fs_page *page = &file->cache.pages[i];
+        if (page->valid && page->size > 0 && (!last || page->index > last->index)) {
+            last = page;
+        }
+    }
+    if (!last) {
         return;
     }
 
-    if (file->pg_buf.dirty) {
-        write_file_impl(file, file->pg_buf.data,
-                        fs_page_start_by_index(file->pg_buf.index),
-                        file->pg_buf.size);
-        file->pg_buf.dirty = false;
+    for (uint i = 0; i < V9FS_FILE_CACHE_PAGES; i++) {
+        struct fs_page *page = &file->cache.pages[i];
+        if (page->valid && page->index < last->index &&
+            page->size < V9FS_FILE_PAGE_BUFFER_SIZE) {
+            memset(fs_page_data(file, page) + page->size, 0,
+                   V9FS_FILE_PAGE_BUFFER_SIZE - page->size);
+            page->size = V9FS_FILE_PAGE_BUFFER_SIZE;
+        }
+    }
+}
+
+// Find the page at index, reading it in if it isn't here. Misses that carry on
+// from the last one read ahead, up to the next page that's already cached.
+static status_t fs_page_get(v9fs_file_t *file, off_t index, struct fs_page **out) {
+    struct fs_page_cache *cache = &file->cache;
+    status_t err;
+
+    struct fs_page *page = fs_page_lookup(file, index);
+    if (page) {
+        page->last_used = ++cache->clock;
+        *out = page;
+        return NO_ERROR;
+    }
+
+    if (!cache->data) {
+        cache->data = malloc(V9FS_FILE_CACHE_PAGES * V9FS_FILE_PAGE_BUFFER_SIZE);
+        if (!cache->data) {
+            return ERR_NO_MEMORY;
+        }
+    }
+
+    uint n = 1;
+    if (index == cache->next_index) {
+        while (n < V9FS_FILE_READAHEAD_PAGES && !fs_page_lookup(file, index + n)) {
+            n++;
+        }
+    }
+    uint8_t *bounce = (n > 1) ? malloc(n * V9FS_FILE_PAGE_BUFFER_SIZE) : NULL;
+    if (!bounce) {
+        n = 1;
+    }
+
+    // dirty pages are only evicted once there's no clean one left, then
+    // they all go back at once
+    uint clean = 0;
+    for (uint i = 0; i < V9FS_FILE_CACHE_PAGES; i++) {
+        if (!cache->pages[i].valid || !cache->pages[i].dirty) {
+            clean++;
+        }
+    }
+    if (clean < n && (err = fs_cache_writeback(file)) != NO_ERROR) {
+        free(bounce);
+        return err;
+    }
+
+    struct fs_page *win[V9FS_FILE_READAHEAD_PAGES];
+    for (uint i = 0; i < n; i++) {
+        struct fs_page *victim = NULL;
+        for (uint j = 0; j < V9FS_FILE_CACHE_PAGES; j++) {
+            struct fs_page *p = &cache->pages[j];
+            if (!p->valid) {
+                victim = p;
+                break;
+            }
+            if (!p->dirty && (!victim || p->last_used < victim->last_used)) {
+                victim = p;
+            }
+        }
+        DEBUG_ASSERT(victim);
+
+        victim->index = index + i;
+        victim->size = 0;
+        victim->valid = true;
+        victim->dirty = false;
+        victim->last_used = ++cache->clock;
+        win[i] = victim;
     }
 
-    memset(file->pg_buf.data, 0, V9FS_FILE_PAGE_BUFFER_SIZE);
-    rsize =
-        read_file_impl(file, file->pg_buf.data, fs_page_start_by_offset(offset),
-                       V9FS_FILE_PAGE_BUFFER_SIZE);
-    file->pg_buf.size = rsize;
-    file->pg_buf.index = fs_page_index(offset);
-    file->pg_buf.need_update = false;
-    file->pg_buf.dirty = false;
+    ssize_t rlen = read_file_impl(file, bounce ? bounce : fs_page_data(file, win[0]),
+                                  fs_page_start_by_index(index),
+                                  n * V9FS_FILE_PAGE_BUFFER_SIZE);
+    if (rlen < 0) {
+        for (uint i = 0; i < n; i++) {
+            win[i]->valid = false;
+        }
+        free(bounce);
+        return rlen;
+    }
+
+    for (uint i = 0; i < n; i++) {
+        uint8_t *data = fs_page_data(file, win[i]);
+        win[i]->size = clamp((int)rlen - (int)(i * V9FS_FILE_PAGE_BUFFER_SIZE), 0,
+                             V9FS_FILE_PAGE_BUFFER_SIZE);
+        if (bounce) {
+            memcpy(data, bounce + i * V9FS_FILE_PAGE_BUFFER_SIZE, win[i]->size);
+        }
+        memset(data + win[i]->size, 0, V9FS_FILE_PAGE_BUFFER_SIZE - win[i]->size);
+    }
+    free(bounce);
+
+    // the server doesn't know about data past these that's only in the cache yet
+    fs_cache_extend(file);
+
+    cache->next_index = index + n;
+    *out = win[0];
+    return NO_ERROR;
+}
+
+// drop the pages a write from offset to offset + len goes over, and any that
+// aren't full, since the end of the file may move. Dirty ones must have been
+// written back already.
+static void fs_cache_invalidate(v9fs_file_t *file, off_t offset, size_t len) {
+    for (uint i = 0; i < V9FS_FILE_CACHE_PAGES; i++) {
+        struct fs_page *page = &file->cache.pages[i];
+        if (!page->valid) {
+            continue;
+        }
+        DEBUG_ASSERT(!page->dirty);
+
+        off_t start = fs_page_start_by_index(page->index);
+        if (page->size < V9FS_FILE_PAGE_BUFFER_SIZE ||
+            (start < offset + (off_t)len && offset < start + V9FS_FILE_PAGE_BUFFER_SIZE)) {
+            page->valid = false;
+        }
+    }
 }
 
 static ssize_t fs_page_read(v9fs_file_t *file, void *buf, off_t offset,
                             size_t size) {
+    struct fs_page *page;
     ssize_t rsize;
+    status_t err;
 
-    fs_page_update(file, offset);
+    if ((err = fs_page_get(file, fs_page_index(offset), &page)) != NO_ERROR) {
+        return err;
+    }
 
+    // nothing past the end of the file
     offset %= V9FS_FILE_PAGE_BUFFER_SIZE;
-    rsize = clamp(size, 0, file->pg_buf.size - offset);
-    memcpy(buf, file->pg_buf.data + offset, rsize);
+    rsize = ((size_t)offset < page->size) ? MIN(size, page->size - offset) : 0;
+    memcpy(buf, fs_page_data(file, page) + offset, rsize);
 
     return rsize;
 }
 
 static ssize_t fs_page_write(v9fs_file_t *file, const void *buf, off_t offset,
                              size_t size) {
-    fs_page_update(file, offset);
+    struct fs_page *page;
+    status_t err;
+
+    if ((err = fs_page_get(file, fs_page_index(offset), &page)) != NO_ERROR) {
+        return err;
+    }
 
     offset %= V9FS_FILE_PAGE_BUFFER_SIZE;
-    memcpy(file->pg_buf.data + offset, buf, size);
-    file->pg_buf.size = offset + size;
-    file->pg_buf.dirty = true;
+    memcpy(fs_page_data(file, page) + offset, buf, size);
+    page->dirty = true;
+    if ((size_t)offset + size > page->size) {
+        page->size = offset + size;
+        fs_cache_extend(file);
+    }
 
     return size;
 }
@@ -391,7 +624,8 @@ ssize_t v9fs_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
 
     if (fs_valid_page(offset, len)) {
         rsize = fs_page_read(file, buf, offset, len);
-    } else {
+    } else if ((rsize = fs_cache_writeback(file)) == NO_ERROR) {
+        // the server has to see what's still dirty here first
         rsize = read_file_impl(file, buf, offset, len);
     }
 
@@ -420,7 +654,8 @@ ssize_t v9fs_write_file(filecookie *fcookie, const void *buf, off_t offset,
 
     if (fs_valid_page(offset, len)) {
         rsize = fs_page_write(file, buf, offset, len);
-    } else {
+    } else if ((rsize = fs_cache_writeback(file)) == NO_ERROR) {
+        fs_cache_invalidate(file, offset, len);
         rsize = write_file_impl(file, buf, offset, len);
     }
 
@@ -444,13 +679,9 @@ status_t v9fs_close_file(filecookie *fcookie) {
         return ret;
     }
 
-    if (file->pg_buf.dirty) {
-        // writeback the dirty page
-        write_file_impl(file, file->pg_buf.data,
-                        fs_page_start_by_index(file->pg_buf.index),
-                        file->pg_buf.size);
-        file->pg_buf.dirty = false;
-    }
+    // writeback the dirty pages
+    fs_cache_writeback(file);
+    free(file->cache.data);
 
     put_fid(file->v9fs, file->fid.fid);
     list_delete(&file->node);
@@ -482,8 +713,13 @@ status_t v9fs_stat_file(filecookie *fcookie, struct file_stat *stat) {
         }};
     virtio_9p_msg_t rgatt = {};
 
+    // the size has to take in what's only been written to the cache so far
+    if ((ret = fs_cache_writeback(file)) != NO_ERROR) {
+        goto err;
+    }
+
     if ((ret = virtio_9p_rpc(file->v9fs->dev, &tgatt, &rgatt)) != NO_ERROR) {
-        return ret;
+        goto err;
     }
     if (rgatt.msg_type != P9_RGETATTR) {
         ret = ERR_BUSY;
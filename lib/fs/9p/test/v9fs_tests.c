@@ -9,6 +9,8 @@
 #include <lk/console_cmd.h>
 #include <lk/debug.h>
 #include <lk/err.h>
+#include <stdlib.h>
+#include <string.h>
 
 // TODO: find a way to convert to a unit test
 
@@ -22,6 +24,213 @@
 
 #define BUF_SIZE 1024
 
+#define CACHE_TEST_FILE  V9FS_MOUNT_POINT "/v9fs_cache_test"
+#define CACHE_TEST_PIECE 100                 // small writes, served from the page cache
+#define CACHE_TEST_SMALL (3 * 4096 + 1000)   // ends part way into a page
+#define CACHE_TEST_LARGE (64 * 1024)         // goes straight to the server
+#define CACHE_TEST_HOLE  (CACHE_TEST_LARGE + CACHE_TEST_PIECE)
+#define CACHE_TEST_HOLE_END (CACHE_TEST_LARGE + 2 * 4096 + 200) // short write past the end
+
+static uint8_t cache_test_byte(size_t pos, uint8_t seed) {
+    return (uint8_t)(pos * 7 + seed);
+}
+
+static void cache_test_fill(uint8_t *buf, size_t pos, size_t len, uint8_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = cache_test_byte(pos + i, seed);
+    }
+}
+
+static bool cache_test_check(const uint8_t *buf, size_t pos, size_t len, uint8_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != cache_test_byte(pos + i, seed)) {
+            LOGF("mismatch at %zu: 0x%x, expected 0x%x\n", pos + i, buf[i],
+                 cache_test_byte(pos + i, seed));
+            return false;
+        }
+    }
+    return true;
+}
+
+// read the whole of len back in pieces of piece bytes
+static status_t cache_test_read_back(filehandle *handle, uint8_t *buf, size_t len,
+                                     size_t piece, uint8_t seed) {
+    for (size_t pos = 0; pos < len; pos += piece) {
+        size_t n = MIN(piece, len - pos);
+        ssize_t readbytes = fs_read_file(handle, buf, pos, n);
+        if (readbytes != (ssize_t)n) {
+            LOGF("read of %zu at %zu returned %ld\n", n, pos, readbytes);
+            return readbytes < 0 ? (status_t)readbytes : ERR_IO;
+        }
+        if (!cache_test_check(buf, pos, n, seed)) {
+            return ERR_IO;
+        }
+    }
+    return NO_ERROR;
+}
+
+// read len bytes from pos back as zeroes, without crossing a page so they all
+// come from the cache
+static status_t cache_test_read_zero(filehandle *handle, uint8_t *buf, size_t pos,
+                                     size_t len) {
+    for (size_t end = pos + len; pos < end;) {
+        size_t n = MIN(MIN(CACHE_TEST_PIECE, end - pos), 4096 - pos % 4096);
+        ssize_t readbytes = fs_read_file(handle, buf, pos, n);
+        if (readbytes != (ssize_t)n) {
+            LOGF("read of %zu at %zu returned %ld\n", n, pos, readbytes);
+            return readbytes < 0 ? (status_t)readbytes : ERR_IO;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i] != 0) {
+                LOGF("hole at %zu reads 0x%x\n", pos + i, buf[i]);
+                return ERR_IO;
+            }
+        }
+        pos += n;
+    }
+    return NO_ERROR;
+}
+
+static status_t cache_test_size(filehandle *handle, uint64_t expected) {
+    struct file_stat stat;
+    status_t status = fs_stat_file(handle, &stat);
+    if (status != NO_ERROR) {
+        LOGF("failed to stat the test file: %d\n", status);
+        return status;
+    }
+    if (stat.size != expected) {
+        LOGF("test file is %llu bytes, expected %llu\n", (unsigned long long)stat.size,
+             (unsigned long long)expected);
+        return ERR_IO;
+    }
+    return NO_ERROR;
+}
+
+// Writes shorter than a page go to the page cache and only reach the server when
+// something needs them there. Check they're seen by stat and by reads that go
+// around the cache, that a large write over cached pages isn't undone by them,
+// that one past the end leaves a hole of zeroes behind it, and that it all made
+// it to the server by reopening the file.
+static status_t v9fs_cache_tests(void) {
+    filehandle *handle;
+    status_t status;
+    ssize_t written;
+
+    uint8_t *buf = malloc(CACHE_TEST_LARGE);
+    if (!buf) {
+        return ERR_NO_MEMORY;
+    }
+
+    status = fs_create_file(CACHE_TEST_FILE, &handle, 0);
+    if (status != NO_ERROR) {
+        LOGF("failed to create the test file: %d\n", status);
+        goto out;
+    }
+
+    // short writes, some of them straddling a page boundary
+    for (size_t pos = 0; pos < CACHE_TEST_SMALL; pos += CACHE_TEST_PIECE) {
+        size_t n = MIN(CACHE_TEST_PIECE, CACHE_TEST_SMALL - pos);
+        cache_test_fill(buf, pos, n, 1);
+        written = fs_write_file(handle, buf, pos, n);
+        if (written != (ssize_t)n) {
+            LOGF("write of %zu at %zu returned %ld\n", n, pos, written);
+            status = written < 0 ? (status_t)written : ERR_IO;
+            goto close;
+        }
+    }
+
+    if ((status = cache_test_size(handle, CACHE_TEST_SMALL)) != NO_ERROR) {
+        goto close;
+    }
+    // a large read bypasses the cache, so the server has to have it all by now
+    if ((status = cache_test_read_back(handle, buf, CACHE_TEST_SMALL, CACHE_TEST_LARGE, 1)) !=
+        NO_ERROR) {
+        goto close;
+    }
+
+    // fill the cache with the old data, then write past it in one go
+    if ((status = cache_test_read_back(handle, buf, CACHE_TEST_SMALL, CACHE_TEST_PIECE, 1)) !=
+        NO_ERROR) {
+        goto close;
+    }
+    cache_test_fill(buf, 0, CACHE_TEST_LARGE, 2);
+    written = fs_write_file(handle, buf, 0, CACHE_TEST_LARGE);
+    if (written != CACHE_TEST_LARGE) {
+        LOGF("large write returned %ld\n", written);
+        status = written < 0 ? (status_t)written : ERR_IO;
+        goto close;
+    }
+
+    // small reads mustn't see the stale cached pages
+    if ((status = cache_test_read_back(handle, buf, CACHE_TEST_LARGE, CACHE_TEST_PIECE, 2)) !=
+        NO_ERROR) {
+        goto close;
+    }
+
+    // one more short write at the end, left for close to write back
+    cache_test_fill(buf, CACHE_TEST_LARGE, CACHE_TEST_PIECE, 2);
+    written = fs_write_file(handle, buf, CACHE_TEST_LARGE, CACHE_TEST_PIECE);
+    if (written != CACHE_TEST_PIECE) {
+        LOGF("write at the end returned %ld\n", written);
+        status = written < 0 ? (status_t)written : ERR_IO;
+        goto close;
+    }
+
+    // and another further on, the pages in between have to read as zeroes
+    // out to it while both are still only in the cache
+    cache_test_fill(buf, CACHE_TEST_HOLE_END, CACHE_TEST_PIECE, 2);
+    written = fs_write_file(handle, buf, CACHE_TEST_HOLE_END, CACHE_TEST_PIECE);
+    if (written != CACHE_TEST_PIECE) {
+        LOGF("write past the end returned %ld\n", written);
+        status = written < 0 ? (status_t)written : ERR_IO;
+        goto close;
+    }
+    if ((status = cache_test_read_zero(handle, buf, CACHE_TEST_HOLE,
+                                       CACHE_TEST_HOLE_END - CACHE_TEST_HOLE)) != NO_ERROR) {
+        goto close;
+    }
+
+close:
+    if (fs_close_file(handle) != NO_ERROR && status == NO_ERROR) {
+        status = ERR_IO;
+    }
+    if (status != NO_ERROR) {
+        goto out;
+    }
+
+    // everything should be on the server now
+    status = fs_open_file(CACHE_TEST_FILE, &handle);
+    if (status != NO_ERROR) {
+        LOGF("failed to reopen the test file: %d\n", status);
+        goto out;
+    }
+    status = cache_test_size(handle, CACHE_TEST_HOLE_END + CACHE_TEST_PIECE);
+    if (status == NO_ERROR) {
+        status = cache_test_read_back(handle, buf, CACHE_TEST_LARGE, CACHE_TEST_LARGE, 2);
+    }
+    if (status == NO_ERROR) {
+        status = cache_test_read_back(handle, buf, CACHE_TEST_LARGE + CACHE_TEST_PIECE,
+                                      CACHE_TEST_PIECE, 2);
+    }
+    if (status == NO_ERROR) {
+        status = cache_test_read_zero(handle, buf, CACHE_TEST_HOLE,
+                                      CACHE_TEST_HOLE_END - CACHE_TEST_HOLE);
+    }
+    if (status == NO_ERROR) {
+        ssize_t readbytes = fs_read_file(handle, buf, CACHE_TEST_HOLE_END, CACHE_TEST_PIECE);
+        if (readbytes != CACHE_TEST_PIECE ||
+            !cache_test_check(buf, CACHE_TEST_HOLE_END, CACHE_TEST_PIECE, 2)) {
+            LOGF("read past the hole returned %ld\n", readbytes);
+            status = readbytes < 0 ? (status_t)readbytes : ERR_IO;
+        }
+    }
+    fs_close_file(handle);
+
+out:
+    free(buf);
+    return status;
+}
+
 int v9fs_tests(int argc, const console_cmd_args *argv) {
     status_t status;
     ssize_t readbytes;
@@ -55,6 +264,12 @@ int v9fs_tests(int argc, const console_cmd_args *argv) {
         return status;
     }
 
+    status = v9fs_cache_tests();
+    if (status != NO_ERROR) {
+        LOGF("cache tests failed: %d\n", status);
+        return status;
+    }
+
     status = fs_unmount(V9FS_MOUNT_POINT);
     if (status != NO_ERROR) {
         LOGF("failed to unmount v9p on mount point (%s): %d\n",
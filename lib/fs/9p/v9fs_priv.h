@@ -47,6 +47,20 @@ typedef struct v9fs {
 #define V9FS_FILE_PAGE_BUFFER_SIZE (1 << 12)
 #define V9FS_FILE_LOCK_TIMEOUT     3000
 
+// pages of each file kept around, the most a sequential miss reads ahead, and
+// how many Tread/Twrite a transfer keeps in flight at once
+#define V9FS_FILE_CACHE_PAGES      32
+#define V9FS_FILE_READAHEAD_PAGES  16
+#define V9FS_FILE_IO_DEPTH         4
+
+struct fs_page {
+    off_t index;
+    size_t size;
+    bool valid;
+    bool dirty;
+    uint32_t last_used;
+};
+
 typedef struct v9fs_file {
     v9fs_t *v9fs;
     v9fs_fid_t fid;
@@ -54,13 +68,14 @@ typedef struct v9fs_file {
     struct list_node node;
     mutex_t lock;
 
-    struct fs_page_buffer {
-        size_t size;
-        off_t index;
-        bool need_update;
-        bool dirty;
-        uint8_t data[V9FS_FILE_PAGE_BUFFER_SIZE];
-    } pg_buf;
+    // small accesses go through here, dirty pages are written back in batches
+    // when room is needed, before large transfers and on close
+    struct fs_page_cache {
+        uint8_t *data; // V9FS_FILE_CACHE_PAGES pages, allocated on first use
+        struct fs_page pages[V9FS_FILE_CACHE_PAGES];
+        uint32_t clock;
+        off_t next_index; // page after the last miss, to spot sequential access
+    } cache;
 } v9fs_file_t;
 
 typedef struct v9fs_dir {
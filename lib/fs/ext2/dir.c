@@ -27,11 +27,15 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 
     buf = malloc(EXT2_BLOCK_SIZE(ext2->sb));
 
+    /* the block map of the dir, kept across its blocks */
+    struct cache_block map_cache[EXT2_MAP_CACHE_LEVELS] = {};
+
     file_blocknum = 0;
     for (;;) {
         /* read in the offset */
-        err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+        err = ext2_read_inode(ext2, dir_inode, map_cache, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
         if (err <= 0) {
+            ext2_map_cache_free(map_cache);
             free(buf);
             return -1;
         }
@@ -54,6 +58,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
                 // match
                 *inum = LE32(ent->inode);
                 LTRACEF("match: inode %d\n", *inum);
+                ext2_map_cache_free(map_cache);
                 free(buf);
                 return 1;
             }
@@ -65,6 +70,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 
         /* sanity check the directory. 4MB should be enough */
         if (file_blocknum > 1024) {
+            ext2_map_cache_free(map_cache);
             free(buf);
             return -1;
         }
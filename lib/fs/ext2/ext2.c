@@ -17,6 +17,15 @@
 
 #define LOCAL_TRACE 0
 
+/* incompat features that don't get in the way of reading */
+#define EXT2_READ_INCOMPAT_SUPP (EXT2_FEATURE_INCOMPAT_FILETYPE |   \
+                                 EXT3_FEATURE_INCOMPAT_RECOVER |    \
+                                 EXT4_FEATURE_INCOMPAT_EXTENTS |    \
+                                 EXT4_FEATURE_INCOMPAT_64BIT |      \
+                                 EXT4_FEATURE_INCOMPAT_FLEX_BG |    \
+                                 EXT4_FEATURE_INCOMPAT_CSUM_SEED |  \
+                                 EXT4_FEATURE_INCOMPAT_LARGEDIR)
+
 static void endian_swap_superblock(struct ext2_super_block *sb) {
     LE32SWAP(sb->s_inodes_count);
     LE32SWAP(sb->s_blocks_count);
@@ -57,6 +66,10 @@ static void endian_swap_superblock(struct ext2_super_block *sb) {
     LE32SWAP(sb->s_last_orphan);
     LE32SWAP(sb->s_default_mount_opts);
     LE32SWAP(sb->s_first_meta_bg);
+
+    /* ext4 */
+    LE16SWAP(sb->s_desc_size);
+    LE32SWAP(sb->s_blocks_count_hi);
 }
 
 static void endian_swap_inode(struct ext2_inode *inode) {
@@ -105,7 +118,12 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie, enum fs_mount_options option
     }
 
     ext2_t *ext2 = malloc(sizeof(ext2_t));
+    if (!ext2) {
+        return ERR_NO_MEMORY;
+    }
     ext2->dev = dev;
+    ext2->gd = NULL;
+    ext2->cache = NULL;
 
     err = bio_read(dev, &ext2->sb, 1024, sizeof(struct ext2_super_block));
     if (err < 0) {
@@ -117,7 +135,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie, enum fs_mount_options option
     /* see if the superblock is good */
     if (ext2->sb.s_magic != EXT2_SUPER_MAGIC) {
         err = -1;
-        return err;
+        goto err;
     }
 
     /* calculate group count, rounded up */
@@ -138,26 +156,50 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie, enum fs_mount_options option
     /* we only support dynamic revs */
     if (ext2->sb.s_rev_level > EXT2_DYNAMIC_REV) {
         err = -2;
-        return err;
+        goto err;
     }
 
-    /* make sure it doesn't have any ro features we don't support */
-    if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
-        err = -3;
-        return err;
+    /* ro features don't matter, this is only ever read. make sure it doesn't have
+     * any features we don't know how to read */
+    if (ext2->sb.s_feature_incompat & ~EXT2_READ_INCOMPAT_SUPP) {
+        LTRACEF("unsupported incompat features 0x%x\n", ext2->sb.s_feature_incompat & ~EXT2_READ_INCOMPAT_SUPP);
+        err = ERR_NOT_SUPPORTED;
+        goto err;
+    }
+
+    /* 64 bit block numbers are fine as long as there aren't any */
+    size_t desc_size = sizeof(struct ext2_group_desc);
+    if (ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        if (ext2->sb.s_blocks_count_hi != 0) {
+            err = ERR_NOT_SUPPORTED;
+            goto err;
+        }
+        desc_size = MAX(ext2->sb.s_desc_size, sizeof(struct ext2_group_desc));
     }
 
-    /* read in all the group descriptors */
+    /* read in all the group descriptors, just the parts of them we use */
     ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
-    err = bio_read(ext2->dev, (void *)ext2->gd,
+    uint8_t *gd_buf = malloc(desc_size * ext2->s_group_count);
+    if (!ext2->gd || !gd_buf) {
+        free(gd_buf);
+        err = ERR_NO_MEMORY;
+        goto err;
+    }
+    err = bio_read(ext2->dev, gd_buf,
                    (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-                   sizeof(struct ext2_group_desc) * ext2->s_group_count);
+                   desc_size * ext2->s_group_count);
     if (err < 0) {
+        free(gd_buf);
         err = -4;
-        return err;
+        goto err;
     }
 
     int i;
+    for (i = 0; i < ext2->s_group_count; i++) {
+        memcpy(&ext2->gd[i], gd_buf + i * desc_size, sizeof(struct ext2_group_desc));
+    }
+    free(gd_buf);
+
     for (i = 0; i < ext2->s_group_count; i++) {
         endian_swap_group_desc(&ext2->gd[i]);
         LTRACEF("group %d:\n", i);
@@ -187,6 +229,10 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie, enum fs_mount_options option
 err:
     LTRACEF("exiting with err code %d\n", err);
 
+    if (ext2->cache) {
+        bcache_destroy(ext2->cache);
+    }
+    free(ext2->gd);
     free(ext2);
     return err;
 }
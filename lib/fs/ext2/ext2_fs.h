@@ -84,6 +84,41 @@ struct ext2_group_desc {
 #define EXT2_DESC_PER_BLOCK(s)   (EXT2_BLOCK_SIZE(s) / sizeof(struct ext2_group_desc))
 #define EXT2_INODES_PER_GROUP(s) ((s).s_inodes_per_group)
 
+/*
+ * Inode flags
+ */
+#define EXT4_EXTENTS_FL 0x00080000 /* Inode uses extents */
+
+/*
+ * ext4 extent tree, rooted in i_block of inodes with EXT4_EXTENTS_FL. Each node
+ * is a header followed by eh_entries index entries, or extents at depth 0.
+ */
+#define EXT4_EXT_MAGIC        0xf30a
+#define EXT4_EXT_MAX_DEPTH    5
+#define EXT4_EXT_INIT_MAX_LEN 32768 /* longer ee_len means unwritten */
+
+struct ext4_extent_header {
+    uint16_t eh_magic;      /* EXT4_EXT_MAGIC */
+    uint16_t eh_entries;    /* number of valid entries */
+    uint16_t eh_max;        /* capacity of the node in entries */
+    uint16_t eh_depth;      /* 0 for a leaf */
+    uint32_t eh_generation;
+};
+
+struct ext4_extent_idx {
+    uint32_t ei_block;   /* first file block covered */
+    uint32_t ei_leaf_lo; /* block of the next level down */
+    uint16_t ei_leaf_hi;
+    uint16_t ei_unused;
+};
+
+struct ext4_extent {
+    uint32_t ee_block;    /* first file block */
+    uint16_t ee_len;      /* number of blocks */
+    uint16_t ee_start_hi; /* first physical block */
+    uint32_t ee_start_lo;
+};
+
 /*
  * Constants relative to the data blocks
  */
@@ -276,11 +311,14 @@ struct ext2_super_block {
     uint32_t s_last_orphan;     /* start of list of inodes to delete */
     uint32_t s_hash_seed[4];    /* HTREE hash seed */
     uint8_t s_def_hash_version; /* Default hash version to use */
-    uint8_t s_reserved_char_pad;
-    uint16_t s_reserved_word_pad;
+    uint8_t s_jnl_backup_type;
+    uint16_t s_desc_size; /* size of group descriptor, with 64BIT */
     uint32_t s_default_mount_opts;
-    uint32_t s_first_meta_bg; /* First metablock block group */
-    uint32_t s_reserved[190]; /* Padding to the end of the block */
+    uint32_t s_first_meta_bg;   /* First metablock block group */
+    uint32_t s_mkfs_time;       /* When the filesystem was created */
+    uint32_t s_jnl_blocks[17];  /* Backup of the journal inode */
+    uint32_t s_blocks_count_hi; /* Blocks count, high 32 bits, with 64BIT */
+    uint32_t s_reserved[171];   /* Padding to the end of the block */
 };
 
 /*
@@ -344,6 +382,11 @@ struct ext2_super_block {
 #define EXT3_FEATURE_INCOMPAT_RECOVER     0x0004
 #define EXT3_FEATURE_INCOMPAT_JOURNAL_DEV 0x0008
 #define EXT2_FEATURE_INCOMPAT_META_BG     0x0010
+#define EXT4_FEATURE_INCOMPAT_EXTENTS     0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT       0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG     0x0200
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED   0x2000
+#define EXT4_FEATURE_INCOMPAT_LARGEDIR    0x4000
 #define EXT2_FEATURE_INCOMPAT_ANY         0xffffffff
 
 #define EXT2_FEATURE_COMPAT_SUPP   EXT2_FEATURE_COMPAT_EXT_ATTR
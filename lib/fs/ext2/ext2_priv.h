@@ -8,8 +8,11 @@
 #pragma once
 
 #include "ext2_fs.h"
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
+#include <lib/bio/queue.h>
 #include <lib/fs.h>
 
 typedef uint32_t blocknum_t;
@@ -26,16 +29,42 @@ typedef struct {
     struct ext2_inode root_inode;
 } ext2_t;
 
+/* a copy of a block of an inode's block map, an indirect block or extent tree node */
 struct cache_block {
     blocknum_t num;
     void *ptr;
 };
 
+/* levels of the block map kept, deeper extent trees share the last one */
+#define EXT2_MAP_CACHE_LEVELS 3
+
+/* most read ahead of a file, in requests of at most EXT2_READAHEAD_REQ_BYTES */
+#define EXT2_READAHEAD_MAX       (128 * 1024)
+#define EXT2_READAHEAD_REQ_BYTES (32 * 1024)
+#define EXT2_READAHEAD_REQS      (EXT2_READAHEAD_MAX / EXT2_READAHEAD_REQ_BYTES)
+
+/* the file data past the last read, fetched while the caller works on that one */
+struct ext2_readahead {
+    uint8_t *buf;
+    off_t offset;    // file offset of buf, block aligned
+    size_t len;      // bytes of buf in use
+    off_t next;      // where a sequential read would start
+
+    // completions come from a dpc
+    spin_lock_t lock;
+    int pending;
+    bool failed;
+    event_t done;
+    bio_request_t req[EXT2_READAHEAD_REQS];
+    iovec_t iov[EXT2_READAHEAD_REQS];
+};
+
 /* open file handle */
 typedef struct {
     ext2_t *ext2;
 
-    struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+    struct cache_block map_cache[EXT2_MAP_CACHE_LEVELS]; // block map blocks last walked through, by level
+    struct ext2_readahead ra;
     struct ext2_inode inode;
 } ext2_file_t;
 
@@ -48,8 +77,17 @@ int ext2_read_block(ext2_t *ext2, void *buf, blocknum_t bnum);
 int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
+/* find the physical block of fileblock, 0 for a hole, and how many blocks from
+ * there on, up to max, follow on from it on disk (or are hole too). map_cache
+ * holds EXT2_MAP_CACHE_LEVELS blocks, freed with ext2_map_cache_free() */
+int ext2_map_blocks(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                    uint fileblock, uint max, blocknum_t *phys, uint *count);
+void ext2_map_cache_free(struct cache_block *map_cache);
+
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+/* map_cache may be NULL, in which case one is used just for this read */
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                        void *buf, off_t offset, size_t len);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
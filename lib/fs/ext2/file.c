@@ -38,14 +38,143 @@ int ext2_open_file(fscookie *cookie, const char *path, filecookie **fcookie) {
     }
 
     file->ext2 = ext2;
+    spin_lock_init(&file->ra.lock);
+    event_init(&file->ra.done, false, EVENT_FLAG_AUTOUNSIGNAL);
     *fcookie = (filecookie *)file;
 
     return 0;
 }
 
-ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len) {
+static void ext2_readahead_done(bio_request_t *req) {
+    struct ext2_readahead *ra = req->cookie;
+
+    LTRACEF("req %p result %ld\n", req, (long)req->result);
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&ra->lock);
+    if (req->result != (ssize_t)req->iov->iov_len) {
+        ra->failed = true;
+    }
+    if (--ra->pending == 0) {
+        event_signal(&ra->done, false);
+    }
+    spin_unlock_irqrestore(&ra->lock, state);
+}
+
+/* wait for any readahead still in flight, returns false if some of it failed */
+static bool ext2_readahead_wait(struct ext2_readahead *ra) {
+    for (;;) {
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&ra->lock);
+        int pending = ra->pending;
+        spin_unlock_irqrestore(&ra->lock, state);
+        if (pending == 0) {
+            break;
+        }
+        event_wait(&ra->done);
+    }
+
+    return !ra->failed;
+}
+
+/* copy out as much of the read as the readahead buffer has, from its start */
+static size_t ext2_readahead_take(struct ext2_readahead *ra, uint8_t *buf, off_t offset, size_t len) {
+    if (ra->len == 0 || offset < ra->offset || offset >= ra->offset + (off_t)ra->len) {
+        return 0;
+    }
+
+    if (!ext2_readahead_wait(ra)) {
+        ra->len = 0;
+        return 0;
+    }
+
+    size_t tocopy = MIN(len, (size_t)(ra->offset + ra->len - offset));
+    memcpy(buf, ra->buf + (offset - ra->offset), tocopy);
+
+    LTRACEF("offset %lld: %zu bytes from readahead\n", offset, tocopy);
+
+    return tocopy;
+}
+
+/* start reading the file from offset on into the readahead buffer */
+static void ext2_readahead_start(ext2_file_t *file, off_t offset) {
+    struct ext2_readahead *ra = &file->ra;
+    ext2_t *ext2 = file->ext2;
+    const size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+
+    offset = ROUNDDOWN(offset, (off_t)block_size);
+
+    /* still to be taken from what's there */
+    if (ra->len > 0 && offset >= ra->offset && offset < ra->offset + (off_t)ra->len) {
+        return;
+    }
+
+    /* the buffer can't be reused until the last lot is in */
+    ext2_readahead_wait(ra);
+    ra->len = 0;
+    ra->failed = false;
+
+    off_t file_size = ext2_file_len(ext2, &file->inode);
+    if (offset >= file_size || block_size % ext2->dev->block_size != 0) {
+        return;
+    }
+    if (!ra->buf) {
+        ra->buf = malloc(EXT2_READAHEAD_MAX);
+        if (!ra->buf) {
+            return;
+        }
+    }
+
+    const uint dev_blocks_per_block = block_size / ext2->dev->block_size;
+    const uint max_req_blocks = MAX(EXT2_READAHEAD_REQ_BYTES / block_size, 1u);
+    const size_t want = MIN(EXT2_READAHEAD_MAX, ROUNDUP((size_t)(file_size - offset), block_size));
+
+    uint file_block = offset / block_size;
+    size_t len = 0;
+    uint reqs = 0;
+    while (len < want && reqs < EXT2_READAHEAD_REQS) {
+        blocknum_t phys_block;
+        uint count;
+        if (ext2_map_blocks(ext2, &file->inode, file->map_cache, file_block, (want - len) / block_size,
+                            &phys_block, &count) < 0) {
+            break;
+        }
+
+        if (phys_block == 0) {
+            memset(ra->buf + len, 0, (size_t)count * block_size);
+        } else {
+            count = MIN(count, max_req_blocks);
+
+            iovec_t *iov = &ra->iov[reqs];
+            bio_request_t *req = &ra->req[reqs];
+            iov->iov_base = ra->buf + len;
+            iov->iov_len = (size_t)count * block_size;
+            bio_request_init(req, BIO_OP_READ, phys_block * dev_blocks_per_block,
+                             count * dev_blocks_per_block, iov, 1, ext2_readahead_done, ra);
+
+            arch_interrupt_saved_state_t state = spin_lock_irqsave(&ra->lock);
+            ra->pending++;
+            spin_unlock_irqrestore(&ra->lock, state);
+            if (bio_submit(ext2->dev, req) < 0) {
+                state = spin_lock_irqsave(&ra->lock);
+                ra->pending--;
+                spin_unlock_irqrestore(&ra->lock, state);
+                break;
+            }
+            reqs++;
+        }
+
+        len += (size_t)count * block_size;
+        file_block += count;
+    }
+
+    LTRACEF("offset %lld, len %zu in %u requests\n", offset, len, reqs);
+
+    ra->offset = offset;
+    ra->len = len;
+}
+
+ssize_t ext2_read_file(filecookie *fcookie, void *_buf, off_t offset, size_t len) {
     ext2_file_t *file = (ext2_file_t *)fcookie;
-    int err;
+    uint8_t *buf = _buf;
 
     // test that it's a file
     if (!S_ISREG(file->inode.i_mode)) {
@@ -53,22 +182,43 @@ ssize_t ext2_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
         return -1;
     }
 
-    // read from the inode
-    err = ext2_read_inode(file->ext2, &file->inode, buf, offset, len);
+    // trim the read
+    off_t file_size = ext2_file_len(file->ext2, &file->inode);
+    if (offset < 0 || offset >= file_size) {
+        return 0;
+    }
+    len = MIN(len, (size_t)(file_size - offset));
 
-    return err;
+    // whatever was read ahead, then the rest from the inode
+    size_t bytes_read = ext2_readahead_take(&file->ra, buf, offset, len);
+    if (bytes_read < len) {
+        ssize_t err = ext2_read_inode(file->ext2, &file->inode, file->map_cache,
+                                      buf + bytes_read, offset + bytes_read, len - bytes_read);
+        if (err < 0) {
+            return err;
+        }
+        bytes_read += err;
+    }
+
+    // reading through the file, get going on what comes next
+    bool sequential = (offset == file->ra.next);
+    file->ra.next = offset + bytes_read;
+    if (sequential && bytes_read > 0) {
+        ext2_readahead_start(file, file->ra.next);
+    }
+
+    return bytes_read;
 }
 
 int ext2_close_file(filecookie *fcookie) {
     ext2_file_t *file = (ext2_file_t *)fcookie;
 
-    // see if we need to free any of the cache blocks
-    int i;
-    for (i = 0; i < 3; i++) {
-        if (file->ind_cache[i].num != 0) {
-            free(file->ind_cache[i].ptr);
-        }
-    }
+    // nothing can still be reading into the buffer
+    ext2_readahead_wait(&file->ra);
+    event_destroy(&file->ra.done);
+    free(file->ra.buf);
+
+    ext2_map_cache_free(file->map_cache);
 
     free(file);
 
@@ -110,7 +260,7 @@ int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len
     }
 
     if (linklen > 60) {
-        int err = ext2_read_inode(ext2, inode, str, 0, linklen);
+        int err = ext2_read_inode(ext2, inode, NULL, str, 0, linklen);
         if (err < 0) {
             return err;
         }
@@ -8,6 +8,7 @@
 
 #include "ext2_priv.h"
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,8 +30,6 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum) {
 static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_find, uint32_t *level, uint32_t pos[]) {
     uint32_t block_ptr_per_block, block_ptr_per_2nd_block;
 
-    // XXX optimize this
-
     // See if it's in the direct blocks
     if (block_to_find < EXT2_NDIR_BLOCKS) {
         *level = 0;
@@ -74,97 +73,199 @@ static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_fi
     return -1;
 }
 
-// This function returns a pointer to the cache block that corresponds to the indirect block pointer.
-static int ext2_get_indirect_block_pointer_cache_block(ext2_t *ext2, struct ext2_inode *inode,
-                                                       blocknum_t **cache_block, uint32_t level, uint32_t pos[], uint *block_loaded) {
-    uint32_t current_level = 0;
-    uint current_block = 0, last_block;
-    blocknum_t *block = NULL;
-    int err;
-
-    if ((level > 3) || (level == 0)) {
-        err = -1;
-        goto error;
+void ext2_map_cache_free(struct cache_block *map_cache) {
+    for (int i = 0; i < EXT2_MAP_CACHE_LEVELS; i++) {
+        free(map_cache[i].ptr);
+        map_cache[i].ptr = NULL;
+        map_cache[i].num = 0;
     }
+}
 
-    // Dig down into the indirect blocks. When done, current_block should point to the target.
-    while (current_level < level) {
-        if (current_level == 0) {
-            // read the direct block, simulates a prior loop
-            current_block = LE32(inode->i_block[pos[0]]);
+/* get a block of the block map, from the copy kept for its level if it's there */
+static int ext2_get_map_block(ext2_t *ext2, struct cache_block *map_cache, uint level,
+                              blocknum_t bnum, const void **ptr) {
+    struct cache_block *cb = &map_cache[MIN(level, EXT2_MAP_CACHE_LEVELS - 1)];
+
+    if (cb->num != bnum || !cb->ptr) {
+        if (!cb->ptr) {
+            cb->ptr = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+            if (!cb->ptr) {
+                return ERR_NO_MEMORY;
+            }
         }
-
-        if (current_block == 0) {
-            err = -1;
-            goto error;
+        cb->num = 0;
+        int err = ext2_read_block(ext2, cb->ptr, bnum);
+        if (err < 0) {
+            return err;
         }
+        cb->num = bnum;
+    }
+
+    *ptr = cb->ptr;
+    return 0;
+}
+
+/* map a run through the direct and indirect block pointers */
+static int ext2_map_indirect(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                             uint fileblock, uint max, blocknum_t *phys, uint *count) {
+    uint32_t pos[4];
+    uint32_t level = 0;
+    if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0) {
+        return ERR_OUT_OF_RANGE;
+    }
 
-        last_block = current_block;
-        current_level++;
-        *block_loaded = current_block;
+    LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
 
-        err = ext2_get_block(ext2, (void **)(void *)&block, current_block);
-        if (err < 0) {
-            goto error;
+    /* dig down to the table holding fileblock */
+    const uint32_t *table = inode->i_block;
+    uint entries = EXT2_NDIR_BLOCKS;
+    if (level > 0) {
+        blocknum_t bnum = LE32(inode->i_block[pos[0]]);
+        for (uint l = 1; l <= level; l++) {
+            if (bnum == 0) {
+                /* a missing table, all hole */
+                *phys = 0;
+                *count = 1;
+                return 0;
+            }
+            const void *ptr;
+            int err = ext2_get_map_block(ext2, map_cache, l - 1, bnum, &ptr);
+            if (err < 0) {
+                return err;
+            }
+            table = ptr;
+            if (l < level) {
+                bnum = LE32(table[pos[l]]);
+            }
         }
+        entries = EXT2_ADDR_PER_BLOCK(ext2->sb);
+    }
 
-        if (current_level < level) {
-            current_block = LE32(block[pos[current_level]]);
-            ext2_put_block(ext2, last_block);
+    /* extend the run to the end of the table at most */
+    uint i = pos[level];
+    blocknum_t first = LE32(table[i]);
+    uint n = 1;
+    while (n < max && i + n < entries) {
+        blocknum_t b = LE32(table[i + n]);
+        if (first == 0 ? b != 0 : b != first + n) {
+            break;
         }
+        n++;
     }
 
-    *cache_block = block;
+    *phys = first;
+    *count = n;
     return 0;
-
-error:
-    *cache_block = NULL;
-    *block_loaded = 0;
-    return err;
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock) {
-    int err;
-    blocknum_t block;
-
-    LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
+/* map a run through an ext4 extent tree */
+static int ext2_map_extents(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                            uint fileblock, uint max, blocknum_t *phys, uint *count) {
+    const struct ext4_extent_header *eh = (const struct ext4_extent_header *)inode->i_block;
+    size_t node_size = sizeof(inode->i_block);
+
+    /* first file block past the subtree being looked at */
+    uint64_t limit = (uint64_t)fileblock + max;
+
+    for (uint level = 0;; level++) {
+        uint entries = LE16(eh->eh_entries);
+        uint depth = LE16(eh->eh_depth);
+        if (LE16(eh->eh_magic) != EXT4_EXT_MAGIC || level > EXT4_EXT_MAX_DEPTH ||
+                sizeof(*eh) + entries * sizeof(struct ext4_extent) > node_size) {
+            LTRACEF("bad extent node at level %u\n", level);
+            return ERR_IO;
+        }
 
-    uint32_t pos[4];
-    uint32_t level = 0;
-    ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+        if (depth == 0) {
+            const struct ext4_extent *ex = (const struct ext4_extent *)(eh + 1);
+
+            /* the last extent starting at or before fileblock */
+            uint i = 0;
+            while (i < entries && LE32(ex[i].ee_block) <= fileblock) {
+                i++;
+            }
+
+            if (i > 0) {
+                const struct ext4_extent *e = &ex[i - 1];
+                uint32_t start = LE32(e->ee_block);
+                uint len = LE16(e->ee_len);
+                bool unwritten = len > EXT4_EXT_INIT_MAX_LEN;
+                if (unwritten) {
+                    len -= EXT4_EXT_INIT_MAX_LEN;
+                }
+
+                if (fileblock - start < len) {
+                    if (LE16(e->ee_start_hi) != 0) {
+                        return ERR_OUT_OF_RANGE;
+                    }
+                    uint n = MIN(len - (fileblock - start), max);
+                    /* unwritten extents read as zeros */
+                    *phys = unwritten ? 0 : LE32(e->ee_start_lo) + (fileblock - start);
+                    *count = n;
+                    return 0;
+                }
+            }
+
+            /* a hole, up to the next extent */
+            if (i < entries) {
+                limit = MIN(limit, LE32(ex[i].ee_block));
+            }
+            *phys = 0;
+            *count = (uint)(limit - fileblock);
+            return 0;
+        }
 
-    LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
+        /* an index node, go down through the last entry starting at or before fileblock */
+        const struct ext4_extent_idx *idx = (const struct ext4_extent_idx *)(eh + 1);
+        uint i = 0;
+        while (i < entries && LE32(idx[i].ei_block) <= fileblock) {
+            i++;
+        }
+        if (i < entries) {
+            limit = MIN(limit, LE32(idx[i].ei_block));
+        }
+        if (i == 0) {
+            *phys = 0;
+            *count = (uint)(limit - fileblock);
+            return 0;
+        }
+        if (LE16(idx[i - 1].ei_leaf_hi) != 0) {
+            return ERR_OUT_OF_RANGE;
+        }
 
-    if (level == 0) {
-        /* direct block, just return it directly */
-        block = LE32(inode->i_block[fileblock]);
-    } else {
-        /* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
-        blocknum_t *ind_table;
-        blocknum_t phys_block;
-        err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
+        const void *ptr;
+        int err = ext2_get_map_block(ext2, map_cache, level, LE32(idx[i - 1].ei_leaf_lo), &ptr);
         if (err < 0) {
-            return 0;
+            return err;
         }
+        eh = ptr;
+        node_size = EXT2_BLOCK_SIZE(ext2->sb);
+    }
+}
+
+int ext2_map_blocks(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                    uint fileblock, uint max, blocknum_t *phys, uint *count) {
+    int err;
 
-        /* dereference the final entry in the final table */
-        block = LE32(ind_table[pos[level]]);
-        LTRACEF("block %u, indirect_block %u\n", block, phys_block);
+    DEBUG_ASSERT(max > 0);
 
-        /* release the ref on the cache block */
-        ext2_put_block(ext2, phys_block);
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        err = ext2_map_extents(ext2, inode, map_cache, fileblock, max, phys, count);
+    } else {
+        err = ext2_map_indirect(ext2, inode, map_cache, fileblock, max, phys, count);
     }
 
-    LTRACEF("returning %u\n", block);
+    LTRACEF("inode %p, fileblock %u: err %d, phys %u, count %u\n", inode, fileblock, err, *phys, *count);
 
-    return block;
+    return err;
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len) {
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                        void *_buf, off_t offset, size_t len) {
     int err = 0;
     size_t bytes_read = 0;
     uint8_t *buf = _buf;
+    const size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
 
     /* calculate the file size */
     off_t file_size = ext2_file_len(ext2, inode);
@@ -182,67 +283,60 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         return 0;
     }
 
-    /* calculate the starting file block */
-    uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+    struct cache_block temp_cache[EXT2_MAP_CACHE_LEVELS] = {};
+    if (!map_cache) {
+        map_cache = temp_cache;
+    }
 
-    /* handle partial first block */
-    if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
+    uint file_block = offset / block_size;
+    size_t block_offset = offset % block_size;
+    while (len > 0) {
+        /* find the run of blocks the rest of the read starts in */
+        uint want = (block_offset + len + block_size - 1) / block_size;
+        blocknum_t phys_block;
+        uint count;
+        err = ext2_map_blocks(ext2, inode, map_cache, file_block, want, &phys_block, &count);
+        if (err < 0) {
+            break;
+        }
 
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+        size_t tocopy;
         if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            /* hole */
+            tocopy = MIN((size_t)count * block_size - block_offset, len);
+            memset(buf, 0, tocopy);
+        } else if (block_offset == 0 && len >= block_size) {
+            /* whole blocks, straight from the device in one read. nothing is ever
+             * dirty in the cache, so it can't have anything newer */
+            tocopy = MIN((size_t)count, len / block_size) * block_size;
+            ssize_t r = bio_read(ext2->dev, buf, (off_t)phys_block * block_size, tocopy);
+            if (r != (ssize_t)tocopy) {
+                err = (r < 0) ? (int)r : ERR_IO;
+                break;
+            }
         } else {
-            ext2_read_block(ext2, temp, phys_block);
+            /* part of a block, through the cache */
+            void *ptr;
+            err = ext2_get_block(ext2, &ptr, phys_block);
+            if (err < 0) {
+                break;
+            }
+            tocopy = MIN(block_size - block_offset, len);
+            memcpy(buf, (uint8_t *)ptr + block_offset, tocopy);
+            ext2_put_block(ext2, phys_block);
         }
 
-        /* copy out what we need */
-        size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
-        size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
-        memcpy(buf, temp + block_offset, tocopy);
-
         /* increment our stuff */
-        file_block++;
+        buf += tocopy;
         len -= tocopy;
         bytes_read += tocopy;
-        buf += tocopy;
-    }
-
-    /* handle middle blocks */
-    while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, buf, phys_block);
-        }
-
-        /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        block_offset += tocopy;
+        file_block += block_offset / block_size;
+        block_offset %= block_size;
     }
 
-    /* handle partial last block */
-    if (len > 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
-
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
-
-        /* copy out what we need */
-        memcpy(buf, temp, len);
-
-        /* increment our stuff */
-        bytes_read += len;
+    if (map_cache == temp_cache) {
+        ext2_map_cache_free(temp_cache);
     }
 
     LTRACEF("err %d, bytes_read %zu\n", err, bytes_read);
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <endian.h>
+#include <lib/unittest.h>
+#include <lk/err.h>
+#include <string.h>
+
+#include "../ext2_priv.h"
+
+// Extent trees are built by hand in an inode, with 1K blocks. A tree with
+// index nodes has its leaf handed to the lookup through the block map cache,
+// so no device is needed.
+#define BLOCK_SIZE 1024
+
+static void init_fs(ext2_t *ext2) {
+    memset(ext2, 0, sizeof(*ext2));
+    ext2->sb.s_log_block_size = 0; // 1K blocks
+}
+
+static void init_header(struct ext4_extent_header *eh, uint entries, uint max, uint depth) {
+    eh->eh_magic = LE16(EXT4_EXT_MAGIC);
+    eh->eh_entries = LE16(entries);
+    eh->eh_max = LE16(max);
+    eh->eh_depth = LE16(depth);
+    eh->eh_generation = 0;
+}
+
+static void set_extent(struct ext4_extent *ex, uint32_t block, uint16_t len, uint32_t start) {
+    ex->ee_block = LE32(block);
+    ex->ee_len = LE16(len);
+    ex->ee_start_hi = 0;
+    ex->ee_start_lo = LE32(start);
+}
+
+static void set_index(struct ext4_extent_idx *idx, uint32_t block, uint32_t leaf) {
+    idx->ei_block = LE32(block);
+    idx->ei_leaf_lo = LE32(leaf);
+    idx->ei_leaf_hi = 0;
+    idx->ei_unused = 0;
+}
+
+// map fileblock and check the run that comes back
+static bool check_map(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *map_cache,
+                      uint fileblock, uint max, blocknum_t want_phys, uint want_count) {
+    BEGIN_TEST;
+
+    blocknum_t phys = 0xdeadbeef;
+    uint count = 0;
+    ASSERT_EQ(0, ext2_map_blocks(ext2, inode, map_cache, fileblock, max, &phys, &count), "");
+    if (phys != want_phys || count != want_count) {
+        unittest_printf("block %u max %u: phys %u count %u, wanted %u %u\n",
+                        fileblock, max, phys, count, want_phys, want_count);
+    }
+    EXPECT_EQ(want_phys, phys, "physical block");
+    EXPECT_EQ(want_count, count, "run length");
+
+    END_TEST;
+}
+
+static bool extent_leaf_in_inode(void) {
+    BEGIN_TEST;
+
+    ext2_t ext2;
+    init_fs(&ext2);
+
+    struct ext2_inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.i_flags = EXT4_EXTENTS_FL;
+
+    // four extents fill the root, with holes between some of them
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+    struct ext4_extent *ex = (struct ext4_extent *)(eh + 1);
+    init_header(eh, 4, 4, 0);
+    set_extent(&ex[0], 0, 4, 100);
+    set_extent(&ex[1], 4, 2, 200);
+    set_extent(&ex[2], 10, EXT4_EXT_INIT_MAX_LEN + 3, 300); // unwritten
+    set_extent(&ex[3], 20, 5, 400);
+
+    struct cache_block map_cache[EXT2_MAP_CACHE_LEVELS] = {};
+
+    // runs stop at the end of their extent, even when the next one follows on
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 0, 10, 100, 4), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 2, 1, 102, 1), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 4, 10, 200, 2), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 22, 100, 402, 3), "");
+
+    // holes run up to the next extent or max
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 6, 10, 0, 4), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 6, 2, 0, 2), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 13, 100, 0, 7), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 30, 8, 0, 8), "");
+
+    // unwritten extents read as holes
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 11, 10, 0, 2), "");
+
+    // blocks past 32 bits can't be read
+    ex[3].ee_start_hi = LE16(1);
+    blocknum_t phys;
+    uint count;
+    EXPECT_EQ(ERR_OUT_OF_RANGE, ext2_map_blocks(&ext2, &inode, map_cache, 20, 1, &phys, &count), "");
+
+    // and a root that isn't an extent node is an error
+    eh->eh_magic = 0;
+    EXPECT_EQ(ERR_IO, ext2_map_blocks(&ext2, &inode, map_cache, 0, 1, &phys, &count), "");
+
+    END_TEST;
+}
+
+static bool extent_index_node(void) {
+    BEGIN_TEST;
+
+    ext2_t ext2;
+    init_fs(&ext2);
+
+    struct ext2_inode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.i_flags = EXT4_EXTENTS_FL;
+
+    // the root indexes two leaves, only the first is looked at here
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)inode.i_block;
+    struct ext4_extent_idx *idx = (struct ext4_extent_idx *)(eh + 1);
+    init_header(eh, 2, 4, 1);
+    set_index(&idx[0], 0, 50);
+    set_index(&idx[1], 100, 51);
+
+    static uint8_t leaf[BLOCK_SIZE];
+    memset(leaf, 0, sizeof(leaf));
+    struct ext4_extent_header *leh = (struct ext4_extent_header *)leaf;
+    struct ext4_extent *ex = (struct ext4_extent *)(leh + 1);
+    init_header(leh, 2, (BLOCK_SIZE - sizeof(*leh)) / sizeof(*ex), 0);
+    set_extent(&ex[0], 0, 8, 1000);
+    set_extent(&ex[1], 8, 8, 2000);
+
+    // the lookup finds block 50 already in the map cache, as if read before
+    struct cache_block map_cache[EXT2_MAP_CACHE_LEVELS] = {};
+    map_cache[0].num = 50;
+    map_cache[0].ptr = leaf;
+
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 3, 100, 1003, 5), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 5, 2, 1005, 2), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 8, 100, 2000, 8), "");
+
+    // past the leaf's last extent is a hole up to where the next leaf starts
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 16, 200, 0, 84), "");
+    EXPECT_TRUE(check_map(&ext2, &inode, map_cache, 16, 10, 0, 10), "");
+
+    // nothing was read or reallocated
+    EXPECT_EQ(50u, map_cache[0].num, "");
+    EXPECT_EQ((void *)leaf, map_cache[0].ptr, "");
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(ext2_extent_tests)
+RUN_TEST(extent_leaf_in_inode)
+RUN_TEST(extent_index_node)
+END_TEST_CASE(ext2_extent_tests)
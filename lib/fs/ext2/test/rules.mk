@@ -0,0 +1,11 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += $(LOCAL_DIR)/extent_tests.c
+
+MODULE_DEPS += \
+	lib/fs/ext2 \
+	lib/unittest
+
+include make/module.mk
@@ -480,7 +480,10 @@ status_t fat_find_next_entry(fat_fs *fat, file_block_iterator &dbi, uint32_t &of
             LTRACEF("found filename '%s'\n", *out_filename);
 
             // fill out the passed in dir entry and exit
-            uint16_t target_cluster = fat_read16(ent, 0x1a);
+            uint32_t target_cluster = fat_read16(ent, 0x1a);
+            if (fat->info().fat_bits == 32) {
+                target_cluster |= (uint32_t)fat_read16(ent, 0x14) << 16;
+            }
             entry->length = fat_read32(ent, 0x1c);
             entry->attributes = (fat_attribute)ent[0x0B];
             entry->start_cluster = target_cluster;
@@ -658,7 +661,10 @@ status_t fat_find_short_file_in_dir_with_offsets(fat_fs *fat, uint32_t starting_
             }
 
             if (!memcmp(ent, short_name, 11)) {
-                uint16_t target_cluster = fat_read16(ent, 0x1a);
+                uint32_t target_cluster = fat_read16(ent, 0x1a);
+                if (fat->info().fat_bits == 32) {
+                    target_cluster |= (uint32_t)fat_read16(ent, 0x14) << 16;
+                }
                 entry->length = fat_read32(ent, 0x1c);
                 entry->attributes = (fat_attribute)ent[0x0B];
                 entry->start_cluster = target_cluster;
@@ -801,8 +807,10 @@ status_t fat_dir_walk(fat_fs *fat, const char *path, dir_entry *out_entry, dir_e
                 *out_entry = entry;
             }
             if (loc) {
+                // found_offset is just past the entry's short name entry, which
+                // is where the location of a file points, as it does when created
                 loc->starting_dir_cluster = dir_start_cluster;
-                loc->dir_offset = found_offset;
+                loc->dir_offset = found_offset - DIR_ENTRY_LENGTH;
             }
             return NO_ERROR;
         }
@@ -1006,12 +1014,8 @@ status_t check_entry_not_busy(fat_fs *fat, uint32_t parent_cluster, uint32_t ent
         .starting_dir_cluster = parent_cluster,
         .dir_offset = entry_end_offset - DIR_ENTRY_LENGTH,
     };
-    dir_entry_location walk_loc = {
-        .starting_dir_cluster = parent_cluster,
-        .dir_offset = entry_end_offset,
-    };
 
-    if (fat->lookup_file(sfn_loc) || fat->lookup_file(walk_loc)) {
+    if (fat->lookup_file(sfn_loc)) {
         return ERR_BUSY;
     }
 
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include "direct_io.h"
+
+#include <lib/bcache.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/trace.h>
+#include <stdlib.h>
+
+#include "fat_fs.h"
+#include "fat_priv.h"
+
+#define LOCAL_TRACE FAT_GLOBAL_TRACE(0)
+
+fat_direct_io::fat_direct_io(fat_fs *fat, bool write)
+    : fat_(fat), write_(write) {
+    event_init(&done_event_, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    const uint32_t bytes_per_sector = fat->info().bytes_per_sector;
+    const size_t block_size = fat->dev()->block_size;
+    if (bytes_per_sector >= block_size && bytes_per_sector % block_size == 0) {
+        blocks_per_sector_ = bytes_per_sector / block_size;
+    }
+}
+
+fat_direct_io::~fat_direct_io() {
+    finish();
+    event_destroy(&done_event_);
+}
+
+// static
+void fat_direct_io::request_done(bio_request_t *req) {
+    auto *io = (fat_direct_io *)req->cookie;
+
+    LTRACEF("req %p result %ld\n", req, (long)req->result);
+
+    AutoSpinLock guard(&io->lock_);
+    if (req->result != (ssize_t)req->iov->iov_len && io->err_ == NO_ERROR) {
+        io->err_ = (req->result < 0) ? (status_t)req->result : ERR_IO;
+    }
+    if (--io->pending_ == 0) {
+        event_signal(&io->done_event_, false);
+    }
+}
+
+status_t fat_direct_io::add(uint32_t sector, uint32_t count, void *buf) {
+    DEBUG_ASSERT(fat_->lock.is_held());
+    DEBUG_ASSERT(supported());
+
+    LTRACEF("%s sector %u count %u buf %p\n", write_ ? "write" : "read", sector, count, buf);
+
+    // the device has to have the latest of what's read, and the cache can't
+    // keep old copies of what's written
+    status_t err;
+    if (write_) {
+        err = bcache_invalidate_range(fat_->bcache(), sector, count);
+    } else {
+        err = bcache_flush_range(fat_->bcache(), sector, count);
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    const uint32_t bytes_per_sector = fat_->info().bytes_per_sector;
+    const uint32_t max_sectors = MAX(kMaxRequestBytes / bytes_per_sector, 1u);
+
+    auto *ptr = (uint8_t *)buf;
+    while (count > 0) {
+        if (used_ == kMaxRequests) {
+            err = finish();
+            if (err < 0) {
+                return err;
+            }
+        }
+
+        const uint32_t n = MIN(count, max_sectors);
+        slot &s = slots_[used_++];
+        s.iov.iov_base = ptr;
+        s.iov.iov_len = (size_t)n * bytes_per_sector;
+        bio_request_init(&s.req, write_ ? BIO_OP_WRITE : BIO_OP_READ,
+                         sector * blocks_per_sector_, n * blocks_per_sector_,
+                         &s.iov, 1, request_done, this);
+
+        {
+            AutoSpinLock guard(&lock_);
+            pending_++;
+        }
+        err = bio_submit(fat_->dev(), &s.req);
+        if (err < 0) {
+            AutoSpinLock guard(&lock_);
+            pending_--;
+            return err;
+        }
+
+        sector += n;
+        count -= n;
+        ptr += s.iov.iov_len;
+    }
+
+    return NO_ERROR;
+}
+
+status_t fat_direct_io::finish() {
+    for (;;) {
+        int pending;
+        {
+            AutoSpinLock guard(&lock_);
+            pending = pending_;
+        }
+        if (pending == 0) {
+            break;
+        }
+        event_wait(&done_event_);
+    }
+
+    used_ = 0;
+    return err_;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <iovec.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <lib/bio/queue.h>
+#include <lk/cpp.h>
+#include <lk/err.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fat_fs.h"
+
+// Moves whole sectors straight between the device and a caller's buffer,
+// around the block cache. Each run added goes out as bio requests right away,
+// a few at a time, and finish() waits for all of them.
+class fat_direct_io {
+  public:
+    fat_direct_io(fat_fs *fat, bool write);
+    ~fat_direct_io();
+
+    DISALLOW_COPY_ASSIGN_AND_MOVE(fat_direct_io);
+
+    // whether the device can take sectors of this fs one for one
+    bool supported() const { return blocks_per_sector_ > 0; }
+
+    // start moving count sectors from sector on. Returns ERR_BUSY, having started
+    // nothing, if the block cache is using some of them, so the caller can go
+    // through the cache instead.
+    status_t add(uint32_t sector, uint32_t count, void *buf);
+
+    // wait for everything added so far, returning the first error
+    status_t finish();
+
+  private:
+    // requests in flight at once, and the most each one carries. Small enough
+    // that any driver takes one whole, the queue merges them back up.
+    static constexpr size_t kMaxRequests = 8;
+    static constexpr size_t kMaxRequestBytes = 32 * 1024;
+
+    struct slot {
+        bio_request_t req;
+        iovec_t iov;
+    };
+
+    static void request_done(bio_request_t *req);
+
+    fat_fs *fat_;
+    const bool write_;
+    uint32_t blocks_per_sector_ = 0;
+
+    slot slots_[kMaxRequests];
+    size_t used_ = 0;
+
+    // completions come from a dpc, this keeps the object around until the last
+    // one is done with it
+    SpinLock lock_;
+    int pending_ = 0;
+    status_t err_ = NO_ERROR;
+    event_t done_event_;
+};
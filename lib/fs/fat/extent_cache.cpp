@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include "extent_cache.h"
+
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/trace.h>
+#include <stdlib.h>
+
+#include "fat_fs.h"
+#include "fat_priv.h"
+
+#define LOCAL_TRACE FAT_GLOBAL_TRACE(0)
+
+namespace {
+
+// how far past the cluster asked for a run is followed, so callers get as much
+// of it as they can in one go
+constexpr uint32_t kRunLookahead = 256;
+
+} // anonymous namespace
+
+fat_extent_cache::~fat_extent_cache() {
+    free(extents_);
+}
+
+bool fat_extent_cache::append(const fat_extent &extent) {
+    if (count_ == capacity_) {
+        if (capacity_ == kMaxExtents) {
+            return false;
+        }
+        uint32_t new_capacity = capacity_ ? MIN(capacity_ * 2, kMaxExtents) : 8;
+        auto *e = (fat_extent *)realloc(extents_, new_capacity * sizeof(fat_extent));
+        if (!e) {
+            return false;
+        }
+        extents_ = e;
+        capacity_ = new_capacity;
+    }
+
+    extents_[count_++] = extent;
+    return true;
+}
+
+status_t fat_extent_cache::lookup(fat_fs *fat, uint32_t start_cluster, uint32_t index, fat_extent *out) {
+    DEBUG_ASSERT(fat->lock.is_held());
+
+    const uint32_t total_clusters = fat->info().total_clusters;
+
+    // already known, find the last run starting at or before index
+    if (count_ > 0 && index < extents_[count_ - 1].logical + extents_[count_ - 1].count) {
+        uint32_t lo = 0;
+        uint32_t hi = count_ - 1;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi + 1) / 2;
+            if (extents_[mid].logical <= index) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        *out = extents_[lo];
+        return NO_ERROR;
+    }
+
+    // walk the chain on from the end of the last known run, extending it in
+    // place while it stays contiguous
+    fat_extent cur;
+    bool cached;
+    if (count_ > 0) {
+        cur = extents_[count_ - 1];
+        cached = true;
+    } else {
+        if (start_cluster == 0) {
+            return ERR_OUT_OF_RANGE;
+        }
+        if (start_cluster < 2 || start_cluster >= total_clusters) {
+            return ERR_IO;
+        }
+        cur = {0, start_cluster, 1};
+        cached = append(cur);
+    }
+
+    uint32_t steps = 0;
+    for (;;) {
+        const bool found = index < cur.logical + cur.count;
+        if (found && cur.logical + cur.count - index >= kRunLookahead) {
+            break;
+        }
+
+        // a chain longer than the volume has a loop in it
+        if (++steps > total_clusters) {
+            return ERR_IO;
+        }
+
+        uint32_t next = fat_next_cluster_in_chain(fat, cur.cluster + cur.count - 1);
+        if (next == cur.cluster + cur.count && next < total_clusters) {
+            cur.count++;
+            if (cached) {
+                extents_[count_ - 1].count++;
+            }
+            continue;
+        }
+
+        if (found) {
+            // the run ends here, the next one is left for the next lookup
+            break;
+        }
+        if (is_eof_cluster(next)) {
+            return ERR_OUT_OF_RANGE;
+        }
+        if (next < 2 || next >= total_clusters) {
+            return ERR_IO;
+        }
+
+        cur = {cur.logical + cur.count, next, 1};
+        cached = cached && append(cur);
+    }
+
+    LTRACEF("index %u: run at %u, cluster %u, count %u\n", index, cur.logical, cur.cluster, cur.count);
+
+    *out = cur;
+    return NO_ERROR;
+}
+
+uint32_t fat_extent_cache::cluster_at(fat_fs *fat, uint32_t start_cluster, uint32_t index) {
+    fat_extent extent;
+    if (lookup(fat, start_cluster, index, &extent) != NO_ERROR) {
+        return 0;
+    }
+
+    return extent.cluster + (index - extent.logical);
+}
+
+void fat_extent_cache::truncate(uint32_t index) {
+    while (count_ > 0 && extents_[count_ - 1].logical >= index) {
+        count_--;
+    }
+    if (count_ > 0) {
+        fat_extent &last = extents_[count_ - 1];
+        last.count = MIN(last.count, index - last.logical);
+    }
+}
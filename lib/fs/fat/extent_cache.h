@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/cpp.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fat_fs.h"
+
+// a run of clusters of a file that sit next to each other on disk
+struct fat_extent {
+    uint32_t logical; // index of the first cluster within the file
+    uint32_t cluster; // first cluster on disk
+    uint32_t count;
+};
+
+// Remembers where the clusters of a file are, as runs, so finding the one at
+// an offset doesn't mean walking the FAT from the start of the chain. Filled in
+// lazily, in order from the first cluster, as far as anyone has asked.
+class fat_extent_cache {
+  public:
+    fat_extent_cache() = default;
+    ~fat_extent_cache();
+
+    DISALLOW_COPY_ASSIGN_AND_MOVE(fat_extent_cache);
+
+    // find the run holding cluster index of the chain that starts at start_cluster.
+    // returns ERR_OUT_OF_RANGE if the chain ends first, ERR_IO if it's broken.
+    status_t lookup(fat_fs *fat, uint32_t start_cluster, uint32_t index, fat_extent *out);
+
+    // the disk cluster at index, or 0 on error
+    uint32_t cluster_at(fat_fs *fat, uint32_t start_cluster, uint32_t index);
+
+    // forget clusters from index on, after the chain has been cut there
+    void truncate(uint32_t index);
+    void clear() { truncate(0); }
+
+  private:
+    // most runs remembered, anything past the last is walked to each time
+    static constexpr uint32_t kMaxExtents = 1024;
+
+    bool append(const fat_extent &extent);
+
+    fat_extent *extents_ = nullptr;
+    uint32_t count_ = 0;
+    uint32_t capacity_ = 0;
+};
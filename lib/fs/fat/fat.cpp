@@ -258,8 +258,18 @@ status_t fat_allocate_cluster_chain(fat_fs *fat, uint32_t start_cluster, uint32_
     *first_cluster = *last_cluster = 0;
     uint32_t prev_cluster = start_cluster;
 
-    // TODO: start search at start_cluster instead of the beginning
-    uint32_t search_cluster = 2; // first 2 clusters are reserved
+    // Start right after the cluster being extended if that's free, so files grow
+    // in runs, otherwise where the last allocation left off per the FSInfo hint.
+    // The first 2 clusters are reserved.
+    const auto total_clusters = fat->info().total_clusters;
+    uint32_t search_cluster = 2;
+    if (start_cluster >= 2 && start_cluster + 1 < total_clusters &&
+        fat_next_cluster_in_chain(fat, start_cluster + 1) == 0) {
+        search_cluster = start_cluster + 1;
+    } else if (fat->info().fsinfo_next_free >= 2 && fat->info().fsinfo_next_free < total_clusters) {
+        search_cluster = fat->info().fsinfo_next_free;
+    }
+    LTRACEF("starting search at %u\n", search_cluster);
 
     // compute the starting address
     uint32_t sector;
@@ -274,8 +284,9 @@ status_t fat_allocate_cluster_chain(fat_fs *fat, uint32_t start_cluster, uint32_
         return EOF_CLUSTER;
     }
 
-    // start walking forward until we have found up to count clusters or we run out of clusters
-    const auto total_clusters = fat->info().total_clusters;
+    // start walking forward until we have found up to count clusters or we have
+    // been all the way around
+    uint32_t scanned = 0;
     while (count > 0) {
         if (fat->info().fat_bits == 12) {
             // FAT12 entries do not advance linearly by whole bytes, so recompute from
@@ -352,11 +363,19 @@ status_t fat_allocate_cluster_chain(fat_fs *fat, uint32_t start_cluster, uint32_
 
         // next entry
         search_cluster++;
-        if (search_cluster >= total_clusters) {
+        if (++scanned >= total_clusters - 2) {
             // no more clusters, abort
             break;
         }
-        if (fat->info().fat_bits == 32) {
+        if (search_cluster >= total_clusters) {
+            // wrap around to the start of the fat
+            search_cluster = 2;
+            compute_fat_entry_address(fat, search_cluster, &sector, &fat_offset_in_sector);
+            if ((err = bref.get_block(sector)) < 0) {
+                printf("bcache_get_block returned: %i\n", err);
+                return err;
+            }
+        } else if (fat->info().fat_bits == 32) {
             fat_offset_in_sector += 4;
             if (fat_offset_in_sector == fat->info().bytes_per_sector) {
                 fat_offset_in_sector = 0;
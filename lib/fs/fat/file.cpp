@@ -8,6 +8,7 @@
  */
 #include "file.h"
 
+#include <lib/bcache/bcache_block_ref.h>
 #include <lib/bio.h>
 #include <lib/fs.h>
 #include <lk/debug.h>
@@ -17,6 +18,7 @@
 #include <string.h>
 
 #include "dir.h"
+#include "direct_io.h"
 #include "fat_fs.h"
 #include "fat_priv.h"
 
@@ -24,6 +26,62 @@
 
 #define LOCAL_TRACE FAT_GLOBAL_TRACE(0)
 
+namespace {
+
+// stretches of whole sectors at least this long skip the block cache
+constexpr size_t kDirectMinBytes = 4096;
+
+// move len bytes between buf and the disk starting offset bytes into sector,
+// all of it within one run of clusters
+status_t transfer_run(fat_fs *fat, fat_direct_io &dio, uint8_t *buf, uint32_t sector,
+                      uint32_t offset_within_sector, size_t len, bool write) {
+    const uint32_t bytes_per_sector = fat->info().bytes_per_sector;
+
+    while (len > 0) {
+        if (offset_within_sector == 0 && len >= kDirectMinBytes && len >= bytes_per_sector &&
+            dio.supported()) {
+            const uint32_t count = len / bytes_per_sector;
+            status_t err = dio.add(sector, count, buf);
+            if (err == NO_ERROR) {
+                sector += count;
+                buf += (size_t)count * bytes_per_sector;
+                len -= (size_t)count * bytes_per_sector;
+                continue;
+            }
+            // the cache is using some of it, go through the cache instead
+            if (err != ERR_BUSY) {
+                return err;
+            }
+        }
+
+        // partial sectors and short stretches go a sector at a time through the cache
+        const size_t to_copy = MIN(bytes_per_sector - offset_within_sector, len);
+
+        bcache_block_ref bref(fat->bcache());
+        status_t err = bref.get_block(sector);
+        if (err < 0) {
+            return err;
+        }
+
+        auto *ptr = (uint8_t *)bref.ptr() + offset_within_sector;
+        if (write) {
+            memcpy(ptr, buf, to_copy);
+            bref.mark_dirty();
+        } else {
+            memcpy(buf, ptr, to_copy);
+        }
+
+        sector++;
+        offset_within_sector = 0;
+        buf += to_copy;
+        len -= to_copy;
+    }
+
+    return NO_ERROR;
+}
+
+} // anonymous namespace
+
 fat_file::fat_file(fat_fs *f)
     : fs_(f) {}
 fat_file::~fat_file() = default;
@@ -39,14 +97,16 @@ status_t fat_file::zero_range_locked(uint32_t offset, uint32_t len) {
         return ERR_IO;
     }
 
-    uint32_t logical_cluster = offset / fs_->info().bytes_per_cluster;
+    uint32_t cluster = extents_.cluster_at(fs_, start_cluster_, offset / fs_->info().bytes_per_cluster);
+    if (cluster == 0) {
+        return ERR_IO;
+    }
     uint32_t sector_within_cluster =
         (offset % fs_->info().bytes_per_cluster) / fs_->info().bytes_per_sector;
     uint32_t offset_within_sector = offset % fs_->info().bytes_per_sector;
 
-    file_block_iterator fbi(fs_, start_cluster_);
-    status_t err = fbi.next_sectors(logical_cluster * fs_->info().sectors_per_cluster +
-                                    sector_within_cluster);
+    file_block_iterator fbi(fs_, cluster);
+    status_t err = fbi.next_sectors(sector_within_cluster);
     if (err < 0) {
         return err;
     }
@@ -81,6 +141,51 @@ status_t fat_file::zero_range_locked(uint32_t offset, uint32_t len) {
     return NO_ERROR;
 }
 
+// Move len bytes between buf and the file at offset, all of it within the file's
+// clusters. Each run of contiguous clusters is moved in one go, whole sectors of
+// it straight between the device and buf when there are enough of them.
+ssize_t fat_file::transfer_locked(uint8_t *buf, uint32_t offset, size_t len, bool write) {
+    DEBUG_ASSERT(fs_->lock.is_held());
+
+    const uint32_t bytes_per_sector = fs_->info().bytes_per_sector;
+    const uint32_t bytes_per_cluster = fs_->info().bytes_per_cluster;
+
+    fat_direct_io dio(fs_, write);
+
+    status_t err = NO_ERROR;
+    size_t done = 0;
+    while (done < len) {
+        const uint32_t pos = offset + done;
+
+        fat_extent extent;
+        err = extents_.lookup(fs_, start_cluster_, pos / bytes_per_cluster, &extent);
+        if (err < 0) {
+            break;
+        }
+
+        // the part of the transfer in this run, and where it starts on disk
+        const uint32_t run_offset = pos - extent.logical * bytes_per_cluster;
+        const size_t run_len = MIN((size_t)extent.count * bytes_per_cluster - run_offset, len - done);
+        const uint32_t sector = fat_sector_for_cluster(fs_, extent.cluster) + run_offset / bytes_per_sector;
+
+        LTRACEF("pos %u: run cluster %u count %u, sector %u len %zu\n",
+                pos, extent.cluster, extent.count, sector, run_len);
+
+        err = transfer_run(fs_, dio, buf + done, sector, pos % bytes_per_sector, run_len, write);
+        if (err < 0) {
+            break;
+        }
+        done += run_len;
+    }
+
+    status_t dio_err = dio.finish();
+    if (err == NO_ERROR) {
+        err = dio_err;
+    }
+
+    return (err < 0) ? err : (ssize_t)done;
+}
+
 void fat_file::inc_ref() {
     ref_++;
     LTRACEF_LEVEL(2, "file %p (%u:%u): ref now %i\n", this, dir_loc_.starting_dir_cluster, dir_loc_.dir_offset, ref_);
@@ -198,67 +303,7 @@ ssize_t fat_file::read_file_priv(void *_buf, const off_t offset, size_t len) {
 
     LTRACEF("trimmed offset %lld len %zu\n", offset, len);
 
-    // create a file block iterator and push it forward to the starting point
-    uint32_t logical_cluster = offset / fs_->info().bytes_per_cluster;
-    uint32_t sector_within_cluster = (offset % fs_->info().bytes_per_cluster) / fs_->info().bytes_per_sector;
-    uint32_t offset_within_sector = offset % fs_->info().bytes_per_sector;
-
-    LTRACEF("starting off logical cluster %u, sector within %u, offset within %u\n",
-            logical_cluster, sector_within_cluster, offset_within_sector);
-
-    file_block_iterator fbi(fs_, start_cluster_);
-
-    // move it forward to our index point
-    // also loads the buffer
-    status_t err = fbi.next_sectors(logical_cluster * fs_->info().sectors_per_cluster + sector_within_cluster);
-    if (err < 0) {
-        LTRACEF("error moving up to starting point!\n");
-        return err;
-    }
-
-    ssize_t amount_read = 0;
-    size_t buf_offset = 0; // offset into the output buffer
-    while (buf_offset < len) {
-        size_t to_read = MIN(fs_->info().bytes_per_sector - offset_within_sector, len - buf_offset);
-
-        LTRACEF("top of loop: sector offset %u, buf offset %zu, remaining len %zu, to_read %zu\n",
-                offset_within_sector, buf_offset, len, to_read);
-
-        // grab a pointer directly to the block cache
-        const uint8_t *ptr;
-        ptr = fbi.get_bcache_ptr(offset_within_sector);
-        if (!ptr) {
-            LTRACEF("error getting pointer to file in cache\n");
-            return ERR_IO;
-        }
-
-        // make sure we dont do something silly
-        DEBUG_ASSERT(buf_offset + to_read <= len);
-        DEBUG_ASSERT(offset_within_sector + to_read <= fs_->info().bytes_per_sector);
-
-        // copy out to the buffer
-        memcpy(buf + buf_offset, ptr, to_read);
-
-        // next iteration of the loop
-        amount_read += to_read;
-        buf_offset += to_read;
-
-        // go to the next sector
-        offset_within_sector += to_read;
-        DEBUG_ASSERT(offset_within_sector <= fs_->info().bytes_per_sector);
-        if (offset_within_sector == fs_->info().bytes_per_sector) {
-            offset_within_sector = 0;
-            // push the iterator forward to next sector
-            if (buf_offset < len) {
-                err = fbi.next_sector();
-                if (err < 0) {
-                    return err;
-                }
-            }
-        }
-    }
-
-    return amount_read;
+    return transfer_locked(buf, offset, len, false);
 }
 
 // static
@@ -351,7 +396,7 @@ status_t fat_file::create_file(fscookie *cookie, const char *path, filecookie **
     return NO_ERROR;
 }
 
-status_t fat_file::truncate_file_priv(uint64_t _len) {
+status_t fat_file::truncate_file_priv(uint64_t _len, bool zero_new_clusters) {
     LTRACEF("file %p, len %" PRIu64 " \n", this, _len);
 
     if (_len == length_) {
@@ -385,7 +430,14 @@ status_t fat_file::truncate_file_priv(uint64_t _len) {
         LTRACEF("existing len %u, clusters %u: newlen %u, clusters %u\n", length_, current_cluster_count, len32, new_cluster_count);
         if (new_cluster_count == current_cluster_count) {
             // new length doesn't change the cluster count
-            // update the dir entry and move on
+            // zero anything newly exposed, update the dir entry and move on
+            if (len32 > length_) {
+                status_t err = zero_range_locked(length_, len32 - length_);
+                if (err != NO_ERROR) {
+                    return err;
+                }
+            }
+
             status_t err = fat_dir_update_entry(fs_, dir_loc_, start_cluster_, len32);
             if (err != NO_ERROR) {
                 return err;
@@ -401,13 +453,21 @@ status_t fat_file::truncate_file_priv(uint64_t _len) {
 
             // TODO: compartmentalize this cluster extension/shrinking so DIR code can reuse it
 
-            // walk to the end of the existing cluster chain
-            const uint32_t existing_chain_end = fat_find_last_cluster_in_chain(fs_, start_cluster_);
+            // find the end of the existing cluster chain, from the last cluster we
+            // know to be in it
+            uint32_t chain_cluster = start_cluster_;
+            if (chain_cluster != 0 && current_cluster_count > 1) {
+                chain_cluster = extents_.cluster_at(fs_, start_cluster_, current_cluster_count - 1);
+                if (chain_cluster == 0) {
+                    return ERR_IO;
+                }
+            }
+            const uint32_t existing_chain_end = fat_find_last_cluster_in_chain(fs_, chain_cluster);
 
             uint32_t first_cluster;
             uint32_t last_cluster;
             status_t err = fat_allocate_cluster_chain(fs_, existing_chain_end, new_cluster_count - current_cluster_count,
-                                                      &first_cluster, &last_cluster, true);
+                                                      &first_cluster, &last_cluster, zero_new_clusters);
 
             LTRACEF("fat_allocate_cluster_chain returns %d, first_cluster %u, last_cluster %u\n", err, first_cluster, last_cluster);
             if (err != NO_ERROR) {
@@ -450,6 +510,7 @@ status_t fat_file::truncate_file_priv(uint64_t _len) {
                 if (err != NO_ERROR) {
                     return err;
                 }
+                extents_.clear();
                 new_start_cluster = 0;
             } else {
                 if (start_cluster_ < 2 || start_cluster_ >= fs_->info().total_clusters) {
@@ -457,13 +518,9 @@ status_t fat_file::truncate_file_priv(uint64_t _len) {
                 }
 
                 // Find the last cluster that remains part of the truncated file.
-                uint32_t keep_last = start_cluster_;
-                for (uint32_t i = 1; i < new_cluster_count; i++) {
-                    uint32_t next = fat_next_cluster_in_chain(fs_, keep_last);
-                    if (is_eof_cluster(next) || next < 2 || next >= fs_->info().total_clusters) {
-                        return ERR_IO;
-                    }
-                    keep_last = next;
+                uint32_t keep_last = extents_.cluster_at(fs_, start_cluster_, new_cluster_count - 1);
+                if (keep_last == 0) {
+                    return ERR_IO;
                 }
 
                 uint32_t first_free = fat_next_cluster_in_chain(fs_, keep_last);
@@ -473,6 +530,7 @@ status_t fat_file::truncate_file_priv(uint64_t _len) {
                         return err;
                     }
                 }
+                extents_.truncate(new_cluster_count);
             }
 
             status_t err = fat_dir_update_entry(fs_, dir_loc_, new_start_cluster, len32);
@@ -516,54 +574,41 @@ ssize_t fat_file::write_file_priv(const void *_buf, const off_t offset, size_t l
         return ERR_TOO_BIG;
     }
 
+    // grow the file first. Its new clusters are left as they are, the write
+    // covers them apart from any gap between the old end and the write.
+    const uint32_t old_length = length_;
     if (end > length_) {
-        status_t err = truncate_file_priv(end);
+        status_t err = truncate_file_priv(end, false);
         if (err != NO_ERROR) {
             return err;
         }
     }
 
-    AutoLock guard(fs_->lock);
-
-    uint32_t logical_cluster = offset / fs_->info().bytes_per_cluster;
-    uint32_t sector_within_cluster =
-        (offset % fs_->info().bytes_per_cluster) / fs_->info().bytes_per_sector;
-    uint32_t offset_within_sector = offset % fs_->info().bytes_per_sector;
-
-    file_block_iterator fbi(fs_, start_cluster_);
-    status_t err = fbi.next_sectors(logical_cluster * fs_->info().sectors_per_cluster +
-                                    sector_within_cluster);
-    if (err < 0) {
-        return err;
-    }
-
-    size_t written = 0;
-    while (written < len) {
-        size_t to_write = MIN(fs_->info().bytes_per_sector - offset_within_sector, len - written);
+    ssize_t written;
+    {
+        AutoLock guard(fs_->lock);
 
-        uint8_t *ptr = fbi.get_bcache_ptr(offset_within_sector);
-        if (!ptr) {
-            return ERR_IO;
+        const uint32_t bytes_per_cluster = fs_->info().bytes_per_cluster;
+        const uint32_t new_clusters_start = ROUNDUP(old_length, bytes_per_cluster);
+        written = NO_ERROR;
+        if (offset > new_clusters_start) {
+            written = zero_range_locked(new_clusters_start, offset - new_clusters_start);
         }
-
-        memcpy(ptr, buf + written, to_write);
-        err = fbi.mark_bcache_dirty();
-        if (err < 0) {
-            return err;
+        if (written == NO_ERROR) {
+            written = transfer_locked((uint8_t *)buf, offset, len, true);
         }
 
-        written += to_write;
-        offset_within_sector += to_write;
-        if (offset_within_sector == fs_->info().bytes_per_sector && written < len) {
-            offset_within_sector = 0;
-            err = fbi.next_sector();
-            if (err < 0) {
-                return err;
-            }
-        }
+        bcache_flush(fs_->bcache());
     }
 
-    bcache_flush(fs_->bcache());
+    // if the write didn't make it the new clusters still hold whatever was on the
+    // disk before, so shrink the file back to where it was rather than expose it
+    if (written < 0 && end > old_length) {
+        status_t err = truncate_file_priv(old_length);
+        if (err != NO_ERROR) {
+            TRACEF("failed to shrink file %p back to %u after failed write: %d\n", this, old_length, err);
+        }
+    }
 
     return written;
 }
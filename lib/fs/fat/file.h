@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include "extent_cache.h"
 #include "fat_fs.h"
 #include "fat_priv.h"
 #include <inttypes.h>
@@ -41,8 +42,9 @@ class fat_file {
     ssize_t write_file_priv(const void *buf, const off_t offset, size_t len);
     status_t stat_file_priv(struct file_stat *stat);
     status_t close_file_priv(bool *last_ref);
-    status_t truncate_file_priv(uint64_t len);
+    status_t truncate_file_priv(uint64_t len, bool zero_new_clusters = true);
     status_t zero_range_locked(uint32_t offset, uint32_t len);
+    ssize_t transfer_locked(uint8_t *buf, uint32_t offset, size_t len, bool write);
 
   protected:
     // increment the ref and add/remove the file from the fs list
@@ -63,4 +65,7 @@ class fat_file {
 
     // saved attributes from our dir entry
     fat_attribute attributes_ = fat_attribute(0);
+
+    // where our clusters are on disk
+    fat_extent_cache extents_;
 };
@@ -8,6 +8,8 @@ MODULE_DEPS += lib/fs
 MODULE_DEPS += lib/libcpp
 
 MODULE_SRCS += $(LOCAL_DIR)/dir.cpp
+MODULE_SRCS += $(LOCAL_DIR)/direct_io.cpp
+MODULE_SRCS += $(LOCAL_DIR)/extent_cache.cpp
 MODULE_SRCS += $(LOCAL_DIR)/fat.cpp
 MODULE_SRCS += $(LOCAL_DIR)/file.cpp
 MODULE_SRCS += $(LOCAL_DIR)/file_iterator.cpp
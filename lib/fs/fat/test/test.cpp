@@ -92,6 +92,118 @@ bool test_mount_wrapper(R routine) {
 
     END_TEST;
 }
+// the byte at offset of a file filled in by fill_pattern
+uint8_t test_pattern(uint32_t offset, uint8_t seed) {
+    return (uint8_t)(offset * 7 + (offset >> 9) + seed);
+}
+
+void fill_pattern(uint8_t *buf, uint32_t offset, size_t len, uint8_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = test_pattern(offset + i, seed);
+    }
+}
+
+// read len bytes of a file at offset and check them against the pattern
+bool check_pattern(filehandle *handle, uint32_t offset, size_t len, uint8_t seed) {
+    BEGIN_TEST;
+
+    uint8_t *buf = new uint8_t[len];
+    auto delete_buffer = lk::make_auto_call([&]() { delete[] buf; });
+
+    ASSERT_EQ((ssize_t)len, fs_read_file(handle, buf, offset, len));
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != test_pattern(offset + i, seed)) {
+            unittest_printf("mismatch at offset %zu: %#x, wanted %#x\n", offset + i, buf[i],
+                            test_pattern(offset + i, seed));
+            ASSERT_TRUE(false);
+        }
+    }
+
+    END_TEST;
+}
+
+// where the FSInfo sector of a FAT32 test image is, read straight off the device
+struct fat32_layout {
+    off_t fsinfo_offset;
+    uint32_t bytes_per_cluster;
+    uint32_t total_clusters;
+};
+
+uint32_t read_le32(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+void write_le32(uint8_t *buf, uint32_t val) {
+    buf[0] = val & 0xff;
+    buf[1] = (val >> 8) & 0xff;
+    buf[2] = (val >> 16) & 0xff;
+    buf[3] = (val >> 24) & 0xff;
+}
+
+// returns false if the image isn't FAT32 or has no valid FSInfo sector
+bool read_fat32_layout(bdev_t *dev, fat32_layout *layout) {
+    uint8_t bs[512];
+    if (bio_read(dev, bs, 0, sizeof(bs)) != (ssize_t)sizeof(bs)) {
+        return false;
+    }
+
+    const uint32_t bytes_per_sector = bs[0x0b] | (bs[0x0c] << 8);
+    const uint32_t sectors_per_cluster = bs[0x0d];
+    const uint32_t reserved_sectors = bs[0x0e] | (bs[0x0f] << 8);
+    const uint32_t fat_count = bs[0x10];
+    const uint32_t sectors_per_fat16 = bs[0x16] | (bs[0x17] << 8);
+    if (sectors_per_fat16 != 0 || bytes_per_sector != sizeof(bs) || sectors_per_cluster == 0) {
+        return false;
+    }
+
+    const uint32_t total_sectors = read_le32(&bs[0x20]);
+    const uint32_t sectors_per_fat = read_le32(&bs[0x24]);
+    const uint32_t data_start = reserved_sectors + fat_count * sectors_per_fat;
+    const uint32_t fsinfo_sector = bs[0x30] | (bs[0x31] << 8);
+    if (fsinfo_sector == 0 || fsinfo_sector >= reserved_sectors) {
+        return false;
+    }
+
+    uint8_t fsi[512];
+    if (bio_read(dev, fsi, (off_t)fsinfo_sector * bytes_per_sector, sizeof(fsi)) != (ssize_t)sizeof(fsi) ||
+        read_le32(&fsi[0]) != 0x41615252 || read_le32(&fsi[0x1e4]) != 0x61417272) {
+        return false;
+    }
+
+    layout->fsinfo_offset = (off_t)fsinfo_sector * bytes_per_sector;
+    layout->bytes_per_cluster = bytes_per_sector * sectors_per_cluster;
+    layout->total_clusters = (total_sectors - data_start) / sectors_per_cluster + 2;
+    return true;
+}
+
+// the free cluster count and next free hint in the FSInfo sector
+bool read_fsinfo(bdev_t *dev, const fat32_layout &layout, uint32_t *free_clusters, uint32_t *next_free) {
+    uint8_t fsi[512];
+    if (bio_read(dev, fsi, layout.fsinfo_offset, sizeof(fsi)) != (ssize_t)sizeof(fsi)) {
+        return false;
+    }
+    *free_clusters = read_le32(&fsi[0x1e8]);
+    *next_free = read_le32(&fsi[0x1ec]);
+    return true;
+}
+
+bool write_fsinfo_next_free(bdev_t *dev, const fat32_layout &layout, uint32_t next_free) {
+    uint8_t fsi[512];
+    if (bio_read(dev, fsi, layout.fsinfo_offset, sizeof(fsi)) != (ssize_t)sizeof(fsi)) {
+        return false;
+    }
+    write_le32(&fsi[0x1ec], next_free);
+    return bio_write(dev, fsi, layout.fsinfo_offset, sizeof(fsi)) == (ssize_t)sizeof(fsi);
+}
+
+#define SKIP_TEST_IF_NOT_FAT32(dev, layout)                                        \
+    do {                                                                           \
+        if (!read_fat32_layout(dev, layout)) {                                     \
+            unittest_printf(" not a FAT32 image with FSInfo, skipping test ");     \
+            return true;                                                           \
+        }                                                                          \
+    } while (0)
+
 bool test_fat_mount() {
     BEGIN_TEST;
 
@@ -768,6 +880,281 @@ bool test_fat_lfn_ordinal_rollover() {
     });
 }
 
+bool test_fat_extent_cache() {
+    return test_mount_wrapper([]() {
+        BEGIN_TEST;
+
+        // appending to two files in turn splits each into a run per append, so
+        // the extent cache has several runs to keep track of
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_create_file(test_path "/extfile", &handle, 0));
+        ASSERT_NONNULL(handle);
+        auto closefile_cleanup = lk::make_auto_call([&]() { fs_close_file(handle); });
+
+        filehandle *other = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_create_file(test_path "/extother", &other, 0));
+        ASSERT_NONNULL(other);
+        auto closeother_cleanup = lk::make_auto_call([&]() { fs_close_file(other); });
+
+        const size_t chunk = 4096;
+        const size_t chunks = 16;
+        uint8_t *buf = new uint8_t[chunk];
+        auto delete_buffer = lk::make_auto_call([&]() { delete[] buf; });
+
+        for (size_t i = 0; i < chunks; i++) {
+            fill_pattern(buf, i * chunk, chunk, 1);
+            ASSERT_EQ((ssize_t)chunk, fs_write_file(handle, buf, i * chunk, chunk));
+            fill_pattern(buf, i * chunk, chunk, 2);
+            ASSERT_EQ((ssize_t)chunk, fs_write_file(other, buf, i * chunk, chunk));
+        }
+
+        // whole, then a piece of each chunk from the back, so lookups land on runs
+        // the cache already holds
+        EXPECT_TRUE(check_pattern(handle, 0, chunks * chunk, 1));
+        for (size_t i = chunks; i > 0; i--) {
+            EXPECT_TRUE(check_pattern(handle, (i - 1) * chunk + 100, 300, 1));
+        }
+        // a read that spans runs
+        EXPECT_TRUE(check_pattern(handle, 3 * chunk - 10, 2 * chunk + 20, 1));
+
+        // cut it back into the middle of its runs and grow it again, the new
+        // clusters go somewhere else and the cache mustn't still point at the old ones
+        ASSERT_EQ(NO_ERROR, fs_truncate_file(handle, 5 * chunk + 123));
+        for (size_t i = 5; i < chunks; i++) {
+            fill_pattern(buf, i * chunk, chunk, 3);
+            ASSERT_EQ((ssize_t)chunk, fs_write_file(other, buf, (chunks + i) * chunk, chunk));
+            ASSERT_EQ((ssize_t)chunk, fs_write_file(handle, buf, i * chunk, chunk));
+        }
+        EXPECT_TRUE(check_pattern(handle, 0, 5 * chunk, 1));
+        EXPECT_TRUE(check_pattern(handle, 5 * chunk, (chunks - 5) * chunk, 3));
+
+        // and down to nothing
+        ASSERT_EQ(NO_ERROR, fs_truncate_file(handle, 0));
+        fill_pattern(buf, 0, chunk, 4);
+        ASSERT_EQ((ssize_t)chunk, fs_write_file(handle, buf, 0, chunk));
+        EXPECT_TRUE(check_pattern(handle, 0, chunk, 4));
+
+        struct file_stat st = {};
+        ASSERT_EQ(NO_ERROR, fs_stat_file(handle, &st));
+        EXPECT_EQ(chunk, st.size);
+
+        // the other file wasn't touched by any of it
+        EXPECT_TRUE(check_pattern(other, 0, chunks * chunk, 2));
+
+        closeother_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_close_file(other));
+        closefile_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+
+        ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/extfile"));
+        ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/extother"));
+
+        END_TEST;
+    });
+}
+
+bool test_fat_direct_io() {
+    return test_mount_wrapper([]() {
+        BEGIN_TEST;
+
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_create_file(test_path "/diofile", &handle, 0));
+        ASSERT_NONNULL(handle);
+        auto closefile_cleanup = lk::make_auto_call([&]() { fs_close_file(handle); });
+
+        // big enough to go out as several requests
+        const size_t len = 300 * 1024;
+        uint8_t *buf = new uint8_t[len];
+        auto delete_buffer = lk::make_auto_call([&]() { delete[] buf; });
+
+        fill_pattern(buf, 0, len, 5);
+        ASSERT_EQ((ssize_t)len, fs_write_file(handle, buf, 0, len));
+        EXPECT_TRUE(check_pattern(handle, 0, len, 5));
+
+        // pull a few sectors into the block cache, then write over them and
+        // around them, with partial sectors at both ends
+        EXPECT_TRUE(check_pattern(handle, 8192, 100, 5));
+        EXPECT_TRUE(check_pattern(handle, 40000, 100, 5));
+
+        const uint32_t offset = 1000;
+        const size_t over_len = 100 * 1024 + 17;
+        fill_pattern(buf, offset, over_len, 6);
+        ASSERT_EQ((ssize_t)over_len, fs_write_file(handle, buf, offset, over_len));
+
+        EXPECT_TRUE(check_pattern(handle, 0, offset, 5));
+        EXPECT_TRUE(check_pattern(handle, offset, over_len, 6));
+        EXPECT_TRUE(check_pattern(handle, offset + over_len, len - offset - over_len, 5));
+
+        // small reads of what went around the cache see it too
+        EXPECT_TRUE(check_pattern(handle, 8192, 100, 6));
+        EXPECT_TRUE(check_pattern(handle, 40000, 100, 6));
+
+        // an unaligned read that covers whole sectors in the middle
+        EXPECT_TRUE(check_pattern(handle, offset + 3, over_len - 6, 6));
+
+        closefile_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+
+        // and it all made it to the disk
+        ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+        ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", get_test_device(), FS_MOUNT_OPTION_NONE));
+
+        handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_open_file(test_path "/diofile", &handle));
+        ASSERT_NONNULL(handle);
+        EXPECT_TRUE(check_pattern(handle, 0, offset, 5));
+        EXPECT_TRUE(check_pattern(handle, offset, over_len, 6));
+        EXPECT_TRUE(check_pattern(handle, offset + over_len, len - offset - over_len, 5));
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+
+        ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/diofile"));
+
+        END_TEST;
+    });
+}
+
+bool test_fat_alloc_wraparound() {
+    BEGIN_TEST;
+
+    SKIP_TEST_IF_NO_DEVICE();
+
+    const char *device_name = get_test_device();
+    ASSERT_NONNULL(device_name);
+
+    bdev_t *dev = bio_open(device_name);
+    ASSERT_NONNULL(dev);
+    auto close_cleanup = lk::make_auto_call([&]() { bio_close(dev); });
+
+    fat32_layout layout;
+    SKIP_TEST_IF_NOT_FAT32(dev, &layout);
+
+    // point the next free hint at the last cluster, so a file of a few clusters
+    // has to carry on from the start of the FAT
+    ASSERT_TRUE(write_fsinfo_next_free(dev, layout, layout.total_clusters - 1));
+
+    const size_t len = 4 * layout.bytes_per_cluster;
+    uint8_t *buf = new uint8_t[len];
+    auto delete_buffer = lk::make_auto_call([&]() { delete[] buf; });
+
+    {
+        ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", device_name, FS_MOUNT_OPTION_NONE));
+        auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_create_file(test_path "/wrapfile", &handle, 0));
+        ASSERT_NONNULL(handle);
+        auto closefile_cleanup = lk::make_auto_call([&]() { fs_close_file(handle); });
+
+        fill_pattern(buf, 0, len, 7);
+        ASSERT_EQ((ssize_t)len, fs_write_file(handle, buf, 0, len));
+        EXPECT_TRUE(check_pattern(handle, 0, len, 7));
+
+        closefile_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+        unmount_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+    }
+
+    // the hint followed the allocation around to the front
+    uint32_t free_clusters, next_free;
+    ASSERT_TRUE(read_fsinfo(dev, layout, &free_clusters, &next_free));
+    EXPECT_LE(2u, next_free);
+    EXPECT_GT(layout.total_clusters - 1, next_free);
+
+    {
+        ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", device_name, FS_MOUNT_OPTION_NONE));
+        auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_open_file(test_path "/wrapfile", &handle));
+        ASSERT_NONNULL(handle);
+        EXPECT_TRUE(check_pattern(handle, 0, len, 7));
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+        ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/wrapfile"));
+
+        unmount_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+    }
+
+    END_TEST;
+}
+
+bool test_fat_fsinfo() {
+    BEGIN_TEST;
+
+    SKIP_TEST_IF_NO_DEVICE();
+
+    const char *device_name = get_test_device();
+    ASSERT_NONNULL(device_name);
+
+    bdev_t *dev = bio_open(device_name);
+    ASSERT_NONNULL(dev);
+    auto close_cleanup = lk::make_auto_call([&]() { bio_close(dev); });
+
+    fat32_layout layout;
+    SKIP_TEST_IF_NOT_FAT32(dev, &layout);
+
+    // create the file up front, in case the directory has to grow for it
+    {
+        ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", device_name, FS_MOUNT_OPTION_NONE));
+        auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_create_file(test_path "/fsifile", &handle, 0));
+        ASSERT_NONNULL(handle);
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+
+        unmount_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+    }
+
+    uint32_t free_before, next_before;
+    ASSERT_TRUE(read_fsinfo(dev, layout, &free_before, &next_before));
+    if (free_before == UINT32_MAX) {
+        unittest_printf(" free cluster count not known, skipping test ");
+        END_TEST;
+    }
+
+    // the count goes down by what the file takes, and the hint moves past it
+    const uint32_t clusters = 10;
+    {
+        ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", device_name, FS_MOUNT_OPTION_NONE));
+        auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+        filehandle *handle = nullptr;
+        ASSERT_EQ(NO_ERROR, fs_open_file(test_path "/fsifile", &handle));
+        ASSERT_NONNULL(handle);
+        ASSERT_EQ(NO_ERROR, fs_truncate_file(handle, clusters * layout.bytes_per_cluster));
+        ASSERT_EQ(NO_ERROR, fs_close_file(handle));
+
+        unmount_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+    }
+
+    uint32_t free_after, next_after;
+    ASSERT_TRUE(read_fsinfo(dev, layout, &free_after, &next_after));
+    EXPECT_EQ(free_before - clusters, free_after);
+    EXPECT_LE(2u, next_after);
+    EXPECT_GT(layout.total_clusters, next_after);
+    EXPECT_NE(next_before, next_after);
+
+    // and comes back when it's removed
+    {
+        ASSERT_EQ(NO_ERROR, fs_mount(test_path, "fat", device_name, FS_MOUNT_OPTION_NONE));
+        auto unmount_cleanup = lk::make_auto_call([]() { fs_unmount(test_path); });
+
+        ASSERT_EQ(NO_ERROR, fs_remove_file(test_path "/fsifile"));
+
+        unmount_cleanup.cancel();
+        ASSERT_EQ(NO_ERROR, fs_unmount(test_path));
+    }
+
+    ASSERT_TRUE(read_fsinfo(dev, layout, &free_after, &next_after));
+    EXPECT_EQ(free_before, free_after);
+
+    END_TEST;
+}
+
 bool test_fat_read_only() {
     BEGIN_TEST;
 
@@ -830,6 +1217,10 @@ RUN_TEST(test_fat_remove_file)
 RUN_TEST(test_fat_remove_dir)
 RUN_TEST(test_fat_dir_growth)
 RUN_TEST(test_fat_lfn_ordinal_rollover)
+RUN_TEST(test_fat_extent_cache)
+RUN_TEST(test_fat_direct_io)
+RUN_TEST(test_fat_alloc_wraparound)
+RUN_TEST(test_fat_fsinfo)
 RUN_TEST(test_fat_read_only)
 END_TEST_CASE(fat)
 
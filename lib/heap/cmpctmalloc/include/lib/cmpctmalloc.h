@@ -8,6 +8,7 @@
 #pragma once
 
 #include <lk/compiler.h>
+#include <stddef.h>
 
 __BEGIN_CDECLS
 
@@ -16,6 +17,14 @@ void *cmpct_realloc(void *, size_t);
 void cmpct_free(void *);
 void *cmpct_memalign(size_t size, size_t alignment);
 
+// Allocate or free a number of blocks while taking the heap lock once.
+// cmpct_alloc_batch returns how many of the count blocks it could allocate.
+size_t cmpct_alloc_batch(size_t size, void **ptrs, size_t count);
+void cmpct_free_batch(void **ptrs, size_t count);
+
+// Number of bytes usable in an allocated block, at least the size asked for.
+size_t cmpct_usable_size(void *payload);
+
 void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
@@ -60,17 +60,34 @@ static inline void HEAP_INIT(void) {
 /* cmpctmalloc implementation */
 #include <lib/cmpctmalloc.h>
 
-#define HEAP_MEMALIGN(boundary, s) cmpct_memalign(s, boundary)
+#if WITH_LIB_HEAP_TCACHE
+/* small blocks go through the per cpu caches in front of the heap */
+#include <lib/tcache.h>
+
+#define HEAP_MALLOC tcache_alloc
+#define HEAP_FREE tcache_free
+static inline void HEAP_DUMP(void) {
+    cmpct_dump();
+    tcache_dump();
+}
+static inline void HEAP_TRIM(void) {
+    tcache_flush();
+    cmpct_trim();
+}
+#else
 #define HEAP_MALLOC cmpct_alloc
-#define HEAP_REALLOC cmpct_realloc
 #define HEAP_FREE cmpct_free
-#define HEAP_INIT cmpct_init
 #define HEAP_DUMP cmpct_dump
 #define HEAP_TRIM cmpct_trim
+#endif
+
+#define HEAP_MEMALIGN(boundary, s) cmpct_memalign(s, boundary)
+#define HEAP_REALLOC cmpct_realloc
+#define HEAP_INIT cmpct_init
 static inline void *HEAP_CALLOC(size_t n, size_t s) {
     size_t realsize = n * s;
 
-    void *ptr = cmpct_alloc(realsize);
+    void *ptr = HEAP_MALLOC(realsize);
     if (likely(ptr))
         memset(ptr, 0, realsize);
     return ptr;
@@ -23,6 +23,14 @@ ifeq ($(LK_HEAP_IMPLEMENTATION),cmpctmalloc)
 MODULE_DEPS := lib/heap/cmpctmalloc
 endif
 
+# optionally put per cpu caches of small blocks in front of the heap
+ifeq ($(call TOBOOL,$(LK_HEAP_TCACHE)),true)
+ifneq ($(LK_HEAP_IMPLEMENTATION),cmpctmalloc)
+$(error LK_HEAP_TCACHE requires LK_HEAP_IMPLEMENTATION=cmpctmalloc)
+endif
+MODULE_DEPS += lib/heap/tcache
+endif
+
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
 include make/module.mk
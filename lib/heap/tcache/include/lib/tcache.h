@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <stddef.h>
+
+__BEGIN_CDECLS
+
+// Per cpu cache of small blocks in front of cmpctmalloc. Small allocations are
+// served from and freed to the current cpu's bins, which are refilled from and
+// flushed back to the underlying heap in batches. Everything else passes
+// straight through.
+void *tcache_alloc(size_t size);
+void tcache_free(void *ptr);
+
+// Return every cached block to the underlying heap.
+void tcache_flush(void);
+
+void tcache_dump(void);
+
+__END_CDECLS
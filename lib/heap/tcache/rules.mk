@@ -0,0 +1,12 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+GLOBAL_INCLUDES += $(LOCAL_DIR)/include
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_DEPS += lib/heap/cmpctmalloc
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/tcache.c
+
+include make/module.mk
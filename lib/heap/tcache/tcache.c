@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/tcache.h>
+
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lib/cmpctmalloc.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Each cpu has a bin per size class, spaced TCACHE_GRANULE bytes apart up to
+ * TCACHE_MAX_SIZE. A bin is a singly linked list threaded through the first
+ * word of the cached blocks, which as far as cmpctmalloc is concerned are
+ * still allocated. An empty bin is refilled with TCACHE_BATCH blocks of the
+ * class size in one trip through the heap lock, and a bin that grows past
+ * TCACHE_BIN_MAX hands TCACHE_BATCH blocks back the same way.
+ *
+ * A freed block is binned by its usable size as reported by the heap, so
+ * blocks that were not handed out by the cache (realloc, memalign, or a
+ * different cpu's bins) can be cached as well, in the largest class they fit.
+ */
+#ifndef TCACHE_GRANULE
+#define TCACHE_GRANULE 16
+#endif
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 256
+#endif
+#ifndef TCACHE_BATCH
+#define TCACHE_BATCH 16
+#endif
+#ifndef TCACHE_BIN_MAX
+#define TCACHE_BIN_MAX (TCACHE_BATCH * 2)
+#endif
+
+#define TCACHE_NUM_BINS (TCACHE_MAX_SIZE / TCACHE_GRANULE)
+
+STATIC_ASSERT(TCACHE_GRANULE >= sizeof(void *));
+STATIC_ASSERT(TCACHE_BIN_MAX >= TCACHE_BATCH);
+
+struct tcache_bin {
+    void *head;
+    uint count;
+};
+
+static struct tcache {
+    spin_lock_t lock;
+    struct tcache_bin bins[TCACHE_NUM_BINS];
+
+    /* stats */
+    ulong hits;
+    ulong refills;
+    ulong flushes;
+} tcaches[SMP_MAX_CPUS] __CPU_ALIGN;
+
+static inline size_t bin_size(uint bin) {
+    return (bin + 1) * TCACHE_GRANULE;
+}
+
+static inline void bin_push(struct tcache_bin *b, void *ptr) {
+    *(void **)ptr = b->head;
+    b->head = ptr;
+    b->count++;
+}
+
+static inline void *bin_pop(struct tcache_bin *b) {
+    void *ptr = b->head;
+    if (ptr) {
+        b->head = *(void **)ptr;
+        b->count--;
+    }
+    return ptr;
+}
+
+void *tcache_alloc(size_t size) {
+    if (size == 0 || size > TCACHE_MAX_SIZE)
+        return cmpct_alloc(size);
+
+    uint bin = (size - 1) / TCACHE_GRANULE;
+
+    struct tcache *tc = &tcaches[arch_curr_cpu_num()];
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&tc->lock);
+    void *ptr = bin_pop(&tc->bins[bin]);
+    if (ptr)
+        tc->hits++;
+    spin_unlock_irqrestore(&tc->lock, state);
+
+    if (likely(ptr))
+        return ptr;
+
+    /* bin is empty, grab a batch of blocks from the heap */
+    void *batch[TCACHE_BATCH];
+    size_t count = cmpct_alloc_batch(bin_size(bin), batch, TCACHE_BATCH);
+    if (count == 0)
+        return NULL;
+
+    LTRACEF("refilled bin %u (%zu bytes) with %zu blocks\n", bin, bin_size(bin), count);
+
+    tc = &tcaches[arch_curr_cpu_num()];
+    state = spin_lock_irqsave(&tc->lock);
+    for (size_t i = 1; i < count; i++) {
+        bin_push(&tc->bins[bin], batch[i]);
+    }
+    tc->refills++;
+    spin_unlock_irqrestore(&tc->lock, state);
+
+    return batch[0];
+}
+
+void tcache_free(void *ptr) {
+    if (!ptr)
+        return;
+
+    /* bin it in the largest class it can serve, or send large blocks straight back */
+    size_t usable = cmpct_usable_size(ptr);
+    if (usable < TCACHE_GRANULE || usable >= TCACHE_MAX_SIZE + TCACHE_GRANULE * 2) {
+        cmpct_free(ptr);
+        return;
+    }
+    uint bin = MIN(usable / TCACHE_GRANULE, TCACHE_NUM_BINS) - 1;
+
+    void *batch[TCACHE_BATCH];
+    size_t count = 0;
+
+    struct tcache *tc = &tcaches[arch_curr_cpu_num()];
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&tc->lock);
+    struct tcache_bin *b = &tc->bins[bin];
+    bin_push(b, ptr);
+    if (unlikely(b->count > TCACHE_BIN_MAX)) {
+        while (count < TCACHE_BATCH) {
+            batch[count++] = bin_pop(b);
+        }
+        tc->flushes++;
+    }
+    spin_unlock_irqrestore(&tc->lock, state);
+
+    if (unlikely(count > 0))
+        cmpct_free_batch(batch, count);
+}
+
+void tcache_flush(void) {
+    void *batch[TCACHE_BATCH];
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct tcache *tc = &tcaches[cpu];
+        for (uint bin = 0; bin < TCACHE_NUM_BINS; bin++) {
+            for (;;) {
+                size_t count = 0;
+
+                arch_interrupt_saved_state_t state = spin_lock_irqsave(&tc->lock);
+                while (count < TCACHE_BATCH && tc->bins[bin].head) {
+                    batch[count++] = bin_pop(&tc->bins[bin]);
+                }
+                spin_unlock_irqrestore(&tc->lock, state);
+
+                if (count == 0)
+                    break;
+                cmpct_free_batch(batch, count);
+            }
+        }
+    }
+}
+
+void tcache_dump(void) {
+    printf("\tper cpu caches (%u bins of %u bytes):\n", TCACHE_NUM_BINS, TCACHE_GRANULE);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct tcache *tc = &tcaches[cpu];
+
+        uint blocks = 0;
+        size_t bytes = 0;
+        for (uint bin = 0; bin < TCACHE_NUM_BINS; bin++) {
+            blocks += tc->bins[bin].count;
+            bytes += tc->bins[bin].count * bin_size(bin);
+        }
+        printf("\t\tcpu %u: %u blocks (%zu bytes), %lu hits, %lu refills, %lu flushes\n",
+               cpu, blocks, bytes, tc->hits, tc->refills, tc->flushes);
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/heap.h>
+
+#include <lib/bench.h>
+#include <lk/console_cmd.h>
+#include <lk/err.h>
+#include <platform.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Multi threaded malloc/free throughput. Each thread keeps a window of live
+ * small allocations and keeps replacing a pseudo random one of them with a new
+ * block of pseudo random size, the pattern of a network or filesystem path
+ * churning through small buffers. Runs with 1, 2, 4... threads up to twice the
+ * number of cpus and reports the aggregate rate.
+ */
+#define HEAP_BENCH_TIME 500 /* ms per run */
+#define HEAP_BENCH_WINDOW 64
+#define HEAP_BENCH_MAX_SIZE 256
+
+static uint64_t heap_bench_thread(void *arg, uint index, const volatile bool *stop) {
+    void *window[HEAP_BENCH_WINDOW] = { 0 };
+    uint seed = index * 7919 + 1;
+    uint64_t ops = 0;
+
+    while (!*stop) {
+        for (uint i = 0; i < 64; i++) {
+            seed = seed * 1664525 + 1013904223;
+            uint slot = (seed >> 8) % HEAP_BENCH_WINDOW;
+            size_t size = (seed >> 16) % HEAP_BENCH_MAX_SIZE + 1;
+
+            free(window[slot]);
+            window[slot] = malloc(size);
+            if (window[slot])
+                *(volatile char *)window[slot] = 0;
+        }
+        ops += 64;
+    }
+
+    for (uint i = 0; i < HEAP_BENCH_WINDOW; i++) {
+        free(window[i]);
+    }
+    return ops;
+}
+
+static int cmd_heap_bench(int argc, const console_cmd_args *argv) {
+    uint cpu_count = bench_cpu_count();
+
+    printf("heap malloc/free throughput on %u cpus, %u ms per run, sizes 1-%u, %u live blocks per thread\n",
+           cpu_count, HEAP_BENCH_TIME, HEAP_BENCH_MAX_SIZE, HEAP_BENCH_WINDOW);
+
+    uint64_t base = 0;
+    for (uint thread_count = 1; thread_count <= MIN(cpu_count * 2, BENCH_MAX_THREADS); thread_count *= 2) {
+        struct bench_run run = {
+            .name = "heap bench",
+            .fn = heap_bench_thread,
+            .thread_count = thread_count,
+            .duration = HEAP_BENCH_TIME,
+        };
+        bench_run_threads(&run);
+
+        uint64_t ops = run.ops;
+        if (thread_count == 1)
+            base = ops ? ops : 1;
+        printf("%2u threads: %llu malloc+free/sec, %llu.%02llux single thread\n",
+               thread_count, ops * 1000 / HEAP_BENCH_TIME, ops / base, (ops * 100 / base) % 100);
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("heap_bench", "multi threaded malloc/free throughput", &cmd_heap_bench)
+STATIC_COMMAND_END(heap_bench);
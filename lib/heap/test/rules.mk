@@ -2,9 +2,12 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
-MODULE_SRCS += $(LOCAL_DIR)/heap_tests.c
+MODULE_SRCS += \
+    $(LOCAL_DIR)/heap_bench.c \
+    $(LOCAL_DIR)/heap_tests.c
 
 MODULE_DEPS += \
+    lib/bench \
     lib/heap \
     lib/unittest
 
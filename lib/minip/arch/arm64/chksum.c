@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "../../minip-internal.h"
+
+#include <arm_neon.h>
+#include <lk/compiler.h>
+#include <stdlib.h>
+
+/*
+ * NEON checksum. Pairs of 16 bit words are added into 32 bit lanes, which can
+ * take 0x8000 loads before they could overflow, and those are widened into
+ * 64 bit lanes after every chunk. The fpu is turned on for a thread the first
+ * time it traps, so this is fine anywhere but interrupt context.
+ */
+#define CHUNK (64 * 1024)
+
+static __ALWAYS_INLINE inline uint64_t neon_sum(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                                                size_t len, bool copy) {
+    uint64x2_t acc64 = vdupq_n_u64(0);
+
+    while (len >= 64) {
+        size_t chunk = MIN(len, (size_t)CHUNK) & ~(size_t)63;
+        uint32x4_t a = vdupq_n_u32(0);
+        uint32x4_t b = vdupq_n_u32(0);
+
+        for (size_t i = 0; i < chunk; i += 64) {
+            uint16x8_t v0 = vreinterpretq_u16_u8(vld1q_u8(src + i));
+            uint16x8_t v1 = vreinterpretq_u16_u8(vld1q_u8(src + i + 16));
+            uint16x8_t v2 = vreinterpretq_u16_u8(vld1q_u8(src + i + 32));
+            uint16x8_t v3 = vreinterpretq_u16_u8(vld1q_u8(src + i + 48));
+            if (copy) {
+                vst1q_u8(dst + i, vreinterpretq_u8_u16(v0));
+                vst1q_u8(dst + i + 16, vreinterpretq_u8_u16(v1));
+                vst1q_u8(dst + i + 32, vreinterpretq_u8_u16(v2));
+                vst1q_u8(dst + i + 48, vreinterpretq_u8_u16(v3));
+            }
+            a = vpadalq_u16(a, v0);
+            b = vpadalq_u16(b, v1);
+            a = vpadalq_u16(a, v2);
+            b = vpadalq_u16(b, v3);
+        }
+
+        acc64 = vpadalq_u32(acc64, a);
+        acc64 = vpadalq_u32(acc64, b);
+        src += chunk;
+        if (copy)
+            dst += chunk;
+        len -= chunk;
+    }
+
+    sum += vgetq_lane_u64(acc64, 0);
+    sum += vgetq_lane_u64(acc64, 1);
+
+    if (copy)
+        return ones_sum_generic_copy(sum, dst, src, len);
+    return ones_sum_generic(sum, src, len);
+}
+
+static uint64_t neon_ones_sum(uint64_t sum, const void *buf, size_t len) {
+    return neon_sum(sum, NULL, buf, len, false);
+}
+
+static uint64_t neon_ones_sum_copy(uint64_t sum, void *dst, const void *src, size_t len) {
+    return neon_sum(sum, dst, src, len, true);
+}
+
+static const struct ones_sum_impl ones_sum_neon = {
+    .name = "neon",
+    .sum = neon_ones_sum,
+    .copy_sum = neon_ones_sum_copy,
+};
+
+size_t ones_sum_arch_impls(const struct ones_sum_impl **impls, size_t max) {
+    size_t count = 0;
+
+    /* advanced simd is always there on the cores arm64 supports */
+    if (count < max)
+        impls[count++] = &ones_sum_neon;
+
+    return count;
+}
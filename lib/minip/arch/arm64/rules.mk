@@ -0,0 +1,7 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+# the neon checksum
+MODULE_FLOAT_SRCS += \
+	$(LOCAL_DIR)/chksum.c
+
+MODULE_DEFINES += MINIP_ARCH_CHKSUM=1
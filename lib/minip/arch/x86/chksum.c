@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "../../minip-internal.h"
+
+#include <arch/x86/feature.h>
+#include <emmintrin.h>
+#include <lk/compiler.h>
+#include <stdlib.h>
+
+/*
+ * SSE2 checksum. Each 32 bit lane sums the two 16 bit words it holds
+ * separately, so it can take 0x8000 loads before it could overflow. The
+ * lanes are widened into 64 bit accumulators after every chunk.
+ *
+ * AVX2 would double the width, but the kernel only saves fpu state with
+ * fxsave and leaves xsave off, so the ymm registers aren't usable.
+ */
+#define CHUNK (64 * 1024)
+
+static inline __m128i sum_halves(__m128i acc, __m128i v, __m128i mask) {
+    acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+    return _mm_add_epi32(acc, _mm_srli_epi32(v, 16));
+}
+
+static inline __m128i widen(__m128i acc64, __m128i acc32) {
+    const __m128i zero = _mm_setzero_si128();
+    acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(acc32, zero));
+    return _mm_add_epi64(acc64, _mm_unpackhi_epi32(acc32, zero));
+}
+
+static __ALWAYS_INLINE inline uint64_t sse2_sum(uint64_t sum, uint8_t *dst, const uint8_t *src,
+                                                size_t len, bool copy) {
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    __m128i acc64 = _mm_setzero_si128();
+
+    while (len >= 64) {
+        size_t chunk = MIN(len, (size_t)CHUNK) & ~(size_t)63;
+        __m128i a = _mm_setzero_si128();
+        __m128i b = _mm_setzero_si128();
+
+        for (size_t i = 0; i < chunk; i += 64) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+            if (copy) {
+                _mm_storeu_si128((__m128i *)(dst + i), v0);
+                _mm_storeu_si128((__m128i *)(dst + i + 16), v1);
+                _mm_storeu_si128((__m128i *)(dst + i + 32), v2);
+                _mm_storeu_si128((__m128i *)(dst + i + 48), v3);
+            }
+            a = sum_halves(a, v0, mask);
+            b = sum_halves(b, v1, mask);
+            a = sum_halves(a, v2, mask);
+            b = sum_halves(b, v3, mask);
+        }
+
+        acc64 = widen(acc64, a);
+        acc64 = widen(acc64, b);
+        src += chunk;
+        if (copy)
+            dst += chunk;
+        len -= chunk;
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc64);
+    sum += lanes[0];
+    sum += lanes[1];
+
+    if (copy)
+        return ones_sum_generic_copy(sum, dst, src, len);
+    return ones_sum_generic(sum, src, len);
+}
+
+static uint64_t sse2_ones_sum(uint64_t sum, const void *buf, size_t len) {
+    return sse2_sum(sum, NULL, buf, len, false);
+}
+
+static uint64_t sse2_ones_sum_copy(uint64_t sum, void *dst, const void *src, size_t len) {
+    return sse2_sum(sum, dst, src, len, true);
+}
+
+static const struct ones_sum_impl ones_sum_sse2 = {
+    .name = "sse2",
+    .sum = sse2_ones_sum,
+    .copy_sum = sse2_ones_sum_copy,
+};
+
+size_t ones_sum_arch_impls(const struct ones_sum_impl **impls, size_t max) {
+    size_t count = 0;
+
+    /* fxsr is what has the fpu code turn on sse in the first place */
+    if (count < max && x86_feature_test(X86_FEATURE_SSE2) && x86_feature_test(X86_FEATURE_FXSR))
+        impls[count++] = &ones_sum_sse2;
+
+    return count;
+}
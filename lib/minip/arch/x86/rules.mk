@@ -0,0 +1,9 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+# the sse2 checksum, for 64 bit where the compiler baseline always has sse2
+ifeq ($(SUBARCH),x86-64)
+MODULE_FLOAT_SRCS += \
+	$(LOCAL_DIR)/chksum.c
+
+MODULE_DEFINES += MINIP_ARCH_CHKSUM=1
+endif
@@ -8,39 +8,216 @@
 
 #include "minip-internal.h"
 
+#include <lib/minip/arp.h>
+#include <assert.h>
+#include <lk/err.h>
 #include <lk/list.h>
 #include <string.h>
-#include <malloc.h>
 #include <stdio.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <lk/trace.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
+
+/* slots in the table, and how far from its hash an address can be */
+#define ARP_TABLE_BITS 6
+#define ARP_TABLE_SIZE (1U << ARP_TABLE_BITS)
+#define ARP_PROBE_SLOTS 8
+
+enum arp_state {
+    ARP_FREE,
+    ARP_INCOMPLETE, /* request sent, no answer yet */
+    ARP_REACHABLE,  /* answered within ARP_REACHABLE_TIME */
+    ARP_STALE,      /* older than that, still used while it's refreshed */
+};
+
 typedef struct {
-    struct list_node node;
+    /* odd while the fields below are being changed */
+    uint32_t seq;
+
     uint32_t addr;
     uint8_t mac[6];
+    uint8_t state;
+
+    /* set by lookups, cleared when an entry goes stale */
+    bool used;
+
+    /* the rest is only touched with arp_mutex held */
+    uint8_t probes;
+    lk_time_t confirmed;
+    lk_time_t probed;
+    netif_t *netif;
+
+    /* packets waiting for the address to resolve */
+    struct list_node pending;
+    uint pending_count;
 } arp_entry_t;
 
-static struct list_node arp_list = LIST_INITIAL_VALUE(arp_list);
+/* what a lookup gets out of an entry */
+typedef struct {
+    uint32_t addr;
+    uint8_t mac[6];
+    uint8_t state;
+    lk_time_t confirmed;
+} arp_snapshot_t;
+
+static arp_entry_t arp_table[ARP_TABLE_SIZE];
 static mutex_t arp_mutex = MUTEX_INITIAL_VALUE(arp_mutex);
 
-void arp_cache_init(void) {}
+static net_timer_t arp_timer;
+static bool arp_timer_armed;
 
-static void mru_update(struct list_node *entry) {
-    if (arp_list.next == entry)
-        return;
+static const char *arp_state_name[] = {
+    [ARP_FREE] = "free",
+    [ARP_INCOMPLETE] = "incomplete",
+    [ARP_REACHABLE] = "reachable",
+    [ARP_STALE] = "stale",
+};
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+void arp_cache_init(void) {
+    for (uint i = 0; i < ARP_TABLE_SIZE; i++) {
+        list_initialize(&arp_table[i].pending);
+    }
 }
 
-void arp_cache_update(uint32_t addr, const uint8_t mac[6]) {
-    arp_entry_t *arp;
-    ipv4_t ip;
-    bool found = false;
+static uint arp_hash(uint32_t addr) {
+    return (addr * 0x9e3779b1U) >> (32 - ARP_TABLE_BITS);
+}
+
+static arp_entry_t *arp_slot(uint32_t addr, uint i) {
+    return &arp_table[(arp_hash(addr) + i) & (ARP_TABLE_SIZE - 1)];
+}
+
+/* a consistent copy of an entry without taking the lock */
+static void arp_entry_read(const arp_entry_t *e, arp_snapshot_t *s) {
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        s->addr = e->addr;
+        s->state = e->state;
+        s->confirmed = e->confirmed;
+        mac_addr_copy(s->mac, e->mac);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq);
+}
+
+/* bracket changes to an entry's addr, mac, state or confirmed time */
+static void arp_entry_write_begin(arp_entry_t *e) {
+    DEBUG_ASSERT(is_mutex_held(&arp_mutex));
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void arp_entry_write_end(arp_entry_t *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6]) {
+    for (uint i = 0; i < ARP_PROBE_SLOTS; i++) {
+        arp_entry_t *e = arp_slot(addr, i);
+        arp_snapshot_t s;
+
+        arp_entry_read(e, &s);
+        if (s.addr != addr || s.state < ARP_REACHABLE)
+            continue;
+
+        /* only stale entries care, and only the first lookup has to write */
+        if (!__atomic_load_n(&e->used, __ATOMIC_RELAXED))
+            __atomic_store_n(&e->used, true, __ATOMIC_RELAXED);
+
+        mac_addr_copy(mac, s.mac);
+        return true;
+    }
+
+    return false;
+}
 
+/* find the entry for addr with the lock held */
+static arp_entry_t *arp_find_locked(uint32_t addr) {
+    for (uint i = 0; i < ARP_PROBE_SLOTS; i++) {
+        arp_entry_t *e = arp_slot(addr, i);
+        if (e->state != ARP_FREE && e->addr == addr)
+            return e;
+    }
+    return NULL;
+}
+
+static void arp_drop_pending(arp_entry_t *e) {
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&e->pending, pktbuf_t, list))) {
+        pktbuf_free_chain(p, true);
+    }
+    e->pending_count = 0;
+}
+
+static void arp_free_entry(arp_entry_t *e) {
+    arp_drop_pending(e);
+
+    arp_entry_write_begin(e);
+    e->state = ARP_FREE;
+    e->addr = 0;
+    arp_entry_write_end(e);
+}
+
+static void arp_timer_cb(void *arg);
+
+static void arp_timer_arm(void) {
+    if (!arp_timer_armed) {
+        arp_timer_armed = true;
+        net_timer_set(&arp_timer, arp_timer_cb, NULL, ARP_RETRY_TIME);
+    }
+}
+
+/* a slot for addr, reusing the least recently confirmed one if they're all taken */
+static arp_entry_t *arp_alloc_locked(uint32_t addr, netif_t *netif, uint8_t state) {
+    arp_entry_t *victim = NULL;
+
+    for (uint i = 0; i < ARP_PROBE_SLOTS; i++) {
+        arp_entry_t *e = arp_slot(addr, i);
+        if (e->state == ARP_FREE) {
+            victim = e;
+            break;
+        }
+        if (!victim || TIME_LT(e->confirmed, victim->confirmed))
+            victim = e;
+    }
+
+    LTRACEF("slot %ld for %u.%u.%u.%u, was state %u\n", (long)(victim - arp_table),
+            IPV4_SPLIT(addr), victim->state);
+
+    arp_drop_pending(victim);
+
+    arp_entry_write_begin(victim);
+    victim->addr = addr;
+    victim->state = state;
+    victim->confirmed = current_time();
+    arp_entry_write_end(victim);
+
+    victim->used = false;
+    victim->probes = 0;
+    victim->probed = 0;
+    victim->netif = netif;
+
+    arp_timer_arm();
+
+    return victim;
+}
+
+/* send packets that were waiting on an entry, once the lock is dropped */
+static void arp_send_pending(netif_t *netif, struct list_node *list, const uint8_t mac[6]) {
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list))) {
+        struct eth_hdr *eth = (struct eth_hdr *)p->data;
+        mac_addr_copy(eth->dst_mac, mac);
+        netif->tx_func(netif->tx_func_arg, p);
+    }
+}
+
+void arp_cache_update(netif_t *netif, uint32_t addr, const uint8_t mac[6], bool create) {
+    ipv4_t ip;
     ip.u = addr;
 
     // Ignore 0.0.0.0 or x.x.x.255
@@ -48,75 +225,201 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6]) {
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
+    /* most updates are from packets of hosts that were answered for recently */
+    for (uint i = 0; i < ARP_PROBE_SLOTS; i++) {
+        arp_snapshot_t s;
+        arp_entry_read(arp_slot(addr, i), &s);
+        if (s.addr == addr && s.state == ARP_REACHABLE && !memcmp(s.mac, mac, 6) &&
+                current_time() - s.confirmed < ARP_REACHABLE_TIME / 2) {
+            return;
         }
     }
 
-    if (!found) {
+    struct list_node pending = LIST_INITIAL_VALUE(pending);
+
+    mutex_acquire(&arp_mutex);
+
+    arp_entry_t *e = arp_find_locked(addr);
+    if (!e) {
+        if (!create)
+            goto done;
+
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x to cache\n",
                 ip.b[0], ip.b[1], ip.b[2], ip.b[3],
                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
-        if (arp == NULL) {
-            goto err;
+        e = arp_alloc_locked(addr, netif, ARP_REACHABLE);
+    }
+
+    arp_entry_write_begin(e);
+    mac_addr_copy(e->mac, mac);
+    e->state = ARP_REACHABLE;
+    e->confirmed = current_time();
+    arp_entry_write_end(e);
+
+    e->probes = 0;
+    e->netif = netif;
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&e->pending, pktbuf_t, list))) {
+        list_add_tail(&pending, &p->list);
+    }
+    e->pending_count = 0;
+
+done:
+    mutex_release(&arp_mutex);
+
+    arp_send_pending(netif, &pending, mac);
+}
+
+status_t arp_cache_queue(netif_t *netif, uint32_t addr, pktbuf_t *p) {
+    uint8_t mac[6];
+    struct list_node pending = LIST_INITIAL_VALUE(pending);
+    bool send_request = false;
+
+    mutex_acquire(&arp_mutex);
+
+    arp_entry_t *e = arp_find_locked(addr);
+    if (!e) {
+        e = arp_alloc_locked(addr, netif, ARP_INCOMPLETE);
+        send_request = true;
+        e->probes = 1;
+        e->probed = current_time();
+    }
+
+    if (e->state == ARP_INCOMPLETE) {
+        if (e->pending_count == ARP_PENDING_MAX) {
+            pktbuf_free_chain(list_remove_head_type(&e->pending, pktbuf_t, list), true);
+            e->pending_count--;
         }
+        list_add_tail(&e->pending, &p->list);
+        e->pending_count++;
+    } else {
+        /* answered since the caller looked */
+        mac_addr_copy(mac, e->mac);
+        list_add_tail(&pending, &p->list);
+    }
+
+    mutex_release(&arp_mutex);
 
-        arp->addr = addr;
-        mac_addr_copy(arp->mac, mac);
-        list_add_head(&arp_list, &arp->node);
+    if (send_request) {
+        arp_send_request(netif, addr);
     }
+    arp_send_pending(netif, &pending, mac);
 
-err:
+    return NO_ERROR;
+}
+
+void arp_cache_remove(uint32_t addr) {
+    mutex_acquire(&arp_mutex);
+    arp_entry_t *e = arp_find_locked(addr);
+    if (e) {
+        arp_free_entry(e);
+    }
+    mutex_release(&arp_mutex);
+}
+
+void arp_cache_flush(void) {
+    mutex_acquire(&arp_mutex);
+    for (uint i = 0; i < ARP_TABLE_SIZE; i++) {
+        if (arp_table[i].state != ARP_FREE) {
+            arp_free_entry(&arp_table[i]);
+        }
+    }
     mutex_release(&arp_mutex);
-    return;
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr) {
-    arp_entry_t *arp = NULL;
-    uint8_t *ret = NULL;
+/* age the table, retrying requests that went unanswered and refreshing used stale entries */
+static void arp_timer_cb(void *arg) {
+    struct {
+        netif_t *netif;
+        uint32_t addr;
+    } requests[ARP_TABLE_SIZE];
+    uint request_count = 0;
+    bool active = false;
+
+    lk_time_t now = current_time();
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
     mutex_acquire(&arp_mutex);
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            ret = arp->mac;
-            break;
+
+    for (uint i = 0; i < ARP_TABLE_SIZE; i++) {
+        arp_entry_t *e = &arp_table[i];
+        if (e->state == ARP_FREE)
+            continue;
+
+        if (e->state == ARP_REACHABLE && now - e->confirmed >= ARP_REACHABLE_TIME) {
+            arp_entry_write_begin(e);
+            e->state = ARP_STALE;
+            arp_entry_write_end(e);
+            __atomic_store_n(&e->used, false, __ATOMIC_RELAXED);
+        }
+
+        if (e->state == ARP_STALE && e->probes == 0) {
+            if (__atomic_load_n(&e->used, __ATOMIC_RELAXED)) {
+                /* still in use, ask again */
+                e->probes = 1;
+                e->probed = now;
+                requests[request_count].netif = e->netif;
+                requests[request_count++].addr = e->addr;
+            } else if (now - e->confirmed >= ARP_REACHABLE_TIME + ARP_STALE_TIME) {
+                LTRACEF("expiring %u.%u.%u.%u\n", IPV4_SPLIT(e->addr));
+                arp_free_entry(e);
+                continue;
+            }
+        } else if (e->state != ARP_REACHABLE && now - e->probed >= ARP_RETRY_TIME) {
+            if (e->probes >= ARP_MAX_PROBES) {
+                LTRACEF("no answer from %u.%u.%u.%u, dropping %u packets\n", IPV4_SPLIT(e->addr),
+                        e->pending_count);
+                arp_free_entry(e);
+                continue;
+            }
+            e->probes++;
+            e->probed = now;
+            requests[request_count].netif = e->netif;
+            requests[request_count++].addr = e->addr;
         }
+
+        active = true;
+    }
+
+    /* the table is empty, the next entry starts the timer again */
+    arp_timer_armed = active;
+    if (active) {
+        net_timer_set(&arp_timer, arp_timer_cb, NULL, ARP_RETRY_TIME);
     }
+
     mutex_release(&arp_mutex);
 
-    return ret;
+    for (uint i = 0; i < request_count; i++) {
+        arp_send_request(requests[i].netif, requests[i].addr);
+    }
 }
 
 void arp_cache_dump(void) {
-    int i = 0;
-    arp_entry_t *arp;
-
-    if (!list_is_empty(&arp_list)) {
-        list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-            ipv4_t ip;
-            ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                   i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                   arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
-        }
-    } else {
+    lk_time_t now = current_time();
+    int count = 0;
+
+    mutex_acquire(&arp_mutex);
+    for (uint i = 0; i < ARP_TABLE_SIZE; i++) {
+        const arp_entry_t *e = &arp_table[i];
+        if (e->state == ARP_FREE)
+            continue;
+
+        printf("%2u: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x %-10s age %u ms, %u pending, %s\n",
+               i, IPV4_SPLIT(e->addr),
+               e->mac[0], e->mac[1], e->mac[2], e->mac[3], e->mac[4], e->mac[5],
+               arp_state_name[e->state], now - e->confirmed, e->pending_count,
+               e->netif ? e->netif->name : "?");
+        count++;
+    }
+    mutex_release(&arp_mutex);
+
+    if (count == 0) {
         printf("The arp table is empty\n");
     }
 }
 
-int arp_send_request(netif_t *netif, ipv4_addr_t addr) {
+static int arp_send(netif_t *netif, uint16_t oper, uint32_t spa, const uint8_t *dst_mac,
+                    const uint8_t *tha, uint32_t tpa) {
     pktbuf_t *p;
     struct eth_hdr *eth;
     struct arp_pkt *arp;
@@ -127,17 +430,17 @@ int arp_send_request(netif_t *netif, ipv4_addr_t addr) {
 
     eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
     arp = pktbuf_append(p, sizeof(struct arp_pkt));
-    minip_build_mac_hdr(netif, eth, bcast_mac, ETH_TYPE_ARP);
+    minip_build_mac_hdr(netif, eth, dst_mac, ETH_TYPE_ARP);
 
     arp->htype = htons(0x0001);
     arp->ptype = htons(0x0800);
     arp->hlen = 6;
     arp->plen = 4;
-    arp->oper = htons(ARP_OPER_REQUEST);
-    arp->spa = netif->ipv4_addr;
-    arp->tpa = addr;
+    arp->oper = htons(oper);
+    arp->spa = spa;
+    arp->tpa = tpa;
     mac_addr_copy(arp->sha, netif->mac_address);
-    mac_addr_copy(arp->tha, bcast_mac);
+    mac_addr_copy(arp->tha, tha);
 
     if (netif->tx_func) {
         netif->tx_func(netif->tx_func_arg, p);
@@ -145,43 +448,15 @@ int arp_send_request(netif_t *netif, ipv4_addr_t addr) {
     return 0;
 }
 
-static void handle_arp_timeout_cb(void *arg) {
-    *(bool *)arg = true;
+int arp_send_request(netif_t *netif, ipv4_addr_t addr) {
+    return arp_send(netif, ARP_OPER_REQUEST, netif->ipv4_addr, bcast_mac, bcast_mac, addr);
 }
 
-const uint8_t *arp_get_dest_mac(uint32_t host) {
-    const uint8_t *dst_mac = NULL;
-    bool arp_timeout = false;
-    net_timer_t arp_timeout_timer;
-
-    if (host == IPV4_BCAST) {
-        return bcast_mac;
-    }
-
-    dst_mac = arp_cache_lookup(host);
-    if (dst_mac == NULL) {
-        // look up route to set local address
-        ipv4_route_t *route = ipv4_search_route(host);
-        if (!route) {
-            return NULL;
-        }
-        netif_t *netif = route->interface;
+void arp_send_gratuitous(netif_t *netif) {
+    static const uint8_t zero_mac[6];
 
-        arp_send_request(netif, host);
-
-        memset(&arp_timeout_timer, 0, sizeof(arp_timeout_timer));
-        net_timer_set(&arp_timeout_timer, handle_arp_timeout_cb, &arp_timeout, 100);
-        while (!arp_timeout) {
-            dst_mac = arp_cache_lookup(host);
-            if (dst_mac) {
-                net_timer_cancel(&arp_timeout_timer);
-                break;
-            }
-        }
-        ipv4_dec_route_ref(route);
-    }
-
-    return dst_mac;
+    /* a request for our own address (RFC 5227), so neighbors update what they have */
+    arp_send(netif, ARP_OPER_REQUEST, netif->ipv4_addr, bcast_mac, zero_mac, netif->ipv4_addr);
 }
 
 int handle_arp_pkt(netif_t *netif, pktbuf_t *p) {
@@ -196,52 +471,38 @@ int handle_arp_pkt(netif_t *netif, pktbuf_t *p) {
         return -1;
     }
 
-    switch (ntohs(arp->oper)) {
-        case ARP_OPER_REQUEST: {
-            pktbuf_t *rp;
-            struct eth_hdr *reth;
-            struct arp_pkt *rarp;
-
-            if (memcmp(&arp->tpa, &netif->ipv4_addr, sizeof(netif->ipv4_addr)) == 0) {
-                if ((rp = pktbuf_alloc()) == NULL) {
-                    break;
-                }
-
-                LTRACEF("arp request for us\n");
-
-                reth = pktbuf_prepend(rp, sizeof(struct eth_hdr));
-                rarp = pktbuf_append(rp, sizeof(struct arp_pkt));
-
-                // Eth header
-                minip_build_mac_hdr(netif, reth, eth->src_mac, ETH_TYPE_ARP);
+    if (arp->htype != htons(0x0001) || arp->ptype != htons(0x0800) || arp->hlen != 6 || arp->plen != 4) {
+        return -1;
+    }
 
-                // ARP packet
-                rarp->oper = htons(ARP_OPER_REPLY);
-                rarp->htype = htons(0x0001);
-                rarp->ptype = htons(0x0800);
-                rarp->hlen = 6;
-                rarp->plen = 4;
-                mac_addr_copy(rarp->sha, netif->mac_address);
-                rarp->spa = netif->ipv4_addr;
-                mac_addr_copy(rarp->tha, arp->sha);
-                rarp->tpa = arp->spa;
+    uint32_t spa, tpa;
+    memcpy(&spa, &arp->spa, sizeof(spa)); // unaligned words
+    memcpy(&tpa, &arp->tpa, sizeof(tpa));
 
-                netif->tx_func(netif->tx_func_arg, rp);
-            }
+    const bool have_addr = netif->ipv4_addr != IPV4_NONE;
+    if (have_addr && spa == netif->ipv4_addr) {
+        if (memcmp(arp->sha, netif->mac_address, 6) != 0) {
+            printf("minip: %s: address %u.%u.%u.%u also in use by %02x:%02x:%02x:%02x:%02x:%02x\n",
+                   netif->name, IPV4_SPLIT(spa),
+                   arp->sha[0], arp->sha[1], arp->sha[2], arp->sha[3], arp->sha[4], arp->sha[5]);
         }
-        break;
+        return 0;
+    }
 
-        case ARP_OPER_REPLY: {
-            LTRACEF("arp reply for us\n");
+    /*
+     * Whatever the operation, the sender's address is worth knowing (RFC 826). Only add it
+     * if it's talking to us though, a gratuitous announcement just updates what's there.
+     * Probes from a host without an address yet have a zero sender.
+     */
+    const bool for_us = have_addr && tpa == netif->ipv4_addr;
+    if (spa != 0) {
+        arp_cache_update(netif, spa, arp->sha, for_us);
+    }
 
-            uint32_t addr;
-            memcpy(&addr, &arp->spa, sizeof(addr)); // unaligned word
-            arp_cache_update(addr, arp->sha);
-        }
-        break;
+    if (ntohs(arp->oper) == ARP_OPER_REQUEST && for_us) {
+        LTRACEF("arp request for us\n");
+        arp_send(netif, ARP_OPER_REPLY, netif->ipv4_addr, eth->src_mac, arp->sha, spa);
     }
 
     return 0;
 }
-
-
@@ -8,19 +8,143 @@
 
 #include "minip-internal.h"
 
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len) {
-    const uint16_t *buf = _buf;
-
-    while (len >= 2) {
-        sum += *buf++;
-        if (sum & 0x80000000)
-            sum = (sum & 0xffff) + (sum >> 16);
-        len -= 2;
+#include <assert.h>
+#include <lk/debug.h>
+#include <lk/init.h>
+#include <lk/trace.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * The checksum is summed 32 bits at a time into 64 bit accumulators and only
+ * folded down to 16 bits at the end. A 32 bit word is its two 16 bit halves
+ * mod 0xffff whichever the endianness, and the accumulators can't carry out
+ * before many gigabytes have been summed.
+ */
+static inline uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t ones_sum_generic(uint64_t sum, const void *_buf, size_t len) {
+    const uint8_t *buf = _buf;
+    uint64_t sum2 = 0;
+
+    /* two accumulators so the adds don't all wait on each other */
+    while (len >= 16) {
+        sum += load32(buf);
+        sum2 += load32(buf + 4);
+        sum += load32(buf + 8);
+        sum2 += load32(buf + 12);
+        buf += 16;
+        len -= 16;
+    }
+
+    while (len >= 4) {
+        sum += load32(buf);
+        buf += 4;
+        len -= 4;
+    }
+
+    /* what's left sums as if padded out with zeros */
+    if (len) {
+        uint32_t tail = 0;
+        memcpy(&tail, buf, len);
+        sum += tail;
+    }
+
+    return sum + sum2;
+}
+
+uint64_t ones_sum_generic_copy(uint64_t sum, void *_dst, const void *_src, size_t len) {
+    const uint8_t *src = _src;
+    uint8_t *dst = _dst;
+    uint64_t sum2 = 0;
+
+    while (len >= 8) {
+        uint32_t a = load32(src);
+        uint32_t b = load32(src + 4);
+        memcpy(dst, &a, sizeof(a));
+        memcpy(dst + 4, &b, sizeof(b));
+        sum += a;
+        sum2 += b;
+        src += 8;
+        dst += 8;
+        len -= 8;
     }
 
     if (len) {
-        uint16_t temp = htons((*(uint8_t *)buf) << 8);
-        sum += temp;
+        memcpy(dst, src, len);
+        sum = ones_sum_generic(sum, src, len);
+    }
+
+    return sum + sum2;
+}
+
+static const struct ones_sum_impl ones_sum_generic_impl = {
+    .name = "generic",
+    .sum = ones_sum_generic,
+    .copy_sum = ones_sum_generic_copy,
+};
+
+/* the arch versions this cpu supports, filled in at boot */
+#define MAX_ARCH_IMPLS 4
+static const struct ones_sum_impl *arch_impls[MAX_ARCH_IMPLS];
+static size_t arch_impl_count;
+
+static const struct ones_sum_impl *ones_sum_best = &ones_sum_generic_impl;
+
+const struct ones_sum_impl *ones_sum_get_impl(size_t index) {
+    if (index < arch_impl_count)
+        return arch_impls[index];
+    if (index == arch_impl_count)
+        return &ones_sum_generic_impl;
+    return NULL;
+}
+
+uint16_t ones_sum16(uint32_t sum, const void *buf, int len) {
+    uint64_t s = sum;
+
+    if (len > 0)
+        s = ones_sum_best->sum(s, buf, len);
+
+    return ones_sum_fold(s);
+}
+
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, size_t len) {
+    return ones_sum_fold(ones_sum_best->copy_sum(sum, dst, src, len));
+}
+
+static void ones_sum_init(uint level) {
+#if MINIP_ARCH_CHKSUM
+    arch_impl_count = ones_sum_arch_impls(arch_impls, MAX_ARCH_IMPLS);
+    DEBUG_ASSERT(arch_impl_count <= MAX_ARCH_IMPLS);
+#endif
+
+    ones_sum_best = ones_sum_get_impl(0);
+    LTRACEF("using %s\n", ones_sum_best->name);
+}
+
+LK_INIT_HOOK(minip_chksum, ones_sum_init, LK_INIT_LEVEL_KERNEL);
+
+/* ones_sum16 over a packet from offset bytes into its first part, across all of its parts */
+uint16_t ones_sum16_pktbuf(uint32_t sum, const pktbuf_t *p, size_t offset) {
+    bool odd = false;
+
+    for (; p; p = p->next, offset = 0) {
+        DEBUG_ASSERT(offset <= p->dlen);
+
+        int len = p->dlen - offset;
+        uint16_t part = ones_sum16(0, p->data + offset, len);
+
+        /* a part starting on an odd byte of the packet sums with its bytes swapped */
+        if (odd)
+            part = (part >> 8) | (part << 8);
+        sum += part;
+
+        if (len & 1)
+            odd = !odd;
     }
 
     while (sum >> 16)
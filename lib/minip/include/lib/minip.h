@@ -72,6 +72,24 @@ status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* zero copy reads and writes.
+ *
+ * tcp_read_pktbuf hands back the next pktbuf of received data, often the one it
+ * arrived in, returning its length. The caller frees it with pktbuf_free().
+ *
+ * tcp_write_pktbuf sends p's data as a single segment straight out of its buffer,
+ * taking ownership of p even on error and freeing it once the data is acked. The
+ * headers are built in the TCP_HEADROOM bytes in front of the data, and it can be
+ * no longer than tcp_get_mss(), otherwise it is copied. To send out of a buffer of
+ * your own, wrap it with pktbuf_alloc_empty() and pktbuf_add_buffer() and get it
+ * back in the free callback.
+ */
+#define TCP_HEADROOM 68
+
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p);
+status_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p);
+uint32_t tcp_get_mss(tcp_socket_t *socket);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket) {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
 }
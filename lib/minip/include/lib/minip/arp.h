@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lib/minip.h>
+#include <lib/minip/netif.h>
+#include <lib/pktbuf.h>
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+// ARP neighbor cache for minip.
+//
+// Entries live in a fixed size table hashed by address, searched a few slots
+// from the hash. Lookups don't take a lock: each entry has a sequence count that
+// is odd while it's being changed, and a reader that sees it move tries again.
+// Everything that changes the table is serialized by a mutex.
+//
+// An answer is trusted for ARP_REACHABLE_TIME, after which the entry goes stale
+// but is still used. A stale entry that's looked up is refreshed with a new
+// request, and one that isn't used for a while longer is dropped. Packets for an
+// address being resolved wait on its entry, a few at a time, and are sent when
+// the answer comes in or dropped if it doesn't.
+
+#define ARP_REACHABLE_TIME (60 * 1000)
+#define ARP_STALE_TIME (60 * 1000)
+#define ARP_RETRY_TIME (1000)
+#define ARP_MAX_PROBES (3)
+
+// packets queued per address being resolved, the oldest is dropped past this
+#define ARP_PENDING_MAX (4)
+
+// look up the mac address for addr, copying it to mac. Safe to call from any thread.
+bool arp_cache_lookup(ipv4_addr_t addr, uint8_t mac[6]);
+
+// Record that addr is at mac, as seen on netif. Only updates an existing entry
+// unless create is set, and sends anything waiting on the address.
+void arp_cache_update(netif_t *netif, ipv4_addr_t addr, const uint8_t mac[6], bool create);
+
+// Hold p until addr is resolved, starting resolution if it isn't already. p has its
+// ethernet header built, the destination is filled in once known.
+status_t arp_cache_queue(netif_t *netif, ipv4_addr_t addr, pktbuf_t *p);
+
+void arp_cache_remove(ipv4_addr_t addr);
+void arp_cache_flush(void);
+
+void arp_cache_init(void);
+void arp_cache_dump(void);
+
+// broadcast a request for addr, or announce our own address on netif
+int arp_send_request(netif_t *netif, ipv4_addr_t addr);
+void arp_send_gratuitous(netif_t *netif);
+
+__END_CDECLS
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+// Internet checksum (RFC 1071) for minip.
+//
+// Sums are of 16-bit words in memory order, so a result stored back into a
+// packet is already in network order. An odd trailing byte is summed as if it
+// were followed by a zero.
+//
+// The implementation is picked at boot from the ones the cpu can run, fastest
+// first. The vector versions use the fpu, so checksums must not be taken from
+// interrupt context.
+
+// add len bytes of buf to sum, 16 bits at a time with the carries folded in
+uint16_t ones_sum16(uint32_t sum, const void *buf, int len);
+
+// as above while copying the bytes to dst, for filling a packet being sent
+uint16_t ones_sum16_copy(uint32_t sum, void *dst, const void *src, size_t len);
+
+struct ones_sum_impl {
+    const char *name;
+
+    // add len bytes to sum without folding, the result is only
+    // congruent to the checksum mod 0xffff
+    uint64_t (*sum)(uint64_t sum, const void *buf, size_t len);
+    uint64_t (*copy_sum)(uint64_t sum, void *dst, const void *src, size_t len);
+};
+
+// the implementations this cpu can run, best first and the portable one
+// last, NULL past the end
+const struct ones_sum_impl *ones_sum_get_impl(size_t index);
+
+// fold an unfolded sum down to 16 bits
+static inline uint16_t ones_sum_fold(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+__END_CDECLS
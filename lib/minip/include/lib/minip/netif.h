@@ -35,6 +35,9 @@ struct netif {
 
     // name
     char name[32];
+
+    // pollers of the driver's queues, for stats
+    struct list_node polls;
 };
 typedef struct netif netif_t;
 #define NETIF_MAGIC 'NETI'
@@ -43,6 +46,8 @@ typedef struct netif netif_t;
 #define NETIF_FLAG_ETH_CONFIGURED  (1U << 1) // mac address and tx func set
 #define NETIF_FLAG_REGISTERED      (1U << 2) // added to the main list
 #define NETIF_FLAG_IPV4_CONFIGURED (1U << 3) // ipv4 address is set
+#define NETIF_FLAG_TX_CKSUM        (1U << 4) // driver finishes PKTBUF_FLAG_CKSUM_PARTIAL checksums
+#define NETIF_FLAG_TX_TSO4         (1U << 5) // driver takes multi part PKTBUF_FLAG_GSO_TCPV4 packets
 
 // Initialize a netif struct.
 // Allocates a new one if passed in pointer is null.
@@ -52,6 +57,75 @@ status_t netif_set_eth(netif_t *n, tx_func_t tx_handler, void *tx_arg, const uin
 status_t netif_set_ipv4_addr(netif_t *n, ipv4_addr_t addr, uint8_t subnet_width);
 status_t netif_register(netif_t *n);
 
+// Polled receive, along the lines of Linux's NAPI.
+//
+// Rather than handling each completion in its interrupt, a driver's interrupt
+// handler calls netif_poll_schedule() for the queue. That turns the queue's
+// interrupt off with the irq_disable hook and hands the queue to a poll thread,
+// which runs its poll routine to handle up to budget packets at a time. A poll
+// that uses up its budget is run again after the other queues waiting on that
+// thread. One that doesn't has found the queue idle, so the interrupt is turned
+// back on with irq_enable, and the poll is scheduled again straight away if that
+// reports more work.
+//
+// Each cpu has a poll thread of its own. Handing packets up the stack can block
+// on socket locks, so this doesn't run on the dpc threads, where it would hold
+// up everything else queued on the cpu.
+//
+// Under load a queue is then drained in batches with its interrupt off, and the
+// cost of an interrupt and a wakeup is paid once per batch rather than per packet.
+struct netif_poll;
+
+struct netif_poll_ops {
+    // handle up to budget packets, returning how many
+    int (*poll)(struct netif_poll *np, int budget);
+
+    // turn the queue's interrupt off, called from the interrupt handler
+    void (*irq_disable)(struct netif_poll *np);
+
+    // turn it back on, returning true if work came in while it was off
+    bool (*irq_enable)(struct netif_poll *np);
+};
+
+struct netif_poll {
+    const struct netif_poll_ops *ops;
+    void *arg;
+    netif_t *netif;
+    int budget;
+    int cpu; // to poll on, or NETIF_POLL_CPU_CURRENT for wherever the interrupt came in
+
+    volatile int state;
+    struct list_node run_node; // on a poll thread's list while scheduled
+    struct list_node node;
+
+    // stats, only updated by the poll
+    uint64_t schedules;   // times the interrupt kicked off polling
+    uint64_t polls;       // poll routine runs
+    uint64_t exhausted;   // runs that used their whole budget
+    uint64_t rx_packets;  // packets handed to the stack
+    uint64_t tx_packets;  // sent packets reclaimed by the driver
+
+    // for netif_poll_dump
+    uint64_t last_rx_packets;
+    uint64_t last_tx_packets;
+};
+
+#define NETIF_POLL_BUDGET 64
+#define NETIF_POLL_CPU_CURRENT (-1)
+
+// set up a poller for one of n's queues, which must have been created already
+void netif_poll_init(struct netif_poll *np, netif_t *n, const struct netif_poll_ops *ops,
+                     void *arg, int budget, int cpu);
+
+// from the interrupt handler, or from anywhere work may have been missed
+void netif_poll_schedule(struct netif_poll *np);
+
+// from the poll routine, hand a received packet up the stack
+void netif_poll_receive(struct netif_poll *np, pktbuf_t *p);
+
+// print the pollers' stats, and packet rates over sample_ms if it isn't 0
+void netif_poll_dump(lk_time_t sample_ms);
+
 // construct netmask and broadcast addresses dynamically
 
 static inline ipv4_addr_t netif_get_netmask_ipv4(netif_t *n) {
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+// TCP congestion control and retransmit timeout estimation for minip.
+//
+// The generic parts of congestion control, slow start and fast recovery, are
+// handled by the tcp stack and the routines below. An algorithm only decides how
+// the window grows in congestion avoidance and where it drops to after a loss.
+// All windows are in bytes and all times in ms.
+
+struct tcp_cc {
+    const struct tcp_cc_ops *ops;
+
+    uint32_t mss;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+
+    // newreno: bytes acked toward the next mss of growth
+    uint32_t bytes_acked;
+
+    // cubic
+    uint32_t w_max;        // window at the last loss
+    uint32_t w_origin;     // top of the curve for this epoch
+    uint32_t w_est;        // what reno would have grown to by now
+    uint32_t k;            // time from the start of the epoch to reach w_origin
+    lk_time_t epoch_start; // 0 when not in an epoch
+};
+
+struct tcp_cc_ops {
+    const char *name;
+
+    void (*init)(struct tcp_cc *cc);
+
+    // grow the window for acked bytes while in congestion avoidance
+    void (*cong_avoid)(struct tcp_cc *cc, uint32_t acked, lk_time_t now, lk_time_t srtt);
+
+    // the slow start threshold after a loss with flight bytes outstanding
+    uint32_t (*ssthresh)(struct tcp_cc *cc, uint32_t flight);
+};
+
+extern const struct tcp_cc_ops tcp_cc_newreno;
+extern const struct tcp_cc_ops tcp_cc_cubic;
+
+// look up an algorithm by name, NULL if there isn't one
+const struct tcp_cc_ops *tcp_cc_find(const char *name);
+
+// start out in slow start with the RFC 6928 initial window
+void tcp_cc_init(struct tcp_cc *cc, const struct tcp_cc_ops *ops, uint32_t mss);
+
+// acked new bytes were cumulatively acked outside of fast recovery
+void tcp_cc_ack(struct tcp_cc *cc, uint32_t acked, lk_time_t now, lk_time_t srtt);
+
+// a loss was detected by duplicate acks, cwnd drops to the new ssthresh
+void tcp_cc_loss(struct tcp_cc *cc, uint32_t flight);
+
+// the retransmit timer went off, cwnd drops to one segment
+void tcp_cc_timeout(struct tcp_cc *cc, uint32_t flight);
+
+// RFC 6298 retransmit timeout estimator
+struct tcp_rtt {
+    uint32_t srtt;   // smoothed rtt << 3, 0 until the first sample
+    uint32_t rttvar; // rtt variance << 2
+    uint32_t rto;    // current timeout, including any backoff
+};
+
+#define TCP_RTO_INITIAL (1000)
+#define TCP_RTO_MIN (200)
+#define TCP_RTO_MAX (60000)
+
+void tcp_rtt_init(struct tcp_rtt *r);
+void tcp_rtt_sample(struct tcp_rtt *r, lk_time_t rtt);
+
+// double the timeout after it expires, until the next sample
+void tcp_rtt_backoff(struct tcp_rtt *r);
+
+static inline lk_time_t tcp_rtt_srtt(const struct tcp_rtt *r) {
+    return r->srtt >> 3;
+}
+
+static inline lk_time_t tcp_rtt_var(const struct tcp_rtt *r) {
+    return r->rttvar >> 2;
+}
+
+__END_CDECLS
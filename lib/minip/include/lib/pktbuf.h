@@ -46,6 +46,18 @@ typedef struct pktbuf {
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
+
+    // the next part of a multi part packet, NULL on the last one (which has PKTBUF_FLAG_EOF)
+    struct pktbuf *next;
+
+    // with PKTBUF_FLAG_CKSUM_PARTIAL, where the checksum is left for the nic to finish:
+    // the l4 header is csum_start bytes into buffer and its checksum field csum_offset
+    // bytes into that, already holding the pseudo header sum
+    u16 csum_start;
+    u16 csum_offset;
+
+    // with PKTBUF_FLAG_GSO_TCPV4, the payload of each segment the nic cuts the packet into
+    u16 gso_size;
 } pktbuf_t;
 
 typedef struct pktbuf_pool_object {
@@ -60,6 +72,8 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF            (1<<3)
 #define PKTBUF_FLAG_CACHED         (1<<4)
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5)
+#define PKTBUF_FLAG_GSO_TCPV4      (1<<6)
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p) {
@@ -76,10 +90,28 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p) {
     return p->blen - (p->data - p->buffer) - p->dlen;
 }
 
+// total data length of a packet, across all of its parts
+static inline u32 pktbuf_total_len(const pktbuf_t *p) {
+    u32 len = 0;
+    for (; p; p = p->next) {
+        len += p->dlen;
+    }
+    return len;
+}
+
 // allocate packet buffer from buffer pool
 pktbuf_t *pktbuf_alloc(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
+// as pktbuf_alloc, but returns NULL rather than waiting if wait is false
+pktbuf_t *pktbuf_alloc_etc(bool wait);
+
+// move p's buffer and data to a new packet buffer, leaving p
+// empty with a fresh buffer of the same size. never waits,
+// returns NULL if there is no free buffer or p's buffer is not
+// from the pool.
+pktbuf_t *pktbuf_detach(pktbuf_t *p);
+
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
@@ -88,6 +120,15 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
 // returns number of threads woken up
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// free every part of a multi part packet
+void pktbuf_free_chain(pktbuf_t *p, bool reschedule);
+
+// add q, and any parts after it, to the end of the packet p
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *q);
+
+// shrink a multi part packet to len bytes, leaving any parts past that empty
+void pktbuf_trim_chain(pktbuf_t *p, size_t len);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
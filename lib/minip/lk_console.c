@@ -20,6 +20,7 @@
 static void arp_usage(void) {
     printf("arp list                        print arp table\n");
     printf("arp query <ipv4 address>        query arp address\n");
+    printf("arp flush                       empty the arp table\n");
 }
 
 static int cmd_arp(int argc, const console_cmd_args *argv) {
@@ -35,7 +36,23 @@ static int cmd_arp(int argc, const console_cmd_args *argv) {
         const char *addr_s = argv[2].str;
         uint32_t addr = minip_parse_ipaddr(addr_s, strlen(addr_s));
 
-        arp_get_dest_mac(addr);
+        uint8_t mac[6];
+        if (arp_cache_lookup(addr, mac)) {
+            printf("%u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n", IPV4_SPLIT(addr),
+                   mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+            return 0;
+        }
+
+        // ask whoever is on the interface it routes to, the answer lands in the table
+        ipv4_route_t *route = ipv4_search_route(addr);
+        if (!route) {
+            printf("no route to %u.%u.%u.%u\n", IPV4_SPLIT(addr));
+            return ERR_NOT_FOUND;
+        }
+        arp_send_request(route->interface, addr);
+        ipv4_dec_route_ref(route);
+    } else if (argc == 2 && strncmp(cmd, "flush", sizeof("flush")) == 0) {
+        arp_cache_flush();
     } else {
         arp_usage();
     }
@@ -49,6 +66,7 @@ minip_usage:
         printf("minip commands\n");
         printf("mi tra[c]e                      toggle packet tracing\n");
         printf("mi [i]interfaces                dump interface list\n");
+        printf("mi [p]oll [ms]                  driver polling stats, with packet rates over ms\n");
         printf("mi [r]outes                     dump routing table\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
@@ -61,6 +79,9 @@ minip_usage:
             case 'i':
                 netif_dump();
                 break;
+            case 'p':
+                netif_poll_dump(argc > 2 ? argv[2].u : 0);
+                break;
             case 'r':
                 dump_ipv4_route_table();
                 break;
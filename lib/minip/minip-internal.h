@@ -15,6 +15,8 @@
 #include <lk/list.h>
 #include <stdint.h>
 #include <string.h>
+#include <lib/minip/arp.h>
+#include <lib/minip/chksum.h>
 #include <lib/minip/netif.h>
 
 /* Lib configuration */
@@ -94,17 +96,20 @@ typedef union {
     uint8_t b[4];
 } ipv4_t;
 
-// ARP cache
-void arp_cache_init(void);
-void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
-void arp_cache_dump(void);
-int arp_send_request(netif_t *, ipv4_addr_t addr);
-const uint8_t *arp_get_dest_mac(uint32_t host);
+// ARP
 int handle_arp_pkt(netif_t *netif, pktbuf_t *p);
 
 // checksums
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
+uint16_t ones_sum16_pktbuf(uint32_t sum, const pktbuf_t *p, size_t offset);
+
+// the portable checksum, which the arch versions finish their tails with
+uint64_t ones_sum_generic(uint64_t sum, const void *buf, size_t len);
+uint64_t ones_sum_generic_copy(uint64_t sum, void *dst, const void *src, size_t len);
+
+#if MINIP_ARCH_CHKSUM
+// fill impls with the arch versions this cpu can run, best first, returning how many
+size_t ones_sum_arch_impls(const struct ones_sum_impl **impls, size_t max);
+#endif
 
 typedef struct ipv4_pseudo_header {
     ipv4_addr_t source_addr;
@@ -119,6 +124,20 @@ static inline uint16_t cksum_pheader(const ipv4_pseudo_header_t *pheader, const
     return ~ones_sum16(checksum, buf, len);
 }
 
+// as above, over all the parts of p
+static inline uint16_t cksum_pheader_pktbuf(const ipv4_pseudo_header_t *pheader, const pktbuf_t *p) {
+    uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
+    return ~ones_sum16_pktbuf(checksum, p, 0);
+}
+
+// leave the checksum of the l4 header at the front of p for whoever sends it to finish,
+// from the pseudo header sum already in it
+static inline void cksum_set_partial(pktbuf_t *p, const void *l4_hdr, size_t csum_offset) {
+    p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+    p->csum_start = (const uint8_t *)l4_hdr - p->buffer;
+    p->csum_offset = csum_offset;
+}
+
 // ipv4 routing
 typedef struct ipv4_route {
     uint32_t flags;
@@ -144,6 +163,7 @@ void minip_build_mac_hdr(netif_t *netif, struct eth_hdr *pkt, const uint8_t *dst
 status_t minip_ipv4_send(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto);
 status_t minip_ipv4_send_raw(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto, const uint8_t *dest_mac, netif_t *netif);
 
+void tcp_init(void);
 void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
 void udp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip);
 
@@ -274,11 +274,35 @@ static void minip_build_ipv4_hdr(netif_t *netif, struct ipv4_hdr *ipv4, ipv4_add
     ipv4->chksum = ~ones_sum16(0, (uint8_t *) ipv4, sizeof(struct ipv4_hdr));
 }
 
-status_t minip_ipv4_send_raw(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto, const uint8_t *dest_mac, netif_t *netif) {
+/* finish a checksum the interface can't, the l4 header has to be in the first part */
+static void minip_finish_checksum(pktbuf_t *p) {
+    size_t start = p->csum_start - (p->data - p->buffer);
+    DEBUG_ASSERT(start + p->csum_offset + sizeof(uint16_t) <= p->dlen);
+
+    uint16_t checksum = ~ones_sum16_pktbuf(0, p, start);
+    if (checksum == 0) {
+        /* all ones is the same sum, and udp uses zero for none at all */
+        checksum = 0xffff;
+    }
+    memcpy(p->buffer + p->csum_start + p->csum_offset, &checksum, sizeof(checksum));
+
+    p->flags &= ~PKTBUF_FLAG_CKSUM_PARTIAL;
+}
+
+/* put the ip and ethernet headers on p, leaving it ready for the driver */
+static void minip_ipv4_build(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto, const uint8_t *dest_mac, netif_t *netif) {
     DEBUG_ASSERT(p);
     DEBUG_ASSERT(netif);
 
-    size_t data_len = p->dlen;
+    /* only drivers that asked for them are handed segmentation offloads */
+    DEBUG_ASSERT(!(p->flags & PKTBUF_FLAG_GSO_TCPV4) || (netif->flags & NETIF_FLAG_TX_TSO4));
+    DEBUG_ASSERT(!p->next || (netif->flags & NETIF_FLAG_TX_TSO4));
+
+    if ((p->flags & PKTBUF_FLAG_CKSUM_PARTIAL) && !(netif->flags & NETIF_FLAG_TX_CKSUM)) {
+        minip_finish_checksum(p);
+    }
+
+    size_t data_len = pktbuf_total_len(p);
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
     struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
@@ -289,6 +313,10 @@ status_t minip_ipv4_send_raw(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto,
 
     minip_build_mac_hdr(netif, eth, dest_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(netif, ip, dest_addr, proto, data_len);
+}
+
+status_t minip_ipv4_send_raw(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto, const uint8_t *dest_mac, netif_t *netif) {
+    minip_ipv4_build(p, dest_addr, proto, dest_mac, netif);
 
     return netif->tx_func(netif->tx_func_arg, p);
 }
@@ -299,6 +327,7 @@ status_t minip_ipv4_send(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto) {
     // TODO: cache route at socket creation
     ipv4_route_t *route = ipv4_search_route(dest_addr);
     if (!route) {
+        pktbuf_free_chain(p, true);
         ret = -EHOSTUNREACH;
         goto err;
     }
@@ -306,9 +335,9 @@ status_t minip_ipv4_send(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto) {
     netif_t *netif = route->interface;
 
     // are we sending a broadcast packet?
-    const uint8_t *dest_mac;
+    uint8_t dest_mac[6];
     if (dest_addr == IPV4_BCAST || dest_addr == netif_get_broadcast_ipv4(netif)) {
-        dest_mac = bcast_mac;
+        mac_addr_copy(dest_mac, bcast_mac);
         goto ready;
     }
 
@@ -318,6 +347,7 @@ status_t minip_ipv4_send(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto) {
     if ((dest_addr & netmask) != (netif->ipv4_addr & netmask)) {
         // need to use the gateway
         if (minip_gateway == IPV4_NONE) {
+            pktbuf_free_chain(p, true);
             ret = ERR_NOT_FOUND; // TODO: better error code
             goto err;
         }
@@ -325,10 +355,10 @@ status_t minip_ipv4_send(pktbuf_t *p, ipv4_addr_t dest_addr, uint8_t proto) {
         target_addr = minip_gateway;
     }
 
-    dest_mac = arp_get_dest_mac(target_addr);
-    if (!dest_mac) {
-        pktbuf_free(p, true);
-        ret = -EHOSTUNREACH;
+    if (!arp_cache_lookup(target_addr, dest_mac)) {
+        // hold on to it until the neighbor answers, which fills in the destination
+        minip_ipv4_build(p, dest_addr, proto, bcast_mac, netif);
+        ret = arp_cache_queue(netif, target_addr, p);
         goto err;
     }
 
@@ -352,6 +382,12 @@ static void send_ping_reply(netif_t *netif, uint32_t ipaddr, struct icmp_pkt *re
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct icmp_pkt *icmp;
+    uint8_t dest_mac[6];
+
+    /* the request was just added to the cache, unless it came from somewhere odd */
+    if (!arp_cache_lookup(ipaddr, dest_mac)) {
+        return;
+    }
 
     if ((p = pktbuf_alloc()) == NULL) {
         return;
@@ -364,7 +400,7 @@ static void send_ping_reply(netif_t *netif, uint32_t ipaddr, struct icmp_pkt *re
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    minip_build_mac_hdr(netif, eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
+    minip_build_mac_hdr(netif, eth, dest_mac, ETH_TYPE_IPV4);
     minip_build_ipv4_hdr(netif, ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
@@ -421,14 +457,21 @@ __NO_INLINE static void handle_ipv4_packet(netif_t *netif, pktbuf_t *p, const ui
     }
 
     /* is the pkt_buf large enough to hold the length the header says the packet is? */
-    if (htons(ip->len) > p->dlen) {
-        LTRACEF("REJECT: packet exceeds size of buffer (header %d, dlen %d)\n", htons(ip->len), p->dlen);
+    size_t len = pktbuf_total_len(p);
+    if (htons(ip->len) > len) {
+        LTRACEF("REJECT: packet exceeds size of buffer (header %d, len %zu)\n", htons(ip->len), len);
         return;
     }
 
     /* trim any excess bytes at the end of the packet */
-    if (p->dlen > htons(ip->len)) {
-        pktbuf_consume_tail(p, p->dlen - htons(ip->len));
+    if (len > htons(ip->len)) {
+        pktbuf_trim_chain(p, htons(ip->len));
+    }
+
+    /* only tcp takes packets coalesced from several segments */
+    if (p->next && ip->proto != IP_PROTO_TCP) {
+        LTRACEF("REJECT: multi part packet for protocol %u\n", ip->proto);
+        return;
     }
 
     /* remove the header from the front of the packet_buf  */
@@ -437,7 +480,7 @@ __NO_INLINE static void handle_ipv4_packet(netif_t *netif, pktbuf_t *p, const ui
     }
 
     /* the packet is good, we can use it to populate our arp cache */
-    arp_cache_update(ip->src_addr, src_mac);
+    arp_cache_update(netif, ip->src_addr, src_mac, true);
 
     /* see if it's for us */
     if (ip->dst_addr != IPV4_BCAST) {
@@ -558,6 +601,7 @@ static void minip_init(uint level) {
     arp_cache_init();
     net_timer_init();
     netif_init();
+    tcp_init();
 }
 
 LK_INIT_HOOK(minip, minip_init, LK_INIT_LEVEL_THREADING);
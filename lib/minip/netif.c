@@ -13,9 +13,17 @@
 #include <lk/list.h>
 #include <lk/trace.h>
 #include <lib/minip.h>
+#include <arch/atomic.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <kernel/event.h>
+#include <kernel/mp.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <stdio.h>
 
 #include "minip-internal.h"
 
@@ -55,6 +63,7 @@ netif_t *netif_create(netif_t *n, const char *name) {
 
     n->magic = NETIF_MAGIC;
     strlcpy(n->name, name, sizeof(n->name));
+    list_initialize(&n->polls);
 
     return n;
 }
@@ -124,6 +133,11 @@ status_t netif_set_ipv4_addr(netif_t *n, ipv4_addr_t addr, uint8_t subnet_width)
     // set an ipv4 route for this
     ipv4_add_route(netif_get_network_ipv4(n), netif_get_netmask_ipv4(n), n);
 
+    // let the neighbors know, in case they knew the address as someone else
+    if ((n->flags & NETIF_FLAG_ETH_CONFIGURED) && !(n->flags & NETIF_FLAG_LOOPBACK) && addr != IPV4_NONE) {
+        arp_send_gratuitous(n);
+    }
+
     return NO_ERROR;
 }
 
@@ -146,3 +160,171 @@ void netif_dump(void) {
 
     mutex_release(&lock);
 }
+
+#define NETIF_POLL_SCHEDULED 1
+
+/* the polls scheduled on a cpu, and the thread that runs them */
+struct netif_poll_cpu {
+    spin_lock_t lock;
+    struct list_node list;
+    event_t event;
+    thread_t *thread;
+} __CPU_ALIGN;
+
+static struct netif_poll_cpu poll_cpus[SMP_MAX_CPUS];
+
+static void netif_poll_enqueue(struct netif_poll *np, uint cpu) {
+    struct netif_poll_cpu *pc = &poll_cpus[cpu];
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&pc->lock);
+    list_add_tail(&pc->list, &np->run_node);
+    spin_unlock_irqrestore(&pc->lock, state);
+
+    event_signal(&pc->event, false);
+}
+
+static void netif_poll_run(struct netif_poll *np, uint cpu) {
+    int done = np->ops->poll(np, np->budget);
+    np->polls++;
+
+    if (done >= np->budget) {
+        /* still busy, go around again once everything else queued here has had a turn */
+        np->exhausted++;
+        netif_poll_enqueue(np, cpu);
+        return;
+    }
+
+    /* idle, so back to waiting on the interrupt. Clear the state first, an interrupt
+     * coming in between here and irq_enable will have scheduled the poll again. */
+    atomic_and(&np->state, ~NETIF_POLL_SCHEDULED);
+    if (np->ops->irq_enable(np)) {
+        netif_poll_schedule(np);
+    }
+}
+
+void netif_poll_init(struct netif_poll *np, netif_t *n, const struct netif_poll_ops *ops,
+                     void *arg, int budget, int cpu) {
+    DEBUG_ASSERT(n->magic == NETIF_MAGIC);
+    DEBUG_ASSERT(ops && ops->poll && ops->irq_disable && ops->irq_enable);
+    DEBUG_ASSERT(budget > 0);
+
+    memset(np, 0, sizeof(*np));
+    np->ops = ops;
+    np->arg = arg;
+    np->netif = n;
+    np->budget = budget;
+    np->cpu = cpu;
+    list_clear_node(&np->run_node);
+
+    mutex_acquire(&lock);
+    list_add_tail(&n->polls, &np->node);
+    mutex_release(&lock);
+}
+
+void netif_poll_schedule(struct netif_poll *np) {
+    if (atomic_or(&np->state, NETIF_POLL_SCHEDULED) & NETIF_POLL_SCHEDULED) {
+        return; /* already polling */
+    }
+
+    np->schedules++;
+    np->ops->irq_disable(np);
+
+    uint cpu = (np->cpu >= 0 && mp_is_cpu_active(np->cpu)) ? (uint)np->cpu : arch_curr_cpu_num();
+    netif_poll_enqueue(np, cpu);
+}
+
+static int netif_poll_thread(void *arg) {
+    uint cpu = (uint)(uintptr_t)arg;
+    struct netif_poll_cpu *pc = &poll_cpus[cpu];
+
+    for (;;) {
+        event_wait(&pc->event);
+
+        for (;;) {
+            arch_interrupt_saved_state_t state = spin_lock_irqsave(&pc->lock);
+            struct netif_poll *np = list_remove_head_type(&pc->list, struct netif_poll, run_node);
+            spin_unlock_irqrestore(&pc->lock, state);
+
+            if (!np)
+                break;
+            netif_poll_run(np, cpu);
+        }
+    }
+
+    return 0;
+}
+
+static void netif_poll_init_early(uint level) {
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct netif_poll_cpu *pc = &poll_cpus[i];
+
+        spin_lock_init(&pc->lock);
+        list_initialize(&pc->list);
+        event_init(&pc->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    }
+}
+
+/* start the poll thread for the cpu this runs on */
+static void netif_poll_init_percpu(uint level) {
+    uint cpu = arch_curr_cpu_num();
+    struct netif_poll_cpu *pc = &poll_cpus[cpu];
+    char name[16];
+
+    snprintf(name, sizeof(name), "netif-poll-%u", cpu);
+    pc->thread = thread_create(name, &netif_poll_thread, (void *)(uintptr_t)cpu, HIGH_PRIORITY,
+                               DEFAULT_STACK_SIZE);
+    if (!pc->thread) {
+        dprintf(CRITICAL, "netif: failed to create poll thread for cpu %u\n", cpu);
+        return;
+    }
+    thread_set_pinned_cpu(pc->thread, cpu);
+    thread_detach_and_resume(pc->thread);
+}
+
+LK_INIT_HOOK(netif_poll, &netif_poll_init_early, LK_INIT_LEVEL_THREADING - 1);
+LK_INIT_HOOK_FLAGS(netif_poll_percpu, &netif_poll_init_percpu, LK_INIT_LEVEL_THREADING, LK_INIT_FLAG_ALL_CPUS);
+
+void netif_poll_receive(struct netif_poll *np, pktbuf_t *p) {
+    np->rx_packets++;
+
+    if (likely(netif_is_configured(np->netif))) {
+        minip_rx_driver_callback(np->netif, p);
+    }
+}
+
+void netif_poll_dump(lk_time_t sample_ms) {
+    netif_t *n;
+    struct netif_poll *np;
+
+    if (sample_ms > 0) {
+        mutex_acquire(&lock);
+        list_for_every_entry(&netif_list, n, netif_t, node) {
+            list_for_every_entry(&n->polls, np, struct netif_poll, node) {
+                np->last_rx_packets = np->rx_packets;
+                np->last_tx_packets = np->tx_packets;
+            }
+        }
+        mutex_release(&lock);
+
+        thread_sleep(sample_ms);
+    }
+
+    mutex_acquire(&lock);
+
+    list_for_every_entry(&netif_list, n, netif_t, node) {
+        uint i = 0;
+        list_for_every_entry(&n->polls, np, struct netif_poll, node) {
+            printf("%s poll %u: budget %d schedules %" PRIu64 " polls %" PRIu64 " exhausted %" PRIu64
+                   " rx %" PRIu64 " tx %" PRIu64, n->name, i++, np->budget, np->schedules, np->polls,
+                   np->exhausted, np->rx_packets, np->tx_packets);
+            if (sample_ms > 0) {
+                printf(" rx pps %" PRIu64 " tx pps %" PRIu64,
+                       (np->rx_packets - np->last_rx_packets) * 1000 / sample_ms,
+                       (np->tx_packets - np->last_tx_packets) * 1000 / sample_ms);
+            }
+            printf("\n");
+        }
+    }
+
+    mutex_release(&lock);
+}
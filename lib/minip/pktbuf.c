@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <lk/debug.h>
+#include <lk/err.h>
 #include <lk/trace.h>
 #include <malloc.h>
 #include <printf.h>
@@ -25,12 +26,22 @@
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
+#if WITH_LIB_SLAB
+#include <lib/slab.h>
+#endif
 
 #define LOCAL_TRACE 0
 
+#if WITH_LIB_SLAB
+/* objects come out of slabs of physically contiguous pages, the semaphore still
+ * bounds how many can be outstanding at once */
+static slab_cache_t pktbuf_cache = SLAB_CACHE_INITIAL_VALUE(pktbuf_cache, "pktbuf",
+                                                            sizeof(pktbuf_pool_object_t), CACHE_LINE);
+#else
 static pool_t pktbuf_pool;
-static semaphore_t pktbuf_sem;
 static spin_lock_t lock;
+#endif
+static semaphore_t pktbuf_sem;
 
 size_t pktbuf_recommended_eth_rx_depth(size_t requested_depth) {
     const size_t objects_per_rx = 2;
@@ -58,11 +69,21 @@ size_t pktbuf_recommended_eth_rx_depth(size_t requested_depth) {
 }
 
 /* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void) {
-    sem_wait(&pktbuf_sem);
+static void *get_pool_object(bool wait) {
+    if (wait) {
+        sem_wait(&pktbuf_sem);
+    } else if (sem_trywait(&pktbuf_sem) != NO_ERROR) {
+        return NULL;
+    }
+#if WITH_LIB_SLAB
+    void *entry = slab_alloc(&pktbuf_cache);
+    if (!entry)
+        sem_post(&pktbuf_sem, false);
+#else
     arch_interrupt_saved_state_t state = spin_lock_irqsave(&lock);
     pool_t *entry = pool_alloc(&pktbuf_pool);
     spin_unlock_irqrestore(&lock, state);
+#endif
 
     return (pktbuf_pool_object_t *)entry;
 }
@@ -71,9 +92,13 @@ static void *get_pool_object(void) {
 static void free_pool_object(pktbuf_pool_object_t *entry, bool reschedule) {
     DEBUG_ASSERT(entry);
 
+#if WITH_LIB_SLAB
+    slab_free(&pktbuf_cache, entry);
+#else
     arch_interrupt_saved_state_t state = spin_lock_irqsave(&lock);
     pool_free(&pktbuf_pool, entry);
     spin_unlock_irqrestore(&lock, state);
+#endif
     sem_post(&pktbuf_sem, reschedule);
 }
 
@@ -105,6 +130,10 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
     p->flags = PKTBUF_FLAG_EOF | flags;
     p->cb = cb;
     p->cb_args = cb_args;
+    p->next = NULL;
+    p->csum_start = 0;
+    p->csum_offset = 0;
+    p->gso_size = 0;
 
     /* If we're using a VM then this may be a virtual address, look up to see
      * if there is an associated physical address we can store. If not, then
@@ -117,16 +146,16 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
 #endif
 }
 
-pktbuf_t *pktbuf_alloc(void) {
+pktbuf_t *pktbuf_alloc_etc(bool wait) {
     pktbuf_t *p = NULL;
     void *buf = NULL;
 
-    p = get_pool_object();
+    p = get_pool_object(wait);
     if (!p) {
         return NULL;
     }
 
-    buf = get_pool_object();
+    buf = get_pool_object(wait);
     if (!buf) {
         free_pool_object((pktbuf_pool_object_t *)p, false);
         return NULL;
@@ -137,6 +166,48 @@ pktbuf_t *pktbuf_alloc(void) {
     return p;
 }
 
+pktbuf_t *pktbuf_alloc(void) {
+    return pktbuf_alloc_etc(true);
+}
+
+/* Move the buffer out of p, along with the data in it, into a new pktbuf and give p a
+ * fresh buffer from the pool in its place. This lets the stack hang on to a received
+ * packet without copying it while the driver goes on to reuse p. Only buffers that
+ * came from the pool can be moved.
+ */
+pktbuf_t *pktbuf_detach(pktbuf_t *p) {
+    DEBUG_ASSERT(p);
+
+    if (p->cb != free_pktbuf_buf_cb) {
+        return NULL;
+    }
+
+    pktbuf_t *q = get_pool_object(false);
+    if (!q) {
+        return NULL;
+    }
+
+    void *buf = get_pool_object(false);
+    if (!buf) {
+        free_pool_object((pktbuf_pool_object_t *)q, false);
+        return NULL;
+    }
+
+    *q = *p;
+    list_clear_node(&q->list);
+    q->next = NULL;
+    q->flags |= PKTBUF_FLAG_EOF;
+
+    /* p stays where it was in any packet the driver is holding it in */
+    pktbuf_t *next = p->next;
+    u32 flags = p->flags;
+    pktbuf_add_buffer(p, buf, PKTBUF_SIZE, p->data - p->buffer, p->flags & PKTBUF_FLAG_CACHED,
+                      free_pktbuf_buf_cb, NULL);
+    p->next = next;
+    p->flags = flags;
+    return q;
+}
+
 void pktbuf_reset(pktbuf_t *p, uint32_t header_sz) {
     DEBUG_ASSERT(p);
     DEBUG_ASSERT(p->buffer);
@@ -147,9 +218,13 @@ void pktbuf_reset(pktbuf_t *p, uint32_t header_sz) {
 }
 
 pktbuf_t *pktbuf_alloc_empty(void) {
-    pktbuf_t *p = (pktbuf_t *)get_pool_object();
+    pktbuf_t *p = (pktbuf_t *)get_pool_object(true);
+    if (!p) {
+        return NULL;
+    }
 
     p->flags = PKTBUF_FLAG_EOF;
+    p->next = NULL;
     return p;
 }
 
@@ -164,6 +239,35 @@ int pktbuf_free(pktbuf_t *p, bool reschedule) {
     return 1;
 }
 
+void pktbuf_free_chain(pktbuf_t *p, bool reschedule) {
+    while (p) {
+        pktbuf_t *next = p->next;
+        pktbuf_free(p, reschedule);
+        p = next;
+    }
+}
+
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *q) {
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(q);
+
+    while (p->next) {
+        p = p->next;
+    }
+
+    p->next = q;
+    p->flags &= ~PKTBUF_FLAG_EOF;
+}
+
+void pktbuf_trim_chain(pktbuf_t *p, size_t len) {
+    for (; p; p = p->next) {
+        if (p->dlen > len) {
+            p->dlen = len;
+        }
+        len -= p->dlen;
+    }
+}
+
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
     if (pktbuf_avail_tail(p) < sz) {
         panic("pktbuf_append_data: overflow");
@@ -223,6 +327,10 @@ void pktbuf_dump(pktbuf_t *p) {
 }
 
 static void pktbuf_init(uint level) {
+#if WITH_LIB_SLAB
+    /* the slab cache grows on demand */
+    sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+#else
     void *slab;
 
 #if LK_DEBUGLEVEL > 0
@@ -243,6 +351,7 @@ static void pktbuf_init(uint level) {
 
     pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
     sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+#endif
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
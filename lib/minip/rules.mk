@@ -3,7 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
-	lib/cbuf \
+	lib/dpc \
 	lib/iovec \
 	lib/libcpp \
 	lib/pool
@@ -18,8 +18,12 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/netif.c \
 	$(LOCAL_DIR)/pktbuf.c \
 	$(LOCAL_DIR)/tcp.c \
+	$(LOCAL_DIR)/tcp_cc.c \
 	$(LOCAL_DIR)/udp.c
 
+# vectorized checksums, where the arch has them
+-include $(LOCAL_DIR)/arch/$(ARCH)/rules.mk
+
 MODULE_OPTIONS := test
 
 include make/module.mk
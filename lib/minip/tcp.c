@@ -11,14 +11,18 @@
 #include <lk/trace.h>
 #include <assert.h>
 #include <lk/compiler.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <lk/err.h>
 #include <string.h>
 #include <sys/types.h>
 #include <lk/console_cmd.h>
-#include <lib/cbuf.h>
+#include <lib/dpc.h>
+#include <lib/minip/tcp_cc.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
+#include <kernel/spinlock.h>
 #include <arch/ops.h>
 #include <platform.h>
 #include <arch/atomic.h>
@@ -36,11 +40,57 @@ typedef struct tcp_header {
     uint16_t urg_pointer;
 } __PACKED tcp_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+/* option kinds */
+#define TCP_OPT_EOL       0
+#define TCP_OPT_NOP       1
+#define TCP_OPT_MSS       2
+#define TCP_OPT_WS        3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK      5
+#define TCP_OPT_TS        8
+
+#define TCP_MAX_OPTIONS_LEN 40
+#define TCP_TS_OPTION_LEN   12 // padded with 2 NOPs
+#define TCP_MAX_WSCALE      14
+#define TCP_MAX_SACK_BLOCKS 4
+
+struct tcp_sack_block {
+    uint32_t start;
+    uint32_t end; // one past the last byte
+};
+
+/* the options we understand out of a received segment */
+struct tcp_options {
+    uint16_t mss;       // 0 if not present
+    int8_t   wscale;    // -1 if not present
+    bool     sack_perm;
+    bool     has_ts;
+    uint32_t tsval;
+    uint32_t tsecr;
+    uint     sack_count;
+    struct tcp_sack_block sack[TCP_MAX_SACK_BLOCKS];
+};
+
+/* a segment that arrived ahead of the left edge of our receive window */
+struct tcp_ooo_segment {
+    struct list_node node;
+    uint32_t seq;
+    uint32_t len;
+    uint8_t  data[];
+};
+
+/*
+ * A segment's worth of data waiting to be sent or acked. The payload sits in a
+ * pktbuf with TCP_HEADROOM in front of it, so a segment is sent by pointing
+ * another pktbuf header at the same buffer and building the headers in place.
+ */
+struct tcp_tx_segment {
+    struct list_node node;
+    uint32_t seq;
+    pktbuf_t *p;
+    volatile int ref; // the socket's, plus one per pktbuf the driver still holds
+    bool copied;      // filled from tcp_write(), so later writes can add to it
+};
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -65,8 +115,14 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+/* how many SACKed ranges we remember of the data we've sent */
+#define TCP_SACK_SCOREBOARD 8
+
+struct tcp_hash_bucket;
+
 typedef struct tcp_socket {
     struct list_node node;
+    struct tcp_hash_bucket *bucket; // socket table bucket we're on, if any
 
     mutex_t lock;
     volatile int ref;
@@ -80,24 +136,64 @@ typedef struct tcp_socket {
 
     uint32_t mss;
 
+    /* options negotiated on the handshake. offered until the remote's SYN says otherwise */
+    bool     ws_ok;
+    bool     sack_ok;
+    bool     ts_ok;
+    uint8_t  snd_wscale;    // shift applied to the windows they advertise
+    uint8_t  rcv_wscale;    // shift applied to the windows we advertise
+    uint32_t ts_recent;     // their latest timestamp, echoed back to them
+    uint32_t last_ack_sent;
+
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
     uint32_t rx_win_high;
-    uint8_t  *rx_buffer_raw;
-    cbuf_t   rx_buffer;
+    struct list_node rx_queue; // pktbufs of in order data waiting to be read
+    uint32_t rx_queued;        // bytes in rx_queue
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
+    struct list_node ooo_list; // out of order segments, sorted and non overlapping
+    uint32_t ooo_count;
+    uint32_t ooo_last_seq;     // start of the most recently queued one, reported first in SACKs
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
-    uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer_raw; // our outgoing buffer backing memory
-    cbuf_t   tx_buffer;   // our outgoing circular buffer
+    uint32_t tx_highest_seq; // next new sequence to send, pulled back to tx_win_low after a timeout
+    uint32_t tx_max_seq;     // highest sequence we have ever txed them
+    struct list_node tx_list; // tcp_tx_segments from tx_win_low on
+    uint32_t tx_queued;       // bytes in tx_list
     event_t  tx_event;
     net_timer_t retransmit_timer;
+    struct tcp_sack_block sacked[TCP_SACK_SCOREBOARD]; // ranges above tx_win_low they hold, sorted
+    uint     sacked_count;
+
+    /* congestion control and retransmit timing */
+    struct tcp_cc cc;
+    struct tcp_rtt rtt;
+    uint32_t dupacks;
+    bool     in_recovery;
+    uint32_t recover;   // tx_max_seq when the last loss was detected
+    bool     rtt_timing; // timing a segment, when there are no timestamps to do it with
+    uint32_t rtt_seq;
+    lk_time_t rtt_start;
+
+    /* counters */
+    struct {
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        uint64_t bytes_retrans;
+        uint32_t segs_in;
+        uint32_t segs_out;
+        uint32_t segs_tso;
+        uint32_t segs_retrans;
+        uint32_t dupacks_in;
+        uint32_t ooo_in;
+        uint32_t fast_retransmits;
+        uint32_t timeouts;
+    } stats;
 
     /* listen accept */
     semaphore_t accept_sem;
@@ -110,10 +206,39 @@ typedef struct tcp_socket {
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
-#define DEFAULT_RX_WINDOW_SIZE (8192)
-#define DEFAULT_TX_BUFFER_SIZE (8192)
+#define MIN_MSS (536) // assumed if they don't send an mss option
+
+/* windows over 64KB are advertised with window scaling */
+#ifndef DEFAULT_RX_WINDOW_SIZE
+#define DEFAULT_RX_WINDOW_SIZE (65536)
+#endif
+#ifndef DEFAULT_TX_BUFFER_SIZE
+#define DEFAULT_TX_BUFFER_SIZE (65536)
+#endif
+
+/* data segments carry at most the timestamp option, and a full one has to fit behind the headroom */
+STATIC_ASSERT(TCP_HEADROOM >= sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr) + sizeof(tcp_header_t) + TCP_TS_OPTION_LEN);
+STATIC_ASSERT(PKTBUF_SIZE - TCP_HEADROOM >= DEFAULT_MSS);
+
+/*
+ * most data sent in one segment to an interface that does tcp segmentation offload,
+ * which has to fit in a single ip packet, and most pktbufs it's gathered from
+ */
+#define TCP_TSO_MAX_SIZE (0xffff - sizeof(struct ipv4_hdr) - sizeof(tcp_header_t) - TCP_MAX_OPTIONS_LEN)
+#define TCP_TSO_MAX_PARTS (48)
+
+/* received segments smaller than this are copied rather than holding on to a whole pktbuf */
+#define TCP_RX_COPYBREAK (256)
+
+/* most out of order segments held per socket, past this new ones are dropped */
+#define TCP_MAX_OOO_SEGMENTS (64)
+
+/* most un-acked segments resent per retransmit, when SACK shows several holes */
+#define TCP_MAX_RETRANSMIT_SEGMENTS (4)
+
+/* duplicate acks that start a fast retransmit */
+#define TCP_DUPACK_THRESHOLD (3)
 
-#define RETRANSMIT_TIMEOUT (250)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
@@ -124,26 +249,58 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
-static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+/*
+ * The socket table. Connected sockets are hashed on their full 4-tuple and
+ * listening sockets on their local port, each in a table of their own, so
+ * demuxing a segment only looks at the few sockets sharing its bucket. Every
+ * bucket has its own lock, so segments for different connections don't
+ * serialize on each other.
+ */
+#ifndef TCP_HASH_BUCKETS
+#define TCP_HASH_BUCKETS 1024
+#endif
+#define TCP_LISTEN_HASH_BUCKETS 64
+
+STATIC_ASSERT((TCP_HASH_BUCKETS & (TCP_HASH_BUCKETS - 1)) == 0);
+STATIC_ASSERT((TCP_LISTEN_HASH_BUCKETS & (TCP_LISTEN_HASH_BUCKETS - 1)) == 0);
+
+struct tcp_hash_bucket {
+    spin_lock_t lock;
+    struct list_node list;
+};
+
+static struct tcp_hash_bucket tcp_conn_hash[TCP_HASH_BUCKETS];
+static struct tcp_hash_bucket tcp_listen_hash[TCP_LISTEN_HASH_BUCKETS];
 
 static bool tcp_debug = false;
 
+/* congestion control new sockets start out with */
+static const struct tcp_cc_ops *tcp_cc_default = &tcp_cc_cubic;
+
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr_t remote_ip, ipv4_addr_t local_ip, uint16_t remote_port, uint16_t local_port);
-static void add_socket_to_list(tcp_socket_t *s);
+static status_t add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
+static tcp_socket_t *create_tcp_socket(void);
 static status_t tcp_send(ipv4_addr_t dest_ip, uint16_t dest_port, ipv4_addr_t src_ip, uint16_t src_port,
                          const iovec_t *iov, size_t iov_cnt,
                          tcp_flags_t flags, const void *options, size_t options_length,
                          uint32_t ack, uint32_t sequence, uint16_t window_size);
+static status_t tcp_send_pktbuf(pktbuf_t *p, ipv4_addr_t dest_ip, uint16_t dest_port, ipv4_addr_t src_ip,
+                                uint16_t src_port, tcp_flags_t flags, const void *options, size_t options_length,
+                                uint32_t ack, uint32_t sequence, uint16_t window_size);
 static status_t tcp_socket_send(tcp_socket_t *s, const iovec_t *iov, size_t iov_cnt,
-                                tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+                                tcp_flags_t flags, uint32_t sequence);
+static status_t tcp_socket_send_pktbuf(tcp_socket_t *s, pktbuf_t *p, tcp_flags_t flags, uint32_t sequence);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len,
+                       const struct tcp_options *opts);
+static void tcp_ooo_free(tcp_socket_t *s);
+static void tcp_rx_free(tcp_socket_t *s);
+static void tcp_tx_free(tcp_socket_t *s);
 static ssize_t tcp_write_pending_data(tcp_socket_t *s);
+static ssize_t tcp_retransmit(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -197,83 +354,149 @@ static void dump_socket(tcp_socket_t *s) {
            s, s->state, tcp_state_to_string(s->state),
            s->local_ip, s->local_port, s->remote_ip, s->remote_port, s->ref);
     if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) {
-        printf("\trx: wsize %u wlo %u whi %u (%u)\n",
+        printf("\trx: wsize %u wlo %u whi %u (%u) queued %u\n",
                s->rx_win_size, s->rx_win_low, s->rx_win_high,
-               s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %zu space_used %u\n",
+               s->rx_win_high - s->rx_win_low, s->rx_queued);
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u queued %u\n",
                s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-               cbuf_size(&s->tx_buffer), (uint32_t)cbuf_space_used(&s->tx_buffer));
+               DEFAULT_TX_BUFFER_SIZE, s->tx_queued);
+        printf("\toptions: mss %u wscale %s%u/%u sack %u timestamps %u, %u out of order, %u sacked ranges\n",
+               s->mss, s->ws_ok ? "" : "(off) ", s->snd_wscale, s->rcv_wscale, s->sack_ok, s->ts_ok,
+               s->ooo_count, s->sacked_count);
+        printf("\tcc: %s cwnd %u ssthresh %u%s, srtt %u rttvar %u rto %u\n",
+               s->cc.ops->name, s->cc.cwnd, s->cc.ssthresh, s->in_recovery ? " (recovering)" : "",
+               tcp_rtt_srtt(&s->rtt), tcp_rtt_var(&s->rtt), s->rtt.rto);
+        printf("\tin: %u segs %llu bytes, %u out of order, %u dup acks\n",
+               s->stats.segs_in, s->stats.bytes_in, s->stats.ooo_in, s->stats.dupacks_in);
+        printf("\tout: %u segs (%u tso) %llu bytes, %u retransmitted %llu bytes, %u fast retransmits, %u timeouts\n",
+               s->stats.segs_out, s->stats.segs_tso, s->stats.bytes_out, s->stats.segs_retrans, s->stats.bytes_retrans,
+               s->stats.fast_retransmits, s->stats.timeouts);
     }
 }
 
 
 
+static uint32_t tcp_hash(ipv4_addr_t remote_ip, ipv4_addr_t local_ip, uint16_t remote_port, uint16_t local_port) {
+    uint32_t h = remote_ip ^ (local_ip * 0x9e3779b1) ^ (((uint32_t)remote_port << 16) | local_port);
+
+    /* murmur3 finalizer, so every input bit reaches the low bits we index with */
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static struct tcp_hash_bucket *conn_bucket(ipv4_addr_t remote_ip, ipv4_addr_t local_ip, uint16_t remote_port, uint16_t local_port) {
+    return &tcp_conn_hash[tcp_hash(remote_ip, local_ip, remote_port, local_port) & (TCP_HASH_BUCKETS - 1)];
+}
+
+static struct tcp_hash_bucket *listen_bucket(uint16_t local_port) {
+    return &tcp_listen_hash[tcp_hash(0, 0, 0, local_port) & (TCP_LISTEN_HASH_BUCKETS - 1)];
+}
+
+/* the listening socket on a port, with its bucket lock held */
+static tcp_socket_t *find_listen_socket_locked(struct tcp_hash_bucket *b, uint16_t local_port) {
+    DEBUG_ASSERT(spin_lock_held(&b->lock));
+
+    tcp_socket_t *s;
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port)
+            return s;
+    }
+    return NULL;
+}
+
 static tcp_socket_t *lookup_socket(ipv4_addr_t remote_ip, ipv4_addr_t local_ip, uint16_t remote_port, uint16_t local_port) {
     LTRACEF_LEVEL(2, "remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    /* connected sockets first, on a full match */
+    struct tcp_hash_bucket *b = conn_bucket(remote_ip, local_ip, remote_port, local_port);
+    tcp_socket_t *s;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&b->lock);
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_CLOSED)
             continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
-        }
-    }
-
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+        if (s->remote_ip == remote_ip &&
+                s->local_ip == local_ip &&
+                s->remote_port == remote_port &&
+                s->local_port == local_port) {
+            /* bump the ref before returning it */
+            inc_socket_ref(s);
+            spin_unlock_irqrestore(&b->lock, state);
+            return s;
         }
     }
+    spin_unlock_irqrestore(&b->lock, state);
 
-    /* fall through case returns null */
-    s = NULL;
+    /* sockets in listen state only care about local port */
+    b = listen_bucket(local_port);
 
-out:
-    /* bump the ref before returning it */
+    state = spin_lock_irqsave(&b->lock);
+    s = find_listen_socket_locked(b, local_port);
     if (s)
         inc_socket_ref(s);
-
-    mutex_release(&tcp_socket_list_lock);
+    spin_unlock_irqrestore(&b->lock, state);
 
     return s;
 }
 
-static void add_socket_to_list(tcp_socket_t *s) {
+/* put a socket in the table. a listening socket fails if its port is taken */
+static status_t add_socket_to_list(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
+    DEBUG_ASSERT(!s->bucket);
+
+    struct tcp_hash_bucket *b;
+    if (s->state == STATE_LISTEN)
+        b = listen_bucket(s->local_port);
+    else
+        b = conn_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&b->lock);
+
+    if (s->state == STATE_LISTEN && find_listen_socket_locked(b, s->local_port)) {
+        spin_unlock_irqrestore(&b->lock, state);
+        return ERR_ALREADY_EXISTS;
+    }
 
-    mutex_acquire(&tcp_socket_list_lock);
+    list_add_head(&b->list, &s->node);
+    s->bucket = b;
 
-    list_add_head(&tcp_socket_list, &s->node);
+    spin_unlock_irqrestore(&b->lock, state);
 
-    mutex_release(&tcp_socket_list_lock);
+    return NO_ERROR;
 }
 
 static void remove_socket_from_list(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    struct tcp_hash_bucket *b = s->bucket;
+    DEBUG_ASSERT(b);
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&b->lock);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
+    s->bucket = NULL;
+
+    spin_unlock_irqrestore(&b->lock, state);
+}
 
-    mutex_release(&tcp_socket_list_lock);
+void tcp_init(void) {
+    for (uint i = 0; i < TCP_HASH_BUCKETS; i++) {
+        spin_lock_init(&tcp_conn_hash[i].lock);
+        list_initialize(&tcp_conn_hash[i].list);
+    }
+    for (uint i = 0; i < TCP_LISTEN_HASH_BUCKETS; i++) {
+        spin_lock_init(&tcp_listen_hash[i].lock);
+        list_initialize(&tcp_listen_hash[i].list);
+    }
 }
 
 static void inc_socket_ref(tcp_socket_t *s) {
@@ -300,8 +523,9 @@ static bool dec_socket_ref(tcp_socket_t *s) {
         event_destroy(&s->rx_event);
         event_destroy(&s->connect_event);
 
-        free(s->rx_buffer_raw);
-        free(s->tx_buffer_raw);
+        tcp_ooo_free(s);
+        tcp_rx_free(s);
+        tcp_tx_free(s);
 
         free(s);
     }
@@ -325,7 +549,112 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer) {
         dec_socket_ref(s);
 }
 
-void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
+static uint16_t get_be16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be16(uint8_t *p, uint16_t val) {
+    p[0] = val >> 8;
+    p[1] = val;
+}
+
+static void put_be32(uint8_t *p, uint32_t val) {
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void tcp_parse_options(const uint8_t *opt, size_t len, struct tcp_options *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->wscale = -1;
+
+    while (len > 0) {
+        uint8_t kind = opt[0];
+        if (kind == TCP_OPT_EOL)
+            break;
+        if (kind == TCP_OPT_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+
+        /* everything else is kind, length, data. stop at anything malformed */
+        if (len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+        uint8_t olen = opt[1];
+
+        switch (kind) {
+            case TCP_OPT_MSS:
+                if (olen == 4)
+                    opts->mss = get_be16(opt + 2);
+                break;
+            case TCP_OPT_WS:
+                if (olen == 3)
+                    opts->wscale = MIN(opt[2], TCP_MAX_WSCALE);
+                break;
+            case TCP_OPT_SACK_PERM:
+                if (olen == 2)
+                    opts->sack_perm = true;
+                break;
+            case TCP_OPT_SACK:
+                for (uint i = 0; i < (olen - 2u) / 8 && i < TCP_MAX_SACK_BLOCKS; i++) {
+                    opts->sack[i].start = get_be32(opt + 2 + i * 8);
+                    opts->sack[i].end = get_be32(opt + 6 + i * 8);
+                    opts->sack_count++;
+                }
+                break;
+            case TCP_OPT_TS:
+                if (olen == 10) {
+                    opts->has_ts = true;
+                    opts->tsval = get_be32(opt + 2);
+                    opts->tsecr = get_be32(opt + 6);
+                }
+                break;
+        }
+
+        opt += olen;
+        len -= olen;
+    }
+}
+
+/* the smallest shift that lets a window of this size fit in the 16 bit header field */
+static uint8_t tcp_wscale_for(uint32_t win_size) {
+    uint8_t shift = 0;
+    while (shift < TCP_MAX_WSCALE && ((win_size - 1) >> shift) > 0xffff)
+        shift++;
+    return shift;
+}
+
+/* resolve what the remote agreed to from the options on their SYN */
+static void tcp_negotiate_options(tcp_socket_t *s, const struct tcp_options *opts) {
+    s->mss = MIN(s->mss, opts->mss ? opts->mss : MIN_MSS);
+
+    if (s->ws_ok && opts->wscale >= 0) {
+        s->snd_wscale = opts->wscale;
+    } else {
+        s->ws_ok = false;
+        s->snd_wscale = 0;
+        s->rcv_wscale = 0;
+    }
+
+    s->sack_ok = s->sack_ok && opts->sack_perm;
+    s->ts_ok = s->ts_ok && opts->has_ts;
+    if (s->ts_ok)
+        s->ts_recent = opts->tsval;
+
+    /* the mss doesn't count options, so leave room for the timestamp on every segment */
+    if (s->ts_ok)
+        s->mss -= TCP_TS_OPTION_LEN;
+
+    tcp_cc_init(&s->cc, s->cc.ops, s->mss);
+}
+
+static void tcp_input_segment(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
     if (unlikely(tcp_debug))
         TRACEF("p %p (len %u), src_ip 0x%x, dst_ip 0x%x\n", p, p->dlen, src_ip, dst_ip);
 
@@ -355,9 +684,9 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         pheader.dest_addr = dst_ip;
         pheader.zero = 0;
         pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+        pheader.tcp_length = htons(pktbuf_total_len(p));
 
-        uint16_t checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        uint16_t checksum = cksum_pheader_pktbuf(&pheader, p);
         if (checksum != 0) {
             TRACEF("REJECT: failed checksum, header says 0x%x, we got 0x%x\n", header->checksum, checksum);
             return;
@@ -373,9 +702,12 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
     header->win_size = ntohs(header->win_size);
     header->urg_pointer = ntohs(header->urg_pointer);
 
+    struct tcp_options opts;
+    tcp_parse_options((const uint8_t *)(header + 1), header_len - MIN(header_len, sizeof(tcp_header_t)), &opts);
+
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
-    size_t data_len = p->dlen - header_len;
+    size_t data_len = pktbuf_total_len(p) - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
 
     /* see if it matches a socket we have */
@@ -393,6 +725,8 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
 
     mutex_acquire(&s->lock);
 
+    s->stats.segs_in++;
+
     /* check to see if they're resetting us */
     if (packet_flags & PKT_RST) {
         if (s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
@@ -401,6 +735,22 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         goto done;
     }
 
+    /* timestamps, once they're in use on an open connection */
+    if (s->ts_ok && opts.has_ts && s->state != STATE_LISTEN && s->state != STATE_SYN_SENT) {
+        if (SEQUENCE_LT(opts.tsval, s->ts_recent)) {
+            /* older than something we've already taken, a stale duplicate from a wrapped sequence */
+            send_ack(s);
+            goto done;
+        }
+        if (SEQUENCE_LTE(header->seq_num, s->last_ack_sent))
+            s->ts_recent = opts.tsval;
+    }
+
+    /* windows are only scaled outside of SYNs */
+    uint32_t win_size = header->win_size;
+    if (!(packet_flags & PKT_SYN))
+        win_size <<= s->snd_wscale;
+
     switch (s->state) {
         case STATE_CLOSED:
             /* socket closed, send RST */
@@ -419,7 +769,7 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
                 goto done;
 
             /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            tcp_socket_t *accept_socket = create_tcp_socket();
             if (!accept_socket)
                 goto done;
 
@@ -429,6 +779,7 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
             accept_socket->state = STATE_SYN_RCVD;
+            tcp_negotiate_options(accept_socket, &opts);
 
             /* look up and cache the route for the accepted socket */
             ipv4_route_t *route = ipv4_search_route(src_ip);
@@ -449,15 +800,8 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
-
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
-                            accept_socket->tx_win_low);
+            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
             accept_socket->tx_win_low++;
@@ -478,8 +822,10 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + win_size;
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_max_seq = s->tx_win_low;
+                s->recover = s->tx_win_low - 1;
 
                 s->state = STATE_ESTABLISHED;
             } else {
@@ -508,13 +854,17 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
                 goto send_reset;
             }
 
+            tcp_negotiate_options(s, &opts);
+
             // remember their sequence
             s->rx_win_low = header->seq_num + 1;
             s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
 
             s->tx_win_low++;
-            s->tx_win_high = s->tx_win_low + header->win_size;
+            s->tx_win_high = s->tx_win_low + win_size;
             s->tx_highest_seq = s->tx_win_low;
+            s->tx_max_seq = s->tx_win_low;
+            s->recover = s->tx_win_low - 1;
 
             s->state = STATE_ESTABLISHED;
 
@@ -529,12 +879,12 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, win_size, data_len, &opts);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -555,7 +905,7 @@ void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, win_size, data_len, &opts);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -629,13 +979,257 @@ send_reset:
     }
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence) {
+/*
+ * Inbound impairment, for exercising loss and reordering recovery against a
+ * clean link. A fraction of segments are dropped, and a fraction are held back
+ * and delivered right after the segment following them.
+ */
+static uint tcp_impair_drop;    // per mille
+static uint tcp_impair_reorder; // per mille
+static mutex_t tcp_impair_lock = MUTEX_INITIAL_VALUE(tcp_impair_lock);
+static struct {
+    pktbuf_t *p;
+    netif_t *netif;
+    uint32_t src_ip;
+    uint32_t dst_ip;
+} tcp_impair_held;
+
+static void tcp_impair_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
+    uint roll = rand() % 1000;
+    if (roll < tcp_impair_drop)
+        return;
+
+    mutex_acquire(&tcp_impair_lock);
+
+    if (!tcp_impair_held.p && !p->next && roll < tcp_impair_drop + tcp_impair_reorder) {
+        /* the caller owns p, so hold back a copy of it */
+        pktbuf_t *copy = pktbuf_alloc();
+        if (copy) {
+            pktbuf_append_data(copy, p->data, p->dlen);
+            copy->flags |= p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD;
+            tcp_impair_held.p = copy;
+            tcp_impair_held.netif = netif;
+            tcp_impair_held.src_ip = src_ip;
+            tcp_impair_held.dst_ip = dst_ip;
+            mutex_release(&tcp_impair_lock);
+            return;
+        }
+    }
+
+    pktbuf_t *held = tcp_impair_held.p;
+    netif_t *held_netif = tcp_impair_held.netif;
+    uint32_t held_src_ip = tcp_impair_held.src_ip;
+    uint32_t held_dst_ip = tcp_impair_held.dst_ip;
+    tcp_impair_held.p = NULL;
+
+    mutex_release(&tcp_impair_lock);
+
+    tcp_input_segment(netif, p, src_ip, dst_ip);
+    if (held) {
+        tcp_input_segment(held_netif, held, held_src_ip, held_dst_ip);
+        pktbuf_free(held, true);
+    }
+}
+
+void tcp_input(netif_t *netif, pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip) {
+    if (unlikely(tcp_impair_drop || tcp_impair_reorder)) {
+        tcp_impair_input(netif, p, src_ip, dst_ip);
+        return;
+    }
+
+    tcp_input_segment(netif, p, src_ip, dst_ip);
+}
+
+/*
+ * Receive queue. In order data waits here for the reader as a list of pktbufs.
+ * Full sized segments are kept in the pktbuf they arrived in, taking it over
+ * from the driver, and small ones are copied onto the end of the last one.
+ */
+static size_t tcp_rx_append(tcp_socket_t *s, const uint8_t *data, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        pktbuf_t *tail = list_peek_tail_type(&s->rx_queue, pktbuf_t, list);
+        if (!tail || pktbuf_avail_tail(tail) == 0) {
+            /* this is on the receive path, don't wait on the pool for it */
+            tail = pktbuf_alloc_etc(false);
+            if (!tail)
+                break;
+            pktbuf_reset(tail, 0);
+            list_add_tail(&s->rx_queue, &tail->list);
+        }
+
+        size_t n = MIN(len - done, pktbuf_avail_tail(tail));
+        pktbuf_append_data(tail, data + done, n);
+        done += n;
+    }
+
+    s->rx_queued += done;
+    return done;
+}
+
+/* queue len bytes from offset into p, returns how many there was room for */
+static size_t tcp_rx_queue_pktbuf(tcp_socket_t *s, pktbuf_t *p, size_t offset, size_t len) {
+    if (len >= TCP_RX_COPYBREAK) {
+        pktbuf_t *q = pktbuf_detach(p);
+        if (q) {
+            pktbuf_consume(q, offset);
+            q->dlen = len;
+            list_add_tail(&s->rx_queue, &q->list);
+            s->rx_queued += len;
+            return len;
+        }
+    }
+
+    return tcp_rx_append(s, p->data + offset, len);
+}
+
+static void tcp_rx_free(tcp_socket_t *s) {
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&s->rx_queue, pktbuf_t, list)))
+        pktbuf_free(p, true);
+    s->rx_queued = 0;
+}
+
+/*
+ * Out of order queue. Segments beyond the left edge of the receive window are
+ * kept here, trimmed against each other so no byte is stored twice, until the
+ * hole in front of them is filled.
+ */
+static void tcp_ooo_free(tcp_socket_t *s) {
+    struct tcp_ooo_segment *seg;
+    while ((seg = list_remove_head_type(&s->ooo_list, struct tcp_ooo_segment, node)))
+        free(seg);
+    s->ooo_count = 0;
+}
+
+static bool tcp_ooo_insert_before(tcp_socket_t *s, struct list_node *before,
+                                  uint32_t seq, const uint8_t *data, uint32_t len) {
+    if (s->ooo_count >= TCP_MAX_OOO_SEGMENTS)
+        return false;
+
+    struct tcp_ooo_segment *seg = malloc(sizeof(*seg) + len);
+    if (!seg)
+        return false;
+
+    seg->seq = seq;
+    seg->len = len;
+    memcpy(seg->data, data, len);
+    list_add_before(before, &seg->node);
+    s->ooo_count++;
+    s->ooo_last_seq = seq;
+
+    return true;
+}
+
+static void tcp_ooo_add(tcp_socket_t *s, uint32_t seq, const uint8_t *data, uint32_t len) {
+    DEBUG_ASSERT(SEQUENCE_GT(seq, s->rx_win_low));
+
+    /* only keep what fits in the window we've advertised */
+    uint32_t win_end = s->rx_win_high + 1;
+    if (SEQUENCE_GTE(seq, win_end))
+        return;
+    if (SEQUENCE_GT(seq + len, win_end))
+        len = win_end - seq;
+
+    struct list_node *pos = s->ooo_list.next;
+    while (pos != &s->ooo_list && len > 0) {
+        struct tcp_ooo_segment *seg = containerof(pos, struct tcp_ooo_segment, node);
+        uint32_t seg_end = seg->seq + seg->len;
+
+        if (SEQUENCE_LTE(seg_end, seq)) {
+            /* entirely before us */
+            pos = pos->next;
+            continue;
+        }
+        if (SEQUENCE_LTE(seq + len, seg->seq)) {
+            /* entirely after us, we go in front of it */
+            break;
+        }
+
+        /* overlapping, keep the part in front of it and skip what it already holds */
+        if (SEQUENCE_LT(seq, seg->seq)) {
+            if (!tcp_ooo_insert_before(s, pos, seq, data, seg->seq - seq))
+                return;
+        }
+        if (SEQUENCE_GTE(seg_end, seq + len))
+            return;
+
+        data += seg_end - seq;
+        len -= seg_end - seq;
+        seq = seg_end;
+        pos = pos->next;
+    }
+
+    if (len > 0)
+        tcp_ooo_insert_before(s, pos, seq, data, len);
+}
+
+/* move whatever the in order data has now reached into the receive buffer */
+static bool tcp_ooo_drain(tcp_socket_t *s) {
+    bool moved = false;
+
+    struct tcp_ooo_segment *seg;
+    while ((seg = list_peek_head_type(&s->ooo_list, struct tcp_ooo_segment, node))) {
+        if (SEQUENCE_GT(seg->seq, s->rx_win_low))
+            break;
+
+        uint32_t seg_end = seg->seq + seg->len;
+        if (SEQUENCE_GT(seg_end, s->rx_win_low)) {
+            uint32_t offset = s->rx_win_low - seg->seq;
+            size_t written = tcp_rx_append(s, seg->data + offset, seg->len - offset);
+            s->rx_win_low += written;
+            s->stats.bytes_in += written;
+            if (written > 0)
+                moved = true;
+
+            if (written < seg->len - offset) {
+                /* out of buffers, keep the rest at the head of the queue. it may
+                 * already have been sacked, so it can't be left for a resend */
+                seg->len -= offset + written;
+                seg->seq = s->rx_win_low;
+                memmove(seg->data, seg->data + offset + written, seg->len);
+                break;
+            }
+        }
+
+        list_delete(&seg->node);
+        free(seg);
+        s->ooo_count--;
+    }
+
+    return moved;
+}
+
+/* queue len bytes of the packet from offset, across its parts, returns how many there was room for */
+static size_t tcp_rx_queue_chain(tcp_socket_t *s, pktbuf_t *p, size_t offset, size_t len) {
+    size_t done = 0;
+
+    for (; p && done < len; p = p->next) {
+        if (offset >= p->dlen) {
+            offset -= p->dlen;
+            continue;
+        }
+
+        size_t n = MIN(len - done, p->dlen - offset);
+        size_t queued = tcp_rx_queue_pktbuf(s, p, offset, n);
+        done += queued;
+        if (queued < n)
+            break;
+        offset = 0;
+    }
+
+    return done;
+}
+
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence) {
+    size_t len = pktbuf_total_len(p);
+
     if (unlikely(tcp_debug))
-        TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
+        TRACEF("data %p, len %zu, sequence %u\n", p->data, len, sequence);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(data);
     DEBUG_ASSERT(len > 0);
 
     /* see if it matches our current window */
@@ -643,28 +1237,37 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
         /* it intersects the bottom of our window, so it's in order */
 
-        /* copy the data we need to our cbuf */
+        /* queue the data we need, p may not have its data after this */
         size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+        LTRACEF("queueing from offset %zu, len %zu\n", offset, copy_len);
+
+        /* if we're out of pktbufs to keep it in, they'll resend the rest */
+        copy_len = tcp_rx_queue_chain(s, p, offset, copy_len);
 
         s->rx_win_low += copy_len;
+        s->stats.bytes_in += copy_len;
+
+        /* see if that filled a hole in front of anything queued out of order */
+        bool filled_hole = tcp_ooo_drain(s);
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
         event_signal(&s->rx_event, true);
 
         /* keep a counter if they've been sending a full mss */
         if (copy_len >= s->mss) {
-            s->rx_full_mss_count++;
+            s->rx_full_mss_count += copy_len / s->mss;
         } else {
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /*
+         * immediately ack if we're more than halfway into our buffer, they've sent 2 or more full
+         * packets, or we're recovering from a loss and they're waiting to hear about it
+         */
+        if (s->rx_full_mss_count >= 2 || filled_hole || !list_is_empty(&s->ooo_list) ||
                 (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
@@ -672,27 +1275,174 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        if (SEQUENCE_GT(sequence, s->rx_win_low)) {
+            /* out of order, hold on to it until the hole in front of it is filled */
+            s->stats.ooo_in++;
+            for (; p; p = p->next) {
+                if (p->dlen > 0)
+                    tcp_ooo_add(s, sequence, p->data, p->dlen);
+                sequence += p->dlen;
+            }
+        }
+
+        // duplicately ack the last thing we really got, with SACK telling them what we're holding
         send_ack(s);
     }
 }
 
+/* the blocks of out of order data we're holding, the one with the latest arrival first */
+static size_t tcp_build_sack_option(tcp_socket_t *s, uint8_t *opt, uint max_blocks) {
+    struct tcp_sack_block blocks[TCP_MAX_SACK_BLOCKS];
+    uint count = 1;
+    bool have_latest = false;
+
+    /* adjacent queued segments are reported as a single block */
+    struct tcp_ooo_segment *seg;
+    struct tcp_sack_block cur = { 0, 0 };
+    bool in_block = false;
+    list_for_every_entry(&s->ooo_list, seg, struct tcp_ooo_segment, node) {
+        if (in_block && seg->seq == cur.end) {
+            cur.end += seg->len;
+        } else {
+            if (in_block && count < max_blocks)
+                blocks[count++] = cur;
+            cur.start = seg->seq;
+            cur.end = seg->seq + seg->len;
+            in_block = true;
+        }
+
+        if (seg->seq == s->ooo_last_seq) {
+            /* finish the block holding the latest arrival and put it in the first slot */
+            struct list_node *next = seg->node.next;
+            while (next != &s->ooo_list) {
+                struct tcp_ooo_segment *n = containerof(next, struct tcp_ooo_segment, node);
+                if (n->seq != cur.end)
+                    break;
+                cur.end += n->len;
+                seg = n;
+                next = next->next;
+            }
+            blocks[0] = cur;
+            have_latest = true;
+            in_block = false;
+        }
+    }
+    if (in_block && count < max_blocks)
+        blocks[count++] = cur;
+
+    if (!have_latest) {
+        /* shouldn't happen, but don't report an empty first block */
+        memmove(&blocks[0], &blocks[1], (count - 1) * sizeof(blocks[0]));
+        count--;
+    }
+    if (count == 0)
+        return 0;
+
+    opt[0] = TCP_OPT_NOP;
+    opt[1] = TCP_OPT_NOP;
+    opt[2] = TCP_OPT_SACK;
+    opt[3] = 2 + count * 8;
+    for (uint i = 0; i < count; i++) {
+        put_be32(opt + 4 + i * 8, blocks[i].start);
+        put_be32(opt + 8 + i * 8, blocks[i].end);
+    }
+
+    return 4 + count * 8;
+}
+
+/*
+ * the options for a segment we're sending, padded to a multiple of 4 with NOPs. SACK
+ * blocks only go on segments without data, there isn't room for them next to a full mss.
+ */
+static size_t tcp_build_options(tcp_socket_t *s, tcp_flags_t flags, bool has_data, uint8_t *opt) {
+    size_t len = 0;
+
+    if (flags & PKT_SYN) {
+        /* offer everything we've got, the remote picks from it */
+        opt[len++] = TCP_OPT_MSS;
+        opt[len++] = 4;
+        put_be16(opt + len, DEFAULT_MSS);
+        len += 2;
+
+        if (s->ws_ok) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_WS;
+            opt[len++] = 3;
+            opt[len++] = s->rcv_wscale;
+        }
+        if (s->sack_ok) {
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_NOP;
+            opt[len++] = TCP_OPT_SACK_PERM;
+            opt[len++] = 2;
+        }
+    }
+
+    if (s->ts_ok) {
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_NOP;
+        opt[len++] = TCP_OPT_TS;
+        opt[len++] = 10;
+        put_be32(opt + len, current_time());
+        put_be32(opt + len + 4, (flags & PKT_ACK) ? s->ts_recent : 0);
+        len += 8;
+    }
+
+    if (s->sack_ok && !has_data && !(flags & PKT_SYN) && (flags & PKT_ACK) && !list_is_empty(&s->ooo_list)) {
+        len += tcp_build_sack_option(s, opt + len, s->ts_ok ? 3 : 4);
+    }
+
+    DEBUG_ASSERT(len <= TCP_MAX_OPTIONS_LEN);
+    DEBUG_ASSERT((len % 4) == 0);
+
+    return len;
+}
+
+/* a pktbuf holding a copy of the data, with room in front for any headers and options */
+static pktbuf_t *tcp_alloc_pktbuf(const iovec_t *iov, size_t iov_cnt, size_t options_length) {
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return NULL;
+
+    /* options can outgrow the default header space, leave room for them and the ip and ethernet headers */
+    size_t header_len = sizeof(tcp_header_t) + options_length;
+    pktbuf_reset(p, MAX(PKTBUF_MAX_HDR, ROUNDUP(sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr), 4) + header_len));
+
+    for (size_t i = 0; i < iov_cnt; i++) {
+        if (iov[i].iov_len > 0) {
+            DEBUG_ASSERT(iov[i].iov_base);
+            pktbuf_append_data(p, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+
+    return p;
+}
+
 static status_t tcp_socket_send(tcp_socket_t *s, const iovec_t *iov, size_t iov_cnt,
-                                tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence) {
+                                tcp_flags_t flags, uint32_t sequence) {
     DEBUG_ASSERT(s);
-    DEBUG_ASSERT(is_mutex_held(&s->lock));
     DEBUG_ASSERT(iov_cnt == 0 || iov);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
+
+    pktbuf_t *p = tcp_alloc_pktbuf(iov, iov_cnt, TCP_MAX_OPTIONS_LEN);
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    return tcp_socket_send_pktbuf(s, p, flags, sequence);
+}
+
+/* send p's data as a segment, headers are built in the room in front of it */
+static status_t tcp_socket_send_pktbuf(tcp_socket_t *s, pktbuf_t *p, tcp_flags_t flags, uint32_t sequence) {
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(p);
 
     // calculate the new right edge of the rx window
-    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
+    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - s->rx_queued - 1;
 
-    LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
-            s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
+    LTRACEF("rx_win_low %u rx_win_size %u rx_queued %u, new win high %u\n",
+            s->rx_win_low, s->rx_win_size, s->rx_queued, rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win_size;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
         win_size = rx_win_high - s->rx_win_low;
@@ -702,13 +1452,28 @@ static status_t tcp_socket_send(tcp_socket_t *s, const iovec_t *iov, size_t iov_
         win_size = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a SYN is never scaled
+    if (!(flags & PKT_SYN))
+        win_size >>= s->rcv_wscale;
+    win_size = MIN(win_size, 0xffffu);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
+        s->last_ack_sent = s->rx_win_low;
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, iov, iov_cnt, flags,
-                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    uint32_t data_len = pktbuf_total_len(p);
+
+    uint8_t options[TCP_MAX_OPTIONS_LEN];
+    size_t options_length = tcp_build_options(s, flags, data_len > 0, options);
+
+    s->stats.segs_out++;
+    s->stats.bytes_out += data_len;
+
+    status_t err = tcp_send_pktbuf(p, s->remote_ip, s->remote_port, s->local_ip, s->local_port, flags,
+                                   options_length ? options : NULL, options_length,
+                                   (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
 
     return err;
 }
@@ -720,21 +1485,33 @@ static void send_ack(tcp_socket_t *s) {
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    tcp_socket_send(s, NULL, 0, PKT_ACK, s->tx_win_low);
 }
 
 static status_t tcp_send(ipv4_addr_t dest_ip, uint16_t dest_port, ipv4_addr_t src_ip, uint16_t src_port,
                          const iovec_t *iov, size_t iov_cnt,
                          tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size) {
     DEBUG_ASSERT(iov_cnt == 0 || iov);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
 
-    pktbuf_t *p = pktbuf_alloc();
+    pktbuf_t *p = tcp_alloc_pktbuf(iov, iov_cnt, options_length);
     if (!p)
         return ERR_NO_MEMORY;
 
-    tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
+    return tcp_send_pktbuf(p, dest_ip, dest_port, src_ip, src_port, flags, options, options_length,
+                           ack, sequence, window_size);
+}
+
+static status_t tcp_send_pktbuf(pktbuf_t *p, ipv4_addr_t dest_ip, uint16_t dest_port, ipv4_addr_t src_ip,
+                                uint16_t src_port, tcp_flags_t flags, const void *options, size_t options_length,
+                                uint32_t ack, uint32_t sequence, uint16_t window_size) {
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(options_length == 0 || options);
+    DEBUG_ASSERT((options_length % 4) == 0);
+
+    size_t header_len = sizeof(tcp_header_t) + options_length;
+    DEBUG_ASSERT(pktbuf_avail_head(p) >= sizeof(struct eth_hdr) + sizeof(struct ipv4_hdr) + header_len);
+
+    tcp_header_t *header = pktbuf_prepend(p, header_len);
     DEBUG_ASSERT(header);
 
     /* fill in the header */
@@ -749,27 +1526,19 @@ static status_t tcp_send(ipv4_addr_t dest_ip, uint16_t dest_port, ipv4_addr_t sr
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (iov) {
-        for (size_t i = 0; i < iov_cnt; i++) {
-            if (iov[i].iov_len > 0) {
-                DEBUG_ASSERT(iov[i].iov_base);
-                pktbuf_append_data(p, iov[i].iov_base, iov[i].iov_len);
-            }
-        }
-    }
-
-    /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        ipv4_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
-
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+    /* compute the checksum, or as much of it as the interface needs to finish it */
+    ipv4_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(pktbuf_total_len(p));
+
+    if (FORCE_TCP_CHECKSUM) {
+        header->checksum = cksum_pheader_pktbuf(&pheader, p);
+    } else {
+        header->checksum = ones_sum16(0, &pheader, sizeof(pheader));
+        cksum_set_partial(p, header, offsetof(tcp_header_t, checksum));
     }
 
     if (LOCAL_TRACE) {
@@ -782,20 +1551,335 @@ static status_t tcp_send(ipv4_addr_t dest_ip, uint16_t dest_port, ipv4_addr_t sr
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
+/*
+ * Transmit queue. Data written to the socket is kept as a list of segments until
+ * it's acked. A segment is normally sent in place, out of its own buffer, and
+ * the driver holds a reference to it until the transmit is done, which may well
+ * be after the ack. While the driver has it, resending it makes a copy instead so
+ * the headers already built in front of it aren't overwritten.
+ */
+static void tcp_tx_reap(void *arg);
+
+static spin_lock_t tcp_tx_reap_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node tcp_tx_reap_list = LIST_INITIAL_VALUE(tcp_tx_reap_list);
+static dpc_t tcp_tx_reap_dpc = DPC_INITIAL_VALUE(tcp_tx_reap_dpc, tcp_tx_reap, NULL);
+
+static void tcp_tx_seg_free(struct tcp_tx_segment *seg) {
+    pktbuf_free(seg->p, true);
+    free(seg);
+}
+
+/* segments the driver let go of last, which may have been from an interrupt handler */
+static void tcp_tx_reap(void *arg) {
+    for (;;) {
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&tcp_tx_reap_lock);
+        struct tcp_tx_segment *seg = list_remove_head_type(&tcp_tx_reap_list, struct tcp_tx_segment, node);
+        spin_unlock_irqrestore(&tcp_tx_reap_lock, state);
+
+        if (!seg)
+            break;
+        tcp_tx_seg_free(seg);
+    }
+}
+
+/* free callback of the pktbufs a segment is sent in */
+static void tcp_tx_seg_sent(void *buf, void *arg) {
+    struct tcp_tx_segment *seg = arg;
+
+    if (atomic_add(&seg->ref, -1) == 1) {
+        arch_interrupt_saved_state_t state = spin_lock_irqsave(&tcp_tx_reap_lock);
+        list_add_tail(&tcp_tx_reap_list, &seg->node);
+        spin_unlock_irqrestore(&tcp_tx_reap_lock, state);
+
+        dpc_queue_etc(&tcp_tx_reap_dpc, DPC_CPU_CURRENT, DPC_FLAG_NORESCHED);
+    }
+}
+
+/* the socket is done with a segment */
+static void tcp_tx_seg_put(struct tcp_tx_segment *seg) {
+    if (atomic_add(&seg->ref, -1) == 1)
+        tcp_tx_seg_free(seg);
+}
+
+/* add p's data to the end of the queue, taking ownership of it */
+static status_t tcp_tx_queue(tcp_socket_t *s, pktbuf_t *p, bool copied) {
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(pktbuf_avail_head(p) >= TCP_HEADROOM);
+
+    struct tcp_tx_segment *seg = malloc(sizeof(*seg));
+    if (!seg)
+        return ERR_NO_MEMORY;
+
+    seg->seq = s->tx_win_low + s->tx_queued;
+    seg->p = p;
+    seg->ref = 1;
+    seg->copied = copied;
+    list_add_tail(&s->tx_list, &seg->node);
+    s->tx_queued += p->dlen;
+
+    return NO_ERROR;
+}
+
+static void tcp_tx_free(tcp_socket_t *s) {
+    struct tcp_tx_segment *seg;
+    while ((seg = list_remove_head_type(&s->tx_list, struct tcp_tx_segment, node)))
+        tcp_tx_seg_put(seg);
+    s->tx_queued = 0;
+}
+
+/* drop acked_len bytes off the front of the queue */
+static void tcp_tx_ack(tcp_socket_t *s, uint32_t acked_len) {
+    DEBUG_ASSERT(acked_len <= s->tx_queued);
+
+    s->tx_queued -= acked_len;
+
+    struct tcp_tx_segment *seg;
+    while (acked_len > 0 && (seg = list_peek_head_type(&s->tx_list, struct tcp_tx_segment, node))) {
+        if (acked_len < seg->p->dlen) {
+            /* they took part of it */
+            pktbuf_consume(seg->p, acked_len);
+            seg->seq += acked_len;
+            break;
+        }
+
+        acked_len -= seg->p->dlen;
+        list_delete(&seg->node);
+        tcp_tx_seg_put(seg);
+    }
+}
+
+/*
+ * send len bytes of queued data starting at sequence, as much of it as fits
+ * in the segment holding it. returns how much that was.
+ */
+static uint32_t tcp_send_data(tcp_socket_t *s, uint32_t sequence, uint32_t len) {
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    struct tcp_tx_segment *seg;
+    list_for_every_entry(&s->tx_list, seg, struct tcp_tx_segment, node) {
+        if (sequence - seg->seq < seg->p->dlen)
+            break;
+    }
+    DEBUG_ASSERT(&seg->node != &s->tx_list);
+
+    uint32_t offset = sequence - seg->seq;
+    len = MIN(len, seg->p->dlen - offset);
+
+    /* from the start of the segment, and nothing else is using the room in front of it */
+    if (offset == 0 && seg->ref == 1) {
+        pktbuf_t *p = pktbuf_alloc_empty();
+        if (p) {
+            pktbuf_add_buffer(p, seg->p->buffer, seg->p->blen, seg->p->data - seg->p->buffer,
+                              seg->p->flags & PKTBUF_FLAG_CACHED, tcp_tx_seg_sent, seg);
+            p->dlen = len;
+            atomic_add(&seg->ref, 1);
+
+            tcp_socket_send_pktbuf(s, p, PKT_ACK|PKT_PSH, sequence);
+            return len;
+        }
+    }
+
+    iovec_t iov = { seg->p->data + offset, len };
+    tcp_socket_send(s, &iov, 1, PKT_ACK|PKT_PSH, sequence);
+
+    return len;
+}
+
+static bool tcp_can_tso(tcp_socket_t *s) {
+    return s->route && (s->route->interface->flags & NETIF_FLAG_TX_TSO4);
+}
+
+/*
+ * send up to len bytes of queued data starting at sequence as one segment for the
+ * interface to cut into mss sized ones. The headers go in a pktbuf of their own in
+ * front of the queued segments, which are all sent in place. returns how much was sent.
+ */
+static uint32_t tcp_send_data_tso(tcp_socket_t *s, uint32_t sequence, uint32_t len) {
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(len > s->mss);
+
+    pktbuf_t *p = tcp_alloc_pktbuf(NULL, 0, TCP_MAX_OPTIONS_LEN);
+    if (!p)
+        return tcp_send_data(s, sequence, s->mss);
+
+    struct tcp_tx_segment *seg;
+    list_for_every_entry(&s->tx_list, seg, struct tcp_tx_segment, node) {
+        if (sequence - seg->seq < seg->p->dlen)
+            break;
+    }
+
+    uint32_t sent = 0;
+    for (uint parts = 0; sent < len && parts < TCP_TSO_MAX_PARTS && &seg->node != &s->tx_list; parts++) {
+        uint32_t offset = sequence + sent - seg->seq;
+        uint32_t n = MIN(len - sent, seg->p->dlen - offset);
+
+        pktbuf_t *part = pktbuf_alloc_empty();
+        if (!part) {
+            /* send what there is, or fall back to a plain segment if there's nothing */
+            if (sent > 0)
+                break;
+            pktbuf_free(p, true);
+            return tcp_send_data(s, sequence, s->mss);
+        }
+        pktbuf_add_buffer(part, seg->p->buffer, seg->p->blen, seg->p->data - seg->p->buffer + offset,
+                          seg->p->flags & PKTBUF_FLAG_CACHED, tcp_tx_seg_sent, seg);
+        part->dlen = n;
+        atomic_add(&seg->ref, 1);
+        pktbuf_chain(p, part);
+
+        sent += n;
+        seg = list_next_type(&s->tx_list, &seg->node, struct tcp_tx_segment, node);
+        if (!seg)
+            break;
+    }
+    DEBUG_ASSERT(sent > 0);
+
+    if (sent > s->mss) {
+        p->flags |= PKTBUF_FLAG_GSO_TCPV4;
+        p->gso_size = s->mss;
+        s->stats.segs_tso++;
+    }
+
+    tcp_socket_send_pktbuf(s, p, PKT_ACK|PKT_PSH, sequence);
+
+    return sent;
+}
+
+/*
+ * SACK scoreboard. Remembers which ranges past the cumulative ack the remote
+ * has told us it holds, so a retransmit only resends the holes between them.
+ */
+static void tcp_sack_insert(tcp_socket_t *s, uint32_t start, uint32_t end) {
+    /* absorb every block this one touches */
+    uint i = 0;
+    while (i < s->sacked_count) {
+        struct tcp_sack_block *b = &s->sacked[i];
+        if (SEQUENCE_LT(end, b->start) || SEQUENCE_GT(start, b->end)) {
+            i++;
+            continue;
+        }
+        if (SEQUENCE_LT(b->start, start))
+            start = b->start;
+        if (SEQUENCE_GT(b->end, end))
+            end = b->end;
+        memmove(b, b + 1, (s->sacked_count - i - 1) * sizeof(*b));
+        s->sacked_count--;
+    }
+
+    uint pos = 0;
+    while (pos < s->sacked_count && SEQUENCE_GT(start, s->sacked[pos].start))
+        pos++;
+
+    if (s->sacked_count == TCP_SACK_SCOREBOARD) {
+        /* full, forget the highest range, it's the last one we'd resend around */
+        if (pos == s->sacked_count)
+            return;
+        s->sacked_count--;
+    }
+
+    memmove(&s->sacked[pos + 1], &s->sacked[pos], (s->sacked_count - pos) * sizeof(s->sacked[0]));
+    s->sacked[pos].start = start;
+    s->sacked[pos].end = end;
+    s->sacked_count++;
+}
+
+/* drop what the cumulative ack now covers */
+static void tcp_sack_trim(tcp_socket_t *s) {
+    uint i = 0;
+    while (i < s->sacked_count && SEQUENCE_LTE(s->sacked[i].end, s->tx_win_low))
+        i++;
+
+    memmove(&s->sacked[0], &s->sacked[i], (s->sacked_count - i) * sizeof(s->sacked[0]));
+    s->sacked_count -= i;
+
+    if (s->sacked_count > 0 && SEQUENCE_LT(s->sacked[0].start, s->tx_win_low))
+        s->sacked[0].start = s->tx_win_low;
+}
+
+static void handle_sack(tcp_socket_t *s, const struct tcp_options *opts) {
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (!s->sack_ok)
+        return;
+
+    for (uint i = 0; i < opts->sack_count; i++) {
+        uint32_t start = opts->sack[i].start;
+        uint32_t end = opts->sack[i].end;
+
+        /* ignore anything that isn't inside what we have outstanding */
+        if (!SEQUENCE_LT(start, end) || SEQUENCE_LTE(end, s->tx_win_low) ||
+                SEQUENCE_GT(end, s->tx_max_seq))
+            continue;
+        if (SEQUENCE_LT(start, s->tx_win_low))
+            start = s->tx_win_low;
+
+        tcp_sack_insert(s, start, end);
+    }
+}
+
+/* a duplicate ack, RFC 5681 fast retransmit and RFC 6582 NewReno fast recovery */
+static void handle_dupack(tcp_socket_t *s) {
+    s->stats.dupacks_in++;
+
+    if (s->in_recovery) {
+        /* another segment has left the network, inflate the window to send a new one */
+        s->cc.cwnd += s->mss;
+        tcp_write_pending_data(s);
+        return;
+    }
+
+    if (++s->dupacks < TCP_DUPACK_THRESHOLD)
+        return;
+
+    /* a loss from the window we already recovered from once doesn't count twice */
+    if (SEQUENCE_LTE(s->tx_win_low, s->recover))
+        return;
+
+    uint32_t flight = s->tx_highest_seq - s->tx_win_low;
+
+    LTRACEF("s %p, fast retransmit at %u, flight %u\n", s, s->tx_win_low, flight);
+
+    s->stats.fast_retransmits++;
+    s->in_recovery = true;
+    s->recover = s->tx_max_seq;
+    tcp_cc_loss(&s->cc, flight);
+
+    tcp_retransmit(s);
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rtt.rto);
+
+    /* the segments that triggered the dup acks have left the network */
+    s->cc.cwnd += TCP_DUPACK_THRESHOLD * s->mss;
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, size_t data_len,
+                       const struct tcp_options *opts) {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %zu space_used %zu\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, cbuf_size(&s->tx_buffer), cbuf_space_used(&s->tx_buffer));
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u queued %u\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_queued);
+
+    handle_sack(s, opts);
+
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
-    } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
+    } else if (SEQUENCE_GT(sequence, s->tx_max_seq)) {
         /* they're acking stuff we haven't sent */
         return;
+    } else if (sequence == s->tx_win_low) {
+        if (data_len == 0 && s->tx_max_seq != s->tx_win_low && s->tx_win_low + win_size == s->tx_win_high) {
+            /* nothing but the same ack again while we have data out */
+            handle_dupack(s);
+        } else if (SEQUENCE_GT(s->tx_win_low + win_size, s->tx_win_high)) {
+            /* a window update */
+            s->tx_win_high = s->tx_win_low + win_size;
+            tcp_write_pending_data(s);
+        }
+        return;
     } else {
         /* their ack is somewhere in our window */
         uint32_t acked_len;
@@ -804,20 +1888,47 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
 
         LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= cbuf_size(&s->tx_buffer));
-        DEBUG_ASSERT(acked_len <= cbuf_space_used(&s->tx_buffer));
-
-        size_t consumed = cbuf_read(&s->tx_buffer, NULL, acked_len, false);
-        DEBUG_ASSERT(consumed == acked_len);
+        tcp_tx_ack(s, acked_len);
 
         s->tx_win_low += acked_len;
         s->tx_win_high = s->tx_win_low + win_size;
+        tcp_sack_trim(s);
+
+        /* the originals of what we resent after a timeout may have made it after all */
+        if (SEQUENCE_GT(s->tx_win_low, s->tx_highest_seq))
+            s->tx_highest_seq = s->tx_win_low;
+
+        /* time the round trip, from the echoed timestamp or the one segment we're timing */
+        lk_time_t now = current_time();
+        if (s->ts_ok && opts->has_ts && opts->tsecr != 0) {
+            tcp_rtt_sample(&s->rtt, now - opts->tsecr);
+        } else if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+            tcp_rtt_sample(&s->rtt, now - s->rtt_start);
+            s->rtt_timing = false;
+        }
+
+        if (s->in_recovery) {
+            if (SEQUENCE_GTE(sequence, s->recover)) {
+                /* everything outstanding at the loss is acked, deflate the window and carry on */
+                s->cc.cwnd = MIN(s->cc.ssthresh, (s->tx_highest_seq - s->tx_win_low) + s->mss);
+                s->in_recovery = false;
+            } else {
+                /* a partial ack, the next hole was lost too. resend it and deflate by what was acked */
+                tcp_retransmit(s);
+                s->cc.cwnd -= MIN(acked_len, s->cc.cwnd - s->mss);
+                if (acked_len >= s->mss)
+                    s->cc.cwnd += s->mss;
+            }
+        } else {
+            tcp_cc_ack(&s->cc, acked_len, now, tcp_rtt_srtt(&s->rtt));
+        }
+        s->dupacks = 0;
 
         /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
+        if (s->tx_win_low == s->tx_max_seq) {
             tcp_timer_cancel(s, &s->retransmit_timer);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rtt.rto);
         }
 
         /* we have opened the transmit buffer */
@@ -829,41 +1940,62 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size) {
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s) {
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %zu space_used %zu\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, cbuf_size(&s->tx_buffer), cbuf_space_used(&s->tx_buffer));
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u queued %u\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_queued);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(cbuf_size(&s->tx_buffer) > 0);
 
     /* do we have any new data to send? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = cbuf_space_used(&s->tx_buffer) - outstanding;
+    uint32_t pending = s->tx_queued - outstanding;
     LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
-    /* check the remote window limit */
+    /* check the remote window limit and the congestion window */
     int32_t allowed = (int32_t)(s->tx_win_high - s->tx_highest_seq);
+    allowed = MIN(allowed, (int32_t)(s->cc.cwnd - outstanding));
     if (allowed < 0) {
         allowed = 0;
     }
     uint32_t to_send = MIN(pending, (uint32_t)allowed);
 
+    /* as few segments as the interface takes, keeping all but the last a multiple of the mss */
+    uint32_t max_seg = s->mss;
+    if (tcp_can_tso(s))
+        max_seg = TCP_TSO_MAX_SIZE - TCP_TSO_MAX_SIZE % s->mss;
+
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
     while (offset < to_send) {
-        uint32_t tosend = MIN(s->mss, to_send - offset);
+        bool resend = SEQUENCE_LT(s->tx_highest_seq, s->tx_max_seq);
+        if (!resend && !s->ts_ok && !s->rtt_timing) {
+            s->rtt_timing = true;
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_start = current_time();
+        }
 
-        iovec_t iov[2];
-        cbuf_peek_at(&s->tx_buffer, outstanding + offset, tosend, iov);
+        uint32_t tosend = MIN(max_seg, to_send - offset);
+        if (tosend > s->mss) {
+            tosend = tcp_send_data_tso(s, s->tx_highest_seq, tosend);
+        } else {
+            tosend = tcp_send_data(s, s->tx_highest_seq, tosend);
+        }
+        if (resend) {
+            /* resending after a timeout */
+            s->stats.segs_retrans++;
+            s->stats.bytes_retrans += tosend;
+        }
 
-        tcp_socket_send(s, iov, 2, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
         s->tx_highest_seq += tosend;
         offset += tosend;
+
+        if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+            s->tx_max_seq = s->tx_highest_seq;
     }
 
     /* reset the retransmit timer if we sent anything */
     if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rtt.rto);
     }
 
     return offset;
@@ -881,16 +2013,43 @@ static ssize_t tcp_retransmit(tcp_socket_t *s) {
     if (outstanding == 0)
         return 0;
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+    /* anything resent can't be timed, we wouldn't know which copy was acked */
+    s->rtt_timing = false;
+
+    /*
+     * without SACK information resend the first segment. with it, resend the holes
+     * below the highest range they hold, skipping over what they already have.
+     */
+    uint32_t seq = s->tx_win_low;
+    uint32_t sent = 0;
+    uint segments = 0;
+    for (uint i = 0; i < MAX(s->sacked_count, 1u) && segments < TCP_MAX_RETRANSMIT_SEGMENTS; i++) {
+        uint32_t hole_end = s->sacked_count ? s->sacked[i].start : s->tx_win_low + MIN(s->mss, outstanding);
+
+        while (SEQUENCE_LT(seq, hole_end) && segments < TCP_MAX_RETRANSMIT_SEGMENTS) {
+            LTRACEF("s %p, tosend %u seq %u\n", s, MIN(s->mss, hole_end - seq), seq);
+
+            uint32_t tosend = tcp_send_data(s, seq, MIN(s->mss, hole_end - seq));
+
+            seq += tosend;
+            sent += tosend;
+            segments++;
+        }
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
+        if (s->sacked_count)
+            seq = s->sacked[i].end;
+    }
 
-    iovec_t iov[2];
-    cbuf_peek_at(&s->tx_buffer, 0, tosend, iov);
+    if (sent == 0) {
+        /* they claim to hold the front of the window but haven't acked it, so resend it anyway */
+        s->sacked_count = 0;
+        return tcp_retransmit(s);
+    }
 
-    tcp_socket_send(s, iov, 2, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    s->stats.segs_retrans += segments;
+    s->stats.bytes_retrans += sent;
 
-    return tosend;
+    return sent;
 }
 
 static void handle_retransmit_timeout(void *_s) {
@@ -902,10 +2061,28 @@ static void handle_retransmit_timeout(void *_s) {
 
     mutex_acquire(&s->lock);
 
-    if (tcp_retransmit(s) == 0)
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
+        goto done;
+    if (s->tx_max_seq == s->tx_win_low)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /*
+     * the timer went off, so assume everything outstanding is gone. drop to one
+     * segment and go back to resending from the oldest unacked byte.
+     */
+    s->stats.timeouts++;
+    tcp_cc_timeout(&s->cc, s->tx_max_seq - s->tx_win_low);
+    tcp_rtt_backoff(&s->rtt);
+    s->in_recovery = false;
+    s->dupacks = 0;
+    s->recover = s->tx_max_seq;
+    s->sacked_count = 0; // they're allowed to have dropped what they SACKed
+    s->rtt_timing = false;
+    s->tx_highest_seq = s->tx_win_low;
+
+    tcp_write_pending_data(s);
+
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rtt.rto);
 
 done:
     mutex_release(&s->lock);
@@ -968,11 +2145,12 @@ static void tcp_remote_close(tcp_socket_t *s) {
 
     tcp_timer_cancel(s, &s->retransmit_timer);
     tcp_timer_cancel(s, &s->ack_delay_timer);
+    tcp_ooo_free(s);
 
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers) {
+static tcp_socket_t *create_tcp_socket(void) {
     tcp_socket_t *s;
 
     s = calloc(1, sizeof(tcp_socket_t));
@@ -985,23 +2163,25 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers) {
     s->state = STATE_CLOSED;
     s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_queue);
+    list_initialize(&s->ooo_list);
 
     s->mss = DEFAULT_MSS;
+    s->ws_ok = true;
+    s->sack_ok = true;
+    s->ts_ok = true;
+    s->rcv_wscale = tcp_wscale_for(s->rx_win_size);
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_max_seq = s->tx_win_low;
+    s->recover = s->tx_win_low;
+    tcp_cc_init(&s->cc, tcp_cc_default, s->mss);
+    tcp_rtt_init(&s->rtt);
+    list_initialize(&s->tx_list);
     event_init(&s->tx_event, true, 0);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_raw = malloc(DEFAULT_TX_BUFFER_SIZE);
-        cbuf_initialize_etc(&s->tx_buffer, DEFAULT_TX_BUFFER_SIZE, s->tx_buffer_raw);
-    }
-
     sem_init(&s->accept_sem, 0);
     event_init(&s->connect_event, false, 0);
 
@@ -1015,7 +2195,7 @@ status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port) {
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(true);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1048,13 +2228,7 @@ status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port) {
     s->state = STATE_SYN_SENT;
     add_socket_to_list(s);
 
-    /* set up a mss option for sending back */
-    tcp_mss_option_t mss_option;
-    mss_option.kind = 0x2;
-    mss_option.len = 0x4;
-    mss_option.mss = ntohs(s->mss);
-
-    tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, NULL, 0, PKT_SYN, &mss_option, 0x4, 0, s->tx_win_low, s->rx_win_size);
+    tcp_socket_send(s, NULL, 0, PKT_SYN, s->tx_win_low);
 
     // TODO: handle retransmit
 
@@ -1084,18 +2258,21 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port) {
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
-    // XXX see if there's another listen socket already on this port
-
     s->local_port = port;
 
     /* go to listen state */
     s->state = STATE_LISTEN;
 
-    add_socket_to_list(s);
+    /* fails if there's another listen socket already on this port */
+    status_t err = add_socket_to_list(s);
+    if (err < 0) {
+        dec_socket_ref(s);
+        return err;
+    }
 
     *handle = s;
 
@@ -1128,16 +2305,29 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
     return NO_ERROR;
 }
 
-ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len) {
-    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
-    if (!socket)
-        return ERR_INVALID_ARGS;
-    if (len == 0)
-        return 0;
-    if (!buf)
-        return ERR_INVALID_ARGS;
+/* copy out of the receive queue, freeing the pktbufs as they empty */
+static size_t tcp_rx_read(tcp_socket_t *s, uint8_t *buf, size_t len) {
+    size_t done = 0;
 
-    tcp_socket_t *s = socket;
+    pktbuf_t *p;
+    while (done < len && (p = list_peek_head_type(&s->rx_queue, pktbuf_t, list))) {
+        size_t n = MIN(len - done, p->dlen);
+        memcpy(buf + done, p->data, n);
+        pktbuf_consume(p, n);
+        done += n;
+
+        if (p->dlen == 0) {
+            list_delete(&p->list);
+            pktbuf_free(p, true);
+        }
+    }
+
+    s->rx_queued -= done;
+    return done;
+}
+
+/* read into buf, or if it's NULL hand back the next pktbuf of data whole */
+static ssize_t tcp_read_etc(tcp_socket_t *s, void *buf, size_t len, pktbuf_t **pp) {
     inc_socket_ref(s);
 
     ssize_t ret = 0;
@@ -1147,8 +2337,17 @@ retry:
 
     mutex_acquire(&s->lock);
 
-    /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
+    /* try to read some data from the receive queue, even if we're closed */
+    if (pp) {
+        pktbuf_t *p = list_remove_head_type(&s->rx_queue, pktbuf_t, list);
+        if (p) {
+            s->rx_queued -= p->dlen;
+            ret = p->dlen;
+            *pp = p;
+        }
+    } else {
+        ret = tcp_rx_read(s, buf, len);
+    }
     if (ret == 0) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
@@ -1163,7 +2362,7 @@ retry:
     }
 
     /* if we've used up the last byte in the read buffer, unsignal the read event */
-    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
+    size_t remaining_bytes = s->rx_queued;
     if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
         event_unsignal(&s->rx_event);
     }
@@ -1182,6 +2381,43 @@ out:
     return ret;
 }
 
+ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len) {
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (len == 0)
+        return 0;
+    if (!buf)
+        return ERR_INVALID_ARGS;
+
+    return tcp_read_etc(socket, buf, len, NULL);
+}
+
+ssize_t tcp_read_pktbuf(tcp_socket_t *socket, pktbuf_t **p) {
+    LTRACEF("socket %p\n", socket);
+    if (!socket || !p)
+        return ERR_INVALID_ARGS;
+
+    return tcp_read_etc(socket, NULL, 0, p);
+}
+
+/* wait for the socket to be writable and return with it locked, or an error if it's closed */
+static status_t tcp_wait_writable(tcp_socket_t *s) {
+    /* wait for the tx buffer to open up */
+    event_wait(&s->tx_event);
+    LTRACEF("after event_wait\n");
+
+    mutex_acquire(&s->lock);
+
+    /* check to see if we've closed */
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+        mutex_release(&s->lock);
+        return ERR_CHANNEL_CLOSED;
+    }
+
+    return NO_ERROR;
+}
+
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
     if (!socket)
@@ -1194,27 +2430,20 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
     tcp_socket_t *s = socket;
     inc_socket_ref(s);
 
+    ssize_t ret = len;
+    pktbuf_t *spare = NULL;
     size_t off = 0;
     while (off < len) {
         LTRACEF("off %zu, len %zu\n", off, len);
 
-        /* wait for the tx buffer to open up */
-        event_wait(&s->tx_event);
-        LTRACEF("after event_wait\n");
-
-        mutex_acquire(&s->lock);
-
-        /* check to see if we've closed */
-        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
-            mutex_release(&s->lock);
-            dec_socket_ref(s);
-            return ERR_CHANNEL_CLOSED;
+        status_t err = tcp_wait_writable(s);
+        if (err < 0) {
+            ret = err;
+            break;
         }
 
-        DEBUG_ASSERT(cbuf_size(&s->tx_buffer) > 0);
-
         /* figure out how much data to copy in */
-        size_t avail = cbuf_space_avail(&s->tx_buffer);
+        size_t avail = DEFAULT_TX_BUFFER_SIZE - s->tx_queued;
         if (avail == 0) {
             event_unsignal(&s->tx_event);
             mutex_release(&s->lock);
@@ -1222,11 +2451,35 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
         }
         size_t to_copy = MIN(avail, len - off);
 
-        size_t written = cbuf_write(&s->tx_buffer, (const uint8_t *)buf + off, to_copy, false);
-        DEBUG_ASSERT(written == to_copy);
+        /* top up the last segment if it's one of ours, otherwise start a new one */
+        struct tcp_tx_segment *tail = list_peek_tail_type(&s->tx_list, struct tcp_tx_segment, node);
+        if (tail && tail->copied && tail->p->dlen < s->mss) {
+            to_copy = MIN(to_copy, s->mss - tail->p->dlen);
+            pktbuf_append_data(tail->p, (const uint8_t *)buf + off, to_copy);
+            s->tx_queued += to_copy;
+        } else if (spare) {
+            to_copy = MIN(to_copy, s->mss);
+            pktbuf_append_data(spare, (const uint8_t *)buf + off, to_copy);
+            if (tcp_tx_queue(s, spare, true) < 0) {
+                mutex_release(&s->lock);
+                ret = ERR_NO_MEMORY;
+                break;
+            }
+            spare = NULL;
+        } else {
+            /* get one outside the lock, this may wait on the pool */
+            mutex_release(&s->lock);
+            spare = pktbuf_alloc();
+            if (!spare) {
+                ret = ERR_NO_MEMORY;
+                break;
+            }
+            pktbuf_reset(spare, TCP_HEADROOM);
+            continue;
+        }
 
         /* if this has completely filled it, unsignal the event */
-        if (cbuf_space_avail(&s->tx_buffer) == 0) {
+        if (s->tx_queued == DEFAULT_TX_BUFFER_SIZE) {
             event_unsignal(&s->tx_event);
         }
 
@@ -1238,8 +2491,68 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len) {
         mutex_release(&s->lock);
     }
 
+    if (spare)
+        pktbuf_free(spare, true);
+
     dec_socket_ref(s);
-    return len;
+    return ret;
+}
+
+status_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p) {
+    LTRACEF("socket %p, p %p, len %u\n", socket, p, p ? p->dlen : 0);
+    if (!socket || !p)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    status_t err;
+    for (;;) {
+        err = tcp_wait_writable(s);
+        if (err < 0)
+            goto out;
+
+        if (p->dlen > s->mss || pktbuf_avail_head(p) < TCP_HEADROOM) {
+            /* can't be sent as it is, fall back to copying it */
+            mutex_release(&s->lock);
+            ssize_t ret = tcp_write(s, p->data, p->dlen);
+            err = (ret < 0) ? ret : NO_ERROR;
+            goto out;
+        }
+
+        if (p->dlen <= DEFAULT_TX_BUFFER_SIZE - s->tx_queued)
+            break;
+
+        event_unsignal(&s->tx_event);
+        mutex_release(&s->lock);
+    }
+
+    if (p->dlen > 0) {
+        err = tcp_tx_queue(s, p, false);
+        if (err >= 0) {
+            p = NULL;
+
+            if (s->tx_queued == DEFAULT_TX_BUFFER_SIZE)
+                event_unsignal(&s->tx_event);
+
+            tcp_write_pending_data(s);
+        }
+    }
+
+    mutex_release(&s->lock);
+
+out:
+    if (p)
+        pktbuf_free(p, true);
+
+    dec_socket_ref(s);
+    return err;
+}
+
+uint32_t tcp_get_mss(tcp_socket_t *socket) {
+    DEBUG_ASSERT(socket);
+
+    return socket->mss;
 }
 
 status_t tcp_close(tcp_socket_t *socket) {
@@ -1272,14 +2585,14 @@ status_t tcp_close(tcp_socket_t *socket) {
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, s->tx_win_low);
             s->tx_win_low++;
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
+            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, s->tx_win_low);
             s->tx_win_low++;
 
             // XXX set up fin retransmit timer here
@@ -1312,6 +2625,202 @@ out:
 }
 
 /* debug stuff */
+
+/* print a table a batch of sockets at a time, holding a ref on each batch so
+ * the printing happens with the bucket lock dropped and interrupts back on */
+static void dump_socket_table(struct tcp_hash_bucket *table, uint buckets) {
+    tcp_socket_t *batch[16];
+
+    for (uint i = 0; i < buckets; i++) {
+        struct tcp_hash_bucket *b = &table[i];
+        uint skip = 0;
+        uint count;
+
+        do {
+            uint index = 0;
+            count = 0;
+
+            arch_interrupt_saved_state_t state = spin_lock_irqsave(&b->lock);
+            tcp_socket_t *s;
+            list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+                if (index++ < skip)
+                    continue;
+                inc_socket_ref(s);
+                batch[count++] = s;
+                if (count == countof(batch))
+                    break;
+            }
+            spin_unlock_irqrestore(&b->lock, state);
+
+            for (uint j = 0; j < count; j++) {
+                dump_socket(batch[j]);
+                dec_socket_ref(batch[j]);
+            }
+            skip += count;
+        } while (count == countof(batch));
+    }
+}
+
+/*
+ * Fill the connection table with count synthetic sockets and time demuxing
+ * segments against it, for both hits and misses.
+ */
+static void tcp_demux_bench(uint count) {
+    const uint lookups = 100000;
+    const ipv4_addr_t local_ip = 0x0a000001;
+
+    tcp_socket_t **sockets = calloc(count, sizeof(tcp_socket_t *));
+    if (!sockets) {
+        printf("out of memory\n");
+        return;
+    }
+
+    /* a spread of remote hosts and ports talking to one local port, like a busy server */
+    uint created;
+    for (created = 0; created < count; created++) {
+        tcp_socket_t *s = create_tcp_socket();
+        if (!s)
+            break;
+        s->state = STATE_ESTABLISHED;
+        s->local_ip = local_ip;
+        s->local_port = 0;
+        s->remote_ip = 0xc0a80000 + (created / 64);
+        s->remote_port = 1024 + (created % 64) * 97;
+        add_socket_to_list(s);
+        sockets[created] = s;
+    }
+
+    uint max_chain = 0;
+    for (uint i = 0; i < TCP_HASH_BUCKETS; i++) {
+        max_chain = MAX(max_chain, (uint)list_length(&tcp_conn_hash[i].list));
+    }
+    printf("%u sockets in %u buckets, longest chain %u\n", created, TCP_HASH_BUCKETS, max_chain);
+
+    if (created > 0) {
+        uint found = 0;
+        lk_bigtime_t t = current_time_hires();
+        for (uint i = 0; i < lookups; i++) {
+            tcp_socket_t *want = sockets[(i * 7919) % created];
+            tcp_socket_t *s = lookup_socket(want->remote_ip, local_ip, want->remote_port, 0);
+            if (s == want)
+                found++;
+            if (s)
+                dec_socket_ref(s);
+        }
+        t = current_time_hires() - t;
+        printf("hits: %u lookups, %u found, %llu ns each\n", lookups, found, t * 1000 / lookups);
+
+        found = 0;
+        t = current_time_hires();
+        for (uint i = 0; i < lookups; i++) {
+            tcp_socket_t *s = lookup_socket(0xac100000 + i, local_ip, 1024 + (i % 64), 0);
+            if (s) {
+                found++;
+                dec_socket_ref(s);
+            }
+        }
+        t = current_time_hires() - t;
+        printf("misses: %u lookups, %u found, %llu ns each\n", lookups, found, t * 1000 / lookups);
+    }
+
+    for (uint i = 0; i < created; i++) {
+        remove_socket_from_list(sockets[i]);
+        dec_socket_ref(sockets[i]);
+    }
+    free(sockets);
+}
+
+static void tcp_print_throughput(const char *what, uint64_t bytes, lk_bigtime_t usecs) {
+    if (usecs == 0)
+        usecs = 1;
+    printf("%s %llu bytes in %llu.%03llu ms, %llu KB/s\n", what, bytes,
+           usecs / 1000, usecs % 1000, bytes * 1000000 / usecs / 1024);
+}
+
+/* accept one connection and read it to the end, reporting the rate */
+static void tcp_sink(uint16_t port, bool zero_copy) {
+    tcp_socket_t *handle;
+    status_t err = tcp_open_listen(&handle, port);
+    if (err < 0) {
+        printf("tcp_open_listen returns %d\n", err);
+        return;
+    }
+
+    tcp_socket_t *accepted;
+    err = tcp_accept(handle, &accepted);
+    if (err < 0) {
+        printf("tcp_accept returns %d\n", err);
+        tcp_close(handle);
+        return;
+    }
+
+    uint8_t *buf = malloc(16384);
+    uint64_t total = 0;
+    lk_bigtime_t start = current_time_hires();
+    while (buf) {
+        ssize_t len;
+        if (zero_copy) {
+            pktbuf_t *p;
+            len = tcp_read_pktbuf(accepted, &p);
+            if (len >= 0)
+                pktbuf_free(p, true);
+        } else {
+            len = tcp_read(accepted, buf, 16384);
+        }
+        if (len <= 0)
+            break;
+        total += len;
+    }
+    tcp_print_throughput("received", total, current_time_hires() - start);
+
+    free(buf);
+    tcp_close(accepted);
+    tcp_close(handle);
+}
+
+/* connect and push bytes of data as fast as the connection takes it */
+static void tcp_source(ipv4_addr_t addr, uint16_t port, uint64_t bytes, bool zero_copy) {
+    tcp_socket_t *handle;
+    status_t err = tcp_connect(&handle, addr, port);
+    if (err < 0) {
+        printf("tcp_connect returns %d\n", err);
+        return;
+    }
+
+    uint8_t *buf = malloc(16384);
+    if (buf) {
+        for (uint i = 0; i < 16384; i++)
+            buf[i] = i;
+    }
+
+    uint64_t total = 0;
+    lk_bigtime_t start = current_time_hires();
+    while (buf && total < bytes) {
+        ssize_t len;
+        if (zero_copy) {
+            /* fill a segment sized pktbuf and hand it over */
+            pktbuf_t *p = pktbuf_alloc();
+            if (!p)
+                break;
+            pktbuf_reset(p, TCP_HEADROOM);
+            len = MIN(bytes - total, (uint64_t)tcp_get_mss(handle));
+            pktbuf_append_data(p, buf, len);
+            status_t werr = tcp_write_pktbuf(handle, p);
+            if (werr < 0)
+                len = werr;
+        } else {
+            len = tcp_write(handle, buf, MIN(bytes - total, 16384ULL));
+        }
+        if (len <= 0)
+            break;
+        total += len;
+    }
+    tcp_print_throughput("sent", total, current_time_hires() - start);
+
+    free(buf);
+    tcp_close(handle);
+}
+
 int cmd_tcp(int argc, const console_cmd_args *argv) {
     if (argc < 2) {
 notenoughargs:
@@ -1321,17 +2830,17 @@ usage:
         printf("usage: %s listenclose <port>\n", argv[0].str);
         printf("usage: %s listen <port>\n", argv[0].str);
         printf("usage: %s debug\n", argv[0].str);
+        printf("usage: %s bench [sockets]\n", argv[0].str);
+        printf("usage: %s sink <port> [zc]\n", argv[0].str);
+        printf("usage: %s send <ipv4 address> <port> <bytes> [zc]\n", argv[0].str);
+        printf("usage: %s impair <drop per mille> <reorder per mille>\n", argv[0].str);
+        printf("usage: %s cc [newreno|cubic]\n", argv[0].str);
         return ERR_INVALID_ARGS;
     }
 
     if (!strcmp(argv[1].str, "sockets")) {
-
-        mutex_acquire(&tcp_socket_list_lock);
-        tcp_socket_t *s = NULL;
-        list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-            dump_socket(s);
-        }
-        mutex_release(&tcp_socket_list_lock);
+        dump_socket_table(tcp_listen_hash, TCP_LISTEN_HASH_BUCKETS);
+        dump_socket_table(tcp_conn_hash, TCP_HASH_BUCKETS);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -1387,6 +2896,35 @@ usage:
     } else if (!strcmp(argv[1].str, "debug")) {
         tcp_debug = !tcp_debug;
         printf("tcp debug now %u\n", tcp_debug);
+    } else if (!strcmp(argv[1].str, "bench")) {
+        tcp_demux_bench((argc >= 3) ? argv[2].u : 10000);
+    } else if (!strcmp(argv[1].str, "sink")) {
+        if (argc < 3) goto notenoughargs;
+
+        tcp_sink(argv[2].u, argc >= 4 && !strcmp(argv[3].str, "zc"));
+    } else if (!strcmp(argv[1].str, "send")) {
+        if (argc < 5) goto notenoughargs;
+
+        ipv4_addr_t addr = minip_parse_ipaddr(argv[2].str, strlen(argv[2].str));
+        tcp_source(addr, argv[3].u, argv[4].u, argc >= 6 && !strcmp(argv[5].str, "zc"));
+    } else if (!strcmp(argv[1].str, "impair")) {
+        if (argc < 4) goto notenoughargs;
+
+        tcp_impair_drop = MIN(argv[2].u, 1000ul);
+        tcp_impair_reorder = MIN(argv[3].u, 1000ul - tcp_impair_drop);
+        printf("dropping %u and reordering %u per mille of received segments\n",
+               tcp_impair_drop, tcp_impair_reorder);
+    } else if (!strcmp(argv[1].str, "cc")) {
+        /* pick the congestion control new sockets use */
+        if (argc >= 3) {
+            const struct tcp_cc_ops *ops = tcp_cc_find(argv[2].str);
+            if (!ops) {
+                printf("ERROR unknown congestion control '%s'\n", argv[2].str);
+                return ERR_NOT_FOUND;
+            }
+            tcp_cc_default = ops;
+        }
+        printf("congestion control: %s\n", tcp_cc_default->name);
     } else {
         printf("ERROR unknown command\n");
         goto usage;
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <lib/minip/tcp_cc.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the most the window is allowed to grow to, well clear of overflowing */
+#define TCP_CC_MAX_CWND (1U << 30)
+
+const struct tcp_cc_ops *tcp_cc_find(const char *name) {
+    if (!strcmp(name, tcp_cc_newreno.name))
+        return &tcp_cc_newreno;
+    if (!strcmp(name, tcp_cc_cubic.name))
+        return &tcp_cc_cubic;
+    return NULL;
+}
+
+void tcp_cc_init(struct tcp_cc *cc, const struct tcp_cc_ops *ops, uint32_t mss) {
+    DEBUG_ASSERT(ops);
+    DEBUG_ASSERT(mss > 0);
+
+    memset(cc, 0, sizeof(*cc));
+    cc->ops = ops;
+    cc->mss = mss;
+    cc->cwnd = MIN(10 * mss, MAX(2 * mss, 14600U));
+    cc->ssthresh = UINT32_MAX;
+
+    if (ops->init)
+        ops->init(cc);
+}
+
+void tcp_cc_ack(struct tcp_cc *cc, uint32_t acked, lk_time_t now, lk_time_t srtt) {
+    if (cc->cwnd < cc->ssthresh) {
+        /* slow start, counting bytes but no more than 2 segments per ack (RFC 3465) */
+        cc->cwnd += MIN(acked, 2 * cc->mss);
+    } else {
+        cc->ops->cong_avoid(cc, acked, now, srtt);
+    }
+
+    cc->cwnd = MIN(cc->cwnd, TCP_CC_MAX_CWND);
+}
+
+void tcp_cc_loss(struct tcp_cc *cc, uint32_t flight) {
+    cc->ssthresh = cc->ops->ssthresh(cc, flight);
+    cc->cwnd = cc->ssthresh;
+    cc->bytes_acked = 0;
+}
+
+void tcp_cc_timeout(struct tcp_cc *cc, uint32_t flight) {
+    cc->ssthresh = cc->ops->ssthresh(cc, flight);
+    cc->cwnd = cc->mss;
+    cc->bytes_acked = 0;
+}
+
+/* NewReno (RFC 5681), one segment of growth per window acked, halve on loss */
+static void newreno_cong_avoid(struct tcp_cc *cc, uint32_t acked, lk_time_t now, lk_time_t srtt) {
+    cc->bytes_acked += acked;
+    if (cc->bytes_acked >= cc->cwnd) {
+        cc->bytes_acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+static uint32_t newreno_ssthresh(struct tcp_cc *cc, uint32_t flight) {
+    return MAX(flight / 2, 2 * cc->mss);
+}
+
+const struct tcp_cc_ops tcp_cc_newreno = {
+    .name = "newreno",
+    .cong_avoid = newreno_cong_avoid,
+    .ssthresh = newreno_ssthresh,
+};
+
+/*
+ * CUBIC (RFC 8312). After a loss the window follows
+ *
+ *   W(t) = C * (t - K)^3 + W_max
+ *
+ * growing quickly back toward the window the loss happened at, flattening out
+ * around it, then probing past it. Never slower than reno would have been.
+ * C = 0.4 with t in seconds, beta = 0.7, both scaled to integers below.
+ */
+#define CUBIC_BETA 717 /* / 1024 */
+#define CUBIC_C_NUM 4
+#define CUBIC_C_DEN 10
+
+/* reno friendly growth, 3 * (1 - beta) / (1 + beta) segments per rtt, / 1024 */
+#define CUBIC_RENO_ALPHA (3 * (1024 - CUBIC_BETA) * 1024 / (1024 + CUBIC_BETA))
+
+/* the furthest from K the curve is evaluated, so the cube fits in 64 bits */
+#define CUBIC_MAX_T (60000)
+
+static uint32_t cubic_root(uint64_t a) {
+    uint64_t x = 0;
+
+    for (int s = 63; s >= 0; s -= 3) {
+        x <<= 1;
+        uint64_t b = 3 * x * (x + 1) + 1;
+        if ((a >> s) >= b) {
+            a -= b << s;
+            x++;
+        }
+    }
+
+    return x;
+}
+
+static void cubic_init(struct tcp_cc *cc) {
+    cc->epoch_start = 0;
+    cc->w_max = 0;
+}
+
+static void cubic_start_epoch(struct tcp_cc *cc, lk_time_t now) {
+    cc->epoch_start = now ? now : 1;
+    cc->w_est = cc->cwnd;
+
+    if (cc->cwnd < cc->w_max) {
+        /* K = cbrt((W_max - cwnd) / C) seconds, done in segments and ms */
+        uint64_t segs_ms3 = (uint64_t)MIN(cc->w_max - cc->cwnd, TCP_CC_MAX_CWND) *
+                            (1000000000ULL * CUBIC_C_DEN / CUBIC_C_NUM) / cc->mss;
+        cc->k = cubic_root(segs_ms3);
+        cc->w_origin = cc->w_max;
+    } else {
+        cc->k = 0;
+        cc->w_origin = cc->cwnd;
+    }
+}
+
+static void cubic_cong_avoid(struct tcp_cc *cc, uint32_t acked, lk_time_t now, lk_time_t srtt) {
+    if (cc->epoch_start == 0)
+        cubic_start_epoch(cc, now);
+
+    /* where the curve will be an rtt from now */
+    int64_t t = (int64_t)(now - cc->epoch_start) + srtt - cc->k;
+    t = MAX(MIN(t, CUBIC_MAX_T), -CUBIC_MAX_T);
+
+    int64_t target = (int64_t)cc->w_origin +
+                     t * t * t * CUBIC_C_NUM / CUBIC_C_DEN * cc->mss / 1000000000LL;
+    target = MAX(target, (int64_t)cc->mss);
+
+    /* track the window reno would have and never fall behind it */
+    cc->w_est += (uint64_t)acked * cc->mss * CUBIC_RENO_ALPHA / (1024ULL * cc->cwnd);
+    if ((int64_t)cc->w_est > target)
+        target = cc->w_est;
+
+    if (target > cc->cwnd) {
+        /* close the gap over about an rtt, but no faster than 1.5x per rtt */
+        uint64_t inc = (uint64_t)acked * (target - cc->cwnd) / cc->cwnd;
+        cc->cwnd += MIN(inc, acked / 2);
+    } else {
+        /* at or past the target, creep up slowly */
+        cc->cwnd += (uint64_t)acked * cc->mss / (100ULL * cc->cwnd);
+    }
+}
+
+static uint32_t cubic_ssthresh(struct tcp_cc *cc, uint32_t flight) {
+    cc->epoch_start = 0;
+
+    /* fast convergence, give up bandwidth sooner if we didn't get back to the last peak */
+    if (cc->cwnd < cc->w_max)
+        cc->w_max = (uint64_t)cc->cwnd * (1024 + CUBIC_BETA) / 2048;
+    else
+        cc->w_max = cc->cwnd;
+
+    return MAX((uint32_t)((uint64_t)cc->cwnd * CUBIC_BETA / 1024), 2 * cc->mss);
+}
+
+const struct tcp_cc_ops tcp_cc_cubic = {
+    .name = "cubic",
+    .init = cubic_init,
+    .cong_avoid = cubic_cong_avoid,
+    .ssthresh = cubic_ssthresh,
+};
+
+/*
+ * Retransmit timeout (RFC 6298). srtt is kept scaled by 8 and rttvar by 4 so the
+ * 1/8 and 1/4 gains are plain shifts. The clock granularity is 1ms.
+ */
+void tcp_rtt_init(struct tcp_rtt *r) {
+    r->srtt = 0;
+    r->rttvar = 0;
+    r->rto = TCP_RTO_INITIAL;
+}
+
+void tcp_rtt_sample(struct tcp_rtt *r, lk_time_t rtt) {
+    rtt = MAX(rtt, 1U);
+    rtt = MIN(rtt, (lk_time_t)TCP_RTO_MAX);
+
+    if (r->srtt == 0) {
+        r->srtt = rtt << 3;
+        r->rttvar = (rtt / 2) << 2;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(r->srtt >> 3);
+        r->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        r->rttvar += delta - (int32_t)(r->rttvar >> 2);
+    }
+
+    /* the stored rttvar is already 4 * rttvar */
+    uint32_t rto = (r->srtt >> 3) + MAX(r->rttvar, 1U);
+    r->rto = MIN(MAX(rto, (uint32_t)TCP_RTO_MIN), (uint32_t)TCP_RTO_MAX);
+}
+
+void tcp_rtt_backoff(struct tcp_rtt *r) {
+    r->rto = MIN(r->rto * 2, (uint32_t)TCP_RTO_MAX);
+}
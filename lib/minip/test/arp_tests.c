@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <lib/minip/arp.h>
+#include <lib/unittest.h>
+#include <lk/err.h>
+#include <string.h>
+
+// addresses from TEST-NET-1, which nothing real will answer for
+#define ADDR_A IPV4(192, 0, 2, 1)
+#define ADDR_B IPV4(192, 0, 2, 2)
+
+static const uint8_t mac_a[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0a};
+static const uint8_t mac_a2[6] = {0x02, 0x00, 0x00, 0x00, 0x01, 0x0a};
+static const uint8_t mac_b[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x0b};
+
+// what the fake interface was asked to send
+static struct {
+    uint arp;
+    uint ipv4;
+    uint8_t last_dst[6];
+} sent;
+
+static int test_tx(void *arg, pktbuf_t *p) {
+    const uint8_t *eth = p->data;
+
+    if (eth[12] == 0x08 && eth[13] == 0x06) {
+        sent.arp++;
+    } else {
+        sent.ipv4++;
+    }
+    memcpy(sent.last_dst, eth, 6);
+
+    pktbuf_free_chain(p, true);
+    return 0;
+}
+
+// the table may keep poking an interface, so it has to outlive the test
+static netif_t test_netif;
+
+static void test_netif_setup(void) {
+    static const uint8_t mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+
+    netif_create(&test_netif, "arptest");
+    memcpy(test_netif.mac_address, mac, 6);
+    test_netif.ipv4_addr = IPV4(192, 0, 2, 100);
+    test_netif.tx_func = test_tx;
+    test_netif.flags = NETIF_FLAG_ETH_CONFIGURED;
+
+    memset(&sent, 0, sizeof(sent));
+}
+
+// an ipv4 frame waiting on its destination
+static pktbuf_t *test_packet(void) {
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return NULL;
+
+    uint8_t *eth = pktbuf_prepend(p, 14);
+    memset(eth, 0xff, 6);
+    memcpy(eth + 6, test_netif.mac_address, 6);
+    eth[12] = 0x08;
+    eth[13] = 0x00;
+    return p;
+}
+
+static bool update_and_lookup(void) {
+    BEGIN_TEST;
+
+    test_netif_setup();
+    arp_cache_remove(ADDR_A);
+
+    uint8_t mac[6];
+    EXPECT_FALSE(arp_cache_lookup(ADDR_A, mac), "");
+
+    // only added when asked to
+    arp_cache_update(&test_netif, ADDR_A, mac_a, false);
+    EXPECT_FALSE(arp_cache_lookup(ADDR_A, mac), "");
+
+    arp_cache_update(&test_netif, ADDR_A, mac_a, true);
+    ASSERT_TRUE(arp_cache_lookup(ADDR_A, mac), "");
+    EXPECT_BYTES_EQ(mac_a, mac, 6, "");
+
+    // a move to another card updates it, whether or not it would have been added
+    arp_cache_update(&test_netif, ADDR_A, mac_a2, false);
+    ASSERT_TRUE(arp_cache_lookup(ADDR_A, mac), "");
+    EXPECT_BYTES_EQ(mac_a2, mac, 6, "");
+
+    // broadcast and unset addresses are never cached
+    arp_cache_update(&test_netif, IPV4(192, 0, 2, 255), mac_a, true);
+    EXPECT_FALSE(arp_cache_lookup(IPV4(192, 0, 2, 255), mac), "");
+    arp_cache_update(&test_netif, 0, mac_a, true);
+    EXPECT_FALSE(arp_cache_lookup(0, mac), "");
+
+    arp_cache_remove(ADDR_A);
+    EXPECT_FALSE(arp_cache_lookup(ADDR_A, mac), "");
+
+    EXPECT_EQ(0U, sent.arp + sent.ipv4, "nothing to send");
+
+    END_TEST;
+}
+
+static bool pending_queue(void) {
+    BEGIN_TEST;
+
+    test_netif_setup();
+    arp_cache_remove(ADDR_B);
+
+    // the first packet starts resolution, the rest wait with it up to the limit
+    for (int i = 0; i < ARP_PENDING_MAX + 2; i++) {
+        pktbuf_t *p = test_packet();
+        ASSERT_NONNULL(p, "");
+        EXPECT_EQ(NO_ERROR, arp_cache_queue(&test_netif, ADDR_B, p), "");
+    }
+    EXPECT_EQ(1U, sent.arp, "one request");
+    EXPECT_EQ(0U, sent.ipv4, "");
+
+    uint8_t mac[6];
+    EXPECT_FALSE(arp_cache_lookup(ADDR_B, mac), "unresolved entries aren't returned");
+
+    // the answer sends what's waiting, to the right place
+    arp_cache_update(&test_netif, ADDR_B, mac_b, false);
+    EXPECT_EQ((uint)ARP_PENDING_MAX, sent.ipv4, "");
+    EXPECT_BYTES_EQ(mac_b, sent.last_dst, 6, "");
+    ASSERT_TRUE(arp_cache_lookup(ADDR_B, mac), "");
+    EXPECT_BYTES_EQ(mac_b, mac, 6, "");
+
+    // and once resolved packets go straight out
+    pktbuf_t *p = test_packet();
+    ASSERT_NONNULL(p, "");
+    EXPECT_EQ(NO_ERROR, arp_cache_queue(&test_netif, ADDR_B, p), "");
+    EXPECT_EQ((uint)ARP_PENDING_MAX + 1, sent.ipv4, "");
+    EXPECT_EQ(1U, sent.arp, "");
+
+    // removing an entry drops anything still waiting on it
+    arp_cache_remove(ADDR_B);
+    p = test_packet();
+    ASSERT_NONNULL(p, "");
+    arp_cache_queue(&test_netif, ADDR_B, p);
+    EXPECT_EQ(2U, sent.arp, "");
+    arp_cache_remove(ADDR_B);
+    EXPECT_EQ((uint)ARP_PENDING_MAX + 1, sent.ipv4, "");
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(arp_tests)
+RUN_TEST(update_and_lookup)
+RUN_TEST(pending_queue)
+END_TEST_CASE(arp_tests)
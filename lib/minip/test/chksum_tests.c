@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <lib/minip/chksum.h>
+#include <lib/unittest.h>
+#include <rand.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFLEN 1024
+
+// a 16 bit word at a time, the way the stack always has
+static uint16_t ref_sum16(uint32_t sum, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint16_t w;
+        memcpy(&w, buf + i, sizeof(w));
+        sum += w;
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    if (len & 1) {
+        uint8_t tail[2] = { buf[len - 1], 0 };
+        uint16_t w;
+        memcpy(&w, tail, sizeof(w));
+        sum += w;
+    }
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static bool impls_match_reference(void) {
+    BEGIN_TEST;
+
+    uint8_t *src = malloc(BUFLEN + 16);
+    uint8_t *dst = malloc(BUFLEN + 16);
+    ASSERT_NONNULL(src, "");
+    ASSERT_NONNULL(dst, "");
+
+    ASSERT_NONNULL(ones_sum_get_impl(0), "there's always at least the generic one");
+    EXPECT_EQ(0, ones_sum16(0, src, 0), "");
+
+    for (size_t n = 0; ones_sum_get_impl(n); n++) {
+        const struct ones_sum_impl *impl = ones_sum_get_impl(n);
+
+        for (uint pass = 0; pass < 2; pass++) {
+            // random data, then all ones to push the accumulators the hardest
+            for (size_t i = 0; i < BUFLEN + 16; i++)
+                src[i] = pass ? 0xff : rand();
+
+            for (size_t align = 0; align < 16; align++) {
+                for (size_t len = 0; len <= BUFLEN; len += (len < 160) ? 1 : 61) {
+                    uint16_t ref = ref_sum16(0x1234, src + align, len);
+
+                    EXPECT_EQ(ref, ones_sum_fold(impl->sum(0x1234, src + align, len)), impl->name);
+
+                    memset(dst, 0, BUFLEN + 16);
+                    uint16_t copy = ones_sum_fold(impl->copy_sum(0x1234, dst + 15 - align,
+                                                                 src + align, len));
+                    EXPECT_EQ(ref, copy, impl->name);
+                    EXPECT_BYTES_EQ(src + align, dst + 15 - align, len, impl->name);
+                    if (len + 15 - align < BUFLEN + 16)
+                        EXPECT_EQ(0, dst[len + 15 - align], "wrote past the end");
+                }
+            }
+        }
+    }
+
+    // the dispatched versions agree too
+    EXPECT_EQ(ref_sum16(0, src + 1, 999), ones_sum16(0, src + 1, 999), "");
+    EXPECT_EQ(ref_sum16(0, src + 3, 777), ones_sum16_copy(0, dst, src + 3, 777), "");
+
+    free(src);
+    free(dst);
+
+    END_TEST;
+}
+
+static bool large_buffer(void) {
+    BEGIN_TEST;
+
+    // past a chunk of the vector versions, so the lanes are widened more than once
+    const size_t len = 256 * 1024 + 7;
+    uint8_t *buf = malloc(len);
+    ASSERT_NONNULL(buf, "");
+    memset(buf, 0xff, len);
+    buf[len - 1] = 0x12;
+
+    uint16_t ref = ref_sum16(0, buf, len);
+    for (size_t n = 0; ones_sum_get_impl(n); n++) {
+        const struct ones_sum_impl *impl = ones_sum_get_impl(n);
+        EXPECT_EQ(ref, ones_sum_fold(impl->sum(0, buf, len)), impl->name);
+    }
+
+    free(buf);
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(chksum_tests)
+RUN_TEST(impls_match_reference)
+RUN_TEST(large_buffer)
+END_TEST_CASE(chksum_tests)
@@ -114,6 +114,87 @@ static bool reset_test(void) {
     END_TEST;
 }
 
+static bool detach_test(void) {
+    BEGIN_TEST;
+
+    pktbuf_t *p = pktbuf_alloc();
+    ASSERT_NONNULL(p, "");
+
+    pktbuf_append_data(p, "received", 8);
+    pktbuf_consume(p, 2);
+    u8 *buffer = p->buffer;
+    u8 *data = p->data;
+
+    // the buffer and data move over to the new pktbuf
+    pktbuf_t *q = pktbuf_detach(p);
+    ASSERT_NONNULL(q, "");
+    EXPECT_EQ(buffer, q->buffer, "Detached buffer mismatch");
+    EXPECT_EQ(data, q->data, "Detached data mismatch");
+    EXPECT_EQ(6UL, q->dlen, "");
+    EXPECT_BYTES_EQ((const uint8_t *)"ceived", q->data, 6, "Detached data mismatch");
+
+    // leaving p empty with a buffer of its own, at the same offset
+    EXPECT_NE(buffer, p->buffer, "Buffer should have been replaced");
+    EXPECT_EQ(0UL, p->dlen, "");
+    EXPECT_EQ((uint32_t)(PKTBUF_MAX_HDR + 2), pktbuf_avail_head(p), "");
+    EXPECT_EQ((uint32_t)PKTBUF_SIZE, p->blen, "");
+
+    pktbuf_free(q, false);
+    pktbuf_free(p, false);
+
+    // buffers that aren't from the pool stay where they are
+    uint8_t buf[256];
+    p = pktbuf_alloc_empty();
+    ASSERT_NONNULL(p, "");
+    pktbuf_add_buffer(p, buf, 256, 32, 0, my_free_cb, NULL);
+    EXPECT_NULL(pktbuf_detach(p), "");
+    EXPECT_EQ(buf, p->buffer, "");
+    pktbuf_free(p, false);
+
+    END_TEST;
+}
+
+static bool chain_test(void) {
+    BEGIN_TEST;
+
+    pktbuf_t *p[3];
+    for (int i = 0; i < 3; i++) {
+        p[i] = pktbuf_alloc();
+        ASSERT_NONNULL(p[i], "");
+        pktbuf_append(p[i], 100 + i);
+    }
+
+    pktbuf_chain(p[0], p[1]);
+    pktbuf_chain(p[0], p[2]);
+    EXPECT_EQ(p[1], p[0]->next, "");
+    EXPECT_EQ(p[2], p[1]->next, "");
+    EXPECT_NULL(p[2]->next, "");
+    EXPECT_EQ(0U, p[0]->flags & PKTBUF_FLAG_EOF, "Only the last part is the end");
+    EXPECT_EQ(0U, p[1]->flags & PKTBUF_FLAG_EOF, "");
+    EXPECT_NE(0U, p[2]->flags & PKTBUF_FLAG_EOF, "");
+    EXPECT_EQ(303U, pktbuf_total_len(p[0]), "");
+
+    // trimming cuts into the middle part and empties the last
+    pktbuf_trim_chain(p[0], 150);
+    EXPECT_EQ(100UL, p[0]->dlen, "");
+    EXPECT_EQ(50UL, p[1]->dlen, "");
+    EXPECT_EQ(0UL, p[2]->dlen, "");
+    EXPECT_EQ(150U, pktbuf_total_len(p[0]), "");
+
+    // a detached part leaves its place in the chain to the fresh buffer
+    pktbuf_t *q = pktbuf_detach(p[1]);
+    ASSERT_NONNULL(q, "");
+    EXPECT_NULL(q->next, "");
+    EXPECT_NE(0U, q->flags & PKTBUF_FLAG_EOF, "");
+    EXPECT_EQ(p[2], p[1]->next, "");
+    EXPECT_EQ(0U, p[1]->flags & PKTBUF_FLAG_EOF, "");
+    pktbuf_free(q, false);
+
+    pktbuf_free_chain(p[0], false);
+
+    END_TEST;
+}
+
 static bool recommended_rx_depth_test(void) {
     BEGIN_TEST;
 
@@ -132,5 +213,7 @@ RUN_TEST(basic_alloc_free)
 RUN_TEST(append_prepend_consume)
 RUN_TEST(custom_buffer)
 RUN_TEST(reset_test)
+RUN_TEST(detach_test)
+RUN_TEST(chain_test)
 RUN_TEST(recommended_rx_depth_test)
 END_TEST_CASE(pktbuf_tests)
@@ -2,7 +2,10 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_SRCS += $(LOCAL_DIR)/arp_tests.c
+MODULE_SRCS += $(LOCAL_DIR)/chksum_tests.c
 MODULE_SRCS += $(LOCAL_DIR)/pktbuf_tests.c
+MODULE_SRCS += $(LOCAL_DIR)/tcp_cc_tests.c
 
 MODULE_DEPS += lib/unittest
 
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+#include <lib/minip/tcp_cc.h>
+#include <lib/unittest.h>
+#include <string.h>
+
+#define MSS 1460
+
+// ack a full window a mss at a time, once per rtt, for duration ms
+static lk_time_t ack_rounds(struct tcp_cc *cc, lk_time_t now, lk_time_t rtt, lk_time_t duration) {
+    for (lk_time_t end = now + duration; now < end; now += rtt) {
+        uint32_t segs = cc->cwnd / MSS;
+        for (uint32_t i = 0; i < segs; i++) {
+            tcp_cc_ack(cc, MSS, now, rtt);
+        }
+    }
+    return now;
+}
+
+static bool rtt_estimator(void) {
+    BEGIN_TEST;
+
+    struct tcp_rtt r;
+    tcp_rtt_init(&r);
+    EXPECT_EQ((uint32_t)TCP_RTO_INITIAL, r.rto, "");
+
+    // the first sample sets srtt and half of it as the variance
+    tcp_rtt_sample(&r, 100);
+    EXPECT_EQ(100U, tcp_rtt_srtt(&r), "");
+    EXPECT_EQ(50U, tcp_rtt_var(&r), "");
+    EXPECT_EQ(300U, r.rto, "rto is srtt + 4 * rttvar");
+
+    // a steady rtt drains the variance, down to the minimum rto
+    for (int i = 0; i < 50; i++) {
+        tcp_rtt_sample(&r, 100);
+    }
+    EXPECT_EQ(100U, tcp_rtt_srtt(&r), "");
+    EXPECT_EQ((uint32_t)TCP_RTO_MIN, r.rto, "");
+
+    // a jump moves srtt by 1/8 of the difference
+    tcp_rtt_sample(&r, 180);
+    EXPECT_EQ(110U, tcp_rtt_srtt(&r), "");
+    EXPECT_GT(r.rto, 110U + 4 * 10U, "");
+
+    // timeouts double it, up to the max
+    uint32_t rto = r.rto;
+    tcp_rtt_backoff(&r);
+    EXPECT_EQ(rto * 2, r.rto, "");
+    for (int i = 0; i < 20; i++) {
+        tcp_rtt_backoff(&r);
+    }
+    EXPECT_EQ((uint32_t)TCP_RTO_MAX, r.rto, "");
+
+    // and the next sample brings it back
+    tcp_rtt_sample(&r, 110);
+    EXPECT_LT(r.rto, 1000U, "");
+
+    // a zero sample from a fast link still counts
+    tcp_rtt_init(&r);
+    tcp_rtt_sample(&r, 0);
+    EXPECT_EQ(1U, tcp_rtt_srtt(&r), "");
+    EXPECT_EQ((uint32_t)TCP_RTO_MIN, r.rto, "");
+
+    END_TEST;
+}
+
+static bool newreno(void) {
+    BEGIN_TEST;
+
+    ASSERT_EQ(&tcp_cc_newreno, tcp_cc_find("newreno"), "");
+    EXPECT_NULL(tcp_cc_find("vegas"), "");
+
+    struct tcp_cc cc;
+    tcp_cc_init(&cc, &tcp_cc_newreno, MSS);
+    EXPECT_EQ(10U * MSS, cc.cwnd, "initial window is 10 segments");
+    EXPECT_EQ(UINT32_MAX, cc.ssthresh, "");
+
+    // slow start grows by what's acked, but no more than 2 segments an ack
+    tcp_cc_ack(&cc, MSS, 0, 100);
+    EXPECT_EQ(11U * MSS, cc.cwnd, "");
+    tcp_cc_ack(&cc, 4 * MSS, 0, 100);
+    EXPECT_EQ(13U * MSS, cc.cwnd, "");
+
+    // a loss halves what was in flight
+    tcp_cc_loss(&cc, 20 * MSS);
+    EXPECT_EQ(10U * MSS, cc.ssthresh, "");
+    EXPECT_EQ(10U * MSS, cc.cwnd, "");
+
+    // congestion avoidance grows by one segment per window acked
+    for (int i = 0; i < 9; i++) {
+        tcp_cc_ack(&cc, MSS, 0, 100);
+    }
+    EXPECT_EQ(10U * MSS, cc.cwnd, "");
+    tcp_cc_ack(&cc, MSS, 0, 100);
+    EXPECT_EQ(11U * MSS, cc.cwnd, "");
+
+    // a timeout drops to one segment, and never below 2 for ssthresh
+    tcp_cc_timeout(&cc, MSS);
+    EXPECT_EQ((uint32_t)MSS, cc.cwnd, "");
+    EXPECT_EQ(2U * MSS, cc.ssthresh, "");
+
+    END_TEST;
+}
+
+static bool cubic(void) {
+    BEGIN_TEST;
+
+    ASSERT_EQ(&tcp_cc_cubic, tcp_cc_find("cubic"), "");
+
+    struct tcp_cc cc;
+    tcp_cc_init(&cc, &tcp_cc_cubic, MSS);
+
+    // lose at 100 segments, which drops the window to 0.7 of that
+    const uint32_t w_max = 100 * MSS;
+    cc.cwnd = w_max;
+    tcp_cc_loss(&cc, w_max);
+    EXPECT_EQ(w_max * 717 / 1024, cc.cwnd, "");
+    EXPECT_EQ(cc.cwnd, cc.ssthresh, "");
+    EXPECT_EQ(w_max, cc.w_max, "");
+
+    // with a 100ms rtt it takes K = cbrt(30 / 0.4) ~= 4.2s to get back
+    lk_time_t now = 1000;
+    const lk_time_t rtt = 100;
+    tcp_cc_ack(&cc, 0, now, rtt);
+    EXPECT_GT(cc.k, 4100U, "");
+    EXPECT_LT(cc.k, 4300U, "");
+
+    // concave on the way back up, fast at first and flattening toward w_max
+    uint32_t start = cc.cwnd;
+    now = ack_rounds(&cc, now, rtt, 2000);
+    uint32_t first = cc.cwnd - start;
+    start = cc.cwnd;
+    now = ack_rounds(&cc, now, rtt, 2000);
+    uint32_t second = cc.cwnd - start;
+    EXPECT_GT(first, 2 * second, "");
+    EXPECT_LE(cc.cwnd, w_max, "");
+    EXPECT_GT(cc.cwnd, w_max * 99 / 100, "");
+
+    // then convex, probing well past it
+    now = ack_rounds(&cc, now, rtt, 5000);
+    EXPECT_GT(cc.cwnd, w_max * 13 / 10, "");
+
+    // losing again below the last peak lowers it further, for fast convergence
+    tcp_cc_init(&cc, &tcp_cc_cubic, MSS);
+    cc.cwnd = w_max;
+    tcp_cc_loss(&cc, w_max);
+    cc.cwnd = 80 * MSS;
+    tcp_cc_loss(&cc, 80 * MSS);
+    EXPECT_EQ(80U * MSS * (1024 + 717) / 2048, cc.w_max, "");
+
+    // on a short rtt the reno friendly estimate gets back well before the curve would
+    tcp_cc_init(&cc, &tcp_cc_cubic, MSS);
+    cc.cwnd = w_max;
+    tcp_cc_loss(&cc, w_max);
+    ack_rounds(&cc, 1000, 1, 1000);
+    EXPECT_GT(cc.cwnd, w_max, "");
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(tcp_cc_tests)
+RUN_TEST(rtt_estimator)
+RUN_TEST(newreno)
+RUN_TEST(cubic)
+END_TEST_CASE(tcp_cc_tests)
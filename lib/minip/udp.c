@@ -15,6 +15,7 @@
 #include <iovec.h>
 #include <lk/list.h>
 #include <malloc.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <lk/trace.h>
 
@@ -147,6 +148,28 @@ status_t udp_close(udp_socket_t *handle) {
     return NO_ERROR;
 }
 
+/* copy an iovec into buf, returning the ones complement sum of the bytes copied */
+static uint16_t udp_copy_sum(void *buf, const iovec_t *iov, uint iov_count) {
+    uint8_t *dst = buf;
+    uint32_t sum = 0;
+    bool odd = false;
+
+    for (uint i = 0; i < iov_count; i++) {
+        uint16_t part = ones_sum16_copy(0, dst, iov[i].iov_base, iov[i].iov_len);
+
+        /* an iovec starting on an odd byte sums with its bytes swapped */
+        if (odd)
+            part = (part >> 8) | (part << 8);
+        sum += part;
+
+        if (iov[i].iov_len & 1)
+            odd = !odd;
+        dst += iov[i].iov_len;
+    }
+
+    return ones_sum_fold(sum);
+}
+
 status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle) {
     pktbuf_t *p;
     udp_hdr_t *udp;
@@ -165,7 +188,15 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
 
     buf = pktbuf_append(p, len);
 
-    iovec_to_membuf(buf, len, iov, iov_count, 0);
+    /* an interface that can't finish the checksum has the data summed as it's copied in */
+    bool sum_now = MINIP_USE_UDP_CHECKSUM && handle->netif &&
+                   !(handle->netif->flags & NETIF_FLAG_TX_CKSUM);
+    uint16_t data_sum = 0;
+    if (sum_now) {
+        data_sum = udp_copy_sum(buf, iov, iov_count);
+    } else {
+        iovec_to_membuf(buf, len, iov, iov_count, 0);
+    }
 
     udp = pktbuf_prepend(p, sizeof(udp_hdr_t));
     udp->src_port   = htons(handle->sport);
@@ -182,7 +213,16 @@ status_t udp_send_iovec(const iovec_t *iov, uint iov_count, udp_socket_t *handle
         pheader.protocol = IP_PROTO_UDP;
         pheader.tcp_length = htons(p->dlen);
 
-        udp->chksum = cksum_pheader(&pheader, p->data, p->dlen);
+        if (sum_now) {
+            uint16_t sum = ones_sum16(data_sum, &pheader, sizeof(pheader));
+            sum = ~ones_sum16(sum, udp, sizeof(*udp));
+            /* all ones is the same sum, and zero means none at all */
+            udp->chksum = sum ? sum : 0xffff;
+        } else {
+            /* the interface finishes it, in hardware if it can */
+            udp->chksum = ones_sum16(0, &pheader, sizeof(pheader));
+            cksum_set_partial(p, udp, offsetof(udp_hdr_t, chksum));
+        }
     }
 #endif
 
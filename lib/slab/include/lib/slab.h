@@ -0,0 +1,109 @@
+//
+// Copyright (c) 2026 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#pragma once
+
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lib/pool.h>
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A growable cache of fixed size objects, for kernel structures that are
+// allocated and freed all the time.
+//
+// Objects live in slabs: naturally aligned, physically contiguous runs of pages
+// from the pmm, each carved up by a lib/pool after a small header. Slabs are
+// added as the cache grows and only given back to the pmm by
+// slab_cache_reclaim(). Each cpu keeps a short list of free objects in front of
+// the slabs, refilled from and drained to them in batches, so an alloc or free
+// normally only touches the current cpu's list.
+//
+// slab_free() never blocks or calls into the page allocator, so it may be
+// called with interrupts disabled or from interrupt context. slab_alloc() may
+// have to grow the cache and must be called from thread context.
+//
+// Typical usage:
+//
+// static slab_cache_t foo_cache = SLAB_CACHE_INITIAL_VALUE(foo_cache, "foo", sizeof(struct foo),
+//                                                          __alignof(struct foo));
+//
+// struct foo *f = slab_alloc(&foo_cache);
+// ...
+// slab_free(&foo_cache, f);
+__BEGIN_CDECLS
+
+struct slab_cache_cpu {
+    spin_lock_t lock;
+    pool_t free;
+    uint count;
+
+    // stats
+    ulong allocs;
+    ulong frees;
+} __CPU_ALIGN;
+
+typedef struct slab_cache {
+    // Private:
+    struct list_node node;
+    const char *name;
+    size_t object_size;
+    size_t object_align;
+
+    // slab geometry, worked out when the first slab is added
+    size_t slab_pages;
+    size_t objects_per_slab;
+    size_t object_offset;
+
+    spin_lock_t lock;
+    struct list_node partial; // some objects handed out
+    struct list_node full;    // every object handed out
+    struct list_node empty;   // no objects handed out
+
+    // stats, under lock
+    size_t slab_count;
+    ulong refills;
+    ulong drains;
+    ulong reclaimed_pages;
+
+    struct slab_cache_cpu cpu[SMP_MAX_CPUS];
+} slab_cache_t;
+
+#define SLAB_CACHE_INITIAL_VALUE(c, _name, size, align) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .name = (_name), \
+    .object_size = (size), \
+    .object_align = (align), \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
+    .partial = LIST_INITIAL_VALUE((c).partial), \
+    .full = LIST_INITIAL_VALUE((c).full), \
+    .empty = LIST_INITIAL_VALUE((c).empty), \
+}
+
+// Initialize a cache in caller provided storage. Equivalent to SLAB_CACHE_INITIAL_VALUE.
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size, size_t object_align);
+
+// Allocate and initialize a cache. Returns NULL if out of memory.
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t object_align);
+
+// Reclaim and free a cache made by slab_cache_create. Every object must have been freed.
+void slab_cache_destroy(slab_cache_t *cache);
+
+// Allocate an object, aligned to object_align and at least object_size bytes.
+// Returns NULL if the cache could not grow.
+void *slab_alloc(slab_cache_t *cache);
+
+// Free an object previously allocated from the same cache.
+void slab_free(slab_cache_t *cache, void *object);
+
+// Flush the per cpu lists and give every slab with no objects in use back to the pmm.
+// Returns the number of pages released.
+size_t slab_cache_reclaim(slab_cache_t *cache);
+
+__END_CDECLS
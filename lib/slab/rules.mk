@@ -0,0 +1,12 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+GLOBAL_INCLUDES += $(LOCAL_DIR)/include
+
+MODULE := $(LOCAL_DIR)
+MODULE_OPTIONS := test extra_warnings
+
+MODULE_DEPS += lib/pool
+
+MODULE_SRCS += $(LOCAL_DIR)/slab.c
+
+include make/module.mk
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2026 Travis Geiselbrecht
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <kernel/mutex.h>
+#include <kernel/vm.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/pow2.h>
+#include <lk/trace.h>
+#include <malloc.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/* a slab holds at least this many objects, unless that takes more than SLAB_MAX_PAGES */
+#ifndef SLAB_MIN_OBJECTS
+#define SLAB_MIN_OBJECTS 8
+#endif
+#ifndef SLAB_MAX_PAGES
+#define SLAB_MAX_PAGES 16
+#endif
+
+/* objects moved between a cpu list and the slabs at a time */
+#ifndef SLAB_BATCH
+#define SLAB_BATCH 8
+#endif
+
+/* a cpu list holding more than this many objects drains a batch */
+#ifndef SLAB_CPU_MAX
+#define SLAB_CPU_MAX (SLAB_BATCH * 2)
+#endif
+
+/* header at the start of every slab, objects follow at cache->object_offset */
+struct slab {
+    struct list_node node;
+    slab_cache_t *cache;
+    pool_t pool;
+    uint inuse; /* objects out of the pool, including those on cpu lists */
+};
+
+/* every cache that has ever had a slab, for the console command */
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+static inline size_t slab_bytes(const slab_cache_t *c) {
+    return c->slab_pages * PAGE_SIZE;
+}
+
+static inline struct slab *object_to_slab(const slab_cache_t *c, void *object) {
+    return (struct slab *)ROUNDDOWN((uintptr_t)object, slab_bytes(c));
+}
+
+void slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size, size_t object_align) {
+    *cache = (slab_cache_t)SLAB_CACHE_INITIAL_VALUE(*cache, name, object_size, object_align);
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t object_size, size_t object_align) {
+    slab_cache_t *cache = memalign(CACHE_LINE, sizeof(slab_cache_t));
+    if (!cache)
+        return NULL;
+
+    slab_cache_init(cache, name, object_size, object_align);
+    return cache;
+}
+
+/* work out the slab size and register the cache, the first time it grows */
+static void slab_cache_setup(slab_cache_t *c) {
+    size_t padded = pool_padded_object_size(c->object_size, c->object_align);
+    size_t offset = ROUNDUP(sizeof(struct slab), pool_storage_align(c->object_size, c->object_align));
+
+    DEBUG_ASSERT(c->object_align <= PAGE_SIZE);
+
+    size_t pages = 1;
+    while (pages < SLAB_MAX_PAGES && (pages * PAGE_SIZE - offset) / padded < SLAB_MIN_OBJECTS)
+        pages *= 2;
+
+    ASSERT(pages * PAGE_SIZE > offset + padded);
+
+    c->object_offset = offset;
+    c->objects_per_slab = (pages * PAGE_SIZE - offset) / padded;
+    c->slab_pages = pages;
+
+    LTRACEF("cache '%s': object size %zu, %zu pages per slab, %zu objects per slab\n",
+            c->name, c->object_size, c->slab_pages, c->objects_per_slab);
+
+    mutex_acquire(&cache_list_lock);
+    if (!list_in_list(&c->node))
+        list_add_tail(&cache_list, &c->node);
+    mutex_release(&cache_list_lock);
+}
+
+/* move a slab to the list matching how many of its objects are handed out, cache lock held */
+static void slab_relink(slab_cache_t *c, struct slab *s) {
+    list_delete(&s->node);
+    if (s->inuse == 0)
+        list_add_head(&c->empty, &s->node);
+    else if (s->inuse == c->objects_per_slab)
+        list_add_head(&c->full, &s->node);
+    else
+        list_add_head(&c->partial, &s->node);
+}
+
+/* add a fresh slab to the cache */
+static status_t slab_grow(slab_cache_t *c) {
+    if (unlikely(c->slab_pages == 0))
+        slab_cache_setup(c);
+
+    void *ptr;
+    if (c->slab_pages == 1) {
+        ptr = pmm_alloc_kpages(1, NULL);
+    } else {
+        /* naturally aligned, so an object's slab header can be found by rounding down */
+        paddr_t pa;
+        uint8_t align_log2 = PAGE_SIZE_SHIFT + log2_uint(c->slab_pages);
+        if (pmm_alloc_contiguous(c->slab_pages, align_log2, &pa, NULL) == 0)
+            return ERR_NO_MEMORY;
+        ptr = paddr_to_kvaddr(pa);
+    }
+    if (!ptr)
+        return ERR_NO_MEMORY;
+
+    struct slab *s = ptr;
+    s->cache = c;
+    s->inuse = 0;
+    pool_init(&s->pool, c->object_size, c->object_align, c->objects_per_slab,
+              (uint8_t *)s + c->object_offset);
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    list_add_head(&c->empty, &s->node);
+    c->slab_count++;
+    spin_unlock_irqrestore(&c->lock, state);
+
+    LTRACEF("cache '%s': new slab %p\n", c->name, s);
+    return NO_ERROR;
+}
+
+/* pull up to SLAB_BATCH objects out of the slabs, preferring partially used ones */
+static size_t slab_take_batch(slab_cache_t *c, void **batch) {
+    size_t count = 0;
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    while (count < SLAB_BATCH) {
+        struct slab *s = list_peek_head_type(&c->partial, struct slab, node);
+        if (!s)
+            s = list_peek_head_type(&c->empty, struct slab, node);
+        if (!s)
+            break;
+
+        while (count < SLAB_BATCH && s->inuse < c->objects_per_slab) {
+            batch[count++] = pool_alloc(&s->pool);
+            s->inuse++;
+        }
+        slab_relink(c, s);
+    }
+    if (count > 0)
+        c->refills++;
+    spin_unlock_irqrestore(&c->lock, state);
+
+    return count;
+}
+
+/* hand objects back to their slabs */
+static void slab_put_batch(slab_cache_t *c, void **batch, size_t count) {
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    for (size_t i = 0; i < count; i++) {
+        struct slab *s = object_to_slab(c, batch[i]);
+
+        DEBUG_ASSERT(s->cache == c);
+        DEBUG_ASSERT(s->inuse > 0);
+
+        pool_free(&s->pool, batch[i]);
+        s->inuse--;
+        slab_relink(c, s);
+    }
+    c->drains++;
+    spin_unlock_irqrestore(&c->lock, state);
+}
+
+static void *slab_alloc_slow(slab_cache_t *c) {
+    void *batch[SLAB_BATCH];
+    size_t count;
+
+    while ((count = slab_take_batch(c, batch)) == 0) {
+        if (slab_grow(c) < 0)
+            return NULL;
+    }
+
+    struct slab_cache_cpu *cc = &c->cpu[arch_curr_cpu_num()];
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&cc->lock);
+    for (size_t i = 1; i < count; i++) {
+        pool_free(&cc->free, batch[i]);
+    }
+    cc->count += count - 1;
+    cc->allocs++;
+    spin_unlock_irqrestore(&cc->lock, state);
+
+    return batch[0];
+}
+
+void *slab_alloc(slab_cache_t *c) {
+    struct slab_cache_cpu *cc = &c->cpu[arch_curr_cpu_num()];
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&cc->lock);
+    void *object = pool_alloc(&cc->free);
+    if (object) {
+        cc->count--;
+        cc->allocs++;
+    }
+    spin_unlock_irqrestore(&cc->lock, state);
+
+    if (likely(object))
+        return object;
+
+    return slab_alloc_slow(c);
+}
+
+void slab_free(slab_cache_t *c, void *object) {
+    DEBUG_ASSERT(object);
+    DEBUG_ASSERT(object_to_slab(c, object)->cache == c);
+
+    void *batch[SLAB_BATCH];
+    size_t count = 0;
+
+    struct slab_cache_cpu *cc = &c->cpu[arch_curr_cpu_num()];
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&cc->lock);
+    pool_free(&cc->free, object);
+    cc->frees++;
+    if (unlikely(++cc->count > SLAB_CPU_MAX)) {
+        while (count < SLAB_BATCH) {
+            batch[count++] = pool_alloc(&cc->free);
+        }
+        cc->count -= count;
+    }
+    spin_unlock_irqrestore(&cc->lock, state);
+
+    if (unlikely(count > 0))
+        slab_put_batch(c, batch, count);
+}
+
+size_t slab_cache_reclaim(slab_cache_t *c) {
+    /* flush every cpu's list back into the slabs */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct slab_cache_cpu *cc = &c->cpu[cpu];
+        for (;;) {
+            void *batch[SLAB_BATCH];
+            size_t count = 0;
+
+            arch_interrupt_saved_state_t state = spin_lock_irqsave(&cc->lock);
+            while (count < SLAB_BATCH && cc->count > 0) {
+                batch[count++] = pool_alloc(&cc->free);
+                cc->count--;
+            }
+            spin_unlock_irqrestore(&cc->lock, state);
+
+            if (count == 0)
+                break;
+            slab_put_batch(c, batch, count);
+        }
+    }
+
+    /* detach the empty slabs and give their pages back */
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    struct slab *s;
+    while ((s = list_remove_head_type(&c->empty, struct slab, node))) {
+        list_add_tail(&list, &s->node);
+        c->slab_count--;
+    }
+    spin_unlock_irqrestore(&c->lock, state);
+
+    size_t pages = 0;
+    while ((s = list_remove_head_type(&list, struct slab, node))) {
+        pmm_free_kpages(s, c->slab_pages);
+        pages += c->slab_pages;
+    }
+
+    state = spin_lock_irqsave(&c->lock);
+    c->reclaimed_pages += pages;
+    spin_unlock_irqrestore(&c->lock, state);
+
+    LTRACEF("cache '%s': reclaimed %zu pages\n", c->name, pages);
+    return pages;
+}
+
+void slab_cache_destroy(slab_cache_t *c) {
+    slab_cache_reclaim(c);
+    ASSERT(c->slab_count == 0);
+
+    mutex_acquire(&cache_list_lock);
+    if (list_in_list(&c->node))
+        list_delete(&c->node);
+    mutex_release(&cache_list_lock);
+
+    free(c);
+}
+
+static void slab_cache_dump(slab_cache_t *c) {
+    size_t free_in_slabs = 0;
+    ulong allocs = 0, frees = 0;
+    uint cached = 0;
+
+    arch_interrupt_saved_state_t state = spin_lock_irqsave(&c->lock);
+    struct slab *s;
+    list_for_every_entry(&c->partial, s, struct slab, node) {
+        free_in_slabs += c->objects_per_slab - s->inuse;
+    }
+    list_for_every_entry(&c->empty, s, struct slab, node) {
+        free_in_slabs += c->objects_per_slab;
+    }
+    size_t slab_count = c->slab_count;
+    ulong refills = c->refills;
+    ulong drains = c->drains;
+    ulong reclaimed = c->reclaimed_pages;
+    spin_unlock_irqrestore(&c->lock, state);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cached += c->cpu[cpu].count;
+        allocs += c->cpu[cpu].allocs;
+        frees += c->cpu[cpu].frees;
+    }
+
+    size_t total = slab_count * c->objects_per_slab;
+    printf("%-16s size %5zu, %2zu pages/slab, %3zu objs/slab, %4zu slabs, "
+           "%5zu in use, %4u cpu cached, %lu allocs, %lu frees, %lu refills, %lu drains, "
+           "%lu pages reclaimed\n",
+           c->name, c->object_size, c->slab_pages, c->objects_per_slab, slab_count,
+           total - free_in_slabs - cached, cached, allocs, frees, refills, drains, reclaimed);
+}
+
+static int cmd_slab(int argc, const console_cmd_args *argv) {
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("%s info\n", argv[0].str);
+        printf("%s reclaim\n", argv[0].str);
+        return ERR_GENERIC;
+    }
+
+    slab_cache_t *c;
+    if (!strcmp(argv[1].str, "info")) {
+        mutex_acquire(&cache_list_lock);
+        list_for_every_entry(&cache_list, c, slab_cache_t, node) {
+            slab_cache_dump(c);
+        }
+        mutex_release(&cache_list_lock);
+    } else if (!strcmp(argv[1].str, "reclaim")) {
+        size_t pages = 0;
+        mutex_acquire(&cache_list_lock);
+        list_for_every_entry(&cache_list, c, slab_cache_t, node) {
+            pages += slab_cache_reclaim(c);
+        }
+        mutex_release(&cache_list_lock);
+        printf("reclaimed %zu pages\n", pages);
+    } else {
+        printf("unknown command\n");
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slab", "slab object caches", &cmd_slab)
+STATIC_COMMAND_END(slab);
@@ -0,0 +1,122 @@
+// Copyright (c) 2026 Travis Geiselbrecht
+//
+// Use of this source code is governed by a MIT-style
+// license that can be found in the LICENSE file or at
+// https://opensource.org/licenses/MIT
+#include <lib/slab.h>
+#include <lib/unittest.h>
+#include <lk/cpp.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace {
+
+// Enough objects to need several slabs and to run through the cpu lists a few times.
+constexpr size_t kObjectCount = 300;
+
+bool test_slab_alloc_free() {
+    BEGIN_TEST;
+
+    slab_cache_t *cache = slab_cache_create("test", 48, 16);
+    ASSERT_NONNULL(cache, "cache create");
+    auto ac = lk::make_auto_call([&]() { slab_cache_destroy(cache); });
+
+    uint8_t **objs = new uint8_t *[kObjectCount];
+    auto ac2 = lk::make_auto_call([&]() { delete[] objs; });
+
+    for (size_t i = 0; i < kObjectCount; i++) {
+        objs[i] = static_cast<uint8_t *>(slab_alloc(cache));
+        ASSERT_NONNULL(objs[i], "allocation should not be null");
+        EXPECT_EQ((uintptr_t)0, (uintptr_t)objs[i] % 16, "alignment check");
+        memset(objs[i], (int)(i & 0xff), 48);
+    }
+
+    EXPECT_GT(cache->slab_count, (size_t)1, "should have grown to more than one slab");
+
+    // Every object should still hold its own pattern, so none of them overlap.
+    for (size_t i = 0; i < kObjectCount; i++) {
+        for (size_t j = 0; j < 48; j++) {
+            if (objs[i][j] != (uint8_t)(i & 0xff)) {
+                EXPECT_EQ((uint8_t)(i & 0xff), objs[i][j], "object contents");
+                break;
+            }
+        }
+    }
+
+    // Free every other object, then reallocate them.
+    for (size_t i = 0; i < kObjectCount; i += 2) {
+        slab_free(cache, objs[i]);
+    }
+    for (size_t i = 0; i < kObjectCount; i += 2) {
+        objs[i] = static_cast<uint8_t *>(slab_alloc(cache));
+        ASSERT_NONNULL(objs[i], "reallocation should not be null");
+    }
+
+    for (size_t i = 0; i < kObjectCount; i++) {
+        slab_free(cache, objs[i]);
+    }
+
+    // With nothing in use, every slab should go back to the pmm.
+    size_t slabs = cache->slab_count;
+    size_t pages = slab_cache_reclaim(cache);
+    EXPECT_EQ(slabs * cache->slab_pages, pages, "reclaim should free every slab");
+    EXPECT_EQ((size_t)0, cache->slab_count, "no slabs left after reclaim");
+
+    END_TEST;
+}
+
+bool test_slab_large_objects() {
+    BEGIN_TEST;
+
+    // Big enough that a slab has to span more than one page.
+    slab_cache_t *cache = slab_cache_create("test_large", 1024, 64);
+    ASSERT_NONNULL(cache, "cache create");
+    auto ac = lk::make_auto_call([&]() { slab_cache_destroy(cache); });
+
+    void *objs[32];
+    for (size_t i = 0; i < countof(objs); i++) {
+        objs[i] = slab_alloc(cache);
+        ASSERT_NONNULL(objs[i], "allocation should not be null");
+        EXPECT_EQ((uintptr_t)0, (uintptr_t)objs[i] % 64, "alignment check");
+        memset(objs[i], 0x5a, 1024);
+    }
+
+    EXPECT_GT(cache->slab_pages, (size_t)1, "slab should span several pages");
+
+    for (size_t i = 0; i < countof(objs); i++) {
+        slab_free(cache, objs[i]);
+    }
+
+    slab_cache_reclaim(cache);
+    EXPECT_EQ((size_t)0, cache->slab_count, "no slabs left after reclaim");
+
+    END_TEST;
+}
+
+bool test_slab_reclaim_in_use() {
+    BEGIN_TEST;
+
+    slab_cache_t *cache = slab_cache_create("test_in_use", 64, 8);
+    ASSERT_NONNULL(cache, "cache create");
+    auto ac = lk::make_auto_call([&]() { slab_cache_destroy(cache); });
+
+    // A slab with an object still handed out has to survive a reclaim.
+    void *obj = slab_alloc(cache);
+    ASSERT_NONNULL(obj, "allocation should not be null");
+
+    slab_cache_reclaim(cache);
+    EXPECT_EQ((size_t)1, cache->slab_count, "slab in use should not be reclaimed");
+
+    slab_free(cache, obj);
+    EXPECT_EQ(cache->slab_pages, slab_cache_reclaim(cache), "slab freed once empty");
+
+    END_TEST;
+}
+
+BEGIN_TEST_CASE(slab_tests);
+RUN_TEST(test_slab_alloc_free);
+RUN_TEST(test_slab_large_objects);
+RUN_TEST(test_slab_reclaim_in_use);
+END_TEST_CASE(slab_tests);
+
+} // namespace
@@ -416,16 +416,25 @@ status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi,
 
     arch_interrupt_saved_state_t state = spin_lock_irqsave(&lock);
 
-    // find a free interrupt
+    // find a run of count free interrupts
     status_t err = ERR_NOT_FOUND;
-    for (unsigned int i = 0; i < INT_VECTORS; i++) {
-        if (!int_table[i].flags.allocated) {
-            int_table[i].flags.allocated = true;
-            *vector = i;
-            LTRACEF("found irq %#x\n", i);
-            err = NO_ERROR;
-            break;
+    for (unsigned int i = 0; count > 0 && i + count <= INT_VECTORS; i++) {
+        size_t free = 0;
+        while (free < count && !int_table[i + free].flags.allocated) {
+            free++;
+        }
+        if (free < count) {
+            i += free;
+            continue;
+        }
+
+        for (size_t j = 0; j < count; j++) {
+            int_table[i + j].flags.allocated = true;
         }
+        *vector = i;
+        LTRACEF("found irq %#x\n", i);
+        err = NO_ERROR;
+        break;
     }
 
     spin_unlock_irqrestore(&lock, state);
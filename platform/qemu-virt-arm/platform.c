@@ -159,7 +159,7 @@ status_t platform_pci_int_pin_to_vector(unsigned int pci_int_pin, pci_location_t
 status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi, unsigned int *vector) {
     TRACEF("count %zu align %u msi %d\n", count, align_log2, msi);
 
-    // TODO: handle nonzero alignment, count > 0, and add locking
+    // TODO: handle nonzero alignment and add locking
 
     // list of allocated msi interrupts
     static uint64_t msi_bitmap = 0;
@@ -171,13 +171,16 @@ status_t platform_allocate_interrupts(size_t count, uint align_log2, bool msi, u
 
     // cannot deal with alignment yet
     DEBUG_ASSERT(align_log2 == 0);
-    DEBUG_ASSERT(count == 1);
+    if (count == 0 || count > sizeof(msi_bitmap) * 8) {
+        return ERR_INVALID_ARGS;
+    }
 
-    // make a copy of the bitmap
+    // find a run of count free interrupts
+    const uint64_t run = (count == 64) ? ~0ULL : ((1ULL << count) - 1);
     int allocated = -1;
-    for (size_t i = 0; i < sizeof(msi_bitmap) * 8; i++) {
-        if ((msi_bitmap & (1UL << i)) == 0) {
-            msi_bitmap |= (1UL << i);
+    for (size_t i = 0; i + count <= sizeof(msi_bitmap) * 8; i++) {
+        if ((msi_bitmap & (run << i)) == 0) {
+            msi_bitmap |= (run << i);
             allocated = i;
             break;
         }
@@ -199,7 +202,9 @@ status_t platform_compute_msi_values(unsigned int vector, unsigned int cpu, bool
     // only handle edge triggered at the moment
     DEBUG_ASSERT(edge);
     // only handle cpu 0
-    DEBUG_ASSERT(cpu == 0);
+    if (cpu != 0) {
+        return ERR_NOT_SUPPORTED;
+    }
 
     // TODO: call through to the appropriate gic driver to deal with GICv2 vs v3
 
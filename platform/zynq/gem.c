@@ -290,7 +290,13 @@ static status_t gem_cfg_buffer_descs(void) {
         void *b = pool_alloc(&rx_buf_pool);
         pktbuf_t *p = pktbuf_alloc_empty();
         if (!p || !b) {
-            return -1;
+            if (p) {
+                pktbuf_free(p, false);
+            }
+            if (b) {
+                pool_free(&rx_buf_pool, b);
+            }
+            return ERR_NO_MEMORY;
         }
 
         pktbuf_add_buffer(p, b, GEM_RX_BUF_SIZE, 0, PKTBUF_FLAG_CACHED, NULL, NULL);